@@ -12,7 +12,10 @@ Arena* arena_create(uint64_t provided_reserve_size, uint64_t provided_commit_siz
   arena->original_commit_size = provided_commit_size;
   arena->original_reserve_size = provided_reserve_size;
   arena->cur_pos = ARENA_HEADER_SIZE;
+  arena->peak_pos = ARENA_HEADER_SIZE;
   arena->cur_commit = commit_size;
+  arena->peak_commit = commit_size;
+  arena->decommit_keep = 0;
   arena->cur_reserve = reserve_size;
   // TODO: ASAN integration here, since IR seems to be a bit dicey.
 
@@ -36,14 +39,18 @@ void* arena_push(Arena* arena, uint64_t size, uint64_t align) {
     uint64_t commit_post_clamped = CLAMP_MAX(commit_post_aligned, arena->cur_reserve);
     uint64_t commit_size = commit_post_clamped - arena->cur_commit;
     uint8_t* commit_ptr = (uint8_t*)arena + arena->cur_commit;
+    TRACE_BEGIN("arena commit", (Str){0});
     base_mem_commit(commit_ptr, commit_size);
+    TRACE_END();
     arena->cur_commit = commit_post_clamped;
+    arena->peak_commit = MAX(arena->peak_commit, commit_post_clamped);
   }
 
   void* result = NULL;
   if (arena->cur_commit >= pos_post) {
     result = (uint8_t*)arena + pos_pre;
     arena->cur_pos = pos_post;
+    arena->peak_pos = MAX(arena->peak_pos, pos_post);
   }
 
   if (BRANCH_UNLIKELY(result == NULL)) {
@@ -59,20 +66,86 @@ uint64_t arena_pos(Arena* arena) {
   return arena->cur_pos;
 }
 
+void arena_set_decommit_keep(Arena* arena, uint64_t keep) {
+  arena->decommit_keep = keep;
+}
+
+// Rounded the same way as arena_push() commits, and never below what
+// arena_create() committed.
+static void arena_decommit_above(Arena* arena, uint64_t pos) {
+  uint64_t commit_post_aligned = pos + arena->original_commit_size - 1;
+  commit_post_aligned -= commit_post_aligned % arena->original_commit_size;
+  commit_post_aligned =
+      CLAMP_MIN(commit_post_aligned, ALIGN_UP(arena->original_commit_size, base_page_size()));
+  if (commit_post_aligned >= arena->cur_commit) {
+    return;
+  }
+  TRACE_BEGIN("arena decommit", (Str){0});
+  base_mem_decommit((uint8_t*)arena + commit_post_aligned, arena->cur_commit - commit_post_aligned);
+  TRACE_END();
+  arena->cur_commit = commit_post_aligned;
+}
+
 void arena_pop_to(Arena* arena, uint64_t pos) {
   uint64_t cpos = CLAMP_MIN(ARENA_HEADER_SIZE, pos);
   arena->cur_pos = cpos;
+  if (arena->decommit_keep && arena->cur_commit - cpos > 2 * arena->decommit_keep) {
+    arena_decommit_above(arena, cpos + arena->decommit_keep);
+  }
   // base_writef_stderr("ARENA %p, pop to %" PRIu64 "\n", arena, arena->cur_pos);
   //  TODO: ASAN
 }
 
+TempArena temp_begin(Arena* arena) {
+  return (TempArena){arena, arena_pos(arena)};
+}
+
+void temp_end(TempArena temp) {
+  arena_pop_to(temp.arena, temp.pos);
+}
+
+// Two is enough as long as callers only ever have one scratch (or one
+// that's passed to them) live while taking another.
+#define SCRATCH_POOL_SIZE 2
+
+// Created on first use, and kept until the thread exits.
+static _Thread_local Arena* scratch_pool[SCRATCH_POOL_SIZE];
+
+TempArena scratch_begin(Arena** conflicts, int num_conflicts) {
+  for (int i = 0; i < SCRATCH_POOL_SIZE; ++i) {
+    if (!scratch_pool[i]) {
+      scratch_pool[i] = arena_create(MiB(64), KiB(64));
+    }
+    bool conflicted = false;
+    for (int j = 0; j < num_conflicts; ++j) {
+      if (conflicts[j] == scratch_pool[i]) {
+        conflicted = true;
+        break;
+      }
+    }
+    if (!conflicted) {
+      return temp_begin(scratch_pool[i]);
+    }
+  }
+  CHECK(false && "all scratch arenas conflict");
+  return (TempArena){0};
+}
+
+void scratch_reset(void) {
+  for (int i = 0; i < SCRATCH_POOL_SIZE; ++i) {
+    if (scratch_pool[i]) {
+      arena_pop_to(scratch_pool[i], 0);
+    }
+  }
+}
+
 // These are vectored by force_include.h for the IR library.
 
 typedef struct ArenaMallocHeader {
   size_t size;
 } ArenaMallocHeader;
 
-Arena* arena_ir;
+_Thread_local Arena* arena_ir;
 
 void* arena_ir_aligned_alloc(size_t size, size_t align) {
   size_t extra = CLAMP_MAX(sizeof(ArenaMallocHeader), align);
@@ -0,0 +1,81 @@
+#include "luv60.h"
+#include "test.h"
+
+TEST(Arena, DecommitOffByDefault) {
+  Arena* arena = arena_create(MiB(64), KiB(128));
+  uint64_t start = arena_pos(arena);
+  memset(arena_push(arena, MiB(4), 16), 0xcc, MiB(4));
+  uint64_t commit = arena->cur_commit;
+  EXPECT_TRUE(commit >= MiB(4));
+  arena_pop_to(arena, start);
+  EXPECT_EQ(arena->cur_commit, commit);
+  arena_destroy(arena);
+}
+
+TEST(Arena, DecommitKeepsWindow) {
+  Arena* arena = arena_create(MiB(64), KiB(128));
+  arena_set_decommit_keep(arena, KiB(256));
+  uint64_t start = arena_pos(arena);
+  memset(arena_push(arena, MiB(4), 16), 0xcc, MiB(4));
+  uint64_t peak = arena->cur_commit;
+  arena_pop_to(arena, start);
+  // start + 256K, rounded up to the 128K that it commits by.
+  EXPECT_EQ(arena->cur_commit, KiB(384));
+  EXPECT_EQ(arena->peak_commit, peak);
+
+  // And can grow again afterwards.
+  uint8_t* p = arena_push(arena, MiB(2), 16);
+  memset(p, 0xdd, MiB(2));
+  EXPECT_EQ(p[MiB(2) - 1], 0xdd);
+  arena_destroy(arena);
+}
+
+TEST(Arena, DecommitHysteresis) {
+  Arena* arena = arena_create(MiB(64), KiB(128));
+  arena_set_decommit_keep(arena, KiB(256));
+  uint64_t start = arena_pos(arena);
+  arena_push(arena, KiB(400), 16);
+  EXPECT_EQ(arena->cur_commit, KiB(512));
+  // Less than 2 * keep above where it's popped to, so it's left alone.
+  arena_pop_to(arena, start);
+  EXPECT_EQ(arena->cur_commit, KiB(512));
+  arena_destroy(arena);
+}
+
+TEST(Arena, ScratchNests) {
+  TempArena outer = scratch_begin(NULL, 0);
+  uint64_t* a = arena_push(outer.arena, sizeof(uint64_t), 8);
+  *a = 1;
+  TempArena inner = scratch_begin(NULL, 0);
+  // Nothing to avoid, so it's the same arena, just further along.
+  EXPECT_EQ(inner.arena, outer.arena);
+  arena_push(inner.arena, KiB(1), 8);
+  scratch_end(inner);
+  EXPECT_EQ(arena_pos(outer.arena), inner.pos);
+  EXPECT_EQ(*a, 1);
+  scratch_end(outer);
+  EXPECT_EQ(arena_pos(outer.arena), outer.pos);
+}
+
+TEST(Arena, ScratchAvoidsConflicts) {
+  TempArena first = scratch_begin(NULL, 0);
+  TempArena second = scratch_begin(&first.arena, 1);
+  EXPECT_TRUE(second.arena != first.arena);
+  // And in the other order, gets the first one back.
+  TempArena third = scratch_begin(&second.arena, 1);
+  EXPECT_EQ(third.arena, first.arena);
+  scratch_end(third);
+  scratch_end(second);
+  scratch_end(first);
+}
+
+TEST(Arena, ScratchReset) {
+  TempArena outer = scratch_begin(NULL, 0);
+  TempArena inner = scratch_begin(&outer.arena, 1);
+  arena_push(outer.arena, KiB(1), 8);
+  arena_push(inner.arena, KiB(1), 8);
+  // As if something longjmp()d out without ending either.
+  scratch_reset();
+  EXPECT_EQ(arena_pos(outer.arena), ARENA_HEADER_SIZE);
+  EXPECT_EQ(arena_pos(inner.arena), ARENA_HEADER_SIZE);
+}
@@ -4,7 +4,16 @@
 #error
 #endif
 
+#include <dispatch/dispatch.h>
+#include <errno.h>
+#include <mach/mach.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -57,6 +66,18 @@ void base_mem_release(void* ptr, uint64_t size) {
   munmap(ptr, size);
 }
 
+void base_mem_rss(uint64_t* rss, uint64_t* peak_rss) {
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) !=
+      KERN_SUCCESS) {
+    *rss = *peak_rss = 0;
+    return;
+  }
+  *rss = info.resident_size;
+  *peak_rss = info.resident_size_max;
+}
+
 ReadFileResult base_read_file(const char* filename) {
   FILE* f = fopen(filename, "rb");
   if (!f) {
@@ -86,6 +107,348 @@ ReadFileResult base_read_file(const char* filename) {
   return (ReadFileResult){read_buf, len, to_alloc};
 }
 
+uint64_t base_file_mtime(const char* filename) {
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    return 0;
+  }
+  return (uint64_t)st.st_mtimespec.tv_sec * 1000000000 + (uint64_t)st.st_mtimespec.tv_nsec;
+}
+
+const char* base_full_path(Arena* arena, const char* filename) {
+  char* full = realpath(filename, NULL);
+  if (!full) {
+    return NULL;
+  }
+  size_t len = strlen(full) + 1;
+  char* ret = arena_push(arena, len, 1);
+  memcpy(ret, full, len);
+  free(full);
+  return ret;
+}
+
+static void (*exit_handler_)(int rc);
+
+void base_set_exit_handler(void (*handler)(int rc)) {
+  exit_handler_ = handler;
+}
+
 NORETURN void base_exit(int rc) {
+  if (exit_handler_) {
+    exit_handler_(rc);
+  }
   exit(rc);
 }
+
+bool base_mem_protect_rwx(void* ptr, uint64_t size) {
+  return mprotect(ptr, size, PROT_READ | PROT_WRITE | PROT_EXEC) == 0;
+}
+
+#define GUARD_ALT_STACK_SIZE (64 << 10)
+
+// Where a fault in base_call_guarded() goes back to, for this thread.
+static _Thread_local sigjmp_buf* guard_jmp_;
+
+static void guard_handler(int sig) {
+  if (!guard_jmp_) {
+    // Another thread's fault while this one was guarded.
+    signal(sig, SIG_DFL);
+    raise(sig);
+    return;
+  }
+  siglongjmp(*guard_jmp_, 1);
+}
+
+bool base_call_guarded(void (*func)(void*), void* arg) {
+  static const int guarded_signals[] = {SIGFPE, SIGSEGV, SIGBUS, SIGILL};
+  struct sigaction saved_actions[COUNTOFI(guarded_signals)];
+  // The handler runs on its own stack so that running out of stack (e.g.
+  // unbounded recursion) can be caught too.
+  static _Thread_local char* alt_stack;
+  if (!alt_stack) {
+    alt_stack = malloc(GUARD_ALT_STACK_SIZE);
+  }
+  stack_t new_stack = {.ss_sp = alt_stack, .ss_size = GUARD_ALT_STACK_SIZE};
+  stack_t saved_stack;
+  sigaltstack(&new_stack, &saved_stack);
+  struct sigaction action = {0};
+  action.sa_handler = guard_handler;
+  action.sa_flags = SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  for (int i = 0; i < COUNTOFI(guarded_signals); ++i) {
+    sigaction(guarded_signals[i], &action, &saved_actions[i]);
+  }
+
+  sigjmp_buf jmp;
+  sigjmp_buf* saved_jmp = guard_jmp_;
+  bool ok = true;
+  if (sigsetjmp(jmp, /*savemask=*/1) == 0) {
+    guard_jmp_ = &jmp;
+    func(arg);
+  } else {
+    ok = false;
+  }
+  guard_jmp_ = saved_jmp;
+
+  for (int i = 0; i < COUNTOFI(guarded_signals); ++i) {
+    sigaction(guarded_signals[i], &saved_actions[i], NULL);
+  }
+  sigaltstack(&saved_stack, NULL);
+  return ok;
+}
+
+void base_sleep_ms(uint32_t ms) {
+  usleep(ms * 1000);
+}
+
+struct BaseThread {
+  pthread_t handle;
+  void (*func)(void*);
+  void* arg;
+};
+
+static void* thread_trampoline(void* param) {
+  BaseThread* thread = param;
+  thread->func(thread->arg);
+  return NULL;
+}
+
+BaseThread* base_thread_create(void (*func)(void*), void* arg) {
+  BaseThread* thread = malloc(sizeof(BaseThread));
+  thread->func = func;
+  thread->arg = arg;
+  if (pthread_create(&thread->handle, NULL, thread_trampoline, thread) != 0) {
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+void base_thread_join(BaseThread* thread) {
+  pthread_join(thread->handle, NULL);
+  free(thread);
+}
+
+BaseSemaphore* base_semaphore_create(void) {
+  return (BaseSemaphore*)dispatch_semaphore_create(0);
+}
+
+void base_semaphore_signal(BaseSemaphore* sem) {
+  dispatch_semaphore_signal((dispatch_semaphore_t)sem);
+}
+
+void base_semaphore_wait(BaseSemaphore* sem) {
+  dispatch_semaphore_wait((dispatch_semaphore_t)sem, DISPATCH_TIME_FOREVER);
+}
+
+// On the wire, a request is a uint32_t size with the client's stdout and
+// stderr attached, then that many bytes of "cwd\0arg1\0arg2\0...". The reply
+// is an int32_t exit code.
+#define SERVER_MAX_REQUEST_SIZE (64 << 10)
+#define SERVER_MAX_ARGS 256
+
+struct BaseServer {
+  int listen_fd;
+  int conn_fd;
+  int saved_stdout;
+  int saved_stderr;
+  char request[SERVER_MAX_REQUEST_SIZE];
+  char* argv[SERVER_MAX_ARGS + 1];
+};
+
+static bool read_all(int fd, void* buf, size_t size) {
+  while (size) {
+    ssize_t n = read(fd, buf, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf = (char*)buf + n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void* buf, size_t size) {
+  while (size) {
+    ssize_t n = write(fd, buf, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf = (const char*)buf + n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool make_socket_addr(const char* socket_path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+    return false;
+  }
+  strcpy(addr->sun_path, socket_path);
+  return true;
+}
+
+BaseServer* base_server_create(const char* socket_path) {
+  struct sockaddr_un addr;
+  if (!make_socket_addr(socket_path, &addr)) {
+    return NULL;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  unlink(socket_path);  // Probably left behind by a previous server.
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+    close(fd);
+    return NULL;
+  }
+  // Otherwise a client that goes away early would take the server with it.
+  signal(SIGPIPE, SIG_IGN);
+  BaseServer* server = malloc(sizeof(BaseServer));
+  server->listen_fd = fd;
+  server->conn_fd = -1;
+  server->saved_stdout = dup(STDOUT_FILENO);
+  server->saved_stderr = dup(STDERR_FILENO);
+  return server;
+}
+
+// Returns argc, or 0 if the request was bad, in which case the connection has
+// been dropped.
+static int server_read_request(BaseServer* server, int conn) {
+  uint32_t size = 0;
+  int fds[2];
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  struct iovec iov = {&size, sizeof(size)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  ssize_t n = recvmsg(conn, &msg, 0);
+  struct cmsghdr* cmsg = n == sizeof(size) ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    return 0;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  int argc = 0;
+  if (size > 0 && size <= sizeof(server->request) && read_all(conn, server->request, size) &&
+      server->request[size - 1] == 0 && chdir(server->request) == 0) {
+    server->argv[argc++] = "luvc";
+    for (char* p = server->request + strlen(server->request) + 1;
+         p < server->request + size && argc < SERVER_MAX_ARGS; p += strlen(p) + 1) {
+      server->argv[argc++] = p;
+    }
+    server->argv[argc] = NULL;
+  }
+  if (argc) {
+    fflush(stdout);
+    fflush(stderr);
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  return argc;
+}
+
+int base_server_accept(BaseServer* server, char*** argv) {
+  for (;;) {
+    int conn = accept(server->listen_fd, NULL, NULL);
+    if (conn < 0) {
+      continue;
+    }
+    int argc = server_read_request(server, conn);
+    if (!argc) {
+      close(conn);
+      continue;
+    }
+    server->conn_fd = conn;
+    *argv = server->argv;
+    return argc;
+  }
+}
+
+void base_server_reply(BaseServer* server, int rc) {
+  fflush(stdout);
+  fflush(stderr);
+  dup2(server->saved_stdout, STDOUT_FILENO);
+  dup2(server->saved_stderr, STDERR_FILENO);
+  int32_t reply = rc;
+  write_all(server->conn_fd, &reply, sizeof(reply));
+  close(server->conn_fd);
+  server->conn_fd = -1;
+}
+
+bool base_server_request(const char* socket_path, int argc, char** argv, int* rc) {
+  char cwd[4096];
+  struct sockaddr_un addr;
+  if (!getcwd(cwd, sizeof(cwd)) || !make_socket_addr(socket_path, &addr)) {
+    return false;
+  }
+  size_t size = strlen(cwd) + 1;
+  for (int i = 1; i < argc; ++i) {
+    size += strlen(argv[i]) + 1;
+  }
+  if (size > SERVER_MAX_REQUEST_SIZE || argc > SERVER_MAX_ARGS) {
+    return false;
+  }
+  char* request = malloc(size);
+  char* p = request;
+  memcpy(p, cwd, strlen(cwd) + 1);
+  p += strlen(cwd) + 1;
+  for (int i = 1; i < argc; ++i) {
+    memcpy(p, argv[i], strlen(argv[i]) + 1);
+    p += strlen(argv[i]) + 1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    free(request);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+
+  uint32_t size32 = (uint32_t)size;
+  int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = {&size32, sizeof(size32)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  int32_t reply;
+  bool ok = sendmsg(fd, &msg, 0) == sizeof(size32) && write_all(fd, request, size) &&
+            read_all(fd, &reply, sizeof(reply));
+  free(request);
+  close(fd);
+  if (ok) {
+    *rc = reply;
+  }
+  return ok;
+}
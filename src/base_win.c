@@ -5,6 +5,8 @@
 #endif
 
 #include <windows.h>
+#include <malloc.h>
+#include <psapi.h>
 
 int base_writef_stderr(const char* fmt, ...) {
   va_list args;
@@ -40,6 +42,16 @@ void base_mem_release(void* ptr, uint64_t size) {
   VirtualFree(ptr, 0, MEM_RELEASE);
 }
 
+void base_mem_rss(uint64_t* rss, uint64_t* peak_rss) {
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+    *rss = *peak_rss = 0;
+    return;
+  }
+  *rss = counters.WorkingSetSize;
+  *peak_rss = counters.PeakWorkingSetSize;
+}
+
 ReadFileResult base_read_file(const char* filename) {
   SECURITY_ATTRIBUTES sa = {sizeof(sa), 0, 0};
   HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, &sa, OPEN_EXISTING,
@@ -73,7 +85,35 @@ ReadFileResult base_read_file(const char* filename) {
   return (ReadFileResult){read_buf, size.QuadPart, to_alloc};
 }
 
+uint64_t base_file_mtime(const char* filename) {
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &data)) {
+    return 0;
+  }
+  return ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) |
+         data.ftLastWriteTime.dwLowDateTime;
+}
+
+const char* base_full_path(Arena* arena, const char* filename) {
+  DWORD len = GetFullPathNameA(filename, 0, NULL, NULL);
+  if (len == 0 || GetFileAttributesA(filename) == INVALID_FILE_ATTRIBUTES) {
+    return NULL;
+  }
+  char* ret = arena_push(arena, len, 1);
+  GetFullPathNameA(filename, len, ret, NULL);
+  return ret;
+}
+
+static void (*exit_handler_)(int rc);
+
+void base_set_exit_handler(void (*handler)(int rc)) {
+  exit_handler_ = handler;
+}
+
 NORETURN void base_exit(int rc) {
+  if (exit_handler_) {
+    exit_handler_(rc);
+  }
   ExitProcess(rc);
 }
 
@@ -95,3 +135,98 @@ uint64_t base_timer_now(void) {
   }
   return result;
 }
+
+bool base_mem_protect_rwx(void* ptr, uint64_t size) {
+  DWORD old_protect;
+  return VirtualProtect(ptr, size, PAGE_EXECUTE_READWRITE, &old_protect) != 0;
+}
+
+static int guard_filter(DWORD code) {
+  switch (code) {
+    case EXCEPTION_INT_DIVIDE_BY_ZERO:
+    case EXCEPTION_INT_OVERFLOW:
+    case EXCEPTION_ACCESS_VIOLATION:
+    case EXCEPTION_ILLEGAL_INSTRUCTION:
+    case EXCEPTION_STACK_OVERFLOW:
+      return EXCEPTION_EXECUTE_HANDLER;
+    default:
+      return EXCEPTION_CONTINUE_SEARCH;
+  }
+}
+
+bool base_call_guarded(void (*func)(void*), void* arg) {
+  // GetExceptionCode() is only allowed in the filter expression.
+  DWORD code = 0;
+  __try {
+    func(arg);
+  } __except (code = GetExceptionCode(), guard_filter(code)) {
+    if (code == EXCEPTION_STACK_OVERFLOW) {
+      _resetstkoflw();
+    }
+    return false;
+  }
+  return true;
+}
+
+void base_sleep_ms(uint32_t ms) {
+  Sleep(ms);
+}
+
+struct BaseThread {
+  HANDLE handle;
+  void (*func)(void*);
+  void* arg;
+};
+
+static DWORD WINAPI thread_trampoline(LPVOID param) {
+  BaseThread* thread = param;
+  thread->func(thread->arg);
+  return 0;
+}
+
+BaseThread* base_thread_create(void (*func)(void*), void* arg) {
+  BaseThread* thread = malloc(sizeof(BaseThread));
+  thread->func = func;
+  thread->arg = arg;
+  thread->handle = CreateThread(NULL, 0, thread_trampoline, thread, 0, NULL);
+  if (!thread->handle) {
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+void base_thread_join(BaseThread* thread) {
+  WaitForSingleObject(thread->handle, INFINITE);
+  CloseHandle(thread->handle);
+  free(thread);
+}
+
+BaseSemaphore* base_semaphore_create(void) {
+  return (BaseSemaphore*)CreateSemaphoreA(NULL, 0, LONG_MAX, NULL);
+}
+
+void base_semaphore_signal(BaseSemaphore* sem) {
+  ReleaseSemaphore((HANDLE)sem, 1, NULL);
+}
+
+void base_semaphore_wait(BaseSemaphore* sem) {
+  WaitForSingleObject((HANDLE)sem, INFINITE);
+}
+
+// TODO: AF_UNIX works on recent Windows 10, but there's no equivalent of
+// passing the client's stdout and stderr along with a request.
+BaseServer* base_server_create(const char* socket_path) {
+  return NULL;
+}
+
+int base_server_accept(BaseServer* server, char*** argv) {
+  return 0;
+}
+
+void base_server_reply(BaseServer* server, int rc) {
+}
+
+bool base_server_request(const char* socket_path, int argc, char** argv, int* rc) {
+  return false;
+}
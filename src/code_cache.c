@@ -0,0 +1,762 @@
+#include "luv60.h"
+
+#include "dict.h"
+
+// The files behind --code-cache, and the registry of names that cached code
+// (and --emit-obj) refers to things by. What goes in them, and when, is up to
+// parse.c; everything here is just data.
+//
+// Anything that doesn't look right when reading is just a miss, as the files
+// are only ever a shortcut for compiling.
+
+typedef struct CacheTargetByAddr {
+  void* addr;
+  CacheTarget* target;
+} CacheTargetByAddr;
+
+typedef struct CacheTargetByName {
+  const char* name;
+  uint32_t name_len;
+  CacheTarget* target;
+} CacheTargetByName;
+
+struct CacheTargets {
+  Arena* arena;
+  DictImpl by_addr;  // Of CacheTargetByAddr.
+  DictImpl by_name;  // Of CacheTargetByName.
+  CacheTarget* list;
+};
+
+struct CodeCache {
+  const char* filename;
+  Arena* arena;
+  ReadFileResult file;  // Entries point into this until code_cache_save().
+  DictImpl entries;     // Of CacheEntry.
+  CacheEntry* used;
+  uint64_t version;
+};
+
+static size_t cache_entry_hash_func(void* ventry) {
+  CacheEntry* entry = (CacheEntry*)ventry;
+  size_t hash = 0;
+  dict_hash_write(&hash, &entry->key, sizeof(entry->key));
+  return hash;
+}
+
+static bool cache_entry_eq_func(void* a, void* b) {
+  return ((CacheEntry*)a)->key == ((CacheEntry*)b)->key;
+}
+
+static size_t cache_target_by_addr_hash_func(void* vt) {
+  CacheTargetByAddr* t = (CacheTargetByAddr*)vt;
+  size_t hash = 0;
+  dict_hash_write(&hash, &t->addr, sizeof(t->addr));
+  return hash;
+}
+
+static bool cache_target_by_addr_eq_func(void* a, void* b) {
+  return ((CacheTargetByAddr*)a)->addr == ((CacheTargetByAddr*)b)->addr;
+}
+
+static size_t cache_target_by_name_hash_func(void* vt) {
+  CacheTargetByName* t = (CacheTargetByName*)vt;
+  size_t hash = 0;
+  dict_hash_write(&hash, (void*)t->name, t->name_len);
+  return hash;
+}
+
+static bool cache_target_by_name_eq_func(void* va, void* vb) {
+  CacheTargetByName* a = (CacheTargetByName*)va;
+  CacheTargetByName* b = (CacheTargetByName*)vb;
+  return a->name_len == b->name_len && memcmp(a->name, b->name, a->name_len) == 0;
+}
+
+CacheTargets* cache_targets_new(Arena* arena) {
+  CacheTargets* targets = arena_push(arena, sizeof(CacheTargets), _Alignof(CacheTargets));
+  targets->arena = arena;
+  targets->by_addr =
+      dict_new(arena, 1 << 10, sizeof(CacheTargetByAddr), _Alignof(CacheTargetByAddr));
+  targets->by_name =
+      dict_new(arena, 1 << 10, sizeof(CacheTargetByName), _Alignof(CacheTargetByName));
+  targets->list = NULL;
+  return targets;
+}
+
+CacheTarget* cache_targets_find_addr(CacheTargets* targets, void* addr) {
+  DictRawIter iter = dict_find(&targets->by_addr, &addr, cache_target_by_addr_hash_func,
+                               cache_target_by_addr_eq_func, sizeof(CacheTargetByAddr));
+  CacheTargetByAddr* t = (CacheTargetByAddr*)dict_rawiter_get(&iter);
+  return t ? t->target : NULL;
+}
+
+CacheTarget* cache_targets_find_name(CacheTargets* targets, const char* name, uint32_t name_len) {
+  CacheTargetByName key = {name, name_len, NULL};
+  DictRawIter iter = dict_find(&targets->by_name, &key, cache_target_by_name_hash_func,
+                               cache_target_by_name_eq_func, sizeof(CacheTargetByName));
+  CacheTargetByName* t = (CacheTargetByName*)dict_rawiter_get(&iter);
+  return t ? t->target : NULL;
+}
+
+CacheTarget* cache_targets_add(CacheTargets* targets,
+                               void* addr,
+                               const char* name,
+                               uint32_t name_len) {
+  CacheTarget* target = cache_targets_find_addr(targets, addr);
+  if (target && target->name_len == name_len && memcmp(target->name, name, name_len) == 0) {
+    return target;
+  }
+  target = arena_push(targets->arena, sizeof(CacheTarget), _Alignof(CacheTarget));
+  *target = (CacheTarget){.addr = addr,
+                          .name = name,
+                          .name_len = name_len,
+                          .obj_symbol = ~0u,
+                          .next = targets->list};
+  targets->list = target;
+
+  CacheTargetByName by_name = {name, name_len, NULL};
+  DictInsert res = dict_insert(&targets->by_name, &by_name, cache_target_by_name_hash_func,
+                               cache_target_by_name_eq_func, sizeof(CacheTargetByName),
+                               _Alignof(CacheTargetByName));
+  CacheTargetByName* slot = (CacheTargetByName*)dict_rawiter_get(&res.iter);
+  if (res.inserted) {
+    slot->target = target;
+  } else if (slot->target->addr != addr) {
+    // e.g. a def that's redefined later in the file. Code that refers to
+    // either one can't be found by name, so don't cache it.
+    slot->target->ambiguous = true;
+    target->ambiguous = true;
+  }
+  CacheTargetByAddr by_addr = {addr, target};
+  res = dict_insert(&targets->by_addr, &by_addr, cache_target_by_addr_hash_func,
+                    cache_target_by_addr_eq_func, sizeof(CacheTargetByAddr),
+                    _Alignof(CacheTargetByAddr));
+  ((CacheTargetByAddr*)dict_rawiter_get(&res.iter))->target = target;
+  return target;
+}
+
+CacheTarget* cache_targets_list(CacheTargets* targets) {
+  return targets->list;
+}
+
+// NULL if it can't be used at all, either because it isn't there (anymore) or
+// because a pinned one has moved.
+static CacheTarget* cache_reloc_target(CacheTargets* targets, const CacheReloc* reloc) {
+  CacheTarget* target = cache_targets_find_name(targets, reloc->name, reloc->name_len);
+  if (!target || target->ambiguous ||
+      (reloc->pinned_addr && (uintptr_t)target->addr != reloc->pinned_addr)) {
+    return NULL;
+  }
+  return target;
+}
+
+bool cache_entry_install(CacheTargets* targets, const CacheEntry* entry, uint8_t* code) {
+  memcpy(code, entry->code, entry->size);
+  for (uint32_t i = 0; i < entry->num_relocs; ++i) {
+    CacheReloc* reloc = &entry->relocs[i];
+    CacheTarget* target = cache_reloc_target(targets, reloc);
+    if (!target) {
+      return false;
+    }
+    if (!reloc->pinned_addr) {
+      memcpy(code + reloc->offset, &target->addr, sizeof(void*));
+    }
+  }
+  return true;
+}
+
+static bool cache_read(const uint8_t** p, const uint8_t* end, void* out, size_t size) {
+  if ((size_t)(end - *p) < size) {
+    return false;
+  }
+  memcpy(out, *p, size);
+  *p += size;
+  return true;
+}
+
+static bool cache_read_str(const uint8_t** p, const uint8_t* end, StrView* out) {
+  if (!cache_read(p, end, &out->size, sizeof(out->size)) || (size_t)(end - *p) < out->size) {
+    return false;
+  }
+  out->data = (const char*)*p;
+  *p += out->size;
+  return true;
+}
+
+// The code and names point into the file's buffer, and the relocs are in
+// |arena|.
+static bool cache_read_entry(const uint8_t** p,
+                             const uint8_t* end,
+                             Arena* arena,
+                             CacheEntry* entry) {
+  *entry = (CacheEntry){0};
+  if (!cache_read(p, end, &entry->key, sizeof(entry->key)) ||
+      !cache_read(p, end, &entry->size, sizeof(entry->size)) ||
+      !cache_read(p, end, &entry->num_relocs, sizeof(entry->num_relocs)) ||
+      entry->num_relocs > entry->size) {
+    return false;
+  }
+  entry->relocs =
+      arena_push(arena, entry->num_relocs * sizeof(CacheReloc) + 1, _Alignof(CacheReloc));
+  for (uint32_t i = 0; i < entry->num_relocs; ++i) {
+    CacheReloc* reloc = &entry->relocs[i];
+    StrView name;
+    if (!cache_read(p, end, &reloc->offset, sizeof(reloc->offset)) ||
+        !cache_read(p, end, &reloc->pinned_addr, sizeof(reloc->pinned_addr)) ||
+        !cache_read_str(p, end, &name) || reloc->offset + sizeof(void*) > entry->size) {
+      return false;
+    }
+    reloc->name = name.data;
+    reloc->name_len = name.size;
+  }
+  if ((size_t)(end - *p) < entry->size) {
+    return false;
+  }
+  entry->code = *p;
+  *p += entry->size;
+  return true;
+}
+
+// Reads the magic and version that every file starts with.
+static bool cache_read_header(const uint8_t** p,
+                              const uint8_t* end,
+                              const char magic[8],
+                              uint64_t expected_version) {
+  char file_magic[8];
+  uint64_t version;
+  return cache_read(p, end, file_magic, sizeof(file_magic)) &&
+         memcmp(file_magic, magic, 8) == 0 && cache_read(p, end, &version, sizeof(version)) &&
+         version == expected_version;
+}
+
+static void cache_write_str(FILE* f, const char* str, uint32_t len) {
+  fwrite(&len, sizeof(len), 1, f);
+  fwrite(str, 1, len, f);
+}
+
+static void cache_write_entry(FILE* f, const CacheEntry* entry) {
+  fwrite(&entry->key, sizeof(entry->key), 1, f);
+  fwrite(&entry->size, sizeof(entry->size), 1, f);
+  fwrite(&entry->num_relocs, sizeof(entry->num_relocs), 1, f);
+  for (uint32_t i = 0; i < entry->num_relocs; ++i) {
+    CacheReloc* reloc = &entry->relocs[i];
+    fwrite(&reloc->offset, sizeof(reloc->offset), 1, f);
+    fwrite(&reloc->pinned_addr, sizeof(reloc->pinned_addr), 1, f);
+    cache_write_str(f, reloc->name, reloc->name_len);
+  }
+  fwrite(entry->code, 1, entry->size, f);
+}
+
+// Cache files are written next to where they go and then renamed into place,
+// so that another luvc that's reading one never sees half of it.
+static FILE* cache_create(Arena* arena, const char* filename, const char** out_tmp_filename) {
+  size_t filename_len = strlen(filename);
+  char* tmp_filename = arena_push(arena, filename_len + 5, 1);
+  memcpy(tmp_filename, filename, filename_len);
+  memcpy(tmp_filename + filename_len, ".tmp", 5);
+  FILE* f = fopen(tmp_filename, "wb");
+  if (!f) {
+    base_writef_stderr("warning: couldn't write '%s'\n", tmp_filename);
+  }
+  *out_tmp_filename = tmp_filename;
+  return f;
+}
+
+static void cache_commit(FILE* f, const char* tmp_filename, const char* filename) {
+#if OS_WINDOWS
+  remove(filename);  // rename() doesn't replace.
+#endif
+  if (fclose(f) != 0 || rename(tmp_filename, filename) != 0) {
+    base_writef_stderr("warning: couldn't write '%s'\n", filename);
+  }
+}
+
+CodeCache* code_cache_load(Arena* arena, const char* filename, uint64_t version) {
+  CodeCache* cache = arena_push(arena, sizeof(CodeCache), _Alignof(CodeCache));
+  *cache = (CodeCache){
+      .filename = filename,
+      .arena = arena,
+      .file = base_read_file(filename),
+      .entries = dict_new(arena, 1 << 10, sizeof(CacheEntry), _Alignof(CacheEntry)),
+      .version = version,
+  };
+  if (!cache->file.buffer) {
+    return cache;
+  }
+  const uint8_t* p = cache->file.buffer;
+  const uint8_t* end = cache->file.buffer + cache->file.file_size;
+  uint32_t num_entries;
+  if (!cache_read_header(&p, end, "LUVCACHE", version) ||
+      !cache_read(&p, end, &num_entries, sizeof(num_entries))) {
+    return cache;
+  }
+  for (uint32_t i = 0; i < num_entries; ++i) {
+    CacheEntry entry;
+    if (!cache_read_entry(&p, end, arena, &entry)) {
+      break;
+    }
+    dict_insert(&cache->entries, &entry, cache_entry_hash_func, cache_entry_eq_func,
+                sizeof(CacheEntry), _Alignof(CacheEntry));
+  }
+  return cache;
+}
+
+CacheEntry* code_cache_find(CodeCache* cache, uint64_t key) {
+  DictRawIter iter = dict_find(&cache->entries, &key, cache_entry_hash_func, cache_entry_eq_func,
+                               sizeof(CacheEntry));
+  return (CacheEntry*)dict_rawiter_get(&iter);
+}
+
+void code_cache_use(CodeCache* cache, CacheEntry* entry) {
+  entry->next_used = cache->used;
+  cache->used = entry;
+}
+
+// Only what was used in this run is kept, so the file doesn't grow forever
+// while editing.
+void code_cache_save(CodeCache* cache) {
+  const char* tmp_filename;
+  FILE* f = cache_create(cache->arena, cache->filename, &tmp_filename);
+  if (f) {
+    uint32_t num_entries = 0;
+    for (CacheEntry* entry = cache->used; entry; entry = entry->next_used) {
+      ++num_entries;
+    }
+    fwrite("LUVCACHE", 1, 8, f);
+    fwrite(&cache->version, sizeof(cache->version), 1, f);
+    fwrite(&num_entries, sizeof(num_entries), 1, f);
+    for (CacheEntry* entry = cache->used; entry; entry = entry->next_used) {
+      cache_write_entry(f, entry);
+    }
+    cache_commit(f, tmp_filename, cache->filename);
+  }
+  if (cache->file.buffer) {
+    base_mem_release(cache->file.buffer, cache->file.allocated_size);
+    cache->file = (ReadFileResult){0};
+  }
+}
+
+typedef enum InterfaceTypeTag {
+  IFT_BUILTIN,
+  IFT_PTR,
+  IFT_ARRAY,
+  IFT_LIST,
+  IFT_FUNC,
+  IFT_STRUCT,      // Declared in the module.
+  IFT_DEP_STRUCT,  // Declared in something it imported, found by contents and name.
+} InterfaceTypeTag;
+
+static uint32_t interface_type_index(const ModuleInterface* iface, Type type) {
+  for (uint32_t i = 0; i < iface->num_types; ++i) {
+    if (type_eq(iface->types[i].type, type)) {
+      return i;
+    }
+  }
+  return iface->num_types;
+}
+
+static void interface_write_type(FILE* f, const ModuleInterface* iface, InterfaceType* it) {
+  Type type = it->type;
+  uint8_t kind;
+  switch (type_kind(type)) {
+    case TYPE_PTR: {
+      kind = IFT_PTR;
+      fwrite(&kind, 1, 1, f);
+      uint32_t sub = interface_type_index(iface, type_ptr_subtype(type));
+      fwrite(&sub, sizeof(sub), 1, f);
+      return;
+    }
+    case TYPE_ARRAY: {
+      kind = IFT_ARRAY;
+      fwrite(&kind, 1, 1, f);
+      uint32_t sub = interface_type_index(iface, type_array_subtype(type));
+      uint32_t count = type_array_count(type);
+      fwrite(&sub, sizeof(sub), 1, f);
+      fwrite(&count, sizeof(count), 1, f);
+      return;
+    }
+    case TYPE_LIST: {
+      kind = IFT_LIST;
+      fwrite(&kind, 1, 1, f);
+      uint32_t sub = interface_type_index(iface, type_list_subtype(type));
+      fwrite(&sub, sizeof(sub), 1, f);
+      return;
+    }
+    case TYPE_FUNC: {
+      kind = IFT_FUNC;
+      fwrite(&kind, 1, 1, f);
+      uint32_t flags = type_func_flags(type);
+      uint32_t num_params = type_func_num_params(type);
+      fwrite(&flags, sizeof(flags), 1, f);
+      fwrite(&num_params, sizeof(num_params), 1, f);
+      for (uint32_t i = 0; i < num_params; ++i) {
+        uint32_t param = interface_type_index(iface, type_func_param(type, i));
+        fwrite(&param, sizeof(param), 1, f);
+      }
+      uint32_t ret = interface_type_index(iface, type_func_return_type(type));
+      fwrite(&ret, sizeof(ret), 1, f);
+      return;
+    }
+    case TYPE_STRUCT: {
+      if (it->dep_name.size) {
+        kind = IFT_DEP_STRUCT;
+        fwrite(&kind, 1, 1, f);
+        fwrite(&it->dep_hash, sizeof(it->dep_hash), 1, f);
+        cache_write_str(f, it->dep_name.data, it->dep_name.size);
+        return;
+      }
+      kind = IFT_STRUCT;
+      fwrite(&kind, 1, 1, f);
+      Str declname = type_struct_decl_name(type);
+      cache_write_str(f, str_raw_ptr(declname), str_len(declname));
+      uint32_t num_fields = type_struct_num_fields(type);
+      fwrite(&num_fields, sizeof(num_fields), 1, f);
+      for (uint32_t i = 0; i < num_fields; ++i) {
+        Str field_name = type_struct_field_name(type, i);
+        cache_write_str(f, str_raw_ptr(field_name), str_len(field_name));
+        uint32_t field_type = interface_type_index(iface, type_struct_field_type(type, i));
+        fwrite(&field_type, sizeof(field_type), 1, f);
+      }
+      uint8_t has_initializer = type_struct_has_initializer(type);
+      fwrite(&has_initializer, 1, 1, f);
+      if (has_initializer) {
+        fwrite(type_struct_initializer_blob(type), 1, type_size(type), f);
+      }
+      return;
+    }
+    default:
+      kind = IFT_BUILTIN;
+      fwrite(&kind, 1, 1, f);
+      fwrite(&type.u, sizeof(type.u), 1, f);
+      return;
+  }
+}
+
+// The module's own targets are "file:name", and are written as ":name" so that
+// they're right wherever it's imported from.
+static void interface_write_func(FILE* f, Arena* arena, const char* filename, InterfaceFunc* func) {
+  size_t prefix_len = strlen(filename);
+  CacheEntry copy = func->code;
+  copy.relocs =
+      arena_push(arena, copy.num_relocs * sizeof(CacheReloc) + 1, _Alignof(CacheReloc));
+  for (uint32_t i = 0; i < copy.num_relocs; ++i) {
+    CacheReloc reloc = func->code.relocs[i];
+    if (reloc.name_len > prefix_len && reloc.name[prefix_len] == ':' &&
+        memcmp(reloc.name, filename, prefix_len) == 0) {
+      reloc.name += prefix_len;
+      reloc.name_len -= (uint32_t)prefix_len;
+    }
+    copy.relocs[i] = reloc;
+  }
+  cache_write_str(f, func->name.data, func->name.size);
+  cache_write_entry(f, &copy);
+}
+
+void module_interface_write(Arena* arena,
+                            const char* filename,
+                            uint64_t version,
+                            const ModuleInterface* iface) {
+  const char* tmp_filename;
+  FILE* f = cache_create(arena, filename, &tmp_filename);
+  if (!f) {
+    return;
+  }
+  fwrite("LUVMODIF", 1, 8, f);
+  fwrite(&version, sizeof(version), 1, f);
+  fwrite(&iface->content_hash, sizeof(iface->content_hash), 1, f);
+
+  fwrite(&iface->num_deps, sizeof(iface->num_deps), 1, f);
+  for (uint32_t i = 0; i < iface->num_deps; ++i) {
+    cache_write_str(f, iface->deps[i].filename.data, iface->deps[i].filename.size);
+    fwrite(&iface->deps[i].content_hash, sizeof(iface->deps[i].content_hash), 1, f);
+  }
+
+  fwrite(&iface->num_types, sizeof(iface->num_types), 1, f);
+  for (uint32_t i = 0; i < iface->num_types; ++i) {
+    interface_write_type(f, iface, &iface->types[i]);
+  }
+
+  fwrite(&iface->num_globals, sizeof(iface->num_globals), 1, f);
+  for (uint32_t i = 0; i < iface->num_globals; ++i) {
+    InterfaceGlobal* g = &iface->globals[i];
+    cache_write_str(f, g->name.data, g->name.size);
+    fwrite(&g->size, sizeof(g->size), 1, f);
+    fwrite(&g->initial, sizeof(g->initial), 1, f);
+  }
+
+  fwrite(&iface->num_funcs, sizeof(iface->num_funcs), 1, f);
+  for (uint32_t i = 0; i < iface->num_funcs; ++i) {
+    interface_write_func(f, arena, iface->filename, &iface->funcs[i]);
+  }
+
+  fwrite(&iface->num_exports, sizeof(iface->num_exports), 1, f);
+  for (uint32_t i = 0; i < iface->num_exports; ++i) {
+    InterfaceExport* exp = &iface->exports[i];
+    cache_write_str(f, exp->name.data, exp->name.size);
+    fwrite(&exp->kind, 1, 1, f);
+    fwrite(&exp->type, sizeof(exp->type), 1, f);
+    fwrite(&exp->payload, sizeof(exp->payload), 1, f);
+  }
+  cache_commit(f, tmp_filename, filename);
+}
+
+// Reads an index of something that was earlier in the file.
+static bool interface_read_index(const uint8_t** p, const uint8_t* end, uint32_t count,
+                                 uint32_t* out) {
+  return cache_read(p, end, out, sizeof(*out)) && *out < count;
+}
+
+// Reads one type, given the ones before it. Indices are 4 bytes, so a count
+// that's more than what's left in the file can't be right.
+static bool interface_read_type(const uint8_t** p,
+                                const uint8_t* end,
+                                Arena* arena,
+                                Arena* blob_arena,
+                                const InterfaceImporter* importer,
+                                ModuleInterface* iface) {
+  InterfaceType* it = &iface->types[iface->num_types];
+  uint32_t num_types = iface->num_types;
+  *it = (InterfaceType){0};
+  uint8_t kind;
+  uint32_t sub, count;
+  if (!cache_read(p, end, &kind, 1)) {
+    return false;
+  }
+  switch (kind) {
+    case IFT_BUILTIN: {
+      uint32_t u;
+      if (!cache_read(p, end, &u, sizeof(u)) || (u & 0xff) >= NUM_TYPE_KINDS ||
+          u != (((u & 0xff) << 8) | (u & 0xff))) {
+        return false;
+      }
+      it->type = (Type){u};
+      return true;
+    }
+    case IFT_PTR:
+      if (!interface_read_index(p, end, num_types, &sub)) {
+        return false;
+      }
+      it->type = type_ptr(iface->types[sub].type);
+      return true;
+    case IFT_ARRAY:
+      if (!interface_read_index(p, end, num_types, &sub) ||
+          !cache_read(p, end, &count, sizeof(count))) {
+        return false;
+      }
+      it->type = type_array(iface->types[sub].type, count);
+      return true;
+    case IFT_LIST:
+      if (!interface_read_index(p, end, num_types, &sub)) {
+        return false;
+      }
+      it->type = type_list(iface->types[sub].type);
+      return true;
+    case IFT_FUNC: {
+      uint32_t flags;
+      if (!cache_read(p, end, &flags, sizeof(flags)) ||
+          !cache_read(p, end, &count, sizeof(count)) || count > (size_t)(end - *p) / 4) {
+        return false;
+      }
+      Type* params = arena_push(arena, count * sizeof(Type) + 1, _Alignof(Type));
+      for (uint32_t i = 0; i < count; ++i) {
+        if (!interface_read_index(p, end, num_types, &sub)) {
+          return false;
+        }
+        params[i] = iface->types[sub].type;
+      }
+      if (!interface_read_index(p, end, num_types, &sub)) {
+        return false;
+      }
+      it->type = type_function(params, count, iface->types[sub].type, (TypeFuncFlags)flags);
+      return true;
+    }
+    case IFT_STRUCT: {
+      StrView name;
+      uint8_t has_initializer;
+      if (!cache_read_str(p, end, &name) || !cache_read(p, end, &count, sizeof(count)) ||
+          count > (size_t)(end - *p) / 8) {
+        return false;
+      }
+      Str* field_names = arena_push(arena, count * sizeof(Str) + 1, _Alignof(Str));
+      Type* field_types = arena_push(arena, count * sizeof(Type) + 1, _Alignof(Type));
+      for (uint32_t i = 0; i < count; ++i) {
+        StrView field_name;
+        if (!cache_read_str(p, end, &field_name) ||
+            !interface_read_index(p, end, num_types, &sub)) {
+          return false;
+        }
+        field_names[i] = str_intern_len(field_name.data, field_name.size);
+        field_types[i] = iface->types[sub].type;
+      }
+      if (!cache_read(p, end, &has_initializer, 1)) {
+        return false;
+      }
+      Type strukt = type_new_struct(str_intern_len(name.data, name.size), count, field_names,
+                                    field_types, has_initializer);
+      if (has_initializer) {
+        if ((size_t)(end - *p) < type_size(strukt)) {
+          return false;
+        }
+        void* blob = arena_push(blob_arena, type_size(strukt), type_align(strukt));
+        memcpy(blob, *p, type_size(strukt));
+        *p += type_size(strukt);
+        type_struct_set_initializer_blob(strukt, blob);
+      }
+      it->type = strukt;
+      return true;
+    }
+    case IFT_DEP_STRUCT:
+      return cache_read(p, end, &it->dep_hash, sizeof(it->dep_hash)) &&
+             cache_read_str(p, end, &it->dep_name) && it->dep_name.size &&
+             importer->find_dep_struct(importer->ctx, it->dep_hash, it->dep_name, &it->type);
+    default:
+      return false;
+  }
+}
+
+bool module_interface_read(Arena* arena,
+                           Arena* blob_arena,
+                           const uint8_t* p,
+                           const uint8_t* end,
+                           uint64_t version,
+                           uint64_t content_hash,
+                           const InterfaceImporter* importer,
+                           ModuleInterface* iface) {
+  *iface = (ModuleInterface){.content_hash = content_hash};
+  uint64_t file_content_hash;
+  if (!cache_read_header(&p, end, "LUVMODIF", version) ||
+      !cache_read(&p, end, &file_content_hash, sizeof(file_content_hash)) ||
+      file_content_hash != content_hash) {
+    return false;
+  }
+
+  // What it imported is imported here as well, and has to be the same as it
+  // was then, before any of its types can be found.
+  if (!cache_read(&p, end, &iface->num_deps, sizeof(iface->num_deps)) ||
+      iface->num_deps > (size_t)(end - p) / 12) {
+    return false;
+  }
+  iface->deps =
+      arena_push(arena, iface->num_deps * sizeof(InterfaceDep) + 1, _Alignof(InterfaceDep));
+  for (uint32_t i = 0; i < iface->num_deps; ++i) {
+    InterfaceDep* dep = &iface->deps[i];
+    if (!cache_read_str(&p, end, &dep->filename) ||
+        !cache_read(&p, end, &dep->content_hash, sizeof(dep->content_hash)) ||
+        !importer->import_dep(importer->ctx, dep->filename, dep->content_hash)) {
+      return false;
+    }
+  }
+
+  uint32_t num_types;
+  if (!cache_read(&p, end, &num_types, sizeof(num_types)) || num_types > MAX_INTERFACE_TYPES) {
+    return false;
+  }
+  iface->types =
+      arena_push(arena, num_types * sizeof(InterfaceType) + 1, _Alignof(InterfaceType));
+  for (uint32_t i = 0; i < num_types; ++i) {
+    if (!interface_read_type(&p, end, arena, blob_arena, importer, iface)) {
+      return false;
+    }
+    ++iface->num_types;
+  }
+
+  if (!cache_read(&p, end, &iface->num_globals, sizeof(iface->num_globals)) ||
+      iface->num_globals > (size_t)(end - p) / 16) {
+    return false;
+  }
+  iface->globals = arena_push(arena, iface->num_globals * sizeof(InterfaceGlobal) + 1,
+                              _Alignof(InterfaceGlobal));
+  for (uint32_t i = 0; i < iface->num_globals; ++i) {
+    InterfaceGlobal* g = &iface->globals[i];
+    *g = (InterfaceGlobal){0};
+    if (!cache_read_str(&p, end, &g->name) || !cache_read(&p, end, &g->size, sizeof(g->size)) ||
+        g->size > sizeof(g->initial) || !IS_POW2(g->size) ||
+        !cache_read(&p, end, &g->initial, sizeof(g->initial))) {
+      return false;
+    }
+  }
+
+  if (!cache_read(&p, end, &iface->num_funcs, sizeof(iface->num_funcs)) ||
+      iface->num_funcs > (size_t)(end - p) / 20) {
+    return false;
+  }
+  iface->funcs =
+      arena_push(arena, iface->num_funcs * sizeof(InterfaceFunc) + 1, _Alignof(InterfaceFunc));
+  for (uint32_t i = 0; i < iface->num_funcs; ++i) {
+    InterfaceFunc* func = &iface->funcs[i];
+    *func = (InterfaceFunc){0};
+    if (!cache_read_str(&p, end, &func->name) ||
+        !cache_read_entry(&p, end, arena, &func->code)) {
+      return false;
+    }
+  }
+
+  if (!cache_read(&p, end, &iface->num_exports, sizeof(iface->num_exports)) ||
+      iface->num_exports > (size_t)(end - p) / 17) {
+    return false;
+  }
+  iface->exports = arena_push(arena, iface->num_exports * sizeof(InterfaceExport) + 1,
+                              _Alignof(InterfaceExport));
+  for (uint32_t i = 0; i < iface->num_exports; ++i) {
+    InterfaceExport* exp = &iface->exports[i];
+    if (!cache_read_str(&p, end, &exp->name) || !cache_read(&p, end, &exp->kind, 1) ||
+        !interface_read_index(&p, end, iface->num_types, &exp->type) ||
+        !cache_read(&p, end, &exp->payload, sizeof(exp->payload))) {
+      return false;
+    }
+  }
+  return p == end;
+}
+
+// Relocations to the module's own functions, globals, and struct initializer
+// blobs are ":name", so they're found in |own|, which only the module's
+// addresses are in. Anything else is in what the importer has registered.
+static CacheTarget* interface_reloc_target(CacheTargets* own,
+                                           CacheTargets* targets,
+                                           const CacheReloc* reloc) {
+  if (reloc->name_len && reloc->name[0] == ':') {
+    CacheTarget* target = cache_targets_find_name(own, reloc->name + 1, reloc->name_len - 1);
+    return target && !target->ambiguous && !reloc->pinned_addr ? target : NULL;
+  }
+  return cache_reloc_target(targets, reloc);
+}
+
+bool module_interface_link(Arena* arena, CacheTargets* targets, ModuleInterface* iface) {
+  CacheTargets* own = cache_targets_new(arena);
+  for (uint32_t i = 0; i < iface->num_types; ++i) {
+    Type type = iface->types[i].type;
+    if (type_kind(type) == TYPE_STRUCT && !iface->types[i].dep_name.size &&
+        type_struct_has_initializer(type)) {
+      Str name = type_struct_decl_name(type);
+      cache_targets_add(own, type_struct_initializer_blob(type),
+                        cstr_copy(arena, name), str_len(name));
+    }
+  }
+  for (uint32_t i = 0; i < iface->num_globals; ++i) {
+    cache_targets_add(own, iface->globals[i].addr, iface->globals[i].name.data,
+                      iface->globals[i].name.size);
+  }
+  for (uint32_t i = 0; i < iface->num_funcs; ++i) {
+    cache_targets_add(own, iface->funcs[i].addr, iface->funcs[i].name.data,
+                      iface->funcs[i].name.size);
+  }
+
+  for (uint32_t i = 0; i < iface->num_funcs; ++i) {
+    CacheEntry* code = &iface->funcs[i].code;
+    for (uint32_t j = 0; j < code->num_relocs; ++j) {
+      if (!interface_reloc_target(own, targets, &code->relocs[j])) {
+        return false;
+      }
+    }
+  }
+  for (uint32_t i = 0; i < iface->num_funcs; ++i) {
+    CacheEntry* code = &iface->funcs[i].code;
+    for (uint32_t j = 0; j < code->num_relocs; ++j) {
+      CacheReloc* reloc = &code->relocs[j];
+      if (!reloc->pinned_addr) {
+        CacheTarget* target = interface_reloc_target(own, targets, reloc);
+        memcpy((uint8_t*)iface->funcs[i].addr + reloc->offset, &target->addr, sizeof(void*));
+      }
+    }
+  }
+  return true;
+}
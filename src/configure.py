@@ -17,18 +17,26 @@ COMMON_FILELIST = [
     "../third_party/ir/ir_gcm.c",
     "../third_party/ir/ir_mem2ssa.c",
     "../third_party/ir/ir_patch.c",
+    "../third_party/ir/ir_perf.c",
     "../third_party/ir/ir_ra.c",
     "../third_party/ir/ir_save.c",
     "../third_party/ir/ir_sccp.c",
     "../third_party/ir/ir_strtab.c",
     "arena.c",
+    "base_linux.c",
     "base_mac.c",
     "base_win.c",
+    "code_cache.c",
+    "hot_reload.c",
     "lex.c",
+    "obj_elf.c",
+    "parse_baseline.c",
     "parse_code_gen.c",
     "parse_syntax_check.c",
+    "profile.c",
     "str.c",
     "token.c",
+    "trace.c",
     "type.c",
 ]
 
@@ -36,12 +44,18 @@ LUVC_FILELIST = [
     "luvc_main.c",
 ]
 
+# Linked into executables made from luvc --emit-obj output, not into luvc.
+LUVRT_FILELIST = [
+    "luvrt.c",
+]
+
 GEN_IR_FOLD_HASH_FILELIST = [
     "../third_party/ir/gen_ir_fold_hash.c",
 ]
 
 UNITTEST_FILELIST = [
     "test_main.c",
+    "arena_test.c",
     "lex_test.c",
     "str_test.c",
     "type_test.c",
@@ -108,6 +122,22 @@ CONFIGS = {
             "obj_ext": ".o",
         },
     },
+    "l": {
+        "d": {
+            "COMPILE": f"{CLANG} -MMD -MF $out.d -O0 -g {DEBUG_DEFINES} -Wall -Werror $extra -Wno-unused-parameter -I$src -I. -c $in -o $out",
+            "LINK": CLANG + " -g $in -lm -lpthread -o $out",
+            "ML": CLANG + " $in -lm -o $out",
+        },
+        "r": {
+            "COMPILE": f"{CLANG} -MMD -MF $out.d -flto -O3 -g {RELEASE_DEFINES} -Wall -Werror $extra -Wno-unused-parameter -I$src -I. -c $in -o $out",
+            "LINK": CLANG + " -flto -g $in -lm -lpthread -o $out",
+            "ML": CLANG + " $in -lm -o $out",
+        },
+        "__": {
+            "exe_ext": "",
+            "obj_ext": ".o",
+        },
+    },
 }
 
 
@@ -122,11 +152,17 @@ def get_tests():
         ret = "0"
         out = ""
         err = ""
+        edits = []
+        serve = 0
+        before = []
         disabled = []
         run_prefix = "# RUN: "
         ret_prefix = "# RET: "
         err_prefix = "# ERR: "
         out_prefix = "# OUT: "
+        edit_prefix = "# EDIT: "
+        serve_prefix = "# SERVE: "
+        before_prefix = "# BEFORE: "
         disabled_linux_prefix = "# DISABLED_LINUX"
         disabled_win_prefix = "# DISABLED_WIN"
         disabled_mac_prefix = "# DISABLED_MAC"
@@ -144,6 +180,17 @@ def get_tests():
                     err += l[len(err_prefix) :].rstrip() + "\n"
                 elif l.startswith(out_prefix):
                     out += l[len(out_prefix) :].rstrip() + "\n"
+                elif l.startswith(edit_prefix):
+                    # "old => new", made to a copy of the test once it has
+                    # printed something, see testrun.py.
+                    old, new = l[len(edit_prefix) :].rstrip().split(" => ")
+                    edits.append([old, new])
+                elif l.startswith(before_prefix):
+                    # Run in order before RUN, see testrun.py.
+                    before.append(l[len(before_prefix) :].rstrip())
+                elif l.startswith(serve_prefix):
+                    # Number of times to send it to the same --serve server.
+                    serve = int(l[len(serve_prefix) :].rstrip())
                 elif l.startswith(disabled_linux_prefix):
                     disabled.append('linux')
                 elif l.startswith(disabled_win_prefix):
@@ -166,6 +213,9 @@ def get_tests():
                 "ret": int(ret),
                 "out": sub(out),
                 "err": sub(err),
+                "edits": edits,
+                "serve": serve,
+                "before": [sub(b) for b in before],
                 "disabled": disabled
             }
 
@@ -210,6 +260,12 @@ def generate(platform, config, settings, cmdlines, tests):
         )
         f.write("  description = DYNASM $out\n")
         f.write("\n")
+        f.write("rule dynasm_sysv\n")
+        f.write(
+            "  command = ./minilua $src/../third_party/ir/dynasm/dynasm.lua -D X64=1 -o $out $in\n"
+        )
+        f.write("  description = DYNASM $out\n")
+        f.write("\n")
         f.write("rule dynasm\n")
         f.write(
             "  command = ./minilua $src/../third_party/ir/dynasm/dynasm.lua -o $out $in\n"
@@ -238,10 +294,14 @@ def generate(platform, config, settings, cmdlines, tests):
         f.write("  description = GEN_DUMBBENCH\n")
         f.write("\n")
         f.write("rule re2c\n")
-        f.write(
-            "  command = ../../third_party/re2c/%s/re2c%s -W -b -i --no-generation-date -o $out $in\n"
-            % (platform, exe_ext)
-        )
+        if platform == "l":
+            # Not vendored for Linux, use the distro's.
+            f.write("  command = re2c -W -b -i --no-generation-date -o $out $in\n")
+        else:
+            f.write(
+                "  command = ../../third_party/re2c/%s/re2c%s -W -b -i --no-generation-date -o $out $in\n"
+                % (platform, exe_ext)
+            )
         f.write("  description = RE2C $out\n")
         f.write("\n")
         f.write("rule testrun\n")
@@ -272,9 +332,13 @@ def generate(platform, config, settings, cmdlines, tests):
 
         common_objs = []
         for src in COMMON_FILELIST:
-            if sys.platform == "darwin" and "_win." in src:
+            if sys.platform != "win32" and "_win." in src:
+                continue
+            elif sys.platform != "darwin" and "_mac." in src:
                 continue
-            elif sys.platform == "win32" and "_mac." in src:
+            elif sys.platform != "linux" and "_linux." in src:
+                continue
+            elif sys.platform != "linux" and "ir_perf." in src:
                 continue
             obj = getobj(src)
             common_objs.append(obj)
@@ -308,6 +372,13 @@ def generate(platform, config, settings, cmdlines, tests):
             f.write("build %s: cc $src/%s\n" % (obj, src))
             f.write("  extra=%s\n" % get_extra(src))
 
+        luvrt_objs = []
+        for src in LUVRT_FILELIST:
+            obj = getobj(src)
+            luvrt_objs.append(obj)
+            # No force_include.h here.
+            f.write("build %s: cc $src/%s\n" % (obj, src))
+
         unittest_objs = []
         for src in UNITTEST_FILELIST:
             obj = getobj(src)
@@ -352,8 +423,8 @@ def generate(platform, config, settings, cmdlines, tests):
         )
 
         f.write(
-            "build ir_emit_x86.h: dynasm_w $src/../third_party/ir/ir_x86.dasc | %s\n"
-            % miniluaexe
+            "build ir_emit_x86.h: %s $src/../third_party/ir/ir_x86.dasc | %s\n"
+            % ("dynasm_sysv" if platform == "l" else "dynasm_w", miniluaexe)
         )
         f.write(
             "build ir_emit_aarch64.h: dynasm $src/../third_party/ir/ir_aarch64.dasc | %s\n"
@@ -391,7 +462,8 @@ def generate(platform, config, settings, cmdlines, tests):
         f.write("\nbuild test: phony " + " ".join(alltests) + "\n")
 
         f.write(
-            "\ndefault luvc%s unittests%s lexbench%s\n" % (exe_ext, exe_ext, exe_ext)
+            "\ndefault luvc%s unittests%s lexbench%s %s\n"
+            % (exe_ext, exe_ext, exe_ext, " ".join(luvrt_objs))
         )
 
         f.write("\nrule gen\n")
@@ -0,0 +1,157 @@
+#include "luv60.h"
+
+#include "dict.h"
+
+#include "../third_party/ir/ir.h"
+
+// What --watch keeps between reloads of the file, and the thread that watches
+// it. The reloading itself is parse.c's hot_reload(), which runs on that
+// thread.
+
+// Only applied once the whole file has been compiled without errors, see
+// hot_commit().
+typedef struct HotChange HotChange;
+struct HotChange {
+  HotSym sym;
+  bool patch_stub;
+  HotChange* next;
+};
+
+struct HotReload {
+  Arena* arena;
+  const char* filename;
+  void (*reload)(ReadFileResult file);
+  DictImpl syms;       // Of HotSym.
+  HotChange* changes;  // Most recent first.
+  size_t content_hash;
+  BaseThread* thread;
+  bool quit;
+  uint32_t num_reloads;  // Including ones that failed, see hot_wait().
+};
+
+static size_t hot_sym_hash_func(void* vsym) {
+  HotSym* sym = (HotSym*)vsym;
+  size_t hash = 0;
+  dict_hash_write(&hash, (void*)str_raw_ptr(sym->name), str_len(sym->name));
+  return hash;
+}
+
+static bool hot_sym_eq_func(void* a, void* b) {
+  return str_eq(((HotSym*)a)->name, ((HotSym*)b)->name);
+}
+
+uint64_t jump_stub_encode(void* from, void* to) {
+  int64_t rel = (uint8_t*)to - ((uint8_t*)from + 5);
+  CHECK(rel == (int32_t)rel);
+  return 0xcccccc0000000000ull | ((uint64_t)(uint32_t)rel << 8) | 0xe9;
+}
+
+void jump_stub_patch(uint64_t* stub, void* target) {
+  uint64_t page_size = base_page_size();
+  void* stub_page = ALIGN_DOWN_PTR(stub, page_size);
+  base_mem_protect_rwx(stub_page, page_size);
+  *(volatile uint64_t*)stub = jump_stub_encode(stub, target);
+  ir_mem_protect(stub_page, page_size);
+  ir_mem_flush(stub, sizeof(uint64_t));
+}
+
+HotReload* hot_new(Arena* arena, const char* filename, ReadFileResult file) {
+  HotReload* hot = arena_push(arena, sizeof(HotReload), _Alignof(HotReload));
+  *hot = (HotReload){
+      .arena = arena,
+      .filename = filename,
+      .syms = dict_new(arena, 1 << 10, sizeof(HotSym), _Alignof(HotSym)),
+  };
+  dict_hash_write(&hot->content_hash, file.buffer, file.file_size);
+  return hot;
+}
+
+HotSym* hot_find(HotReload* hot, Str name, bool is_global) {
+  DictRawIter iter =
+      dict_find(&hot->syms, &name, hot_sym_hash_func, hot_sym_eq_func, sizeof(HotSym));
+  HotSym* hs = (HotSym*)dict_rawiter_get(&iter);
+  return hs && hs->is_global == is_global ? hs : NULL;
+}
+
+void hot_queue(HotReload* hot, HotSym sym, bool patch_stub) {
+  HotChange* change = arena_push(hot->arena, sizeof(HotChange), _Alignof(HotChange));
+  *change = (HotChange){sym, patch_stub, hot->changes};
+  hot->changes = change;
+}
+
+void hot_discard(HotReload* hot) {
+  hot->changes = NULL;
+}
+
+uint32_t hot_commit(HotReload* hot) {
+  uint32_t num_changed = 0;
+  for (HotChange* change = hot->changes; change; change = change->next) {
+    HotSym* sym = &change->sym;
+    if (change->patch_stub) {
+      jump_stub_patch(sym->addr, sym->code);
+    }
+    if (!sym->is_global) {
+      ++num_changed;
+    }
+    DictInsert res = dict_insert(&hot->syms, sym, hot_sym_hash_func, hot_sym_eq_func,
+                                 sizeof(HotSym), _Alignof(HotSym));
+    *(HotSym*)dict_rawiter_get(&res.iter) = *sym;
+  }
+  hot->changes = NULL;
+  return num_changed;
+}
+
+static void hot_watcher(void* arg) {
+  HotReload* hot = arg;
+  trace_thread_name("watcher");
+  arena_ir = arena_create(MiB(256), KiB(128));
+  // Each reload builds the IR for every function again.
+  arena_set_decommit_keep(arena_ir, MiB(1));
+  for (;;) {
+    base_sleep_ms(100);
+    if (hot->quit) {
+      break;
+    }
+    ReadFileResult file = base_read_file(hot->filename);
+    if (!file.buffer) {
+      continue;  // Probably in the middle of being saved.
+    }
+    size_t content_hash = 0;
+    dict_hash_write(&content_hash, file.buffer, file.file_size);
+    if (content_hash == hot->content_hash) {
+      base_mem_release(file.buffer, file.allocated_size);
+      continue;
+    }
+    hot->content_hash = content_hash;
+    hot->reload(file);
+    __atomic_fetch_add(&hot->num_reloads, 1, __ATOMIC_RELEASE);
+  }
+  arena_destroy(arena_ir);
+}
+
+void hot_watch(HotReload* hot, void (*reload)(ReadFileResult file)) {
+  hot->reload = reload;
+  hot->thread = base_thread_create(hot_watcher, hot);
+}
+
+uint32_t hot_wait(HotReload* hot) {
+  uint32_t before = __atomic_load_n(&hot->num_reloads, __ATOMIC_ACQUIRE);
+  fflush(stdout);
+  for (int i = 0; hot->thread && i < 10000; ++i) {
+    uint32_t now = __atomic_load_n(&hot->num_reloads, __ATOMIC_ACQUIRE);
+    if (now != before) {
+      return now;
+    }
+    base_sleep_ms(1);
+  }
+  return before;
+}
+
+void hot_stop(HotReload* hot) {
+  if (!hot->thread) {
+    return;
+  }
+  hot->quit = true;
+  base_thread_join(hot->thread);
+  hot->thread = NULL;
+}
@@ -21,6 +21,9 @@ typedef struct Arena {
   uint64_t cur_pos;
   uint64_t cur_commit;
   uint64_t cur_reserve;
+  uint64_t peak_pos;  // High-water marks of cur_pos and cur_commit, for --stats.
+  uint64_t peak_commit;
+  uint64_t decommit_keep;  // See arena_set_decommit_keep().
 } Arena;
 
 _Static_assert(sizeof(Arena) < ARENA_HEADER_SIZE, "Arena too large");
@@ -33,11 +36,39 @@ void arena_destroy(Arena* arena);
 void* arena_push(Arena* arena, uint64_t size, uint64_t align);
 uint64_t arena_pos(Arena* arena);
 void arena_pop_to(Arena* arena, uint64_t pos);
-
-extern Arena* arena_ir;
-
-
-// base_{win,mac}.c
+// By default committed memory is kept for good once an arena has grown, which
+// is fine for a compile that's about to exit. For long-lived processes, this
+// makes arena_pop_to() give back what's committed beyond pos + keep, once
+// that's more than 2 * keep so that popping and pushing around the same spot
+// doesn't decommit and recommit every time. 0 turns it back off.
+void arena_set_decommit_keep(Arena* arena, uint64_t keep);
+
+// A saved position to go back to, for temporaries that don't outlive a scope.
+typedef struct TempArena {
+  Arena* arena;
+  uint64_t pos;
+} TempArena;
+
+TempArena temp_begin(Arena* arena);
+void temp_end(TempArena temp);
+
+// Each thread has a small pool of scratch arenas for temporaries, so they
+// don't have to go in (and be leaked into) whichever arena the caller has
+// handy. conflicts are arenas the caller is keeping something in across the
+// scratch's lifetime (e.g. a result arena, or a dict that might grow), so
+// that the scratch comes from a different one. Must be ended in LIFO order.
+TempArena scratch_begin(Arena** conflicts, int num_conflicts);
+#define scratch_end(temp) temp_end(temp)
+// Pops all of this thread's scratch arenas, for after an error has longjmp()d
+// past whatever scratch_end()s there were. Nothing can still be using them.
+void scratch_reset(void);
+
+// Where the IR library's allocations go, see force_include.h. Per thread, so
+// that the --tiered and --watch threads can build IR while main is too.
+extern _Thread_local Arena* arena_ir;
+
+
+// base_{win,mac,linux}.c
 
 typedef struct ReadFileResult {
   unsigned char* buffer;
@@ -52,11 +83,53 @@ bool base_mem_commit(void* ptr, uint64_t size);
 void *base_mem_large_alloc(uint64_t size);
 void base_mem_decommit(void* ptr, uint64_t size);
 void base_mem_release(void* ptr, uint64_t size);
+// Resident set size of the process now and at its most, in bytes.
+void base_mem_rss(uint64_t* rss, uint64_t* peak_rss);
 ReadFileResult base_read_file(const char* filename);
+// When the file was last written, in some platform unit that's only good for
+// comparing against another call. 0 if it can't be found.
+uint64_t base_file_mtime(const char* filename);
+// The absolute path of an existing file, allocated in arena, so that it's
+// recognizable however it was named. NULL if it can't be found.
+const char* base_full_path(Arena* arena, const char* filename);
 NORETURN void base_exit(int rc);
+// If set, base_exit() calls this instead, which must not return.
+void base_set_exit_handler(void (*handler)(int rc));
 void base_timer_init(void);
 uint64_t base_timer_now(void);
 
+// Makes already-mapped code pages writable without dropping execute, so that a
+// jump can be patched while other threads may still be running on that page.
+bool base_mem_protect_rwx(void* ptr, uint64_t size);
+
+// Runs func(arg), and returns false rather than taking the process down if it
+// faults (divides by zero, touches unmapped memory, runs out of stack, ...).
+// For running JIT'd code from the program being compiled inside the compiler.
+bool base_call_guarded(void (*func)(void*), void* arg);
+
+void base_sleep_ms(uint32_t ms);
+
+typedef struct BaseThread BaseThread;
+typedef struct BaseSemaphore BaseSemaphore;
+BaseThread* base_thread_create(void (*func)(void*), void* arg);
+void base_thread_join(BaseThread* thread);
+BaseSemaphore* base_semaphore_create(void);
+void base_semaphore_signal(BaseSemaphore* sem);
+void base_semaphore_wait(BaseSemaphore* sem);
+
+// For --serve. A request is the client's command line, which is run in the
+// client's working directory, and with the client's stdout and stderr swapped
+// in for the server's until the reply.
+typedef struct BaseServer BaseServer;
+BaseServer* base_server_create(const char* socket_path);
+// Blocks until the next request and returns its argc. argv[0] is a placeholder
+// and the strings are only valid until base_server_reply().
+int base_server_accept(BaseServer* server, char*** argv);
+void base_server_reply(BaseServer* server, int rc);
+// Sends argv (not including argv[0]) and waits for the reply. Returns false if
+// the server couldn't be reached or went away.
+bool base_server_request(const char* socket_path, int argc, char** argv, int* rc);
+
 
 // str.c
 
@@ -65,6 +138,9 @@ typedef struct Str {
 } Str;
 
 void str_intern_pool_init(Arena* arena, char* parse_buffer, size_t buffer_size);
+// For --serve, where the pool is kept across requests, but each one has its
+// own file.
+void str_intern_pool_set_parse_buffer(char* parse_buffer, size_t buffer_size);
 void str_intern_pool_destroy_for_tests(void);
 
 Str str_intern_len(const char* str, uint32_t len);
@@ -100,6 +176,34 @@ static inline char* cstr_copy(Arena* arena, Str s) {
 }
 
 
+// trace.c
+
+// --trace writes a Chrome trace-event JSON file (chrome://tracing, or
+// ui.perfetto.dev) of where the compiler's time went. Zones nest per thread,
+// and detail is shown as an arg on the zone.
+extern bool trace_enabled;
+void trace_start(void);
+// Writes what was recorded, or with filename NULL just throws it away.
+bool trace_finish(const char* filename);
+void trace_thread_name(const char* name);
+void trace_begin_impl(const char* name, Str detail);
+void trace_end_impl(void);
+
+#define TRACE_BEGIN(name, detail)         \
+  do {                                    \
+    if (BRANCH_UNLIKELY(trace_enabled)) { \
+      trace_begin_impl(name, detail);     \
+    }                                     \
+  } while (0)
+
+#define TRACE_END()                       \
+  do {                                    \
+    if (BRANCH_UNLIKELY(trace_enabled)) { \
+      trace_end_impl();                   \
+    }                                     \
+  } while (0)
+
+
 // lex.c
 
 typedef enum TokenKind {
@@ -184,7 +288,14 @@ typedef enum TypeKind {
 #define type_range BASIC_TYPE_CONSTANT_IMPL(TYPE_RANGE)
 
 void type_init(Arena* arena);
-void type_destroy_for_tests(void);
+void type_destroy(void);
+// For --serve, which keeps imported modules' types for later requests but not
+// the rest. type_drop_unkept() removes every type made since the last
+// type_keep() (or type_init()).
+void type_keep(void);
+void type_drop_unkept(void);
+// Distinct types made since type_init(), not counting the builtins.
+uint32_t type_num_created(void);
 // returned str is either allocated into the arena passed to type_init(), or a constant.
 const char* type_as_str(Type type);
 
@@ -241,6 +352,8 @@ Type type_ptr_subtype(Type type);
 Type type_array_subtype(Type type);
 uint32_t type_array_count(Type type);
 
+Type type_list_subtype(Type type);
+
 uint32_t type_struct_num_fields(Type type);
 Str type_struct_decl_name(Type type);
 bool type_struct_has_initializer(Type type);
@@ -252,21 +365,361 @@ uint32_t type_struct_field_index_by_name(Type type, Str name);  // == num_fields
 bool type_struct_find_field_by_name(Type type, Str name, Type* out_type, uint32_t* out_offset);
 
 
+// obj_elf.c
+
+typedef enum ObjSection {
+  OBJ_SECTION_UNDEF,
+  OBJ_SECTION_TEXT,
+  OBJ_SECTION_DATA,
+} ObjSection;
+
+typedef struct ObjSymbol {
+  const char* name;
+  ObjSection section;  // OBJ_SECTION_UNDEF for externals, which are always global.
+  bool global;
+  uint64_t offset;
+  uint64_t size;
+} ObjSymbol;
+
+// A 64 bit absolute address at `offset` in `section`, pointing either at
+// `addend` bytes into `target_section`, or at `symbol` (an index into
+// ObjFile.symbols) if target_section is OBJ_SECTION_UNDEF.
+typedef struct ObjReloc {
+  ObjSection section;
+  uint64_t offset;
+  ObjSection target_section;
+  uint32_t symbol;
+  int64_t addend;
+} ObjReloc;
+
+typedef struct ObjFile {
+  const uint8_t* text;
+  size_t text_size;
+  const uint8_t* data;
+  size_t data_size;
+  ObjSymbol* symbols;
+  uint32_t num_symbols;
+  ObjReloc* relocs;
+  uint32_t num_relocs;
+} ObjFile;
+
+// x64 ELF relocatable object. Scratch allocations are made in arena.
+bool obj_write_elf(Arena* arena, const char* filename, ObjFile* obj);
+
+
+// code_cache.c
+
+// Anything that generated code might refer to by absolute address, by a name
+// that will be the same in the next run. Used by both --code-cache (to find
+// things by name in the next run) and --emit-obj (to turn addresses into
+// relocations).
+typedef struct CacheTarget CacheTarget;
+struct CacheTarget {
+  void* addr;
+  const char* name;  // Not \0 terminated.
+  uint32_t name_len;
+  uint32_t data_size;  // Non-zero for globals, string objects, and initializer blobs.
+  bool is_extern;      // Runtime helpers and foreign functions, named "$cname".
+  bool is_str;         // A RuntimeStr whose data points just past itself.
+  bool ambiguous;      // Name registered for more than one address, so can't be used.
+  uint32_t obj_symbol;  // For externs, ~0 until the object writer gives it a symbol.
+  CacheTarget* next;
+};
+
+typedef struct CacheReloc {
+  uint32_t offset;
+  uint32_t pinned_addr;  // If non-zero, there's nothing to patch, see cache_record().
+  uint32_t name_len;
+  const char* name;
+} CacheReloc;
+
+// A function's machine code, and where it refers to CacheTargets.
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+  uint64_t key;
+  const uint8_t* code;
+  uint32_t size;
+  uint32_t num_relocs;
+  CacheReloc* relocs;
+  CacheEntry* next_used;  // What gets written back out at the end.
+};
+
+typedef struct CacheTargets CacheTargets;
+CacheTargets* cache_targets_new(Arena* arena);
+// Returns the existing target if addr is already registered as name. A name
+// that's registered for a second address makes both ambiguous.
+CacheTarget* cache_targets_add(CacheTargets* targets,
+                               void* addr,
+                               const char* name,
+                               uint32_t name_len);
+CacheTarget* cache_targets_find_addr(CacheTargets* targets, void* addr);
+CacheTarget* cache_targets_find_name(CacheTargets* targets, const char* name, uint32_t name_len);
+// All of them, most recent first.
+CacheTarget* cache_targets_list(CacheTargets* targets);
+// Copies entry's code to code and patches it, or returns false if something it
+// refers to doesn't exist (anymore) in this run.
+bool cache_entry_install(CacheTargets* targets, const CacheEntry* entry, uint8_t* code);
+
+// A --code-cache file of CacheEntrys, keyed by whatever the compiler says
+// makes a function the same. version is for how the code was compiled, a file
+// with a different one is treated as empty.
+typedef struct CodeCache CodeCache;
+CodeCache* code_cache_load(Arena* arena, const char* filename, uint64_t version);
+CacheEntry* code_cache_find(CodeCache* cache, uint64_t key);
+// Only entries that were used are written back out.
+void code_cache_use(CodeCache* cache, CacheEntry* entry);
+// Also releases what was loaded, so nothing found in it can be used after.
+void code_cache_save(CodeCache* cache);
+
+// An imported module's interface file, see module_interface_save() in parse.c.
+// Names point into the file's contents, or whatever they were saved from.
+#define MAX_INTERFACE_TYPES 1024
+
+typedef struct InterfaceDep {
+  StrView filename;  // Relative to the module's directory.
+  uint64_t content_hash;
+} InterfaceDep;
+
+// Structs that the module didn't declare are found again by which of its deps
+// exported them, and as what. dep_name is empty for everything else.
+typedef struct InterfaceType {
+  Type type;
+  uint64_t dep_hash;
+  StrView dep_name;
+} InterfaceType;
+
+typedef struct InterfaceGlobal {
+  StrView name;
+  uint32_t size;
+  uint64_t initial;
+  void* addr;  // Only for module_interface_link().
+} InterfaceGlobal;
+
+typedef struct InterfaceFunc {
+  StrView name;
+  CacheEntry code;
+  void* addr;  // Only for module_interface_link().
+} InterfaceFunc;
+
+typedef struct InterfaceExport {
+  StrView name;
+  uint8_t kind;   // SymKind.
+  uint32_t type;  // Index into types.
+  uint64_t payload;
+} InterfaceExport;
+
+typedef struct ModuleInterface {
+  const char* filename;  // Own targets are "filename:name", only for saving.
+  uint64_t content_hash;
+  InterfaceDep* deps;
+  uint32_t num_deps;
+  InterfaceType* types;  // Each one after the types it's made of.
+  uint32_t num_types;
+  InterfaceGlobal* globals;
+  uint32_t num_globals;
+  InterfaceFunc* funcs;
+  uint32_t num_funcs;
+  InterfaceExport* exports;
+  uint32_t num_exports;
+} ModuleInterface;
+
+// What reading an interface needs from whoever's importing the module.
+typedef struct InterfaceImporter {
+  void* ctx;
+  // Imports one of what the module imported, false if it isn't the same as it
+  // was when the interface was saved.
+  bool (*import_dep)(void* ctx, StrView filename, uint64_t content_hash);
+  // The struct that the module with content_hash exported as name.
+  bool (*find_dep_struct)(void* ctx, uint64_t content_hash, StrView name, Type* out);
+} InterfaceImporter;
+
+// Scratch allocations are made in arena.
+void module_interface_write(Arena* arena,
+                            const char* filename,
+                            uint64_t version,
+                            const ModuleInterface* iface);
+// Types go in the type table as they're read, with struct initializer blobs
+// in blob_arena. Everything else is in arena or points into [p, end). Returns
+// false if anything about it isn't right.
+bool module_interface_read(Arena* arena,
+                           Arena* blob_arena,
+                           const uint8_t* p,
+                           const uint8_t* end,
+                           uint64_t version,
+                           uint64_t content_hash,
+                           const InterfaceImporter* importer,
+                           ModuleInterface* iface);
+// Patches the functions' code, which has already been copied to each addr, to
+// point at the module's own functions, globals, and struct initializer blobs,
+// and at whatever else is in targets. Nothing is patched if any of them can't
+// be found. Scratch allocations are made in arena.
+bool module_interface_link(Arena* arena, CacheTargets* targets, ModuleInterface* iface);
+
+
+// profile.c
+
+// For --profile-gen and --profile-use. Counts are keyed by source offset
+// (and which file, by its contents), so a profile lines up with a later
+// compile of the same code, and just stops matching once the file is edited.
+typedef enum ProfileKind {
+  PROF_ENTRY,      // At the function name.
+  PROF_TAKEN,      // At an if/elif condition, when it was true.
+  PROF_NOT_TAKEN,  // ... and when it was false.
+  PROF_BACKEDGE,   // At the ':' of a for loop, for each iteration.
+  PROF_LOOP_EXIT,  // ... and when it finished.
+} ProfileKind;
+
+typedef struct ProfileKey {
+  uint64_t file_hash;
+  uint32_t offset;
+  uint32_t kind;
+} ProfileKey;
+
+typedef struct ProfileCount {
+  ProfileKey key;  // First so that the hash/eq functions work on the key alone.
+  uint64_t count;
+} ProfileCount;
+
+// Counts for the same key (i.e. from a function that was compiled more than
+// once) are summed. Exits if the file can't be read or isn't a profile.
+typedef struct Profile Profile;
+Profile* profile_load(Arena* arena, const char* filename);
+bool profile_find(Profile* profile, ProfileKey key, uint64_t* count);
+void profile_save(const char* filename, const ProfileCount* counts, uint32_t num_counts);
+
+
+// hot_reload.c
+
+// With --watch, every top level function is called through a stub like the
+// --tiered ones, and the whole file is parsed again each time it changes.
+// Functions whose code key is the same as last time keep their code without
+// going through the backend, and the stubs of the ones that did change are
+// pointed at the new code. Globals keep their storage (and so their current
+// value) as long as their type is the same.
+typedef struct HotSym {
+  Str name;
+  bool is_global;
+  size_t type_hash;
+  void* addr;  // The stub for functions, the storage for globals.
+  void* code;
+  uint64_t key;
+} HotSym;
+
+// `jmp rel32` padded with int3 to 8 bytes, so that it can be replaced with a
+// single aligned store while other threads might be executing it.
+uint64_t jump_stub_encode(void* from, void* to);
+// Redirects a stub that's already executable, and might be running. Also how
+// --tiered installs tier 2 code.
+void jump_stub_patch(uint64_t* stub, void* target);
+
+typedef struct HotReload HotReload;
+HotReload* hot_new(Arena* arena, const char* filename, ReadFileResult file);
+// What the last successful parse of the file left, as opposed to what's
+// pending.
+HotSym* hot_find(HotReload* hot, Str name, bool is_global);
+void hot_queue(HotReload* hot, HotSym sym, bool patch_stub);
+// Drops what's pending, after a reload that failed.
+void hot_discard(HotReload* hot);
+// Applies what's pending, which must all be executable by now. Returns the
+// number of functions that are new or changed.
+uint32_t hot_commit(HotReload* hot);
+// Starts polling the file on a background thread, and calls reload on that
+// thread each time its contents change.
+void hot_watch(HotReload* hot, void (*reload)(ReadFileResult file));
+// For tests. Flushes stdout so that whatever is reading it knows that it's
+// time to change the file, then waits (for up to 10s) until the watcher has
+// tried to reload it, and returns how many times it has.
+uint32_t hot_wait(HotReload* hot);
+void hot_stop(HotReload* hot);
+
+// third_party/ir/ir_perf.c, only built for Linux.
+
+int ir_perf_jitdump_open(void);
+int ir_perf_jitdump_close(void);
+int ir_perf_jitdump_register(const char* name, const void* start, size_t size);
+void ir_perf_map_register(const char* name, const void* start, size_t size);
+
 // parse.c
 
+// What's on the command line, filled in once by luvc_main.c and handed to
+// parse_*() as is.
+typedef struct Options {
+  const char* input;
+  int verbose;
+  bool syntax_only;
+  bool ir_only;
+  bool return_main_rc;
+  bool register_test_helpers;
+  int opt_level;
+  bool bounds_check;
+  bool tiered;
+  bool time_phases;
+  const char* code_cache_dir;
+  const char* obj_filename;
+  bool watch;
+  const char* serve_socket;
+  const char* profile_gen_filename;
+  const char* profile_use_filename;
+  bool perf_map;
+  bool jitdump;
+  const char* trace_filename;
+  bool stats;
+  // Not from the command line: set for --serve requests so that imported
+  // modules are kept for later requests rather than compiled every time.
+  bool keep_modules;
+} Options;
+
+// For --stats, filled in by parse_*() if one's passed. Counts include
+// imports, and compiles by --tiered or --watch after parse_*() has returned.
+typedef struct CompileStats {
+  uint64_t index_us;
+  uint64_t jit_us;
+  uint32_t num_tokens;
+  uint32_t num_funcs;
+  uint64_t num_ir_insns;
+  uint64_t code_bytes;
+  uint32_t num_string_literals;
+  uint32_t num_types;
+  uint64_t code_buffer_used;
+  uint64_t code_buffer_size;
+} CompileStats;
+
 void* parse_code_gen(Arena* arena,
                      Arena* temp_arena,
-                     const char* filename,
                      ReadFileResult file,
                      void* (*get_extern)(StrView),
-                     int verbose,
-                     bool ir_only,
-                     int opt_level);
+                     const Options* options,
+                     CompileStats* stats);
+// Waits for everything --tiered has queued so far to be compiled, and returns
+// how many functions have been tiered up.
+uint32_t parse_code_gen_tier_wait(void);
+// Waits for --watch to reload the file after it changes, and returns how many
+// times it has been (or failed to be) reloaded.
+uint32_t parse_code_gen_hot_wait(void);
+// How many functions --profile-use put with the cold code because they never
+// ran when the profile was written.
+uint32_t parse_code_gen_num_cold_funcs(void);
+// How many imports --code-cache loaded from interface files rather than
+// compiling.
+uint32_t parse_code_gen_num_module_interfaces(void);
+// How far into the list comprehension arena the running program is using, or 0
+// when no lists are live.
+uint64_t parse_code_gen_list_bytes(void);
+// Waits for any background compilation (i.e. --tiered or --watch) to stop, and
+// writes the --profile-gen counts.
+void parse_code_gen_shutdown(void);
+// --opt -1, templated x64 directly from the parser without going through IR.
+void* parse_baseline(Arena* arena,
+                     Arena* temp_arena,
+                     ReadFileResult file,
+                     void* (*get_extern)(StrView),
+                     const Options* options,
+                     CompileStats* stats);
+// parse_code_gen_list_bytes() for --opt -1.
+uint64_t parse_baseline_list_bytes(void);
 void* parse_syntax_check(Arena* arena,
                          Arena* temp_arena,
-                         const char* filename,
                          ReadFileResult file,
                          void* (*get_extern)(StrView),
-                         int verbose,
-                         bool ir_only,
-                         int opt_level);
+                         const Options* options,
+                         CompileStats* stats);
@@ -1,65 +1,178 @@
 #include "luv60.h"
 
+#include <inttypes.h>
+#include <setjmp.h>
+#if OS_LINUX
+#include <unistd.h>
+#endif
+
+// How much committed memory above where they're popped to is kept by arenas
+// in the long-running modes, see arena_set_decommit_keep().
+#define LONG_RUNNING_ARENA_KEEP MiB(1)
+
 // Cannot use Str as it's not initialized yet.
-static void parse_commandline(int argc,
-                              char** argv,
-                              char** input,
-                              int* verbose,
-                              bool* syntax_only,
-                              bool* ir_only,
-                              bool* return_main_rc,
-                              bool* register_test_helpers,
-                              int* opt_level) {
+static void parse_commandline(int argc, char** argv, Options* opts) {
   int i = 1;
-  *verbose = 0;
-  *return_main_rc = false;
-  *syntax_only = false;
-  *ir_only = false;
-  *input = NULL;
-  *register_test_helpers = false;
-  *opt_level = 1;
+  *opts = (Options){.opt_level = 1};
   while (i < argc) {
     if (strcmp(argv[i], "-v") == 0) {
-      *verbose = 1;
+      opts->verbose = 1;
       ++i;
     } else if (strcmp(argv[i], "-vv") == 0) {
-      *verbose = 2;
+      opts->verbose = 2;
       ++i;
     } else if (strcmp(argv[i], "--main-rc") == 0) {
-      *return_main_rc = true;
+      opts->return_main_rc = true;
       ++i;
     } else if (strcmp(argv[i], "--syntax-only") == 0) {
-      *syntax_only = true;
+      opts->syntax_only = true;
       ++i;
     } else if (strcmp(argv[i], "--ir-only") == 0) {
-      *ir_only = true;
+      opts->ir_only = true;
       ++i;
     } else if (strcmp(argv[i], "--internal-register-test-helpers") == 0) {
-      *register_test_helpers = true;
+      opts->register_test_helpers = true;
       ++i;
     } else if (strcmp(argv[i], "--opt") == 0) {
-      *opt_level = atoi(argv[i+1]);
-      if (*opt_level < 0 || *opt_level > 2) {
-        base_writef_stderr("Valid optimization levels are 0, 1, 2.\n");
+      opts->opt_level = atoi(argv[i+1]);
+      if (opts->opt_level < -1 || opts->opt_level > 2) {
+        base_writef_stderr("Valid optimization levels are -1, 0, 1, 2.\n");
+        base_exit(1);
+      }
+      i += 2;
+    } else if (strcmp(argv[i], "--bounds-check") == 0) {
+      opts->bounds_check = true;
+      ++i;
+    } else if (strcmp(argv[i], "--tiered") == 0) {
+      opts->tiered = true;
+      ++i;
+    } else if (strcmp(argv[i], "--time-phases") == 0) {
+      opts->time_phases = true;
+      ++i;
+    } else if (strcmp(argv[i], "--code-cache") == 0) {
+      if (i + 1 >= argc) {
+        base_writef_stderr("--code-cache requires a directory.\n");
         base_exit(1);
       }
+      opts->code_cache_dir = argv[i + 1];
       i += 2;
+    } else if (strcmp(argv[i], "--emit-obj") == 0) {
+      if (i + 1 >= argc) {
+        base_writef_stderr("--emit-obj requires an output filename.\n");
+        base_exit(1);
+      }
+      opts->obj_filename = argv[i + 1];
+      i += 2;
+    } else if (strcmp(argv[i], "--watch") == 0) {
+      opts->watch = true;
+      ++i;
+    } else if (strcmp(argv[i], "--serve") == 0) {
+      if (i + 1 >= argc) {
+        base_writef_stderr("--serve requires a socket path.\n");
+        base_exit(1);
+      }
+      opts->serve_socket = argv[i + 1];
+      i += 2;
+    } else if (strcmp(argv[i], "--profile-gen") == 0) {
+      if (i + 1 >= argc) {
+        base_writef_stderr("--profile-gen requires an output filename.\n");
+        base_exit(1);
+      }
+      opts->profile_gen_filename = argv[i + 1];
+      i += 2;
+    } else if (strcmp(argv[i], "--profile-use") == 0) {
+      if (i + 1 >= argc) {
+        base_writef_stderr("--profile-use requires a filename from --profile-gen.\n");
+        base_exit(1);
+      }
+      opts->profile_use_filename = argv[i + 1];
+      i += 2;
+    } else if (strcmp(argv[i], "--perf-map") == 0) {
+      opts->perf_map = true;
+      ++i;
+    } else if (strcmp(argv[i], "--jitdump") == 0) {
+      opts->jitdump = true;
+      ++i;
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      if (i + 1 >= argc) {
+        base_writef_stderr("--trace requires an output filename.\n");
+        base_exit(1);
+      }
+      opts->trace_filename = argv[i + 1];
+      i += 2;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      opts->stats = true;
+      ++i;
     } else {
-      if (*input) {
+      if (opts->input) {
         base_writef_stderr("Can only specify a single input file.\n");
         base_exit(1);
       }
-      *input = argv[i];
+      opts->input = argv[i];
       ++i;
     }
   }
 
-  if (*ir_only && *syntax_only) {
+  if (opts->ir_only && opts->syntax_only) {
     base_writef_stderr("--ir-only and --syntax-only don't make sense together.\n");
     base_exit(1);
   }
 
-  if (!*input) {
+  if (opts->tiered && opts->opt_level == -1) {
+    base_writef_stderr("--tiered and --opt -1 don't make sense together.\n");
+    base_exit(1);
+  }
+
+  if (opts->code_cache_dir && (opts->tiered || opts->opt_level == -1)) {
+    base_writef_stderr("--code-cache only works with --opt 0, 1, or 2.\n");
+    base_exit(1);
+  }
+
+  if (opts->obj_filename && (opts->tiered || opts->opt_level == -1 || opts->code_cache_dir ||
+                             opts->ir_only || opts->syntax_only)) {
+    base_writef_stderr(
+        "--emit-obj doesn't work with --tiered, --opt -1, --code-cache, --ir-only, or "
+        "--syntax-only.\n");
+    base_exit(1);
+  }
+
+  if (opts->watch && (opts->tiered || opts->opt_level == -1 || opts->code_cache_dir ||
+                      opts->obj_filename || opts->ir_only || opts->syntax_only)) {
+    base_writef_stderr(
+        "--watch doesn't work with --tiered, --opt -1, --code-cache, --emit-obj, --ir-only, or "
+        "--syntax-only.\n");
+    base_exit(1);
+  }
+
+  if ((opts->profile_gen_filename || opts->profile_use_filename) &&
+      (opts->tiered || opts->opt_level == -1 || opts->code_cache_dir || opts->obj_filename ||
+       opts->watch || opts->syntax_only)) {
+    base_writef_stderr(
+        "--profile-gen and --profile-use don't work with --tiered, --opt -1, --code-cache, "
+        "--emit-obj, --watch, or --syntax-only.\n");
+    base_exit(1);
+  }
+
+  if (opts->perf_map || opts->jitdump) {
+    if (!OS_LINUX) {
+      base_writef_stderr("--perf-map and --jitdump are only implemented for Linux.\n");
+      base_exit(1);
+    }
+    if (opts->obj_filename || opts->syntax_only) {
+      base_writef_stderr("--perf-map and --jitdump don't work with --emit-obj or --syntax-only.\n");
+      base_exit(1);
+    }
+  }
+
+  if (opts->serve_socket) {
+    if (opts->input || argc != 3) {
+      base_writef_stderr("--serve doesn't take any other arguments, they come with each request.\n");
+      base_exit(1);
+    }
+    return;
+  }
+
+  if (!opts->input) {
     base_writef_stderr("No input file specified.\n");
     base_exit(1);
   }
@@ -118,6 +231,50 @@ static struct LittleStuff testhelper_takes_and_returns_little_and_big(struct Lit
   return (struct LittleStuff){999, 888.0f};
 }
 
+static int testhelper_tier_wait(void) {
+  return (int)parse_code_gen_tier_wait();
+}
+
+static int testhelper_hot_wait(void) {
+  return (int)parse_code_gen_hot_wait();
+}
+
+static int testhelper_num_cold_funcs(void) {
+  return (int)parse_code_gen_num_cold_funcs();
+}
+
+static int testhelper_num_module_interfaces(void) {
+  return (int)parse_code_gen_num_module_interfaces();
+}
+
+// Bytes of list comprehension storage the program is using, from whichever
+// of the two back ends is running it.
+static int testhelper_list_bytes(void) {
+  return (int)(parse_code_gen_list_bytes() + parse_baseline_list_bytes());
+}
+
+// How many functions --perf-map has named so far, i.e. lines in the file that
+// perf looks for. Removes the file afterwards.
+static int testhelper_perf_map_lines(void) {
+#if OS_LINUX
+  char filename[64];
+  snprintf(filename, sizeof(filename), "/tmp/perf-%d.map", (int)getpid());
+  FILE* f = fopen(filename, "r");
+  if (!f) {
+    return -1;
+  }
+  int lines = 0;
+  for (int c; (c = fgetc(f)) != EOF;) {
+    lines += c == '\n';
+  }
+  fclose(f);
+  remove(filename);
+  return lines;
+#else
+  return -1;
+#endif
+}
+
 static void* get_testhelper_addresses(StrView name) {
 #define EXPORT_FUNC(x)                          \
   if (strncmp(name.data, #x, name.size) == 0) { \
@@ -129,52 +286,284 @@ static void* get_testhelper_addresses(StrView name) {
   EXPORT_FUNC(testhelper_returns_littlestuff);
   EXPORT_FUNC(testhelper_takes_littlestuff);
   EXPORT_FUNC(testhelper_takes_and_returns_little_and_big);
+  EXPORT_FUNC(testhelper_tier_wait);
+  EXPORT_FUNC(testhelper_hot_wait);
+  EXPORT_FUNC(testhelper_num_cold_funcs);
+  EXPORT_FUNC(testhelper_num_module_interfaces);
+  EXPORT_FUNC(testhelper_perf_map_lines);
+  EXPORT_FUNC(testhelper_list_bytes);
   return NULL;
 }
 
-int main(int argc, char** argv) {
-  Arena* main_arena = arena_create(MiB(256), KiB(128));
-  Arena* parse_temp_arena = arena_create(MiB(256), KiB(128));
-  Arena* str_arena = arena_create(MiB(256), KiB(128));
-  arena_ir = arena_create(MiB(256), KiB(128));
+// Once nothing else is running that might still record into it.
+static int write_trace(const char* trace_filename, int rc) {
+  if (trace_filename && !trace_finish(trace_filename)) {
+    base_writef_stderr("Couldn't write '%s'.\n", trace_filename);
+    return 1;
+  }
+  return rc;
+}
+
+static void print_arena_stats(const char* name, Arena* arena) {
+  base_writef_stderr("%-16s %10.1f KiB peak, %.1f KiB peak committed, %.1f KiB now\n", name,
+                     arena->peak_pos / 1024.0, arena->peak_commit / 1024.0,
+                     arena->cur_commit / 1024.0);
+}
+
+static void print_stats(CompileStats* stats,
+                        ReadFileResult file,
+                        uint64_t read_us,
+                        uint64_t compile_us,
+                        uint64_t run_us,
+                        Arena* main_arena,
+                        Arena* parse_temp_arena,
+                        Arena* str_arena) {
+  uint32_t num_lines = 0;
+  for (size_t i = 0; i < file.file_size; ++i) {
+    num_lines += file.buffer[i] == '\n';
+  }
+  uint64_t parse_us = compile_us - MIN(compile_us, stats->index_us + stats->jit_us);
+  uint64_t total_us = read_us + compile_us + run_us;
+  base_writef_stderr("%-16s %10.3f ms\n", "read", read_us / 1000.0);
+  base_writef_stderr("%-16s %10.3f ms, %u tokens\n", "index", stats->index_us / 1000.0,
+                     stats->num_tokens);
+  base_writef_stderr("%-16s %10.3f ms, %u functions, %" PRIu64 " IR instructions\n", "parse+IR",
+                     parse_us / 1000.0, stats->num_funcs, stats->num_ir_insns);
+  base_writef_stderr("%-16s %10.3f ms, %" PRIu64 " bytes of code\n", "JIT",
+                     stats->jit_us / 1000.0, stats->code_bytes);
+  base_writef_stderr("%-16s %10.3f ms\n", "run", run_us / 1000.0);
+  base_writef_stderr("%-16s %10.3f ms, %u lines, %.0f lines/s compiling\n", "total",
+                     total_us / 1000.0, num_lines,
+                     compile_us ? num_lines * 1e6 / compile_us : 0.0);
+  base_writef_stderr("%-16s %10u\n", "string literals", stats->num_string_literals);
+  base_writef_stderr("%-16s %10u\n", "types", stats->num_types);
+  print_arena_stats("main arena", main_arena);
+  print_arena_stats("parse temp arena", parse_temp_arena);
+  print_arena_stats("str arena", str_arena);
+  print_arena_stats("ir arena", arena_ir);
+  base_writef_stderr("%-16s %10.1f KiB used, %.1f KiB reserved\n", "code buffer",
+                     stats->code_buffer_used / 1024.0, stats->code_buffer_size / 1024.0);
+  uint64_t rss, peak_rss;
+  base_mem_rss(&rss, &peak_rss);
+  base_writef_stderr("%-16s %10.1f MiB, %.1f MiB peak\n", "rss", rss / (1024.0 * 1024.0),
+                     peak_rss / (1024.0 * 1024.0));
+}
 
-  char* input;
-  int verbose;
-  bool syntax_only;
-  bool ir_only;
-  bool return_main_rc;
-  bool register_test_helpers;
-  int opt_level;
-  parse_commandline(argc, argv, &input, &verbose, &syntax_only, &ir_only, &return_main_rc,
-                    &register_test_helpers, &opt_level);
-
-  ReadFileResult file = base_read_file(input);
-  if (!file.buffer) {
-    base_writef_stderr("Couldn't read '%s'\n", input);
+typedef struct RunMain {
+  void* entry;
+  int rc;
+} RunMain;
+
+static void run_main(void* arg) {
+  RunMain* run = arg;
+  run->rc = ((int (*)())run->entry)();
+}
+
+// With serving set, this is a --serve request, and the Str pool and arenas are
+// already set up.
+static int compile_and_run(int argc,
+                           char** argv,
+                           Arena* main_arena,
+                           Arena* parse_temp_arena,
+                           Arena* str_arena,
+                           bool serving,
+                           ReadFileResult* file) {
+  Options options;
+  parse_commandline(argc, argv, &options);
+  options.keep_modules = serving;
+  if (serving && (options.tiered || options.watch || options.serve_socket)) {
+    // These leave threads running that would outlive the request.
+    base_writef_stderr("--tiered, --watch, and --serve can't be used in a --serve request.\n");
     return 1;
   }
+  if (options.time_phases || options.trace_filename || options.stats) {
+    base_timer_init();
+  }
 
-  str_intern_pool_init(str_arena, (char*)file.buffer, file.file_size);
+  CompileStats stats = {0};
+  CompileStats* want_stats = options.stats ? &stats : NULL;
+  uint64_t read_start_us = options.stats ? base_timer_now() : 0;
+  if (options.stats) {
+    // Otherwise they'd be the peak across all --serve requests so far.
+    Arena* arenas[] = {main_arena, parse_temp_arena, str_arena, arena_ir};
+    for (size_t i = 0; i < COUNTOF(arenas); ++i) {
+      arenas[i]->peak_pos = arenas[i]->cur_pos;
+      arenas[i]->peak_commit = arenas[i]->cur_commit;
+    }
+  }
+  *file = base_read_file(options.input);
+  if (!file->buffer) {
+    base_writef_stderr("Couldn't read '%s'\n", options.input);
+    return 1;
+  }
 
-  if (syntax_only) {
-    parse_syntax_check(main_arena, parse_temp_arena, input, file, NULL, verbose, ir_only,
-                       opt_level);
-    return 0;
+  if (serving) {
+    str_intern_pool_set_parse_buffer((char*)file->buffer, file->file_size);
   } else {
-    void* entry = parse_code_gen(main_arena, parse_temp_arena, input, file,
-                                 register_test_helpers ? get_testhelper_addresses : NULL, verbose,
-                                 ir_only, opt_level);
+    str_intern_pool_init(str_arena, (char*)file->buffer, file->file_size);
+  }
+
+  if (options.trace_filename) {
+    trace_start();
+  }
+
+  uint64_t compile_start_us = options.stats ? base_timer_now() : 0;
+  if (options.syntax_only) {
+    parse_syntax_check(main_arena, parse_temp_arena, *file, NULL, &options, want_stats);
+    if (options.stats) {
+      print_stats(&stats, *file, compile_start_us - read_start_us,
+                  base_timer_now() - compile_start_us, 0, main_arena, parse_temp_arena,
+                  str_arena);
+    }
+    return write_trace(options.trace_filename, 0);
+  } else {
+    void* (*get_extern)(StrView) =
+        options.register_test_helpers ? get_testhelper_addresses : NULL;
+#if OS_LINUX
+    // Goes in /tmp/jit-<pid>.dump for `perf inject --jit` to find.
+    if (options.jitdump && !ir_perf_jitdump_open()) {
+      base_writef_stderr("Couldn't open the jitdump file.\n");
+      return 1;
+    }
+#endif
+    void* entry;
+    if (options.opt_level == -1) {
+      entry = parse_baseline(main_arena, parse_temp_arena, *file, get_extern, &options, want_stats);
+    } else {
+      entry = parse_code_gen(main_arena, parse_temp_arena, *file, get_extern, &options, want_stats);
+    }
+    uint64_t run_start_us = options.stats ? base_timer_now() : 0;
     int rc = 0;
-    if (entry) {
-      int entry_returned = ((int (*)())entry)();
-      if (verbose) {
-        printf("main() returned %d\n", entry_returned);
+    // With --emit-obj, main() runs when the linked executable does.
+    if (entry && !options.obj_filename) {
+      TRACE_BEGIN("main()", (Str){0});
+      RunMain run = {.entry = entry};
+      bool ran = true;
+      if (serving) {
+        ran = base_call_guarded(run_main, &run);
+      } else {
+        run_main(&run);
       }
-      if (return_main_rc) {
-        rc = entry_returned;
+      TRACE_END();
+      if (!ran) {
+        base_writef_stderr("main() crashed (e.g. divided by zero or used a bad pointer).\n");
+        rc = 1;
+      } else {
+        if (options.verbose) {
+          printf("main() returned %d\n", run.rc);
+        }
+        if (options.return_main_rc) {
+          rc = run.rc;
+        }
       }
     }
+    uint64_t run_end_us = options.stats ? base_timer_now() : 0;
+    parse_code_gen_shutdown();
+#if OS_LINUX
+    if (options.jitdump) {
+      ir_perf_jitdump_close();
+    }
+#endif
+    if (options.stats) {
+      print_stats(&stats, *file, compile_start_us - read_start_us,
+                  run_start_us - compile_start_us, run_end_us - run_start_us, main_arena,
+                  parse_temp_arena, str_arena);
+    }
+
+    return write_trace(options.trace_filename, rc);
+  }
+}
+
+static jmp_buf request_exit_jmp;
+static int request_exit_rc;
+
+static void request_exit(int rc) {
+  request_exit_rc = rc;
+  longjmp(request_exit_jmp, 1);
+}
+
+// Each request is handled in this process, so the arenas are already
+// committed, the Str pool is already full of the usual names, the code buffer
+// is already mapped, and so on. Everything that a request allocates is popped
+// afterwards, other than imported modules, which are kept until their file
+// changes (see find_kept_module()), along with their types.
+//
+// The program runs in the server too, guarded so that a fault only fails the
+// request. One that scribbles over the compiler's memory without faulting, or
+// never returns, still takes the server with it.
+static int serve(const char* socket_path,
+                 Arena* main_arena,
+                 Arena* parse_temp_arena,
+                 Arena* str_arena) {
+  BaseServer* server = base_server_create(socket_path);
+  if (!server) {
+    base_writef_stderr("Couldn't listen on '%s'.\n", socket_path);
+    return 1;
+  }
+  str_intern_pool_init(str_arena, NULL, 0);
+  // Like the str arena, this only grows, by the types of kept modules.
+  Arena* type_arena = arena_create(MiB(256), KiB(128));
+  type_init(type_arena);
+  // The str arena only grows, it has the names from every request.
+  arena_set_decommit_keep(main_arena, LONG_RUNNING_ARENA_KEEP);
+  arena_set_decommit_keep(parse_temp_arena, LONG_RUNNING_ARENA_KEEP);
+  arena_set_decommit_keep(arena_ir, LONG_RUNNING_ARENA_KEEP);
+  uint64_t main_pos = arena_pos(main_arena);
+  uint64_t parse_temp_pos = arena_pos(parse_temp_arena);
+  uint64_t ir_pos = arena_pos(arena_ir);
+  base_set_exit_handler(request_exit);
+
+  for (;;) {
+    char** argv;
+    int argc = base_server_accept(server, &argv);
+    ReadFileResult file = {0};
+    int rc;
+    if (setjmp(request_exit_jmp) == 0) {
+      rc = compile_and_run(argc, argv, main_arena, parse_temp_arena, str_arena,
+                           /*serving=*/true, &file);
+    } else {
+      rc = request_exit_rc;
+    }
+    // In case the request exited before getting to write its --trace.
+    trace_finish(NULL);
+    if (file.buffer) {
+      base_mem_release(file.buffer, file.allocated_size);
+    }
+    type_drop_unkept();
+    arena_pop_to(main_arena, main_pos);
+    arena_pop_to(parse_temp_arena, parse_temp_pos);
+    arena_pop_to(arena_ir, ir_pos);
+    // Anything that exited in the middle of compiling skipped its scratch_end().
+    scratch_reset();
+    base_server_reply(server, rc);
+  }
+}
 
+int main(int argc, char** argv) {
+  // The client doesn't need anything else set up.
+  if (argc >= 2 && strcmp(argv[1], "--client") == 0) {
+    if (argc < 3) {
+      base_writef_stderr("--client requires the socket path that the server is using.\n");
+      return 1;
+    }
+    int rc;
+    if (!base_server_request(argv[2], argc - 2, argv + 2, &rc)) {
+      base_writef_stderr("Couldn't get a reply from a server at '%s'.\n", argv[2]);
+      return 1;
+    }
     return rc;
   }
+
+  Arena* main_arena = arena_create(MiB(256), KiB(128));
+  Arena* parse_temp_arena = arena_create(MiB(256), KiB(128));
+  Arena* str_arena = arena_create(MiB(256), KiB(128));
+  arena_ir = arena_create(MiB(256), KiB(128));
+
+  if (argc == 3 && strcmp(argv[1], "--serve") == 0) {
+    return serve(argv[2], main_arena, parse_temp_arena, str_arena);
+  }
+
+  ReadFileResult file;
+  return compile_and_run(argc, argv, main_arena, parse_temp_arena, str_arena, /*serving=*/false,
+                         &file);
 }
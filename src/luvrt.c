@@ -0,0 +1,125 @@
+// Runtime support for code written by `luvc --emit-obj`, e.g.
+//
+//   luvc --emit-obj prog.o prog.luv
+//   cc -no-pie prog.o luvrt.o -o prog
+//
+// (-no-pie because the code has absolute addresses in it.)
+//
+// These are the same as the *_impl helpers that parse.c hands to JIT'd code,
+// and need to match them (and how parse.c calls them) exactly.
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct RuntimeStr {
+  const uint8_t* data;
+  int64_t length;
+} RuntimeStr;
+
+typedef struct RuntimeRange {
+  int64_t start;
+  int64_t stop;
+  int64_t step;
+} RuntimeRange;
+
+void print_i32_impl(int32_t val) {
+  printf("%d\n", val);
+}
+
+void print_bool_impl(uint8_t val) {
+  printf("%s\n", val ? "true" : "false");
+}
+
+void print_float_impl(float val) {
+  printf("%f\n", val);
+}
+
+void print_double_impl(double val) {
+  printf("%f\n", val);
+}
+
+void print_str_impl(RuntimeStr str) {
+  printf("%.*s\n", (int)str.length, str.data);
+}
+
+void print_range_impl(RuntimeRange range) {
+  if (range.step == 1) {
+    printf("range(%" PRIi64 ", %" PRIi64 ")\n", range.start, range.stop);
+  } else {
+    printf("range(%" PRIi64 ", %" PRIi64 ", %" PRIi64 ")\n", range.start, range.stop, range.step);
+  }
+}
+
+void bounds_check_fail_impl(int64_t index, uint64_t length, int32_t line) {
+  fflush(stdout);
+  fprintf(stderr, "Line %d: index %" PRIi64 " out of bounds for length %" PRIu64 ".\n", line, index,
+          length);
+  exit(1);
+}
+
+void range_step_zero_fail_impl(int32_t line) {
+  fflush(stdout);
+  fprintf(stderr, "Line %d: range() step cannot be zero.\n", line);
+  exit(1);
+}
+
+// Each list is its own malloc() here, tagged with the frame of the function
+// that made it in the same way as in parse.c.
+#define LIST_FRAME_KEEP UINTPTR_MAX
+
+typedef struct ListBlock {
+  struct ListBlock* prev;
+  uintptr_t frame;
+  uint64_t pad[2];
+} ListBlock;
+
+static ListBlock* list_top;
+
+static void list_pop_below(uintptr_t frame) {
+  while (list_top && list_top->frame < frame) {
+    ListBlock* prev = list_top->prev;
+    free(list_top);
+    list_top = prev;
+  }
+}
+
+void* list_alloc_impl(uint64_t header_size, uint64_t count, uint64_t elem_size, uintptr_t frame) {
+  list_pop_below(frame);
+  ListBlock* block = NULL;
+  uint64_t avail = UINT64_MAX - sizeof(ListBlock);
+  if (header_size <= avail && (elem_size == 0 || count <= (avail - header_size) / elem_size)) {
+    block = malloc(sizeof(ListBlock) + header_size + count * elem_size);
+  }
+  if (!block) {
+    fflush(stdout);
+    fprintf(stderr, "Out of memory allocating a list of %" PRIu64 " elements.\n", count);
+    exit(1);
+  }
+  block->prev = list_top;
+  block->frame = frame;
+  list_top = block;
+  return block + 1;
+}
+
+void list_release_impl(uintptr_t frame) {
+  list_pop_below(frame + 1);
+}
+
+void list_adopt_impl(uintptr_t frame) {
+  for (ListBlock* block = list_top; block && block->frame < frame; block = block->prev) {
+    block->frame = frame;
+  }
+}
+
+void list_keep_impl(uintptr_t frame) {
+  for (ListBlock* block = list_top;
+       block && (block->frame <= frame || block->frame == LIST_FRAME_KEEP); block = block->prev) {
+    block->frame = LIST_FRAME_KEEP;
+  }
+}
+
+uint64_t list_count_mul_impl(uint64_t a, uint64_t b) {
+  return b && a > UINT64_MAX / b ? UINT64_MAX : a * b;
+}
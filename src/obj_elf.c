@@ -0,0 +1,216 @@
+#include "luv60.h"
+
+#include "../third_party/ir/ir.h"
+#include "../third_party/ir/ir_elf.h"
+
+// Only what's needed to write an x64 ET_REL that a system linker will take.
+// ir_elf.h has the structures, but not the relocation bits.
+
+#define ELF_TYPE_REL 1
+#define ELF_MACHINE_X86_64 62
+#define ELFSECT_TYPE_RELA 4
+#define ELFSECT_FLAGS_INFO_LINK (1 << 6)
+#define ELFSYM_TYPE_NOTYPE 0
+#define ELFSYM_TYPE_OBJECT 1
+#define ELFSYM_TYPE_SECTION 3
+#define ELF_R_X86_64_64 1
+
+typedef struct ElfRela {
+  uint64_t offset;
+  uint64_t info;
+  int64_t addend;
+} ElfRela;
+
+enum {
+  SECT_NULL,
+  SECT_TEXT,
+  SECT_DATA,
+  SECT_SYMTAB,
+  SECT_STRTAB,
+  SECT_RELA_TEXT,
+  SECT_RELA_DATA,
+  SECT_NOTE_GNU_STACK,
+  SECT_SHSTRTAB,
+  NUM_SECTS,
+};
+
+static const char shstrtab[] =
+    "\0.text\0.data\0.symtab\0.strtab\0.rela.text\0.rela.data\0.note.GNU-stack\0.shstrtab";
+
+static uint32_t shstrtab_offset(const char* name) {
+  for (uint32_t i = 1; i < sizeof(shstrtab); ++i) {
+    if (shstrtab[i - 1] == 0 && strcmp(&shstrtab[i], name) == 0) {
+      return i;
+    }
+  }
+  ASSERT(false);
+  return 0;
+}
+
+typedef struct ElfBuffer {
+  Arena* arena;
+  uint8_t* data;
+  size_t size;
+  size_t capacity;
+} ElfBuffer;
+
+static size_t elfbuf_write(ElfBuffer* buf, const void* data, size_t size, size_t align) {
+  size_t pos = ALIGN_UP(buf->size, align);
+  if (pos + size > buf->capacity) {
+    size_t new_capacity = buf->capacity * 2;
+    while (new_capacity < pos + size) {
+      new_capacity *= 2;
+    }
+    uint8_t* larger = arena_push(buf->arena, new_capacity, 16);
+    memcpy(larger, buf->data, buf->size);
+    buf->data = larger;
+    buf->capacity = new_capacity;
+  }
+  memset(buf->data + buf->size, 0, pos - buf->size);
+  if (size) {
+    memcpy(buf->data + pos, data, size);
+  }
+  buf->size = pos + size;
+  return pos;
+}
+
+bool obj_write_elf(Arena* arena, const char* filename, ObjFile* obj) {
+  ElfBuffer buf = {arena, arena_push(arena, MiB(1), 16), 0, MiB(1)};
+
+  // Symbols: null, the two section symbols, then locals, then globals, as
+  // ELF requires. Undefined symbols are always global.
+  uint32_t num_syms = 3 + obj->num_symbols;
+  ir_elf_symbol* syms = arena_push(arena, num_syms * sizeof(ir_elf_symbol), 8);
+  uint32_t* sym_index = arena_push(arena, (obj->num_symbols + 1) * sizeof(uint32_t), 4);
+  memset(syms, 0, 3 * sizeof(ir_elf_symbol));
+  syms[1].info = ELFSYM_INFO(ELFSYM_BIND_LOCAL, ELFSYM_TYPE_SECTION);
+  syms[1].sectidx = SECT_TEXT;
+  syms[2].info = ELFSYM_INFO(ELFSYM_BIND_LOCAL, ELFSYM_TYPE_SECTION);
+  syms[2].sectidx = SECT_DATA;
+
+  ElfBuffer strtab = {arena, arena_push(arena, KiB(64), 1), 1, KiB(64)};
+  strtab.data[0] = 0;
+
+  uint32_t next_sym = 3;
+  uint32_t first_global = 0;
+  for (int pass = 0; pass < 2; ++pass) {
+    bool want_global = pass == 1;
+    if (want_global) {
+      first_global = next_sym;
+    }
+    for (uint32_t i = 0; i < obj->num_symbols; ++i) {
+      ObjSymbol* sym = &obj->symbols[i];
+      bool is_global = sym->global || sym->section == OBJ_SECTION_UNDEF;
+      if (is_global != want_global) {
+        continue;
+      }
+      ir_elf_symbol* out = &syms[next_sym];
+      sym_index[i] = next_sym++;
+      out->name = (uint32_t)elfbuf_write(&strtab, sym->name, strlen(sym->name) + 1, 1);
+      out->other = 0;
+      out->value = sym->offset;
+      out->size = sym->size;
+      switch (sym->section) {
+        case OBJ_SECTION_TEXT:
+          out->sectidx = SECT_TEXT;
+          out->info = ELFSYM_INFO(is_global, ELFSYM_TYPE_FUNC);
+          break;
+        case OBJ_SECTION_DATA:
+          out->sectidx = SECT_DATA;
+          out->info = ELFSYM_INFO(is_global, ELFSYM_TYPE_OBJECT);
+          break;
+        default:
+          out->sectidx = 0;
+          out->info = ELFSYM_INFO(ELFSYM_BIND_GLOBAL, ELFSYM_TYPE_NOTYPE);
+          break;
+      }
+    }
+  }
+
+  ElfRela* relas[2];
+  uint32_t num_relas[2] = {0, 0};
+  relas[0] = arena_push(arena, (obj->num_relocs + 1) * sizeof(ElfRela), 8);
+  relas[1] = arena_push(arena, (obj->num_relocs + 1) * sizeof(ElfRela), 8);
+  for (uint32_t i = 0; i < obj->num_relocs; ++i) {
+    ObjReloc* reloc = &obj->relocs[i];
+    ObjSection section = reloc->section;
+    ASSERT(section == OBJ_SECTION_TEXT || section == OBJ_SECTION_DATA);
+    uint64_t sym;
+    switch (reloc->target_section) {
+      case OBJ_SECTION_TEXT:
+        sym = 1;
+        break;
+      case OBJ_SECTION_DATA:
+        sym = 2;
+        break;
+      default:
+        ASSERT(reloc->symbol < obj->num_symbols);
+        sym = sym_index[reloc->symbol];
+        break;
+    }
+    int which = section == OBJ_SECTION_TEXT ? 0 : 1;
+    relas[which][num_relas[which]++] = (ElfRela){
+        .offset = reloc->offset, .info = (sym << 32) | ELF_R_X86_64_64, .addend = reloc->addend};
+  }
+
+  ir_elf_sectheader sects[NUM_SECTS];
+  memset(sects, 0, sizeof(sects));
+
+  ir_elf_header hdr = {
+      .emagic = {0x7f, 'E', 'L', 'F'},
+      .eclass = 2,   // 64 bit
+      .eendian = 1,  // Little endian
+      .eversion = 1,
+      .type = ELF_TYPE_REL,
+      .machine = ELF_MACHINE_X86_64,
+      .version = 1,
+      .ehsize = sizeof(ir_elf_header),
+      .shentsize = sizeof(ir_elf_sectheader),
+      .shnum = NUM_SECTS,
+      .shstridx = SECT_SHSTRTAB,
+  };
+  elfbuf_write(&buf, &hdr, sizeof(hdr), 1);
+
+#define SECTION(idx, sname, stype, sflags, contents, ssize, salign) \
+  sects[idx].name = shstrtab_offset(sname);                         \
+  sects[idx].type = stype;                                          \
+  sects[idx].flags = sflags;                                        \
+  sects[idx].ofs = elfbuf_write(&buf, contents, ssize, salign);     \
+  sects[idx].size = ssize;                                          \
+  sects[idx].align = salign
+
+  SECTION(SECT_TEXT, ".text", ELFSECT_TYPE_PROGBITS, ELFSECT_FLAGS_ALLOC | ELFSECT_FLAGS_EXEC,
+          obj->text, obj->text_size, 16);
+  SECTION(SECT_DATA, ".data", ELFSECT_TYPE_PROGBITS, ELFSECT_FLAGS_ALLOC | ELFSECT_FLAGS_WRITE,
+          obj->data, obj->data_size, 16);
+  SECTION(SECT_SYMTAB, ".symtab", ELFSECT_TYPE_SYMTAB, 0, syms, next_sym * sizeof(ir_elf_symbol),
+          8);
+  sects[SECT_SYMTAB].link = SECT_STRTAB;
+  sects[SECT_SYMTAB].info = first_global;
+  sects[SECT_SYMTAB].entsize = sizeof(ir_elf_symbol);
+  SECTION(SECT_STRTAB, ".strtab", ELFSECT_TYPE_STRTAB, 0, strtab.data, strtab.size, 1);
+  SECTION(SECT_RELA_TEXT, ".rela.text", ELFSECT_TYPE_RELA, ELFSECT_FLAGS_INFO_LINK, relas[0],
+          num_relas[0] * sizeof(ElfRela), 8);
+  sects[SECT_RELA_TEXT].link = SECT_SYMTAB;
+  sects[SECT_RELA_TEXT].info = SECT_TEXT;
+  sects[SECT_RELA_TEXT].entsize = sizeof(ElfRela);
+  SECTION(SECT_RELA_DATA, ".rela.data", ELFSECT_TYPE_RELA, ELFSECT_FLAGS_INFO_LINK, relas[1],
+          num_relas[1] * sizeof(ElfRela), 8);
+  sects[SECT_RELA_DATA].link = SECT_SYMTAB;
+  sects[SECT_RELA_DATA].info = SECT_DATA;
+  sects[SECT_RELA_DATA].entsize = sizeof(ElfRela);
+  // Otherwise the linker assumes an executable stack is needed.
+  SECTION(SECT_NOTE_GNU_STACK, ".note.GNU-stack", ELFSECT_TYPE_PROGBITS, 0, NULL, 0, 1);
+  SECTION(SECT_SHSTRTAB, ".shstrtab", ELFSECT_TYPE_STRTAB, 0, shstrtab, sizeof(shstrtab), 1);
+#undef SECTION
+
+  size_t shofs = elfbuf_write(&buf, sects, sizeof(sects), 8);
+  ((ir_elf_header*)buf.data)->shofs = shofs;
+
+  FILE* f = fopen(filename, "wb");
+  if (!f) {
+    return false;
+  }
+  bool ok = fwrite(buf.data, 1, buf.size, f) == buf.size;
+  return fclose(f) == 0 && ok;
+}
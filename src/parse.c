@@ -2,6 +2,8 @@
 
 #include "dict.h"
 
+#include <setjmp.h>
+
 
 typedef struct RuntimeStr {
   const uint8_t* data;
@@ -57,21 +59,55 @@ typedef struct Sym {
       void* addr;
       ir_ref ref2;  // upvals for SYM_FUNC
     };
+    Val val;  // SYM_CONST
+    struct Module* module;  // SYM_PACKAGE
   };
   SymScopeDecl scope_decl;
 } Sym;
 
 #define MAX_SCOPES 32
 #define MAX_FUNC_PARAMS 32
+// After aggregates are split up for the ABI, see sysv_layout().
+#define MAX_CALL_OPERANDS 128
 #define MAX_STRUCT_FIELDS 64
 #define MAX_PENDING_CONDS 32
+#define MAX_BOUNDED_ITERS 32
+#define MAX_COMPREHENSION_FORS 4
+#define MAX_INLINE_DEPTH 4
+#define INLINE_MAX_TOKENS 24
+#define INLINE_FORCED_MAX_TOKENS 256
 #define MAX_UPVALS 32
 #define MAX_PACKAGE_DEPTH 16
+#define MAX_MODULES 256
+#define TIER_UP_THRESHOLD 1000
+#define MAX_PROFILE_COUNTS (1 << 16)
+// With --profile-use, functions entered at least this many times get
+// INLINE_HOT_MAX_TOKENS.
+#define PROFILE_HOT_ENTRIES 1000
+#define INLINE_HOT_MAX_TOKENS 64
+// The end of the code buffer that's kept for functions that never ran.
+#define PROFILE_COLD_CODE_SIZE MiB(64)
+// The end of the code buffer that's kept for imported modules with --serve.
+#define MODULE_CODE_SIZE MiB(64)
 
 typedef struct PendingCond {
   ir_ref iftrue;
 } PendingCond;
 
+// The iterator of a range() loop that's being parsed, and that's always in
+// [min, max] because the loop body never writes to it. See range_loop().
+typedef struct BoundedIter {
+  Sym* sym;
+  int64_t min;
+  int64_t max;
+} BoundedIter;
+
+typedef enum InlineHint {
+  INLINE_DEFAULT,
+  INLINE_ALWAYS,  // @inline
+  INLINE_NEVER,   // @noinline
+} InlineHint;
+
 typedef enum ScopeResult {
   SCOPE_RESULT_GLOBAL,
   SCOPE_RESULT_UNDEFINED,
@@ -89,27 +125,103 @@ typedef struct Upval {
   // scope it's meant for. GLOBAL/UNDEFINED are not valid, and UPVALUE means it
   // needs to be acquired through the functions $up, not this ref.
   ir_ref ref;
+  // In the nested function, when it was loaded once at entry by
+  // capture_upvals() rather than at each use. 0 otherwise.
+  ir_ref value;
 } Upval;
 
 typedef struct UpvalMap {
   Upval upvals[MAX_UPVALS];
   int num_upvals;
   uint32_t alloc_size;
+  // There's only the one scalar upval, and it's passed as $up itself rather
+  // than in a block that $up points at.
+  bool direct;
 } UpvalMap;
 
-typedef struct SmallFlatNameSymMap {
-  Str names[16];
-  Sym syms[16];
-  int num_entries;
-} SmallFlatNameSymMap;
+// Every declaration is a Binding, which shadows whatever was previously
+// visible for the same name until its scope is left. Sym is first so that Sym*
+// handed out by sym_new() is stable (it's in var_scope_arena).
+typedef struct Binding Binding;
+struct Binding {
+  Sym sym;
+  Binding* shadowed;
+  Binding* prev_in_scope;
+  int scope_index;
+};
 
-static void flat_name_map_init(SmallFlatNameSymMap* nm) {
-  nm->num_entries = 0;
-}
+// The slots of Parser.name_bindings. The top of each name's stack of Bindings
+// is the innermost visible declaration, so lookup doesn't depend on how deeply
+// the current scope is nested.
+typedef struct NameBinding {
+  Str name;
+  Binding* top;
+} NameBinding;
+
+// An imported file. Each one is compiled once, and afterwards only the syms
+// declared at its top level are kept, so another import of the same contents
+// just gets this interface back without reparsing anything.
+typedef struct Module {
+  const char* filename;
+  uint64_t content_hash;
+  bool in_progress;  // For catching circular imports.
+  DictImpl exports;  // Of ModuleExport.
+  struct ModuleDep* deps;
+  struct ModuleGlobal* globals;
+
+  // Only for modules that are kept across --serve requests, see
+  // find_kept_module().
+  Str full_path;
+  uint64_t mtime;
+  int opt_level;
+  bool bounds_check;
+  void* (*get_extern)(StrView);
+  bool replaced;  // By a recompile, so anything that imported this is stale.
+
+  // Only with --code-cache, see module_interface_save().
+  struct ModuleFunc* funcs;
+  uint32_t num_funcs;
+  uint32_t max_funcs;
+  bool no_interface;  // Something in it can't be written to an interface file.
+} Module;
+
+// What a module imported. A kept module's deps have to still be current for it
+// to be, and an interface file's have to have the same contents.
+typedef struct ModuleDep {
+  Module* module;
+  const char* filename;  // As it was imported, so relative to the importer.
+  struct ModuleDep* next;
+} ModuleDep;
+
+// The program can change a kept module's globals, so they're put back for
+// each request that reuses it. Also how globals are written to an interface
+// file.
+typedef struct ModuleGlobal {
+  Str name;
+  void* addr;
+  uint32_t size;
+  Val initial;
+  struct ModuleGlobal* next;
+} ModuleGlobal;
+
+// Slots of Parser.kept_modules. Str first for the NameBinding hash/eq functions.
+typedef struct KeptModule {
+  Str full_path;
+  Module* module;
+} KeptModule;
+
+// Str name first so that the NameBinding hash/eq functions work on these too.
+typedef struct ModuleExport {
+  Str name;
+  Sym sym;
+} ModuleExport;
+
+typedef struct TierRecord TierRecord;
 
 typedef struct Scope {
   // FuncData
   Sym* func_sym;
+  TierRecord* tier_rec;
   Sym* return_slot;
   PendingCond pending_conds[MAX_PENDING_CONDS];
   int num_pending_conds;
@@ -117,18 +229,26 @@ typedef struct Scope {
   uint64_t arena_saved_pos;
   UpvalMap upval_map;
   ir_ref upval_base;
+  // For --code-cache, the body text starts at cache_span_start, and cache_key
+  // accumulates everything the body looked up from the module scope.
+  uint32_t cache_span_start;
+  size_t cache_key;
+  uint64_t hot_key;  // cache_function_key() of this function for --watch.
+  bool made_lists;   // Has to free them when it returns, see list_alloc_impl().
 
   // VarScope
-  union {
-    DictImpl sym_dict;  // when is_full_dict
-    SmallFlatNameSymMap flat_map;
-  };
+  Binding* last_binding;
+  int func_depth;  // Number of function scopes from the module down to this one.
   uint64_t arena_pos;
   bool is_function;
   bool is_module;
-  bool is_full_dict;
+  bool is_ctfe;  // A thunk for const_expression(), see there.
 } Scope;
 
+// A position in the token stream that can be saved and then later restored
+// with seek_cursor(). paren_level is the categorizer's continuation state after
+// token_index, so seeking is possible even once the token has fallen out of
+// the ring below.
 typedef struct TokenCursor {
   uint32_t token_index;
   TokenKind cur_kind;
@@ -136,7 +256,108 @@ typedef struct TokenCursor {
   int paren_level;
 } TokenCursor;
 
-typedef struct Parser {
+// A function whose whole body is `return <expression>` of only its
+// parameters. At opt >= 1, calls to it parse that expression again in the
+// caller with the parameters bound to the arguments, rather than emitting a
+// CALL. See inline_call().
+typedef struct InlineBody {
+  void* addr;  // First, for the key.
+  TokenCursor cursor;  // On the `return`.
+  Str* param_names;
+  uint32_t entry_offset;  // For PROF_ENTRY, calls still count when they're inlined.
+} InlineBody;
+
+typedef struct TokenRingEntry {
+  TokenKind kind;
+  int paren_level;
+} TokenRingEntry;
+
+// Must be a power of 2.
+#define TOKEN_RING_SIZE 512
+
+// In --tiered mode, every toplevel function is first compiled at opt 0 with a
+// counter that's bumped on entry and on loop back-edges. When the counter hits
+// TIER_UP_THRESHOLD, the background thread re-parses the function starting
+// from the saved lexer state at opt 2, and then redirects `stub` (which is
+// what the function's sym->addr points at) to the new code.
+struct TierRecord {
+  uint32_t count;
+  TokenCursor cursor;
+  TokenKind pending_indent_kind;
+  int num_pending_indents;
+  int indent_levels[12];
+  int num_indents;
+  Sym sym;
+  uint64_t* stub;
+  void* tier2_entry;
+};
+
+// A top level function of a module that's being compiled with --code-cache.
+// cached is NULL if it couldn't be recorded.
+typedef struct ModuleFunc {
+  Str name;
+  void* addr;
+  CacheEntry* cached;
+} ModuleFunc;
+
+// Each distinct string literal gets one RuntimeStr. Its data points at the
+// intern'd bytes where there are any (i.e. for longer strings, into the source
+// buffer or str's new buffer), which both live until exit.
+typedef struct StringObj {
+  Str contents;  // First so that the NameBinding hash/eq functions work on these too.
+  RuntimeStr* obj;
+} StringObj;
+
+typedef struct ObjCodeReloc {
+  uint32_t offset;  // From the start of the code buffer.
+  void* addr;
+} ObjCodeReloc;
+
+typedef struct ObjFunc ObjFunc;
+struct ObjFunc {
+  Str name;
+  uint32_t offset;  // From the start of the code buffer.
+  uint32_t size;
+  uint32_t num_relocs;
+  ObjCodeReloc* relocs;
+  ObjFunc* next;
+};
+
+// Backend phases in the order jit_compile() runs them, for --time-phases. Not
+// all of them run at every opt level.
+#define JIT_PHASES(X)               \
+  X(DEF_USE, "def/use lists")       \
+  X(CFG, "cfg")                     \
+  X(DOMINATORS, "dominators")       \
+  X(MEM2SSA, "mem2ssa")             \
+  X(SCCP, "sccp")                   \
+  X(LOOPS, "loops")                 \
+  X(GCM, "gcm")                     \
+  X(SCHEDULE, "schedule")           \
+  X(MATCH, "match")                 \
+  X(VREGS, "vregs")                 \
+  X(LIVE_RANGES, "live ranges")     \
+  X(COALESCE, "coalesce")           \
+  X(DESSA, "dessa moves")           \
+  X(REG_ALLOC, "reg alloc")         \
+  X(SCHEDULE_BLOCKS, "block layout") \
+  X(EMIT, "emit")
+
+typedef enum JitPhase {
+#define X(name, desc) JP_##name,
+  JIT_PHASES(X)
+#undef X
+  NUM_JIT_PHASES
+} JitPhase;
+
+static const char* jit_phase_names[NUM_JIT_PHASES] = {
+#define X(name, desc) desc,
+    JIT_PHASES(X)
+#undef X
+};
+
+typedef struct Parser Parser;
+struct Parser {
   Arena* arena;
   Arena* var_scope_arena;
   const char* cur_filename;
@@ -144,30 +365,125 @@ typedef struct Parser {
   const char* file_contents;
   uint32_t num_tokens;
   uint32_t* token_offsets;
+  size_t token_offsets_capacity;  // In bytes of file, see ensure_token_offsets().
 
   TokenCursor cursor;
 
-  TokenKind token_buffer[16];
-  int num_buffered_tokens;
+  // Raw categorizations of the most recently seen tokens, so that peek() and
+  // rewinding to a saved TokenCursor don't run the categorizer again. Entries
+  // for token indices in [token_ring_start, token_ring_end) are valid if
+  // they're within TOKEN_RING_SIZE of the end.
+  TokenRingEntry token_ring[TOKEN_RING_SIZE];
+  uint32_t token_ring_start;
+  uint32_t token_ring_end;
+
+  // A NEWLINE that changes the indent level is followed by a single INDENT or
+  // one or more DEDENTs that advance() hands out before moving on.
+  TokenKind pending_indent_kind;
+  int num_pending_indents;
   int indent_levels[12];  // This is the maximum possible in lexer.
   int num_indents;
 
   Scope scopes[MAX_SCOPES];
   int num_scopes;
   Scope* cur_scope;
+  DictImpl name_bindings;  // Of NameBinding.
+
+  Module* modules[MAX_MODULES];
+  int num_modules;
+  // With --serve, imported modules are compiled into module_arena and
+  // module_code (the end of the code buffer), and their types are
+  // type_keep()'d, so that later requests can use them again.
+  bool keep_modules;
+  Arena* module_arena;
+  uint64_t module_arena_kept_pos;  // Past the last module that was kept.
+  ir_code_buffer module_code;      // pos is past the last module that was kept.
+  DictImpl kept_modules;           // Of KeptModule, by full path.
+  Module* cur_module;              // Being compiled, if any.
 
   void* main_func_entry;
   void* (*get_extern)(StrView);
   int verbose;
   bool ir_only;
   int opt_level;
+  bool bounds_check;
+  BoundedIter bounded_iters[MAX_BOUNDED_ITERS];
+  int num_bounded_iters;
+  DictImpl inline_bodies;  // Of InlineBody, only for the current file.
+  int inline_depth;
   ir_code_buffer code_buffer;
+  uint8_t* code_writable_start;  // Before this is already executable.
+
+  uint64_t file_hash;                // Of the file being parsed, for ProfileKey.
+  const char* profile_gen_filename;  // NULL unless --profile-gen.
+  ProfileCount* profile_counts;      // Incremented by the running program.
+  uint32_t num_profile_counts;
+  Profile* profile;                  // NULL unless --profile-use.
+  ir_code_buffer cold_code;          // The last PROFILE_COLD_CODE_SIZE of code_buffer.
+  uint32_t num_cold_funcs;           // Put in cold_code because they never ran.
+
+  bool perf_map;
+  bool jitdump;
+
+  Arena* list_arena;  // Of the running program, see list_alloc_impl().
+  struct ListBlock* list_top;
+
+  bool tiered;
+  TierRecord* tier_recompiling;
+  TierRecord* tier_queue[256];
+  // tail is only written by the program's thread, and head and num_done only
+  // by the worker, but each reads the other's so they're accessed with
+  // acquire/release.
+  uint32_t tier_queue_head;
+  uint32_t tier_queue_tail;
+  uint32_t tier_num_done;
+  uint32_t tier_num_installed;
+  bool tier_quit;
+  BaseSemaphore* tier_sem;
+  BaseThread* tier_thread;
+
+  bool track_deps;     // Either --code-cache or --watch, see cache_note_sym().
+  bool track_targets;  // Either --code-cache or --emit-obj.
+  CacheTargets* cache_targets;
+
+  const char* code_cache_dir;
+  CodeCache* code_cache;  // NULL when not caching.
+  uint32_t num_cache_hits;
+  uint32_t num_cache_misses;
+  uint32_t num_module_interfaces;  // Imports that were loaded rather than compiled.
+
+  const char* obj_filename;  // NULL unless --emit-obj.
+  ObjFunc* obj_funcs;        // Most recent first.
+
+  DictImpl string_objs;  // Of StringObj.
+  RuntimeStr* empty_string_obj;
+  size_t string_bytes_saved;
+
+  const char* hot_filename;  // NULL unless --watch.
+  bool hot_active;           // Only while parsing the root file, not imports.
+  bool hot_reloading;        // Errors go to hot_error_jmp instead of exiting.
+  HotReload* hot;
+  ReadFileResult hot_file;   // Of the last reload, the original is str_intern()'s.
+  Parser* hot_saved;
+  jmp_buf hot_error_jmp;
+
+  bool time_phases;
+  uint64_t start_us;
+  CompileStats* stats;
+  uint64_t phase_us[NUM_JIT_PHASES];
+  uint32_t num_funcs_compiled;
 
   Str static_str_main;
   Str static_str_repr;
   Str static_str_ret;
+  Str static_str_ctfe;
   Str static_str_up;
-} Parser;
+  Str static_str_pad;
+  Str static_str_inline;
+  Str static_str_noinline;
+
+  Type print_range_func_type;
+};
 
 static Parser parser;
 
@@ -306,6 +622,7 @@ typedef enum LastStatementType {
 } LastStatementType;
 
 static LastStatementType parse_statement(bool toplevel);
+static Operand parse_variable(bool can_assign, Type* expected);
 static Operand parse_expression(Type* expected);
 static LastStatementType parse_block(void);
 
@@ -349,6 +666,7 @@ static ir_type type_to_ir_type(Type type) {
 
 static ScopeResult scope_lookup_single(Scope* scope, Str name, bool crossed_function, Sym** sym);
 static ScopeResult scope_lookup_recursive(Str name, Sym** sym);
+static Binding* binding_visible_from(Str name, int scope_index);
 
 #if 0
 static Operand operand_sym(Type type, LqSymbol lqsym) {
@@ -438,6 +756,10 @@ NORETURN static void error_offset(uint32_t offset, const char* message) {
   base_writef_stderr("%.*s\n", (int)line.size, line.data);
   base_writef_stderr("%*s", indent + loc_column - 1, "");
   base_writef_stderr("^ error: %s\n", message);
+  if (parser.hot_reloading) {
+    // The program keeps running what it had, see hot_reload().
+    longjmp(parser.hot_error_jmp, 1);
+  }
   base_exit(1);
 }
 
@@ -527,68 +849,215 @@ static ir_ref addr_for_operand(Operand* op) {
   return ir_VADDR(var);
 }
 
-typedef struct NameSymPair {
-  Str name;
-  Sym sym;
-} NameSymPair;
+static size_t name_binding_hash_func(void* vnb) {
+  NameBinding* nb = (NameBinding*)vnb;
+  size_t hash = 0;
+  const char* str_data = str_raw_ptr(nb->name);
+  dict_hash_write(&hash, (void*)str_data, str_len(nb->name));
+  return hash;
+}
 
-static size_t namesym_hash_func(void* vnsp) {
-  NameSymPair* nsp = (NameSymPair*)vnsp;
+static bool name_binding_eq_func(void* void_nb_a, void* void_nb_b) {
+  NameBinding* nb_a = (NameBinding*)void_nb_a;
+  NameBinding* nb_b = (NameBinding*)void_nb_b;
+  return str_eq(nb_a->name, nb_b->name);
+}
+
+static size_t inline_body_hash_func(void* vbody) {
+  InlineBody* body = (InlineBody*)vbody;
   size_t hash = 0;
-  const char* str_data = str_raw_ptr(nsp->name);
-  dict_hash_write(&hash, (void*)str_data, str_len(nsp->name));
+  dict_hash_write(&hash, &body->addr, sizeof(body->addr));
   return hash;
 }
 
-static bool namesym_eq_func(void* void_nsp_a, void* void_nsp_b) {
-  NameSymPair* nsp_a = (NameSymPair*)void_nsp_a;
-  NameSymPair* nsp_b = (NameSymPair*)void_nsp_b;
-  return str_eq(nsp_a->name, nsp_b->name);
+static bool inline_body_eq_func(void* a, void* b) {
+  return ((InlineBody*)a)->addr == ((InlineBody*)b)->addr;
+}
+
+static NameBinding* find_name_binding(Str name) {
+  DictRawIter iter = dict_find(&parser.name_bindings, &name, name_binding_hash_func,
+                               name_binding_eq_func, sizeof(NameBinding));
+  return (NameBinding*)dict_rawiter_get(&iter);
+}
+
+static Sym* module_find_export(Module* module, Str name) {
+  DictRawIter iter = dict_find(&module->exports, &name, name_binding_hash_func,
+                               name_binding_eq_func, sizeof(ModuleExport));
+  ModuleExport* exp = (ModuleExport*)dict_rawiter_get(&iter);
+  return exp ? &exp->sym : NULL;
 }
 
-// Returns pointer into dict where Sym is stored by value, probably bad idea.
 static Sym* sym_new(SymKind kind, Str name, Type type) {
   ASSERT(parser.cur_scope);
-  if (parser.cur_scope->is_full_dict) {
-    NameSymPair nsp = {.name = name,
-                      .sym = {
-                          .kind = kind,
-                          .name = name,
-                          .type = type,
-                      }};
-    DictInsert res = dict_insert(&parser.cur_scope->sym_dict, &nsp, namesym_hash_func,
-                                namesym_eq_func, sizeof(NameSymPair), _Alignof(NameSymPair));
-    return &((NameSymPair*)dict_rawiter_get(&res.iter))->sym;
-  } else {
-    SmallFlatNameSymMap* nm = &parser.cur_scope->flat_map;
-    int count = nm->num_entries;
+  Binding* b = arena_push(parser.var_scope_arena, sizeof(Binding), _Alignof(Binding));
+  b->sym = (Sym){.kind = kind, .name = name, .type = type};
 
-    if (count == COUNTOFI(nm->names)) {
-      // flat_map is full, 'rehash' into full dict
+  NameBinding nb = {.name = name, .top = NULL};
+  DictInsert res = dict_insert(&parser.name_bindings, &nb, name_binding_hash_func,
+                               name_binding_eq_func, sizeof(NameBinding), _Alignof(NameBinding));
+  NameBinding* slot = (NameBinding*)dict_rawiter_get(&res.iter);
+  b->shadowed = slot->top;
+  slot->top = b;
 
-      // Can't immediately put into cur_scope because the flat_map and
-      // dict_sym are a union.
-      DictImpl new_dict = dict_new(parser.var_scope_arena, COUNTOFI(nm->names) * 4,
-                                   sizeof(NameSymPair), _Alignof(NameSymPair));
-      for (int i = 0; i < count; ++i) {
-        NameSymPair nsp = {.name = nm->names[i], .sym = nm->syms[i]};
-        dict_insert(&new_dict, &nsp, namesym_hash_func, namesym_eq_func,
-                    sizeof(NameSymPair), _Alignof(NameSymPair));
-      }
+  b->scope_index = (int)(parser.cur_scope - parser.scopes);
+  b->prev_in_scope = parser.cur_scope->last_binding;
+  parser.cur_scope->last_binding = b;
+  return &b->sym;
+}
 
-      // Now flat_map is dead, overrwrite with the dict and update the bool to
-      // indicate we have a full dict.
-      parser.cur_scope->is_full_dict = true;
-      parser.cur_scope->sym_dict = new_dict;
+static CacheTarget* cache_register_target(void* addr, const char* name, uint32_t name_len) {
+  if (!parser.track_targets || !addr) {
+    return NULL;
+  }
+  return cache_targets_add(parser.cache_targets, addr, name, name_len);
+}
 
-      // Call the other branch to actually insert the new sym.
-      return sym_new(kind, name, type);
+// Top level functions, globals, and struct initializer blobs are
+// "file:name".
+static CacheTarget* cache_register_global(void* addr, Str sym_name) {
+  if (!parser.track_targets || !addr) {
+    return NULL;
+  }
+  size_t filename_len = strlen(parser.cur_filename);
+  uint32_t name_len = (uint32_t)(filename_len + 1 + str_len(sym_name));
+  char* name = arena_push(parser.arena, name_len, 1);
+  memcpy(name, parser.cur_filename, filename_len);
+  name[filename_len] = ':';
+  memcpy(name + filename_len + 1, str_raw_ptr(sym_name), str_len(sym_name));
+  return cache_register_target(addr, name, name_len);
+}
+
+static void cache_register_sym(Sym* sym) {
+  cache_register_global(sym->addr, sym->name);
+}
+
+static void cache_register_data(void* addr, Str sym_name, size_t size) {
+  CacheTarget* target = cache_register_global(addr, sym_name);
+  if (target) {
+    target->data_size = (uint32_t)size;
+  }
+}
+
+static void cache_register_extern(void* addr, const char* cname, size_t cname_len) {
+  uint32_t name_len = (uint32_t)(1 + cname_len);
+  char* name = arena_push(parser.arena, name_len, 1);
+  name[0] = '$';
+  memcpy(name + 1, cname, cname_len);
+  CacheTarget* target = cache_register_target(addr, name, name_len);
+  if (target) {
+    target->is_extern = true;
+  }
+}
+
+// String literal objects are "$str:contents", and since print and friends
+// load the length directly (which folds to a separate constant), that's
+// "$len:contents". Identical literals share one object so that the names are
+// never ambiguous. The object writer and code cache want the bytes right after
+// the object.
+static RuntimeStr* cache_string_obj(StrView contents) {
+  uint32_t name_len = (uint32_t)(5 + contents.size);
+  char* name = arena_push(parser.arena, name_len, 1);
+  memcpy(name, "$str:", 5);
+  memcpy(name + 5, contents.data, contents.size);
+  CacheTarget* existing = cache_targets_find_name(parser.cache_targets, name, name_len);
+  if (existing) {
+    return existing->addr;
+  }
+  RuntimeStr* obj =
+      arena_push(parser.arena, sizeof(RuntimeStr) + contents.size + 1, _Alignof(RuntimeStr));
+  uint8_t* strp = (uint8_t*)(obj + 1);
+  memcpy(strp, contents.data, contents.size);
+  obj->data = strp;
+  obj->length = contents.size;
+  CacheTarget* target = cache_register_target(obj, name, name_len);
+  target->data_size = (uint32_t)(sizeof(RuntimeStr) + contents.size + 1);
+  target->is_str = true;
+  char* len_name = arena_push(parser.arena, name_len, 1);
+  memcpy(len_name, name, name_len);
+  memcpy(len_name, "$len:", 5);
+  cache_register_target(&obj->length, len_name, name_len);
+  return obj;
+}
+
+// Structs are hashed by layout rather than by Type since the value of a Type
+// depends on the order things were declared in.
+static void cache_hash_type(size_t* hash, Type type, int depth) {
+  TypeKind kind = type_kind(type);
+  dict_hash_write(hash, &kind, sizeof(kind));
+  if (depth > 8) {
+    return;
+  }
+  switch (kind) {
+    case TYPE_PTR:
+      cache_hash_type(hash, type_ptr_subtype(type), depth + 1);
+      break;
+    case TYPE_ARRAY: {
+      uint32_t count = type_array_count(type);
+      dict_hash_write(hash, &count, sizeof(count));
+      cache_hash_type(hash, type_array_subtype(type), depth + 1);
+      break;
+    }
+    case TYPE_LIST:
+      cache_hash_type(hash, type_list_subtype(type), depth + 1);
+      break;
+    case TYPE_FUNC: {
+      uint32_t num_params = type_func_num_params(type);
+      TypeFuncFlags flags = type_func_flags(type);
+      dict_hash_write(hash, &num_params, sizeof(num_params));
+      dict_hash_write(hash, &flags, sizeof(flags));
+      for (uint32_t i = 0; i < num_params; ++i) {
+        cache_hash_type(hash, type_func_param(type, i), depth + 1);
+      }
+      cache_hash_type(hash, type_func_return_type(type), depth + 1);
+      break;
+    }
+    case TYPE_STRUCT: {
+      Str name = type_struct_decl_name(type);
+      dict_hash_write(hash, (void*)str_raw_ptr(name), str_len(name));
+      uint32_t num_fields = type_struct_num_fields(type);
+      dict_hash_write(hash, &num_fields, sizeof(num_fields));
+      for (uint32_t i = 0; i < num_fields; ++i) {
+        Str field_name = type_struct_field_name(type, i);
+        uint32_t offset = type_struct_field_offset(type, i);
+        dict_hash_write(hash, (void*)str_raw_ptr(field_name), str_len(field_name));
+        dict_hash_write(hash, &offset, sizeof(offset));
+        cache_hash_type(hash, type_struct_field_type(type, i), depth + 1);
+      }
+      if (type_struct_has_initializer(type)) {
+        dict_hash_write(hash, type_struct_initializer_blob(type), type_size(type));
+      }
+      break;
     }
+    default:
+      break;
+  }
+}
 
-    nm->names[nm->num_entries] = name;
-    nm->syms[nm->num_entries] = (Sym){.kind = kind, .name = name, .type = type};
-    Sym* ret = &nm->syms[nm->num_entries++];
-    return ret;
+// Called for every lookup that resolves to the module scope, as the compiled
+// body depends on what the name was when it was compiled, not just on the
+// text of the body.
+static void cache_note_sym(Sym* sym) {
+  Scope* scope = parser.cur_scope;
+  while (scope > parser.scopes && !scope->func_sym) {
+    --scope;  // const_expression() thunks get baked into the function.
+  }
+  if (scope == parser.scopes) {
+    return;
+  }
+  size_t* hash = &scope->cache_key;
+  dict_hash_write(hash, (void*)str_raw_ptr(sym->name), str_len(sym->name));
+  dict_hash_write(hash, &sym->kind, sizeof(sym->kind));
+  switch (sym->kind) {
+    case SYM_CONST:
+      cache_hash_type(hash, sym->type, 0);
+      dict_hash_write(hash, &sym->val, sizeof(sym->val));
+      break;
+    case SYM_PACKAGE:
+      dict_hash_write(hash, &sym->module->content_hash, sizeof(sym->module->content_hash));
+      break;
+    default:
+      cache_hash_type(hash, sym->type, 0);
+      break;
   }
 }
 
@@ -654,34 +1123,224 @@ static void print_range_impl(RuntimeRange range) {
   }
 }
 
+static Operand lower_structs_and_call(Operand* func, uint32_t num_args, ir_ref* arg_values);
+
 static void print_range(Operand* op) {
 #if ARCH_X64 && OS_WINDOWS
   ir_ref praddr = ir_CONST_ADDR(print_range_impl);
   ir_CALL_1(IR_VOID, praddr, operand_to_irref_imm(op));
 #elif ARCH_X64
-  // I think these need to be exploded out into the stack but 'inline' on the
-  // stack, not pointed at. Soooo, not sure how to do that.
-  /*
-  ir_ref start = ir_LOAD(IR_ADDR, op->ref);
-  ir_ref stop = ir_LOAD(IR_I64, ir_ADD_OFFSET(op->ref, 8));
-  ir_ref step = ir_LOAD(IR_I64, ir_ADD_OFFSET(op->ref, 16));
-  ir_CALL_3(IR_VOID, praddr, start, stop, step);
-  */
-  (void)print_range_impl;
+  // It's MEMORY class, so it has to be copied onto the stack, which
+  // lower_structs_and_call() knows how to do.
+  Operand func =
+      operand_rvalue_global_addr(parser.print_range_func_type, ir_CONST_ADDR(print_range_impl));
+  ir_ref arg = operand_to_irref_imm(op);
+  lower_structs_and_call(&func, 1, &arg);
 #else
 #error port
 #endif
 }
 
+// Only called from --bounds-check code, when a subscript is out of range.
+static void bounds_check_fail_impl(int64_t index, uint64_t length, int32_t line) {
+  fflush(stdout);
+  base_writef_stderr("Line %d: index %" PRIi64 " out of bounds for length %" PRIu64 ".\n", line,
+                     index, length);
+  base_exit(1);
+}
+
+// Called when a range() step that wasn't known at compile time turns out to be
+// zero.
+static void range_step_zero_fail_impl(int32_t line) {
+  fflush(stdout);
+  base_writef_stderr("Line %d: range() step cannot be zero.\n", line);
+  base_exit(1);
+}
+
+// Storage for list comprehensions. It's in an arena rather than on the stack
+// so that one in a loop doesn't use up more stack every time around, but it's
+// freed like the stack: each block is tagged with the frame address of the
+// function that made it, and since frames further down the stack are at lower
+// addresses, a block on top that's tagged below the current frame belongs to a
+// function that has already returned. Those are popped before the next
+// allocation, and a function pops its own when it returns (see
+// leave_function()) unless its return value might refer to them.
+#define LIST_ARENA_RESERVE_SIZE MiB(16384ull)
+
+// Never popped, see list_keep_impl().
+#define LIST_FRAME_KEEP UINTPTR_MAX
+
+typedef struct ListBlock {
+  struct ListBlock* prev;
+  uintptr_t frame;
+  uint64_t pos;  // Of list_arena before this block.
+  uint64_t pad;  // So the list after this is still 16 aligned.
+} ListBlock;
+
+static void list_pop_below(uintptr_t frame) {
+  ListBlock* top = parser.list_top;
+  if (!top || top->frame >= frame) {
+    return;
+  }
+  uint64_t pos;
+  do {
+    pos = top->pos;
+    top = top->prev;
+  } while (top && top->frame < frame);
+  parser.list_top = top;
+  arena_pop_to(parser.list_arena, pos);
+}
+
+static void* list_alloc_impl(uint64_t header_size,
+                             uint64_t count,
+                             uint64_t elem_size,
+                             uintptr_t frame) {
+  if (!parser.list_arena) {
+    parser.list_arena = arena_create(LIST_ARENA_RESERVE_SIZE, MiB(1));
+    arena_set_decommit_keep(parser.list_arena, MiB(1));
+  }
+  list_pop_below(frame);
+  uint64_t pos = arena_pos(parser.list_arena);
+  uint64_t avail = LIST_ARENA_RESERVE_SIZE - ALIGN_UP(pos, 16) - sizeof(ListBlock);
+  if (header_size > avail || (elem_size && count > (avail - header_size) / elem_size)) {
+    fflush(stdout);
+    base_writef_stderr("Out of memory allocating a list of %" PRIu64 " elements.\n", count);
+    base_exit(1);
+  }
+  ListBlock* block =
+      arena_push(parser.list_arena, sizeof(ListBlock) + header_size + count * elem_size, 16);
+  block->prev = parser.list_top;
+  block->frame = frame;
+  block->pos = pos;
+  parser.list_top = block;
+  return block + 1;
+}
+
+// Called by a function that made lists, as it returns.
+static void list_release_impl(uintptr_t frame) {
+  list_pop_below(frame + 1);
+}
+
+// Called after a call that returned something containing a list, so that
+// whatever the callee left behind now lives as long as the caller.
+static void list_adopt_impl(uintptr_t frame) {
+  for (ListBlock* block = parser.list_top; block && block->frame < frame; block = block->prev) {
+    block->frame = frame;
+  }
+}
+
+// Called when a list is stored somewhere that might outlive the function, like
+// through a pointer. Everything the function has made is kept until the
+// program's done, since there's no telling which of them it was.
+static void list_keep_impl(uintptr_t frame) {
+  for (ListBlock* block = parser.list_top;
+       block && (block->frame <= frame || block->frame == LIST_FRAME_KEEP); block = block->prev) {
+    block->frame = LIST_FRAME_KEEP;
+  }
+}
+
+// Used for the size of a comprehension with more than one `for`, where the
+// product can overflow. Saturating means list_alloc_impl() reports it.
+static uint64_t list_count_mul_impl(uint64_t a, uint64_t b) {
+  return b && a > UINT64_MAX / b ? UINT64_MAX : a * b;
+}
+
+// Whether a value of |type| can refer to a list's storage, which has to live
+// as long as the value does.
+static bool type_contains_list(Type type) {
+  switch (type_kind(type)) {
+    case TYPE_LIST:
+      return true;
+    case TYPE_ARRAY:
+      return type_contains_list(type_array_subtype(type));
+    case TYPE_STRUCT:
+      for (uint32_t i = 0; i < type_struct_num_fields(type); ++i) {
+        if (type_contains_list(type_struct_field_type(type, i))) {
+          return true;
+        }
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+// When a value of |type| is stored where it might outlive the function.
+static void list_note_escape(Type type) {
+  if (type_contains_list(type)) {
+    ir_CALL_1(IR_VOID, ir_CONST_ADDR(list_keep_impl), ir_FRAME_ADDR());
+  }
+}
+
+// Aggregates up to this size are zeroed/initialized/copied with inline loads
+// and stores rather than calling memset/memcpy, which clobbers all the
+// caller-saved registers, and which mem2ssa can't see through.
+#define INLINE_AGGREGATE_MAX_SIZE 64
+
+// Stores size bytes at dst in the largest chunks that fit. Each chunk comes
+// from src if it's non-zero, otherwise from blob if that's non-NULL,
+// otherwise it's zero.
+static void emit_aggregate_chunks(ir_ref dst, ir_ref src, const uint8_t* blob, size_t size) {
+  size_t offset = 0;
+  while (offset < size) {
+    size_t chunk = size - offset >= 8 ? 8 : size - offset >= 4 ? 4 : size - offset >= 2 ? 2 : 1;
+    ir_type type = chunk == 8 ? IR_U64 : chunk == 4 ? IR_U32 : chunk == 2 ? IR_U16 : IR_U8;
+    ir_ref value;
+    if (src) {
+      value = ir_LOAD(type, offset ? ir_ADD_OFFSET(src, offset) : src);
+    } else {
+      uint64_t bits = 0;
+      if (blob) {
+        memcpy(&bits, blob + offset, chunk);
+      }
+      switch (chunk) {
+        case 8:
+          value = ir_CONST_U64(bits);
+          break;
+        case 4:
+          value = ir_CONST_U32(bits);
+          break;
+        case 2:
+          value = ir_CONST_U16(bits);
+          break;
+        default:
+          value = ir_CONST_U8(bits);
+          break;
+      }
+    }
+    ir_STORE(offset ? ir_ADD_OFFSET(dst, offset) : dst, value);
+    offset += chunk;
+  }
+}
+
+static void emit_aggregate_copy(ir_ref dst, ir_ref src, size_t size) {
+  if (size <= INLINE_AGGREGATE_MAX_SIZE) {
+    emit_aggregate_chunks(dst, src, NULL, size);
+  } else {
+    ir_ref memcpy_addr = ir_CONST_ADDR(memcpy);
+    ir_CALL_3(IR_VOID, memcpy_addr, dst, src, ir_CONST_U64(size));
+  }
+}
+
 static void initialize_aggregate(ir_ref base_addr, Type type) {
   size_t size = type_size(type);
   if (type_kind(type) == TYPE_STRUCT && type_struct_has_initializer(type)) {
-    ir_ref memcpy_addr = ir_CONST_ADDR(memcpy);
-    ir_ref default_blob = ir_CONST_ADDR(type_struct_initializer_blob(type));
-    ir_CALL_3(IR_VOID, memcpy_addr, base_addr, default_blob, ir_CONST_U64(size));
+    if (size <= INLINE_AGGREGATE_MAX_SIZE) {
+      // The initializer values are baked into the code, so the code cache key
+      // includes them, see cache_hash_type().
+      emit_aggregate_chunks(base_addr, 0, type_struct_initializer_blob(type), size);
+    } else {
+      ir_ref memcpy_addr = ir_CONST_ADDR(memcpy);
+      ir_ref default_blob = ir_CONST_ADDR(type_struct_initializer_blob(type));
+      ir_CALL_3(IR_VOID, memcpy_addr, base_addr, default_blob, ir_CONST_U64(size));
+    }
   } else {
-    ir_ref memset_addr = ir_CONST_ADDR(memset);
-    ir_CALL_3(IR_VOID, memset_addr, base_addr, ir_CONST_U8(0), ir_CONST_U64(size));
+    if (size <= INLINE_AGGREGATE_MAX_SIZE) {
+      emit_aggregate_chunks(base_addr, 0, NULL, size);
+    } else {
+      ir_ref memset_addr = ir_CONST_ADDR(memset);
+      ir_CALL_3(IR_VOID, memset_addr, base_addr, ir_CONST_U8(0), ir_CONST_U64(size));
+    }
   }
 }
 
@@ -724,8 +1383,34 @@ static Sym* make_local_and_alloc(SymKind kind, Str name, Type type, Operand* ini
   return new;
 }
 
+static size_t hot_type_hash(Type type) {
+  size_t hash = 0;
+  cache_hash_type(&hash, type, 0);
+  return hash;
+}
+
+static void hot_note(Str name, const char* what) {
+  if (parser.hot_reloading) {
+    base_writef_stderr("%s: '%s' %s.\n", parser.cur_filename, cstr_copy(parser.arena, name),
+                       what);
+  }
+}
+
 static Sym* make_global(SymKind kind, Str name, Type type, Val initial_value) {
   Sym* new = sym_new(kind, name, type);
+  new->scope_decl = SSD_DECLARED_GLOBAL;
+  size_t type_hash = 0;
+  if (parser.hot_active) {
+    // Keep whatever value the running program has given it so far.
+    type_hash = hot_type_hash(type);
+    HotSym* hs = hot_find(parser.hot, name, /*is_global=*/true);
+    if (hs && hs->type_hash == type_hash) {
+      new->addr = hs->addr;
+      return new;
+    } else if (hs) {
+      hot_note(name, "changed type, so code that's already running still uses the old one");
+    }
+  }
   void* addr = arena_push(parser.arena, type_size(type), type_align(type));
   switch (type_kind(type)) {
     case TYPE_BOOL:
@@ -755,46 +1440,284 @@ static Sym* make_global(SymKind kind, Str name, Type type, Val initial_value) {
     case TYPE_I64:
       *(int64_t*)addr = initial_value.i64;
       break;
+    case TYPE_FLOAT:
+      *(float*)addr = initial_value.f;
+      break;
+    case TYPE_DOUBLE:
+      *(double*)addr = initial_value.d;
+      break;
     default:
       error("internal error: unexpected global const init.");
   }
   new->addr = addr;
-  new->scope_decl = SSD_DECLARED_GLOBAL;
+  cache_register_data(addr, name, type_size(type));
+  if (parser.cur_module) {
+    ModuleGlobal* mg = arena_push(parser.arena, sizeof(ModuleGlobal), _Alignof(ModuleGlobal));
+    mg->name = name;
+    mg->addr = addr;
+    mg->size = type_size(type);
+    memcpy(&mg->initial, addr, mg->size);
+    mg->next = parser.cur_module->globals;
+    parser.cur_module->globals = mg;
+  }
+  if (parser.hot_active) {
+    hot_queue(parser.hot,
+              (HotSym){.name = name, .is_global = true, .type_hash = type_hash, .addr = addr},
+              /*patch_stub=*/false);
+  }
   return new;
 }
 
-static Sym* make_param(Str name, Type type, int index) {
-  Sym* new = sym_new(SYM_VAR, name, type);
-  new->ref = ir_PARAM(type_to_ir_type(type),
+static ir_ref emit_param(Str name, ir_type type, int index) {
+  return ir_PARAM(type,
 #if BUILD_DEBUG
-                      cstr_copy(parser.arena, name),
+                  cstr_copy(parser.arena, name),
 #else
-                      "",
+                  "",
 #endif
-                      index + 1);
+                  index + 1);
+}
+
+static Sym* make_param(Str name, Type type, ir_ref ref) {
+  Sym* new = sym_new(SYM_VAR, name, type);
+  new->ref = ref;
   new->scope_decl = SSD_DECLARED_PARAMETER;
   return new;
 }
 
+#if ARCH_X64 && !OS_WINDOWS
+// System V x64 passes aggregates of up to 16 bytes in registers, one per
+// eightbyte, with each eightbyte classified by what's in it. Everything else
+// is MEMORY, which means copied into the argument area on the stack (not a
+// pointer to a copy, like Windows).
+//
+// IR doesn't know about aggregates at all, and the only way to get something
+// onto the stack is for it to run out of registers. So the operands of a CALL
+// (and the PARAMs of a function) are reordered: everything that goes in a
+// register first, then dummy integers to use up any integer registers that
+// are left, then each eightbyte that goes on the stack. IR assigns registers
+// to integer and floating point operands in order, the same as the ABI does,
+// so the registers end up the same, and the stack ends up as if the
+// aggregates had been copied there.
+typedef enum SysvClass {
+  SYSV_NO_CLASS,
+  SYSV_INTEGER,
+  SYSV_SSE,
+} SysvClass;
+
+#define SYSV_PIECE_PAD 0xfe
+#define SYSV_PIECE_SRET 0xff
+
+typedef struct SysvPiece {
+  uint8_t param;  // Index into the function's params, or SYSV_PIECE_PAD or SYSV_PIECE_SRET.
+  uint16_t offset;  // Of the eightbyte, for aggregates.
+  ir_type type;
+} SysvPiece;
+
+typedef struct SysvLayout {
+  SysvPiece pieces[MAX_CALL_OPERANDS];
+  uint32_t num_pieces;
+  uint32_t num_ret_eightbytes;  // Zero unless an aggregate is returned in registers.
+  SysvClass ret_class[2];
+  bool sret;
+} SysvLayout;
+
+// Returns false if any of it has to be MEMORY.
+static bool sysv_classify(Type type, uint32_t offset, SysvClass classes[2]) {
+  if (offset % type_align(type) != 0) {
+    return false;
+  }
+  switch (type_kind(type)) {
+    case TYPE_STRUCT:
+      for (uint32_t i = 0; i < type_struct_num_fields(type); ++i) {
+        if (!sysv_classify(type_struct_field_type(type, i),
+                           offset + type_struct_field_offset(type, i), classes)) {
+          return false;
+        }
+      }
+      return true;
+    case TYPE_ARRAY: {
+      Type subtype = type_array_subtype(type);
+      for (uint32_t i = 0; i < type_array_count(type); ++i) {
+        if (!sysv_classify(subtype, offset + i * (uint32_t)type_size(subtype), classes)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case TYPE_STR:
+      return sysv_classify(type_i64, offset, classes) &&
+             sysv_classify(type_i64, offset + 8, classes);
+    case TYPE_RANGE:
+    case TYPE_LIST:
+    case TYPE_DICT:
+    case TYPE_UNION:
+      return false;
+    default: {
+      TypeKind kind = type_kind(type);
+      SysvClass c = kind == TYPE_FLOAT || kind == TYPE_DOUBLE ? SYSV_SSE : SYSV_INTEGER;
+      SysvClass* eightbyte = &classes[offset / 8];
+      if (*eightbyte != SYSV_INTEGER) {
+        *eightbyte = c;
+      }
+      return true;
+    }
+  }
+}
+
+// Returns the number of eightbytes passed in registers, or 0 for MEMORY.
+static uint32_t sysv_classify_aggregate(Type type, SysvClass classes[2]) {
+  classes[0] = classes[1] = SYSV_NO_CLASS;
+  size_t size = type_size(type);
+  if (size == 0 || size > 16 || !sysv_classify(type, 0, classes)) {
+    return 0;
+  }
+  uint32_t n = (uint32_t)((size + 7) / 8);
+  ASSERT(classes[0] != SYSV_NO_CLASS && (n == 1 || classes[1] != SYSV_NO_CLASS));
+  return n;
+}
+
+static ir_type sysv_ir_type(SysvClass c) {
+  return c == SYSV_SSE ? IR_DOUBLE : IR_U64;
+}
+
+static void sysv_add_piece(SysvPiece* pieces, uint32_t* num_pieces, SysvPiece piece) {
+  if (*num_pieces >= MAX_CALL_OPERANDS) {
+    error("Arguments too large to pass.");
+  }
+  pieces[(*num_pieces)++] = piece;
+}
+
+static void sysv_layout(Type func_type, SysvLayout* layout) {
+  SysvPiece stack[MAX_CALL_OPERANDS];
+  uint32_t num_stack = 0;
+  int ints_left = 6;
+  int sses_left = 8;
+  layout->num_pieces = 0;
+  layout->num_ret_eightbytes = 0;
+  layout->sret = false;
+
+  Type ret_type = type_func_return_type(func_type);
+  if (type_is_aggregate(ret_type)) {
+    uint32_t n = sysv_classify_aggregate(ret_type, layout->ret_class);
+    // The second register of a foreign function's return value can be read
+    // with RLOAD right after the CALL, but there's nothing that can reliably
+    // set it before a RETURN, so luv functions use sret for those.
+    if (n == 0 || (n == 2 && !(type_func_flags(func_type) & TFF_FOREIGN))) {
+      layout->sret = true;
+      sysv_add_piece(layout->pieces, &layout->num_pieces,
+                     (SysvPiece){.param = SYSV_PIECE_SRET, .type = IR_ADDR});
+      --ints_left;
+    } else {
+      layout->num_ret_eightbytes = n;
+    }
+  }
+
+  for (uint32_t i = 0; i < type_func_num_params(func_type); ++i) {
+    Type param = type_func_param(func_type, i);
+    if (!type_is_aggregate(param)) {
+      ir_type type = type_to_ir_type(param);
+      int* left = type == IR_FLOAT || type == IR_DOUBLE ? &sses_left : &ints_left;
+      SysvPiece piece = {.param = (uint8_t)i, .type = type};
+      if (*left > 0) {
+        --*left;
+        sysv_add_piece(layout->pieces, &layout->num_pieces, piece);
+      } else {
+        sysv_add_piece(stack, &num_stack, piece);
+      }
+      continue;
+    }
+
+    SysvClass classes[2];
+    uint32_t n = sysv_classify_aggregate(param, classes);
+    int need_ints = 0;
+    int need_sses = 0;
+    for (uint32_t j = 0; j < n; ++j) {
+      ++*(classes[j] == SYSV_SSE ? &need_sses : &need_ints);
+    }
+    if (n > 0 && need_ints <= ints_left && need_sses <= sses_left) {
+      ints_left -= need_ints;
+      sses_left -= need_sses;
+      for (uint32_t j = 0; j < n; ++j) {
+        sysv_add_piece(layout->pieces, &layout->num_pieces,
+                       (SysvPiece){.param = (uint8_t)i,
+                                   .offset = (uint16_t)(j * 8),
+                                   .type = sysv_ir_type(classes[j])});
+      }
+    } else {
+      // Either MEMORY, or it didn't fit in what's left, in which case the
+      // whole thing goes on the stack.
+      uint32_t num_eightbytes = (uint32_t)((type_size(param) + 7) / 8);
+      for (uint32_t j = 0; j < num_eightbytes; ++j) {
+        sysv_add_piece(stack, &num_stack,
+                       (SysvPiece){.param = (uint8_t)i, .offset = (uint16_t)(j * 8), .type = IR_U64});
+      }
+    }
+  }
+
+  if (num_stack > 0) {
+    for (; ints_left > 0; --ints_left) {
+      sysv_add_piece(layout->pieces, &layout->num_pieces,
+                     (SysvPiece){.param = SYSV_PIECE_PAD, .type = IR_U64});
+    }
+    for (uint32_t i = 0; i < num_stack; ++i) {
+      sysv_add_piece(layout->pieces, &layout->num_pieces, stack[i]);
+    }
+  }
+}
+
+static ir_type sysv_return_ir_type(SysvLayout* layout, Type ret_type) {
+  if (layout->sret) {
+    return IR_ADDR;
+  } else if (layout->num_ret_eightbytes) {
+    return sysv_ir_type(layout->ret_class[0]);
+  } else {
+    return type_to_ir_type(ret_type);
+  }
+}
+#endif
+
 static void enter_scope(bool is_module, bool is_function, Sym* funcsym) {
   parser.cur_scope = &parser.scopes[parser.num_scopes++];
   parser.cur_scope->func_sym = funcsym;
+  parser.cur_scope->tier_rec = NULL;
   parser.cur_scope->arena_saved_pos = arena_pos(arena_ir);
   parser.cur_scope->upval_map.num_upvals = 0;
+  parser.cur_scope->upval_map.alloc_size = 0;
+  parser.cur_scope->upval_map.direct = false;
+  parser.cur_scope->upval_base = 0;
   parser.cur_scope->arena_pos = arena_pos(parser.var_scope_arena);
   parser.cur_scope->is_function = is_function;
   parser.cur_scope->is_module = is_module;
-  parser.cur_scope->is_full_dict = !is_function;
-  if (parser.cur_scope->is_full_dict) {
-    parser.cur_scope->sym_dict =
-        dict_new(parser.var_scope_arena, 1 << 20, sizeof(NameSymPair), _Alignof(NameSymPair));
-  } else {
-    flat_name_map_init(&parser.cur_scope->flat_map);
+  parser.cur_scope->is_ctfe = false;
+  parser.cur_scope->cache_key = 0;
+  parser.cur_scope->hot_key = 0;
+  parser.cur_scope->made_lists = false;
+  parser.cur_scope->last_binding = NULL;
+  parser.cur_scope->func_depth =
+      (parser.num_scopes > 1 ? parser.cur_scope[-1].func_depth : 0) + (is_function ? 1 : 0);
+}
+
+// Makes the names declared in |scope| after |mark| visible as whatever they
+// shadowed again.
+static void unwind_bindings(Scope* scope, Binding* mark) {
+  for (Binding* b = scope->last_binding; b != mark; b = b->prev_in_scope) {
+    NameBinding* nb = find_name_binding(b->sym.name);
+    ASSERT(nb && nb->top == b);
+    nb->top = b->shadowed;
   }
+  scope->last_binding = mark;
 }
 
 static void leave_scope(void) {
-  arena_pop_to(parser.var_scope_arena, parser.cur_scope->arena_pos);
+  // Not cur_scope, leave_function() points that at the parent already.
+  Scope* scope = &parser.scopes[parser.num_scopes - 1];
+  // Nothing is looked up after the module is done, so don't bother unwinding
+  // all the globals, unless --watch is going to parse it all again.
+  if (!scope->is_module || parser.hot_active) {
+    unwind_bindings(scope, NULL);
+  }
+  arena_pop_to(parser.var_scope_arena, scope->arena_pos);
   --parser.num_scopes;
   ASSERT(parser.num_scopes >= 0);
   if (parser.num_scopes == 0) {
@@ -804,44 +1727,302 @@ static void leave_scope(void) {
   }
 }
 
-static void enter_function(Sym* sym,
-                           Str param_names[MAX_FUNC_PARAMS],
-                           Type param_types[MAX_FUNC_PARAMS]) {
-  bool is_nested = parser.num_scopes > 1;  // Module, parent.
-  if (is_nested) {
-    ASSERT(parser.scopes[parser.num_scopes - 1].is_function);
-    ASSERT(parser.scopes[0].is_module);
+// Called from opt 0 code when a function's counter reaches
+// TIER_UP_THRESHOLD. Only ever called from the (single) thread running the
+// program.
+static void tier_up_request(TierRecord* rec) {
+  uint32_t tail = parser.tier_queue_tail;
+  uint32_t head = __atomic_load_n(&parser.tier_queue_head, __ATOMIC_ACQUIRE);
+  if (tail - head >= COUNTOF(parser.tier_queue)) {
+    // Worker is backed up, let this one try again later.
+    rec->count = 0;
+    return;
   }
+  parser.tier_queue[tail % COUNTOF(parser.tier_queue)] = rec;
+  __atomic_store_n(&parser.tier_queue_tail, tail + 1, __ATOMIC_RELEASE);
+  base_semaphore_signal(parser.tier_sem);
+}
 
-  enter_scope(/*is_module=*/false, /*is_function=*/true, sym);
-
-#if BUILD_DEBUG
-  ir_consistency_check();
+// In the prologue and at every loop back-edge. The count stops at
+// TIER_UP_THRESHOLD so that it can't wrap around and queue the function
+// again.
+static void tier_emit_count(void) {
+  TierRecord* rec = parser.cur_scope->tier_rec;
+  if (!rec || parser.tier_recompiling) {
+    return;
+  }
+  ir_ref addr = ir_CONST_ADDR(&rec->count);
+  ir_ref count = ir_LOAD_U32(addr);
+  ir_ref below = ir_ULT(count, ir_CONST_U32(TIER_UP_THRESHOLD));
+  ir_STORE(addr, ir_ADD_U32(count, ir_ZEXT_U32(below)));
+  ir_ref hot = ir_IF(ir_EQ(count, ir_CONST_U32(TIER_UP_THRESHOLD - 1)));
+  ir_IF_TRUE_cold(hot);
+  ir_CALL_1(IR_VOID, ir_CONST_ADDR(tier_up_request), ir_CONST_ADDR(rec));
+  ir_MERGE_WITH_EMPTY_FALSE(hot);
+}
+
+// A function that's compiled more than once gets a counter each time, they're
+// summed by profile_load().
+static void profile_emit_count(uint32_t offset, ProfileKind kind) {
+#if ENABLE_PROFILE
+  if (!parser.profile_gen_filename) {
+    return;
+  }
+  if (parser.num_profile_counts >= MAX_PROFILE_COUNTS) {
+    error("Too many profile counters.");
+  }
+  ProfileCount* pc = &parser.profile_counts[parser.num_profile_counts++];
+  *pc = (ProfileCount){{parser.file_hash, offset, kind}, 0};
+  ir_ref addr = ir_CONST_ADDR(&pc->count);
+  ir_STORE(addr, ir_ADD_U64(ir_LOAD_U64(addr), ir_CONST_U64(1)));
+#else
+  (void)offset;
+  (void)kind;
 #endif
+}
 
-  uint32_t opts = parser.opt_level ? IR_OPT_FOLDING : 0;
-  if (parser.opt_level == 2) {
-    opts |= IR_OPT_MEM2SSA;
+static bool profile_lookup(uint32_t offset, ProfileKind kind, uint64_t* count) {
+  if (!parser.profile) {
+    return false;
   }
-  ir_init(_ir_CTX, IR_FUNCTION | opts, 4096, 4096);
-#if ARCH_X64 && OS_WINDOWS  // TODO: Reosetta doesn't support AVX, check SSE
-  parser.cur_scope->ctx.mflags = IR_X86_SSE2 | IR_X86_SSE3 | IR_X86_SSSE3 | IR_X86_SSE41 |
-                                 IR_X86_SSE42 | IR_X86_AVX | IR_X86_AVX2 | IR_X86_BMI1 |
-                                 IR_X86_CLDEMOTE;
-#endif
+  return profile_find(parser.profile, (ProfileKey){parser.file_hash, offset, kind}, count);
+}
 
-  parser.cur_scope->ctx.code_buffer = &parser.code_buffer;
-  ir_START();
+// How often (in percent, 1-99) the if/elif condition at |offset| was true (or
+// with PROF_BACKEDGE and PROF_LOOP_EXIT, how often the loop went around again
+// rather than finishing), or 0 if the profile doesn't know.
+static int profile_branch_percent(uint32_t offset,
+                                  ProfileKind taken_kind,
+                                  ProfileKind not_taken_kind) {
+  uint64_t taken, not_taken;
+  if (!profile_lookup(offset, taken_kind, &taken) ||
+      !profile_lookup(offset, not_taken_kind, &not_taken) || taken + not_taken == 0) {
+    return 0;
+  }
+  int percent = (int)((double)taken * 100.0 / (double)(taken + not_taken) + 0.5);
+  return percent < 1 ? 1 : percent > 99 ? 99 : percent;
+}
+
+// ir_IF_TRUE() or ir_IF_FALSE(), with the arm's probability from the profile
+// so that ir_schedule_blocks() makes the likely arm the fallthrough and moves
+// the unlikely one out of the way. |percent| is for the true arm.
+static void if_arm(ir_ref cond, bool true_arm, int percent) {
+  if (true_arm) {
+    ir_IF_TRUE(cond);
+  } else {
+    ir_IF_FALSE(cond);
+  }
+#if ENABLE_PROFILE
+  if (percent) {
+    // The same operand that the _cold() variants set to 1.
+    _ir_CTX->ir_base[_ir_CTX->control].op2 = true_arm ? percent : 100 - percent;
+  }
+#else
+  (void)percent;
+#endif
+}
+
+// Counts entries to the function that was just entered for --profile-gen, and
+// for --profile-use, puts it with the other cold code if it never ran.
+static void profile_enter_function(uint32_t function_start_offset) {
+  profile_emit_count(function_start_offset, PROF_ENTRY);
+  uint64_t entries;
+  // Never true for anything that a const expression calls, since that ran
+  // while compiling for --profile-gen, so cold_code doesn't need to be
+  // executable until the end of parse_impl().
+  if (profile_lookup(function_start_offset, PROF_ENTRY, &entries) && entries == 0) {
+#if ENABLE_PROFILE
+    parser.cur_scope->ctx.code_buffer = &parser.cold_code;
+    ++parser.num_cold_funcs;
+#endif
+  }
+}
+
+static uint64_t* emit_jump_stub(void* target) {
+  uint64_t* stub = ALIGN_UP_PTR(parser.code_buffer.pos, sizeof(uint64_t));
+  if ((void*)(stub + 1) > parser.code_buffer.end) {
+    error("Out of code buffer space.");
+  }
+  *stub = jump_stub_encode(stub, target);
+  parser.code_buffer.pos = stub + 1;
+  return stub;
+}
+
+static void* tier_emit_stub(TierRecord* rec, void* target) {
+  rec->stub = emit_jump_stub(target);
+  return rec->stub;
+}
+
+// Returns what the function's sym->addr should be for --watch.
+static void* hot_install(Sym* func_sym, void* entry) {
+  HotSym sym = {.name = func_sym->name,
+                .type_hash = hot_type_hash(func_sym->type),
+                .code = entry,
+                .key = parser.cur_scope->hot_key};
+  HotSym* hs = hot_find(parser.hot, func_sym->name, /*is_global=*/false);
+  if (hs && hs->type_hash == sym.type_hash) {
+    sym.addr = hs->addr;
+    if (entry != hs->code) {
+      hot_queue(parser.hot, sym, /*patch_stub=*/true);
+    }
+    return sym.addr;
+  }
+  if (hs) {
+    hot_note(func_sym->name,
+             "changed signature, so code that's already running still calls the old one");
+  }
+  sym.addr = emit_jump_stub(entry);
+  hot_queue(parser.hot, sym, /*patch_stub=*/false);
+  return sym.addr;
+}
+
+#if ENABLE_CODE_GEN
+// Each code generating instantiation of this file provides this.
+static void* jit_compile(ir_ctx* ctx, int opt_level, size_t* size);
+#endif
+
+static void begin_function_ir(ir_ref consts_limit, ir_ref insns_limit) {
+#if BUILD_DEBUG
+  ir_consistency_check();
+#endif
+
+  uint32_t opts = parser.opt_level ? IR_OPT_FOLDING : 0;
+  if (parser.opt_level == 2) {
+    opts |= IR_OPT_MEM2SSA;
+  }
+  ir_init(_ir_CTX, IR_FUNCTION | opts, consts_limit, insns_limit);
+#if ARCH_X64 && OS_WINDOWS  // TODO: Reosetta doesn't support AVX, check SSE
+  parser.cur_scope->ctx.mflags = IR_X86_SSE2 | IR_X86_SSE3 | IR_X86_SSSE3 | IR_X86_SSE41 |
+                                 IR_X86_SSE42 | IR_X86_AVX | IR_X86_AVX2 | IR_X86_BMI1 |
+                                 IR_X86_CLDEMOTE;
+#endif
+
+  parser.cur_scope->ctx.code_buffer = &parser.code_buffer;
+  ir_START();
+}
+
+static int find_upval(UpvalMap* uvm, Str name) {
+  for (int i = uvm->num_upvals - 1; i >= 0; --i) {
+    if (str_eq(name, uvm->upvals[i].name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// A direct upval (see UpvalMap) is passed as the $up pointer, so it's just
+// its bits widened to 64.
+static ir_ref upval_to_up(ir_ref value, Type type) {
+  switch (type_kind(type)) {
+    case TYPE_PTR:
+      return value;
+    case TYPE_U64:
+    case TYPE_I64:
+    case TYPE_DOUBLE:
+      return ir_BITCAST(IR_ADDR, value);
+    case TYPE_FLOAT:
+      return ir_ZEXT(IR_ADDR, ir_BITCAST(IR_U32, value));
+    default:
+      return ir_ZEXT(IR_ADDR, value);
+  }
+}
+
+static ir_ref upval_from_up(ir_ref up, Type type) {
+  ir_type t = type_to_ir_type(type);
+  switch (type_kind(type)) {
+    case TYPE_PTR:
+      return up;
+    case TYPE_U64:
+    case TYPE_I64:
+    case TYPE_DOUBLE:
+      return ir_BITCAST(t, up);
+    case TYPE_FLOAT:
+      return ir_BITCAST(IR_FLOAT, ir_TRUNC(IR_U32, up));
+    default:
+      return ir_TRUNC(t, up);
+  }
+}
+
+static void enter_function(Sym* sym,
+                           Str param_names[MAX_FUNC_PARAMS],
+                           Type param_types[MAX_FUNC_PARAMS]) {
+  bool is_nested = parser.num_scopes > 1;  // Module, parent.
+  if (is_nested) {
+    ASSERT(parser.scopes[parser.num_scopes - 1].is_function);
+    ASSERT(parser.scopes[0].is_module);
+  }
+
+  enter_scope(/*is_module=*/false, /*is_function=*/true, sym);
+  parser.cur_scope->cache_span_start = cur_offset();
+  TRACE_BEGIN("build IR", sym->name);
+  begin_function_ir(4096, 4096);
 
   uint32_t num_params = type_func_num_params(sym->type);
   Sym* param_syms[MAX_FUNC_PARAMS];
+  Type ret_type = type_func_return_type(sym->type);
+#if ARCH_X64 && !OS_WINDOWS
+  SysvLayout layout;
+  sysv_layout(sym->type, &layout);
+  ir_ref operands[MAX_CALL_OPERANDS];
+  for (uint32_t i = 0; i < layout.num_pieces; ++i) {
+    uint8_t param = layout.pieces[i].param;
+    Str name = param == SYSV_PIECE_SRET ? parser.static_str_ret
+               : param == SYSV_PIECE_PAD ? parser.static_str_pad
+                                         : param_names[param];
+    operands[i] = emit_param(name, layout.pieces[i].type, i);
+  }
+
+  // Aggregates are put back together in a local, which also means the callee
+  // gets its own copy.
   for (uint32_t i = 0; i < num_params; ++i) {
-    param_syms[i] = make_param(param_names[i], type_func_param(sym->type, i), i);
+    Type type = type_func_param(sym->type, i);
+    ir_ref ref = 0;
+    if (type_is_aggregate(type)) {
+      ref = ir_ALLOCA(ir_CONST_U64(ALIGN_UP(type_size(type), 8)));
+    }
+    for (uint32_t j = 0; j < layout.num_pieces; ++j) {
+      SysvPiece* piece = &layout.pieces[j];
+      if (piece->param != i) {
+        continue;
+      }
+      if (type_is_aggregate(type)) {
+        ir_STORE(piece->offset ? ir_ADD_OFFSET(ref, piece->offset) : ref, operands[j]);
+      } else {
+        ref = operands[j];
+      }
+    }
+    param_syms[i] = make_param(param_names[i], type, ref);
+  }
+
+  parser.cur_scope->ctx.ret_type = sysv_return_ir_type(&layout, ret_type);
+  if (type_eq(ret_type, type_void)) {
+    parser.cur_scope->return_slot = NULL;
+  } else if (layout.sret) {
+    // Written directly, and returned in rax as the ABI requires.
+    Sym* ret = sym_new(SYM_VAR, parser.static_str_ret, ret_type);
+    ret->ref = operands[0];
+    ret->scope_decl = SSD_DECLARED_LOCAL;
+    parser.cur_scope->return_slot = ret;
+  } else if (type_is_aggregate(ret_type)) {
+    // Rounded up so the whole eightbyte can be loaded when returning.
+    Sym* ret = sym_new(SYM_VAR, parser.static_str_ret, ret_type);
+    ret->ref = ir_ALLOCA(ir_CONST_U64(ALIGN_UP(type_size(ret_type), 8)));
+    ret->scope_decl = SSD_DECLARED_LOCAL;
+    initialize_aggregate(ret->ref, ret_type);
+    parser.cur_scope->return_slot = ret;
+  } else {
+    parser.cur_scope->return_slot =
+        make_local_and_alloc(SYM_VAR, parser.static_str_ret, ret_type, NULL);
+  }
+#else
+  for (uint32_t i = 0; i < num_params; ++i) {
+    Type type = type_func_param(sym->type, i);
+    param_syms[i] =
+        make_param(param_names[i], type, emit_param(param_names[i], type_to_ir_type(type), i));
   }
 
   // Allocation of the VAR for return_slot must be after all PARAMs.
   // https://github.com/dstogov/ir/issues/103.
-  Type ret_type = type_func_return_type(sym->type);
   parser.cur_scope->ctx.ret_type = type_to_ir_type(ret_type);
   if (type_eq(ret_type, type_void)) {
     parser.cur_scope->return_slot = NULL;
@@ -849,6 +2030,7 @@ static void enter_function(Sym* sym,
     parser.cur_scope->return_slot =
         make_local_and_alloc(SYM_VAR, parser.static_str_ret, ret_type, NULL);
   }
+#endif
 
   if (is_nested) {
     ASSERT(str_eq(param_syms[0]->name, parser.static_str_up));
@@ -858,19 +2040,511 @@ static void enter_function(Sym* sym,
   }
 }
 
-static void leave_function(void) {
-  Type ret_type = type_func_return_type(parser.cur_scope->func_sym->type);
-  if (type_eq(ret_type, type_void)) {
-    ir_RETURN(IR_UNUSED);
-  } else {
-    ir_RETURN(ir_VLOAD(type_to_ir_type(ret_type), parser.cur_scope->return_slot->ref));
+// TODO: Only catches changes to this file, not to the rest of the compiler.
+static const char cache_version[] = "luv code cache 2 " __DATE__ " " __TIME__;
+
+#if ENABLE_CODE_CACHE
+// With --code-cache, every top level function's machine code is saved along
+// with where it refers to anything by absolute address, so that a later run
+// with the same function can copy it back into the code buffer and patch it
+// rather than running the backend. Cached code is always compiled so that
+// those addresses are 64 bit immediates, see cache_compile().
+static uint64_t cache_function_key(Str name) {
+  Scope* scope = parser.cur_scope;
+  size_t hash = scope->cache_key;
+  dict_hash_write(&hash, (void*)cache_version, sizeof(cache_version));
+  dict_hash_write(&hash, &parser.opt_level, sizeof(parser.opt_level));
+  dict_hash_write(&hash, &parser.bounds_check, sizeof(parser.bounds_check));
+  dict_hash_write(&hash, &scope->ctx.mflags, sizeof(scope->ctx.mflags));
+  dict_hash_write(&hash, (void*)str_raw_ptr(name), str_len(name));
+  cache_hash_type(&hash, scope->func_sym->type, 0);
+  uint32_t span_end = cur_offset();
+  ASSERT(span_end >= scope->cache_span_start);
+  dict_hash_write(&hash, (void*)&parser.file_contents[scope->cache_span_start],
+                  span_end - scope->cache_span_start);
+  return hash;
+}
+
+// Copies a cached function into the code buffer, or returns NULL if something
+// it refers to doesn't exist (anymore) in this run.
+static void* cache_install(CacheEntry* cached, size_t* size) {
+  uint8_t* entry = ALIGN_UP_PTR(parser.code_buffer.pos, 16);
+  if (entry + cached->size > (uint8_t*)parser.code_buffer.end ||
+      !cache_entry_install(parser.cache_targets, cached, entry)) {
+    return NULL;
+  }
+  parser.code_buffer.pos = entry + cached->size;
+  *size = cached->size;
+  return entry;
+}
+
+static void cache_grow_relocs(CacheReloc** relocs, uint32_t num_relocs, uint32_t* max_relocs) {
+  if (num_relocs < *max_relocs) {
+    return;
+  }
+  CacheReloc* larger =
+      arena_push(parser.arena, *max_relocs * 2 * sizeof(CacheReloc), _Alignof(CacheReloc));
+  memcpy(larger, *relocs, *max_relocs * sizeof(CacheReloc));
+  *relocs = larger;
+  *max_relocs *= 2;
+}
+
+// Finds where each address constant ended up in the code that was just
+// compiled. If any of them aren't a registered CacheTarget, the function can't
+// be cached and this returns NULL.
+static CacheEntry* cache_record(uint64_t key, void* entry, size_t size) {
+  ir_ctx* ctx = &parser.cur_scope->ctx;
+  uint32_t max_relocs = 16;
+  uint32_t num_relocs = 0;
+  CacheReloc* relocs = arena_push(parser.arena, max_relocs * sizeof(CacheReloc), _Alignof(CacheReloc));
+  for (ir_ref ref = -1; ref > -ctx->consts_count; --ref) {
+    ir_insn* insn = &ctx->ir_base[ref];
+    if (insn->type != IR_ADDR || insn->op == IR_STR) {
+      continue;
+    }
+    if (insn->op == IR_FUNC || insn->op == IR_SYM) {
+      return NULL;
+    }
+    CacheTarget* target = cache_targets_find_addr(parser.cache_targets, (void*)insn->val.addr);
+    if (insn->val.addr <= 0xffffffffull) {
+      // Offsets and NULL aren't targets, but helpers in a non-PIE luvc are.
+      // Those might be encoded as 32 bit immediates that there'd be no way to
+      // patch, so instead the entry is only used if they're still at the same
+      // address, i.e. it's the same luvc binary.
+      if (target && !target->ambiguous) {
+        cache_grow_relocs(&relocs, num_relocs, &max_relocs);
+        relocs[num_relocs++] = (CacheReloc){.pinned_addr = (uint32_t)insn->val.addr,
+                                            .name_len = target->name_len,
+                                            .name = target->name};
+      }
+      continue;
+    }
+    if (!target || target->ambiguous) {
+      return NULL;
+    }
+    for (size_t offset = 0; offset + sizeof(void*) <= size; ++offset) {
+      if (memcmp((uint8_t*)entry + offset, &insn->val.addr, sizeof(void*)) != 0) {
+        continue;
+      }
+      cache_grow_relocs(&relocs, num_relocs, &max_relocs);
+      relocs[num_relocs++] = (CacheReloc){
+          .offset = (uint32_t)offset, .name_len = target->name_len, .name = target->name};
+    }
   }
 
+  CacheEntry* cached = arena_push(parser.arena, sizeof(CacheEntry), _Alignof(CacheEntry));
+  *cached = (CacheEntry){.key = key,
+                         .code = entry,
+                         .size = (uint32_t)size,
+                         .num_relocs = num_relocs,
+                         .relocs = relocs};
+  code_cache_use(parser.code_cache, cached);
+  return cached;
+}
+
+// While a module is being compiled, its top level functions are also
+// collected for its interface file. Nested functions aren't needed, as
+// whatever calls one couldn't be recorded anyway.
+static void module_note_func(Str name, void* entry, CacheEntry* cached) {
+  Module* module = parser.cur_module;
+  if (!module) {
+    return;
+  }
+  if (!entry || !cached) {
+    module->no_interface = true;
+    return;
+  }
+  if (module->num_funcs == module->max_funcs) {
+    uint32_t max_funcs = module->max_funcs ? module->max_funcs * 2 : 64;
+    ModuleFunc* larger =
+        arena_push(parser.arena, max_funcs * sizeof(ModuleFunc), _Alignof(ModuleFunc));
+    if (module->num_funcs) {
+      memcpy(larger, module->funcs, module->num_funcs * sizeof(ModuleFunc));
+    }
+    module->funcs = larger;
+    module->max_funcs = max_funcs;
+  }
+  module->funcs[module->num_funcs++] = (ModuleFunc){name, entry, cached};
+}
+
+// Pretending the code buffer is huge means that IR_MAY_USE_32BIT_ADDR() is
+// never true, so every address is a mov64 that can be found after the fact,
+// including calls to other functions in the code buffer. Nothing is anywhere
+// near 16M, so the end of the real buffer is still respected.
+static void* jit_compile_far(size_t* size) {
+  Scope* scope = parser.cur_scope;
+  ir_code_buffer* code_buffer = &parser.code_buffer;
+  ASSERT((uint8_t*)code_buffer->end - (uint8_t*)code_buffer->pos >= MiB(16));
+  ir_code_buffer far = {.start = code_buffer->start,
+                        .end = (uint8_t*)code_buffer->end + (1ull << 40),
+                        .pos = code_buffer->pos};
+  scope->ctx.code_buffer = &far;
+  void* entry = jit_compile(&scope->ctx, parser.opt_level, size);
+  scope->ctx.code_buffer = code_buffer;
+  code_buffer->pos = far.pos;
+  ASSERT(code_buffer->pos <= code_buffer->end);
+  return entry;
+}
+
+static void* cache_compile(Str name, size_t* size) {
+  Scope* scope = parser.cur_scope;
+  // Nested functions also depend on their parents' locals, and the parent
+  // refers to the nested function by an address that can't be found by name.
+  if (!scope->func_sym || type_func_is_nested(scope->func_sym->type)) {
+    return jit_compile(&scope->ctx, parser.opt_level, size);
+  }
+
+  uint64_t key = cache_function_key(name);
+  CacheEntry* cached = code_cache_find(parser.code_cache, key);
+  if (cached) {
+    void* entry = cache_install(cached, size);
+    if (entry) {
+      ++parser.num_cache_hits;
+      code_cache_use(parser.code_cache, cached);
+      module_note_func(name, entry, cached);
+      return entry;
+    }
+  }
+  ++parser.num_cache_misses;
+
+  if ((uint8_t*)parser.code_buffer.end - (uint8_t*)parser.code_buffer.pos < MiB(16)) {
+    module_note_func(name, NULL, NULL);
+    return jit_compile(&scope->ctx, parser.opt_level, size);
+  }
+  void* entry = jit_compile_far(size);
+  module_note_func(name, entry, entry ? cache_record(key, entry, *size) : NULL);
+  return entry;
+}
+
+// For --watch, skips the backend if the function is the same as it was in the
+// code that's currently running.
+static void* hot_compile(Str name, size_t* size) {
+  Scope* scope = parser.cur_scope;
+  if (!parser.hot_active || !scope->func_sym || type_func_is_nested(scope->func_sym->type)) {
+    return jit_compile(&scope->ctx, parser.opt_level, size);
+  }
+  scope->hot_key = cache_function_key(name);
+  HotSym* hs = hot_find(parser.hot, name, /*is_global=*/false);
+  if (hs && hs->key == scope->hot_key) {
+    *size = 0;
+    return hs->code;
+  }
+  return jit_compile(&scope->ctx, parser.opt_level, size);
+}
+
+// --emit-obj compiles everything the same way as a code cache miss, and then
+// finds every address constant in the code so that it can be relocated by
+// obj_write().
+static void obj_record(Str name, void* entry, size_t size) {
+  ir_ctx* ctx = &parser.cur_scope->ctx;
+  uint32_t offset = (uint32_t)((uint8_t*)entry - (uint8_t*)parser.code_buffer.start);
+  uint32_t max_relocs = 16;
+  uint32_t num_relocs = 0;
+  ObjCodeReloc* relocs =
+      arena_push(parser.arena, max_relocs * sizeof(ObjCodeReloc), _Alignof(ObjCodeReloc));
+  for (ir_ref ref = -1; ref > -ctx->consts_count; --ref) {
+    ir_insn* insn = &ctx->ir_base[ref];
+    if (insn->type != IR_ADDR || insn->op == IR_STR) {
+      continue;
+    }
+    if (insn->op == IR_FUNC || insn->op == IR_SYM) {
+      error("internal error: symbolic address constant with --emit-obj.");
+    }
+    if (insn->val.addr <= 0xffffffffull) {
+      if (cache_targets_find_addr(parser.cache_targets, (void*)insn->val.addr)) {
+        // Could be encoded as a 32 bit immediate, so there's no relocation
+        // that would work.
+        error("--emit-obj requires luvc to be built as a position independent executable.");
+      }
+      continue;  // Offsets, NULL, etc.
+    }
+    for (size_t i = 0; i + sizeof(void*) <= size; ++i) {
+      if (memcmp((uint8_t*)entry + i, &insn->val.addr, sizeof(void*)) != 0) {
+        continue;
+      }
+      if (num_relocs == max_relocs) {
+        ObjCodeReloc* larger = arena_push(parser.arena, max_relocs * 2 * sizeof(ObjCodeReloc),
+                                          _Alignof(ObjCodeReloc));
+        memcpy(larger, relocs, max_relocs * sizeof(ObjCodeReloc));
+        relocs = larger;
+        max_relocs *= 2;
+      }
+      relocs[num_relocs++] = (ObjCodeReloc){offset + (uint32_t)i, (void*)insn->val.addr};
+    }
+  }
+
+  ObjFunc* func = arena_push(parser.arena, sizeof(ObjFunc), _Alignof(ObjFunc));
+  *func = (ObjFunc){.name = name,
+                    .offset = offset,
+                    .size = (uint32_t)size,
+                    .num_relocs = num_relocs,
+                    .relocs = relocs,
+                    .next = parser.obj_funcs};
+  parser.obj_funcs = func;
+}
+
+static void* obj_compile(Str name, size_t* size) {
+  Scope* scope = parser.cur_scope;
+  if (!scope->func_sym) {
+    // Constant expression thunks only run at compile time. Their code does
+    // end up in the object, but nothing refers to it.
+    return jit_compile(&scope->ctx, parser.opt_level, size);
+  }
+  if ((uint8_t*)parser.code_buffer.end - (uint8_t*)parser.code_buffer.pos < MiB(16)) {
+    error("Out of code space.");
+  }
+  void* entry = jit_compile_far(size);
+  if (entry) {
+    obj_record(name, entry, *size);
+  }
+  return entry;
+}
+#endif
+
+static uint64_t cache_version_hash(void) {
+  size_t hash = 0;
+  dict_hash_write(&hash, (void*)cache_version, sizeof(cache_version));
+  return hash;
+}
+
+static void targets_init(void) {
+  if (parser.track_targets) {
+    return;
+  }
+  parser.track_targets = true;
+  parser.cache_targets = cache_targets_new(parser.arena);
+
+#define REGISTER_HELPER(fn) cache_register_extern((void*)fn, #fn, sizeof(#fn) - 1)
+  REGISTER_HELPER(print_i32_impl);
+  REGISTER_HELPER(print_bool_impl);
+  REGISTER_HELPER(print_float_impl);
+  REGISTER_HELPER(print_double_impl);
+  REGISTER_HELPER(print_str_impl);
+  REGISTER_HELPER(print_range_impl);
+  REGISTER_HELPER(bounds_check_fail_impl);
+  REGISTER_HELPER(range_step_zero_fail_impl);
+  REGISTER_HELPER(list_alloc_impl);
+  REGISTER_HELPER(list_release_impl);
+  REGISTER_HELPER(list_adopt_impl);
+  REGISTER_HELPER(list_keep_impl);
+  REGISTER_HELPER(list_count_mul_impl);
+  REGISTER_HELPER(memcpy);
+  REGISTER_HELPER(memset);
+#undef REGISTER_HELPER
+}
+
+static void cache_init(const char* code_cache_dir, const char* filename) {
+  size_t filename_hash = 0;
+  dict_hash_write(&filename_hash, (void*)filename, strlen(filename));
+  size_t len = strlen(code_cache_dir) + 1 + 16 + sizeof(".luvcache");
+  char* cache_filename = arena_push(parser.arena, len, 1);
+  snprintf(cache_filename, len, "%s/%016llx.luvcache", code_cache_dir,
+           (unsigned long long)filename_hash);
+  parser.code_cache_dir = code_cache_dir;
+  parser.code_cache = code_cache_load(parser.arena, cache_filename, cache_version_hash());
+  parser.track_deps = true;
+  targets_init();
+}
+
+// Once the program is done, from parse_code_gen_shutdown().
+static void profile_write(void) {
+  const char* filename = parser.profile_gen_filename;
+  if (!filename) {
+    return;
+  }
+  // The counters are gone after a --serve request, so this must not happen
+  // again for a later one.
+  parser.profile_gen_filename = NULL;
+  profile_save(filename, parser.profile_counts, parser.num_profile_counts);
+}
+
+#if ENABLE_CODE_CACHE
+typedef struct ObjData {
+  CacheTarget* target;
+  uint64_t offset;  // In .data.
+} ObjData;
+
+static int obj_data_compare(const void* va, const void* vb) {
+  uintptr_t a = (uintptr_t)((const ObjData*)va)->target->addr;
+  uintptr_t b = (uintptr_t)((const ObjData*)vb)->target->addr;
+  return a < b ? -1 : a > b ? 1 : 0;
+}
+
+typedef struct ObjWriter {
+  ObjFile file;
+  ObjData* data;
+  uint32_t num_data;
+  uint32_t max_symbols;
+} ObjWriter;
+
+static uint32_t obj_add_symbol(ObjWriter* w, ObjSymbol sym) {
+  if (w->file.num_symbols == w->max_symbols) {
+    ObjSymbol* larger = arena_push(parser.arena, w->max_symbols * 2 * sizeof(ObjSymbol),
+                                   _Alignof(ObjSymbol));
+    memcpy(larger, w->file.symbols, w->max_symbols * sizeof(ObjSymbol));
+    w->file.symbols = larger;
+    w->max_symbols *= 2;
+  }
+  w->file.symbols[w->file.num_symbols] = sym;
+  return w->file.num_symbols++;
+}
+
+// Fills out where `addr` points, for a relocation.
+static void obj_resolve(ObjWriter* w, void* addr, ObjReloc* reloc) {
+  uint8_t* text = parser.code_buffer.start;
+  if ((uint8_t*)addr >= text && (size_t)((uint8_t*)addr - text) < w->file.text_size) {
+    reloc->target_section = OBJ_SECTION_TEXT;
+    reloc->addend = (uint8_t*)addr - text;
+    return;
+  }
+
+  // Last data object that starts at or before addr.
+  uint32_t lo = 0, hi = w->num_data;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if ((uintptr_t)w->data[mid].target->addr <= (uintptr_t)addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo > 0) {
+    ObjData* data = &w->data[lo - 1];
+    uintptr_t start = (uintptr_t)data->target->addr;
+    if ((uintptr_t)addr - start < data->target->data_size) {
+      reloc->target_section = OBJ_SECTION_DATA;
+      reloc->addend = (int64_t)(data->offset + ((uintptr_t)addr - start));
+      return;
+    }
+  }
+
+  CacheTarget* target = cache_targets_find_addr(parser.cache_targets, addr);
+  if (target && target->is_extern) {
+    if (target->obj_symbol == ~0u) {
+      char* name = arena_push(parser.arena, target->name_len, 1);
+      memcpy(name, target->name + 1, target->name_len - 1);  // Without the '$'.
+      name[target->name_len - 1] = 0;
+      target->obj_symbol = obj_add_symbol(w, (ObjSymbol){.name = name});
+    }
+    reloc->target_section = OBJ_SECTION_UNDEF;
+    reloc->symbol = target->obj_symbol;
+    reloc->addend = 0;
+    return;
+  }
+
+  base_writef_stderr("--emit-obj: don't know what address %p refers to.\n", addr);
+  base_exit(1);
+}
+
+// Everything that was compiled goes into .text as it's laid out in the code
+// buffer, and every data object that was registered goes into .data. The root
+// file's main() is the only global symbol, so the result links against luvrt
+// and libc into a normal executable.
+static void obj_write(void) {
+  ObjWriter w = {0};
+  w.file.text_size = (uint8_t*)parser.code_buffer.pos - (uint8_t*)parser.code_buffer.start;
+  uint8_t* text = arena_push(parser.arena, w.file.text_size, 16);
+  memcpy(text, parser.code_buffer.start, w.file.text_size);
+  w.file.text = text;
+
+  for (CacheTarget* target = cache_targets_list(parser.cache_targets); target;
+       target = target->next) {
+    if (target->data_size) {
+      ++w.num_data;
+    }
+  }
+  w.data = arena_push(parser.arena, (w.num_data + 1) * sizeof(ObjData), _Alignof(ObjData));
+  uint32_t num_data = 0;
+  for (CacheTarget* target = cache_targets_list(parser.cache_targets); target;
+       target = target->next) {
+    if (target->data_size) {
+      w.data[num_data++] = (ObjData){.target = target};
+    }
+  }
+  qsort(w.data, w.num_data, sizeof(ObjData), obj_data_compare);
+  for (uint32_t i = 0; i < w.num_data; ++i) {
+    w.data[i].offset = w.file.data_size;
+    w.file.data_size = ALIGN_UP(w.file.data_size + w.data[i].target->data_size, 16);
+  }
+  uint8_t* data = arena_push(parser.arena, w.file.data_size, 16);
+  memset(data, 0, w.file.data_size);
+  for (uint32_t i = 0; i < w.num_data; ++i) {
+    memcpy(data + w.data[i].offset, w.data[i].target->addr, w.data[i].target->data_size);
+  }
+  w.file.data = data;
+
+  uint32_t max_relocs = w.num_data;
+  for (ObjFunc* func = parser.obj_funcs; func; func = func->next) {
+    max_relocs += func->num_relocs;
+  }
+  w.file.relocs = arena_push(parser.arena, (max_relocs + 1) * sizeof(ObjReloc), _Alignof(ObjReloc));
+  w.max_symbols = 64;
+  w.file.symbols = arena_push(parser.arena, w.max_symbols * sizeof(ObjSymbol), _Alignof(ObjSymbol));
+
+  uint32_t main_offset = ~0u;
+  if (parser.main_func_entry) {
+    main_offset =
+        (uint32_t)((uint8_t*)parser.main_func_entry - (uint8_t*)parser.code_buffer.start);
+  }
+  for (ObjFunc* func = parser.obj_funcs; func; func = func->next) {
+    obj_add_symbol(&w, (ObjSymbol){.name = cstr_copy(parser.arena, func->name),
+                                   .section = OBJ_SECTION_TEXT,
+                                   .global = func->offset == main_offset,
+                                   .offset = func->offset,
+                                   .size = func->size});
+    for (uint32_t i = 0; i < func->num_relocs; ++i) {
+      ObjReloc* reloc = &w.file.relocs[w.file.num_relocs++];
+      *reloc = (ObjReloc){.section = OBJ_SECTION_TEXT, .offset = func->relocs[i].offset};
+      obj_resolve(&w, func->relocs[i].addr, reloc);
+      memset(text + reloc->offset, 0, sizeof(void*));
+    }
+  }
+
+  for (uint32_t i = 0; i < w.num_data; ++i) {
+    if (w.data[i].target->is_str) {
+      ObjReloc* reloc = &w.file.relocs[w.file.num_relocs++];
+      *reloc = (ObjReloc){.section = OBJ_SECTION_DATA, .offset = w.data[i].offset};
+      obj_resolve(&w, (void*)((RuntimeStr*)w.data[i].target->addr)->data, reloc);
+      memset(data + reloc->offset, 0, sizeof(void*));
+    }
+  }
+
+  if (!obj_write_elf(parser.arena, parser.obj_filename, &w.file)) {
+    base_writef_stderr("Couldn't write '%s'.\n", parser.obj_filename);
+    base_exit(1);
+  }
+}
+#endif
+
+// For --perf-map and --jitdump, so that `perf report` can name JIT'd code. The
+// jitdump file itself is opened and closed in luvc_main.c.
+static void perf_register(Str name, void* entry, size_t size) {
+#if OS_LINUX && ENABLE_CODE_GEN
+  if (!parser.perf_map && !parser.jitdump) {
+    return;
+  }
+  const char* cname = cstr_copy(parser.arena, name);
+  if (parser.perf_map) {
+    ir_perf_map_register(cname, entry, size);
+  }
+  if (parser.jitdump) {
+    ir_perf_jitdump_register(cname, entry, size);
+  }
+#else
+  (void)name;
+  (void)entry;
+  (void)size;
+#endif
+}
+
+// Dumps, checks, and (unless --ir-only) compiles the current scope's function.
+// Returns NULL if there's no code.
+static void* finish_function_ir(Str name, size_t* out_size) {
   if (parser.verbose) {
     ir_save(_ir_CTX, -1, stderr);
 #if BUILD_DEBUG
     FILE* f = fopen("tmp.dot", "wb");
-    ir_dump_dot(_ir_CTX, cstr_copy(parser.arena, parser.cur_scope->func_sym->name), f);
+    ir_dump_dot(_ir_CTX, cstr_copy(parser.arena, name), f);
     base_writef_stderr("Wrote tmp.dot\n");
     fclose(f);
 #endif
@@ -883,14 +2557,32 @@ static void leave_function(void) {
   }
 #endif
 
+  void* entry = NULL;
+  *out_size = 0;
 #if ENABLE_CODE_GEN
+  if (parser.stats) {
+    parser.stats->num_ir_insns += ir_insns_count(_ir_CTX);
+  }
   if (!parser.ir_only) {
     size_t size = 0;
-    void* entry = ir_jit_compile(_ir_CTX, /*opt=*/parser.opt_level, &size);
+    TRACE_BEGIN("codegen", name);
+#if ENABLE_CODE_CACHE
+    if (parser.code_cache) {
+      entry = cache_compile(name, &size);
+    } else if (parser.obj_filename) {
+      entry = obj_compile(name, &size);
+    } else if (parser.hot_filename) {
+      entry = hot_compile(name, &size);
+    } else
+#endif
+    {
+      entry = jit_compile(_ir_CTX, /*opt=*/parser.opt_level, &size);
+    }
+    TRACE_END();
     if (entry) {
       if (parser.verbose) {
         base_writef_stderr("=> codegen to %zu bytes at %p for '%s'\n", size, entry,
-                           cstr_copy(parser.arena, parser.cur_scope->func_sym->name));
+                           cstr_copy(parser.arena, name));
 #if BUILD_DEBUG
         // ir_disasm uses capstone, but it makes the compiler binary about ~10x
         // larger, so just save the code in verbose mode and use an external
@@ -901,15 +2593,103 @@ static void leave_function(void) {
         base_writef_stderr("Wrote code.raw\n");
 #endif
       }
-      if (str_eq(parser.cur_scope->func_sym->name, parser.static_str_main)) {
-        parser.main_func_entry = entry;
+      *out_size = size;
+      if (parser.stats) {
+        parser.stats->code_bytes += size;
       }
     } else {
-      base_writef_stderr("compilation failed '%s'\n",
-                         cstr_copy(parser.arena, parser.cur_scope->func_sym->name));
+      base_writef_stderr("compilation failed '%s'\n", cstr_copy(parser.arena, name));
+    }
+  }
+#else
+  (void)name;
+#endif
+  return entry;
+}
+
+// The value of |uv| to capture for a nested function as it's defined, in the
+// parent function (whose upvals are |parent_uvm|).
+static ir_ref capture_value(UpvalMap* parent_uvm, Upval* uv) {
+  switch (uv->scope_result) {
+    case SCOPE_RESULT_LOCAL:
+      return ir_VLOAD(type_to_ir_type(uv->type), uv->ref);
+    case SCOPE_RESULT_PARAMETER:
+      return uv->ref;
+    case SCOPE_RESULT_UPVALUE: {
+      // The upval we're trying to capture is itself an upval in the current
+      // function.
+      int i = find_upval(parent_uvm, uv->name);
+      ASSERT(i >= 0);
+      Upval* parent_uv = &parent_uvm->upvals[i];
+      ASSERT(type_eq(parent_uv->type, uv->type));
+      if (parent_uv->value) {
+        return parent_uv->value;
+      }
+      ASSERT(parser.cur_scope->upval_base);
+      return ir_LOAD(type_to_ir_type(uv->type),
+                     ir_ADD_OFFSET(parser.cur_scope->upval_base, parent_uv->offset));
+    }
+    default:
+      error("internal error, unexpected scope_result in upval capture");
+  }
+}
+
+static void leave_function(void) {
+  Type ret_type = type_func_return_type(parser.cur_scope->func_sym->type);
+  if (parser.cur_scope->made_lists && !type_contains_list(ret_type)) {
+    ir_CALL_1(IR_VOID, ir_CONST_ADDR(list_release_impl), ir_FRAME_ADDR());
+  }
+  if (type_eq(ret_type, type_void)) {
+    ir_RETURN(IR_UNUSED);
+#if ARCH_X64 && !OS_WINDOWS
+  } else if (type_is_aggregate(ret_type)) {
+    ir_ref slot = parser.cur_scope->return_slot->ref;
+    if (parser.cur_scope->ctx.ret_type == IR_ADDR) {  // sret
+      ir_RETURN(slot);
+    } else {
+      ir_RETURN(ir_LOAD(parser.cur_scope->ctx.ret_type, slot));
+    }
+#endif
+  } else {
+    ir_RETURN(ir_VLOAD(type_to_ir_type(ret_type), parser.cur_scope->return_slot->ref));
+  }
+
+  TRACE_END();
+
+  size_t size;
+  void* entry = finish_function_ir(parser.cur_scope->func_sym->name, &size);
+
+#if ENABLE_CODE_GEN
+  if (!parser.ir_only) {
+    if (entry) {
+      if (str_eq(parser.cur_scope->func_sym->name, parser.static_str_main) &&
+          !parser.hot_reloading) {
+        parser.main_func_entry = entry;
+      }
+      ++parser.num_funcs_compiled;
+      if (parser.stats) {
+        ++parser.stats->num_funcs;
+      }
+      perf_register(parser.cur_scope->func_sym->name, entry, size);
+      TierRecord* rec = parser.cur_scope->tier_rec;
+      if (rec && parser.tier_recompiling) {
+        // Installed by tier_recompile() once the new code is executable.
+        rec->tier2_entry = entry;
+      } else if (rec) {
+        entry = tier_emit_stub(rec, entry);
+      } else if (parser.hot_active && !type_func_is_nested(parser.cur_scope->func_sym->type)) {
+        entry = hot_install(parser.cur_scope->func_sym, entry);
+      }
+    } else if (parser.hot_reloading) {
+      error("Compilation failed.");
     }
     parser.cur_scope->func_sym->addr = entry;
+    if (!type_func_is_nested(parser.cur_scope->func_sym->type)) {
+      cache_register_sym(parser.cur_scope->func_sym);
+    }
   }
+#else
+  (void)entry;
 #endif
 
   ir_free(_ir_CTX);
@@ -930,47 +2710,19 @@ static void leave_function(void) {
     Sym* child_func = parser.cur_scope->func_sym;
     parser.cur_scope = &parser.scopes[parser.num_scopes - 2];
     UpvalMap* parent_uvm = &parser.cur_scope->upval_map;
-    (void)parent_uvm;
-
-    ir_ref upval_data = ir_ALLOCA(ir_CONST_U64(inner_uvm->alloc_size));
-    child_func->ref2 = upval_data;
-
-    for (int i = 0; i < inner_uvm->num_upvals; ++i) {
-      Upval* uv = &inner_uvm->upvals[i];
-      switch (uv->scope_result) {
-        case SCOPE_RESULT_GLOBAL:
-        case SCOPE_RESULT_UNDEFINED:
-          error("internal error, unexpected scope_result in upval capture");
-        case SCOPE_RESULT_LOCAL:
-          ir_STORE(ir_ADD_OFFSET(upval_data, uv->offset),
-                   ir_VLOAD(type_to_ir_type(uv->type), uv->ref));
-          break;
-        case SCOPE_RESULT_PARAMETER:
-          ir_STORE(ir_ADD_OFFSET(upval_data, uv->offset), uv->ref);
-          break;
-        case SCOPE_RESULT_UPVALUE: {
-          // This case is that the upval we're trying to capture is itself an
-          // upval in the current function.
-          for (int j = 0; j < parent_uvm->num_upvals; ++j) {
-            Upval* parent_uv = &parent_uvm->upvals[j];
-            if (str_eq(parent_uv->name, uv->name)) {
-              ASSERT(type_eq(parent_uv->type, uv->type));
-              /*
-              base_writef_stderr("want to write %s from %s for %s in %s\n",
-                                 cstr_copy(parser.arena, parent_uv->name),
-                                 cstr_copy(parser.arena, parser.cur_scope->func_sym->name),
-                                 cstr_copy(parser.arena, uv->name),
-                                 cstr_copy(parser.arena, child_func->name));
-                                 */
-              ASSERT(parser.cur_scope->upval_base);
-              ir_STORE(ir_ADD_OFFSET(upval_data, uv->offset),
-                       ir_LOAD(type_to_ir_type(uv->type),
-                               ir_ADD_OFFSET(parser.cur_scope->upval_base, parent_uv->offset)));
-              break;
-            }
-          }
-          break;
-        }
+
+    if (inner_uvm->direct) {
+      ASSERT(inner_uvm->num_upvals == 1);
+      Upval* uv = &inner_uvm->upvals[0];
+      child_func->ref2 = upval_to_up(capture_value(parent_uvm, uv), uv->type);
+    } else if (inner_uvm->num_upvals == 0) {
+      child_func->ref2 = ir_CONST_ADDR(0);
+    } else {
+      ir_ref upval_data = ir_ALLOCA(ir_CONST_U64(inner_uvm->alloc_size));
+      child_func->ref2 = upval_data;
+      for (int i = 0; i < inner_uvm->num_upvals; ++i) {
+        Upval* uv = &inner_uvm->upvals[i];
+        ir_STORE(ir_ADD_OFFSET(upval_data, uv->offset), capture_value(parent_uvm, uv));
       }
     }
   }
@@ -978,42 +2730,60 @@ static void leave_function(void) {
   leave_scope();
 }
 
+static inline TokenRingEntry* token_at(uint32_t index) {
+  TokenRingEntry* entry = &parser.token_ring[index & (TOKEN_RING_SIZE - 1)];
+  if (BRANCH_LIKELY(index == parser.token_ring_end)) {
+    ASSERT(index < parser.num_tokens);
+    entry->kind = token_categorize(parser.token_offsets[index]);
+    entry->paren_level = token_get_continuation_paren_level();
+    ++parser.token_ring_end;
+  } else {
+    ASSERT(index >= parser.token_ring_start && index < parser.token_ring_end &&
+           parser.token_ring_end - index <= TOKEN_RING_SIZE);
+  }
+  return entry;
+}
+
+static inline bool is_newline_kind(TokenKind kind) {
+  return kind == TOK_NEWLINE_BLANK ||
+         (kind >= TOK_NEWLINE_INDENT_0 && kind <= TOK_NEWLINE_INDENT_40);
+}
+
 static void advance(void) {
-again:
   parser.cursor.prev_kind = parser.cursor.cur_kind;
-  if (parser.num_buffered_tokens > 0) {
-    parser.cursor.cur_kind = parser.token_buffer[--parser.num_buffered_tokens];
+  if (parser.num_pending_indents > 0) {
+    --parser.num_pending_indents;
+    parser.cursor.cur_kind = parser.pending_indent_kind;
 #if BUILD_DEBUG
     if (parser.verbose > 1) {
-      base_writef_stderr("token %s (buffered)\n", token_enum_name(parser.cursor.cur_kind));
+      base_writef_stderr("token %s (pending)\n", token_enum_name(parser.cursor.cur_kind));
     }
 #endif
     return;
-  } else {
-    ++parser.cursor.token_index;
-    ASSERT(parser.cursor.token_index < parser.num_tokens);
-    parser.cursor.cur_kind = token_categorize(parser.token_offsets[parser.cursor.token_index]);
   }
 
-  if (parser.cursor.cur_kind == TOK_NL) {
-    goto again;
-  }
+  TokenRingEntry* tok;
+  do {
+    tok = token_at(++parser.cursor.token_index);
+  } while (tok->kind == TOK_NL);
+  parser.cursor.cur_kind = tok->kind;
+  parser.cursor.paren_level = tok->paren_level;
+
   if (parser.cursor.cur_kind == TOK_NEWLINE_BLANK) {
     parser.cursor.cur_kind = TOK_NEWLINE;
   } else if (parser.cursor.cur_kind >= TOK_NEWLINE_INDENT_0 && parser.cursor.cur_kind <= TOK_NEWLINE_INDENT_40) {
     int n = (parser.cursor.cur_kind - TOK_NEWLINE_INDENT_0) * 4;
+    parser.cursor.cur_kind = TOK_NEWLINE;
     if (n > parser.indent_levels[parser.num_indents - 1]) {
-      parser.cursor.cur_kind = TOK_NEWLINE;
       parser.indent_levels[parser.num_indents++] = n;
-      parser.token_buffer[parser.num_buffered_tokens++] = TOK_INDENT;
+      parser.pending_indent_kind = TOK_INDENT;
+      parser.num_pending_indents = 1;
     } else if (n < parser.indent_levels[parser.num_indents - 1]) {
-      parser.cursor.cur_kind = TOK_NEWLINE;
+      parser.pending_indent_kind = TOK_DEDENT;
       while (parser.num_indents > 1 && parser.indent_levels[parser.num_indents - 1] > n) {
-        parser.token_buffer[parser.num_buffered_tokens++] = TOK_DEDENT;
+        ++parser.num_pending_indents;
         --parser.num_indents;
       }
-    } else {
-      parser.cursor.cur_kind = TOK_NEWLINE;
     }
   }
 
@@ -1024,6 +2794,19 @@ again:
 #endif
 }
 
+// Restores a cursor saved earlier (or later, when skipping back over something
+// that's already been parsed). Everything that's still in the ring is reused,
+// otherwise categorization restarts from |to|.
+static void seek_cursor(TokenCursor to) {
+  ASSERT(parser.num_pending_indents == 0);
+  uint32_t next = to.token_index + 1;
+  if (next < parser.token_ring_start || next > parser.token_ring_end ||
+      parser.token_ring_end - next > TOKEN_RING_SIZE) {
+    parser.token_ring_start = parser.token_ring_end = next;
+    token_restore_continuation_paren_level(to.paren_level);
+  }
+  parser.cursor = to;
+}
 static bool match(TokenKind tok_kind) {
   if (parser.cursor.cur_kind != tok_kind) {
     return false;
@@ -1037,18 +2820,21 @@ static bool check(TokenKind tok_kind) {
 }
 
 static bool peek(TokenKind tok_kind) {
-  TokenKind old_cur = parser.cursor.cur_kind;
-  TokenKind old_prev = parser.cursor.prev_kind;
-  advance();
-
-  bool result = parser.cursor.cur_kind == tok_kind;
-
-  // semi-retreat, but keep categorization by buffering it.
-  parser.token_buffer[parser.num_buffered_tokens++] = parser.cursor.cur_kind;
-  parser.cursor.cur_kind = old_cur;
-  parser.cursor.prev_kind = old_prev;
+  if (parser.num_pending_indents > 0) {
+    return parser.pending_indent_kind == tok_kind;
+  }
 
-  return result;
+  // Only looks in the ring (categorizing into it if necessary), the indent
+  // stack is updated when advance() actually gets there.
+  uint32_t index = parser.cursor.token_index;
+  TokenKind kind;
+  do {
+    kind = token_at(++index)->kind;
+  } while (kind == TOK_NL);
+  if (is_newline_kind(kind)) {
+    kind = TOK_NEWLINE;
+  }
+  return kind == tok_kind;
 }
 
 static void consume(TokenKind tok_kind, const char* message) {
@@ -1059,6 +2845,96 @@ static void consume(TokenKind tok_kind, const char* message) {
   error_offset(cur_offset(), message);
 }
 
+// As opposed to any other all-capitals name, e.g. a global, which would be
+// loaded.
+static bool token_is_const_sym(uint32_t index) {
+  StrView view =
+      get_strview_for_offsets(parser.token_offsets[index], parser.token_offsets[index + 1]);
+  while (view.size > 0 && view.data[view.size - 1] == ' ') {
+    --view.size;
+  }
+  Binding* b = binding_visible_from(str_intern_len(view.data, view.size),
+                                    (int)(parser.cur_scope - parser.scopes));
+  return b && b->sym.kind == SYM_CONST;
+}
+
+#define FOLDABLE_SCAN_MAX_TOKENS 64
+
+// Whether the expression at the cursor is only literals and consts with
+// arithmetic and comparisons on them, so that parsing it is sure to fold to a
+// constant without emitting anything. Looks ahead in the ring like peek(), and
+// gives up on anything it doesn't know (or that's long), so false only means
+// that it might not fold.
+static bool scan_is_foldable_expression(void) {
+  if (parser.num_pending_indents > 0) {
+    return false;
+  }
+  uint32_t index = parser.cursor.token_index;
+  TokenKind kind = parser.cursor.cur_kind;
+  bool after_operand = false;
+  int paren_depth = 0;
+  for (int i = 0; i < FOLDABLE_SCAN_MAX_TOKENS; ++i) {
+    switch (kind) {
+      case TOK_IDENT_CONST:
+      case TOK_IDENT_TYPE:  // A one-letter const, see const_statement().
+        if (!token_is_const_sym(index)) {
+          return false;
+        }
+        after_operand = true;
+        break;
+      case TOK_INT_LITERAL:
+      case TOK_FLOAT_LITERAL:
+      case TOK_TRUE:
+      case TOK_FALSE:
+        after_operand = true;
+        break;
+      case TOK_LPAREN:
+        if (after_operand) {
+          return false;  // A call.
+        }
+        ++paren_depth;
+        break;
+      case TOK_RPAREN:
+        if (paren_depth == 0) {
+          return after_operand;
+        }
+        --paren_depth;
+        break;
+      case TOK_PLUS:
+      case TOK_MINUS:
+      case TOK_STAR:
+      case TOK_SLASH:
+      case TOK_PERCENT:
+      case TOK_PIPE:
+      case TOK_CARET:
+      case TOK_LSHIFT:
+      case TOK_RSHIFT:
+      case TOK_EQEQ:
+      case TOK_BANGEQ:
+      case TOK_LT:
+      case TOK_LEQ:
+      case TOK_GT:
+      case TOK_GEQ:
+        after_operand = false;
+        break;
+      case TOK_NEWLINE:
+      case TOK_EOF:
+      case TOK_RSQUARE:
+      case TOK_COMMA:
+        return paren_depth == 0 && after_operand;
+      default:
+        return false;
+    }
+    do {
+      kind = token_at(++index)->kind;
+    } while (kind == TOK_NL);
+    if (is_newline_kind(kind)) {
+      kind = TOK_NEWLINE;
+    }
+  }
+  return false;
+}
+
 // We need some constant propagation. Needed for fixed array sizes, making
 // `const` actually consts, possibly for nicer overflow checking, and something
 // is needed for struct initializers. For struct inits, I was planning on just
@@ -1086,11 +2962,76 @@ static void consume(TokenKind tok_kind, const char* message) {
 // semantics a bit fuzzy on the edges. Since #1 is pretty clear and a strict
 // subset of #2's ability, we'll do that for now, and expand flexibility later
 // if necessary.
-static Operand const_expression(void) {
-  Operand expr = parse_expression(&type_u64);
+//
+// ... and now #2 is there too, for when #1 isn't enough. Unless it's plain
+// enough to be sure to fold, the expression is parsed into a thunk `void
+// $ctfe(Val* out)` that stores the result, and if it didn't fold to a constant
+// after all, the thunk is compiled and called right away.
+// Functions that have already been compiled and globals (which have their
+// initial values at compile time) can be used, but not locals of a function
+// that's in the middle of being parsed. Only basic types for now, aggregates
+// would need something other than Val in Operand.
+static Operand const_expression(Type* expected) {
+  uint32_t expr_offset = cur_offset();
+  // Most are, and this skips setting up IR (and with --opt -1, a jmp over the
+  // thunk in the middle of the function being parsed).
+  if (scan_is_foldable_expression()) {
+    Operand expr = parse_expression(expected);
+    ASSERT(op_is_const(expr));
+    return expr;
+  }
+
+  enter_scope(/*is_module=*/false, /*is_function=*/true, NULL);
+  parser.cur_scope->is_ctfe = true;
+  // Even these are mostly small.
+  begin_function_ir(256, 256);
+  parser.cur_scope->ctx.ret_type = IR_VOID;
+  ir_ref out = ir_PARAM(IR_ADDR, "out", 1);
+
+  Operand expr = parse_expression(expected);
   if (!op_is_const(expr)) {
-    error("Expected constant expression.");
+    if (!type_is_arithmetic(expr.type) && type_kind(expr.type) != TYPE_BOOL) {
+      errorf("Cannot evaluate expression of type %s at compile time.", type_as_str(expr.type));
+    }
+    ir_STORE(out, operand_to_irref_imm(&expr));
+    ir_RETURN(IR_UNUSED);
+    size_t size;
+    void* entry = finish_function_ir(parser.static_str_ctfe, &size);
+
+    Val result = {0};
+#if ENABLE_CODE_GEN
+    if (parser.ir_only) {
+      error("Cannot evaluate constant expression with --ir-only.");
+    }
+    if (!entry) {
+      error("Failed to compile constant expression.");
+    }
+    // Nothing's executable until the end of parse_impl() (or the end of a
+    // --tiered or --watch recompile), so flip everything so far over while the
+    // thunk runs.
+    uint8_t* code_start = parser.code_writable_start;
+    uint8_t* code_end = ALIGN_UP_PTR(parser.code_buffer.pos, base_page_size());
+    ir_mem_protect(code_start, code_end - code_start);
+    ir_mem_flush(code_start, code_end - code_start);
+    bool ran = base_call_guarded((void (*)(void*))entry, &result);
+    ir_mem_unprotect(code_start, code_end - code_start);
+    if (!ran) {
+      error_offset(expr_offset,
+                   "Constant expression crashed when evaluated at compile time (e.g. divided by "
+                   "zero or used a bad pointer).");
+    }
+#else
+    (void)entry;
+    // Nothing runs when syntax checking. Not 0 so that array sizes still make
+    // arrays.
+    result.u64 = 1;
+#endif
+    expr = operand_const(expr.type, result);
   }
+
+  ir_free(_ir_CTX);
+  arena_pop_to(arena_ir, parser.cur_scope->arena_saved_pos);
+  leave_scope();
   return expr;
 }
 
@@ -1335,7 +3276,7 @@ static Type parse_type(void) {
   if (match(TOK_LSQUARE)) {
     size_t count = 0;
     if (!check(TOK_RSQUARE)) {
-      Operand count_op = const_expression();
+      Operand count_op = const_expression(&type_u64);
       cast_operand(&count_op, type_i64);
       count = count_op.val.i64;
       if (count < 0) {
@@ -1369,6 +3310,33 @@ static Type parse_type(void) {
     return t;
   }
 
+  if (check(TOK_IDENT_VAR) && peek(TOK_DOT)) {
+    // Could be `pkg.Type`, otherwise it's an expression so back up.
+    TokenCursor start = parser.cursor;
+    advance();
+    NameBinding* nb = find_name_binding(str_from_previous());
+    if (nb && nb->top && nb->top->sym.kind == SYM_PACKAGE) {
+      Sym* package_sym = &nb->top->sym;
+      if (parser.track_deps) {
+        cache_note_sym(package_sym);
+      }
+      advance();
+      if (match(TOK_IDENT_TYPE)) {
+        Str type_name = str_from_previous();
+        Sym* sym = module_find_export(package_sym->module, type_name);
+        if (!sym || sym->kind != SYM_TYPE) {
+          errorf("Package '%s' has no type '%s'.", cstr_copy(parser.arena, package_sym->name),
+                 cstr_copy(parser.arena, type_name));
+        }
+        if (!check(TOK_LPAREN)) {
+          return sym->type;
+        }
+        // Otherwise it's a compound literal.
+      }
+    }
+    seek_cursor(start);
+  }
+
   if (match(TOK_IDENT_TYPE)) {
     Sym* sym;
     Str type_name = str_from_previous();
@@ -1927,14 +3895,9 @@ static bool is_aggregate_in_int_register_x64win(Type type) {
 // structs aren't supported at the IR level, they need to be handled here
 // specially. This is different per ABI.
 static Operand lower_structs_and_call(Operand* func, uint32_t num_args, ir_ref* arg_values) {
-  // TODO: Other cases, mostly Linux+SysV.
-
   // The complex case below would work without this, but bail to a simple CALL_N
   // if we know the function type doesn't have any aggregates being passed.
-#if (OS_WINDOWS && ARCH_X64) || (OS_MAC && ARCH_ARM64)
-  if ((type_func_flags(func->type) & TFF_HAS_AGGREGATE_ARGS) == 0)
-#endif
-  {
+  if ((type_func_flags(func->type) & TFF_HAS_AGGREGATE_ARGS) == 0) {
     Type ret_type = type_func_return_type(func->type);
     return operand_rvalue_imm(
         ret_type, ir_CALL_N(type_to_ir_type(ret_type), func->ref, num_args, arg_values));
@@ -1972,21 +3935,19 @@ static Operand lower_structs_and_call(Operand* func, uint32_t num_args, ir_ref*
   for (uint32_t i = 0; i < num_args; ++i) {
     Type param = type_func_param(func->type, i);
     if (type_is_aggregate(param)) {
-      ir_ref size = ir_CONST_U64(type_size(param));
+      size_t size = type_size(param);
       if (is_aggregate_in_int_register_x64win(param)) {
         ir_ref tmp_int = ir_VAR(IR_U64, "pack");
-        ir_ref memcpy_addr = ir_CONST_ADDR(memcpy);
-        ir_CALL_3(IR_VOID, memcpy_addr, ir_VADDR(tmp_int), arg_values[i], size);
+        emit_aggregate_copy(ir_VADDR(tmp_int), arg_values[i], size);
         new_arg_values[num_new_args] = ir_VLOAD(IR_U64, tmp_int);
         ++num_new_args;
       } else {
         // Copy the argument by value to a new stack location (it can't be the one
         // already on the stack because the callee might modify it), and then
         // pass a pointer to that.
-        ir_ref copy = ir_ALLOCA(size);
-        ir_ref memcpy_addr = ir_CONST_ADDR(memcpy);
+        ir_ref copy = ir_ALLOCA(ir_CONST_U64(size));
         // TODO: maybe pass Operand so we can check the arg_values is an addr.
-        ir_CALL_3(IR_VOID, memcpy_addr, copy, arg_values[i], size);
+        emit_aggregate_copy(copy, arg_values[i], size);
         new_arg_values[num_new_args] = copy;
         ++num_new_args;
       }
@@ -2000,10 +3961,9 @@ static Operand lower_structs_and_call(Operand* func, uint32_t num_args, ir_ref*
   if (ret_type_packed_into_int) {
     ir_ref tmp_int = ir_VAR(IR_U64, "unpack");
     ir_VSTORE(tmp_int, rv);
-    ir_ref size = ir_CONST_U64(type_size(ret_type));
-    ir_ref unpacked = ir_ALLOCA(size);
-    ir_ref memcpy_addr = ir_CONST_ADDR(memcpy);
-    ir_CALL_3(IR_VOID, memcpy_addr, unpacked, ir_VADDR(tmp_int), size);
+    size_t size = type_size(ret_type);
+    ir_ref unpacked = ir_ALLOCA(ir_CONST_U64(size));
+    emit_aggregate_copy(unpacked, ir_VADDR(tmp_int), size);
     return operand_rvalue_local_addr(ret_type, unpacked);
   } else {
     return operand_rvalue_imm(ret_type, rv);
@@ -2038,9 +3998,260 @@ static Operand lower_structs_and_call(Operand* func, uint32_t num_args, ir_ref*
   }
 
   error("internal error; lower_structs_and_call");
+#elif ARCH_X64
+  // SysV, see sysv_layout().
+  SysvLayout layout;
+  sysv_layout(func->type, &layout);
+  Type ret_type = type_func_return_type(func->type);
+  ir_ref ret_addr = 0;
+  if (type_is_aggregate(ret_type)) {
+    ret_addr = ir_ALLOCA(ir_CONST_U64(ALIGN_UP(type_size(ret_type), 8)));
+  }
+
+  // Aggregates that don't fill their last eightbyte are copied somewhere that
+  // does, so that loading it doesn't go off the end.
+  ir_ref arg_addrs[MAX_FUNC_PARAMS];
+  ASSERT(type_func_num_params(func->type) == num_args);
+  for (uint32_t i = 0; i < num_args; ++i) {
+    Type param = type_func_param(func->type, i);
+    arg_addrs[i] = arg_values[i];
+    if (type_is_aggregate(param) && type_size(param) % 8 != 0) {
+      size_t size = type_size(param);
+      arg_addrs[i] = ir_ALLOCA(ir_CONST_U64(ALIGN_UP(size, 8)));
+      emit_aggregate_copy(arg_addrs[i], arg_values[i], size);
+    }
+  }
+
+  ir_ref operands[MAX_CALL_OPERANDS];
+  for (uint32_t i = 0; i < layout.num_pieces; ++i) {
+    SysvPiece* piece = &layout.pieces[i];
+    if (piece->param == SYSV_PIECE_SRET) {
+      operands[i] = ret_addr;
+    } else if (piece->param == SYSV_PIECE_PAD) {
+      operands[i] = ir_CONST_U64(0);
+    } else if (type_is_aggregate(type_func_param(func->type, piece->param))) {
+      ir_ref addr = arg_addrs[piece->param];
+      operands[i] = ir_LOAD(piece->type, piece->offset ? ir_ADD_OFFSET(addr, piece->offset) : addr);
+    } else {
+      operands[i] = arg_values[piece->param];
+    }
+  }
+
+  ir_ref rv = ir_CALL_N(sysv_return_ir_type(&layout, ret_type), func->ref, layout.num_pieces,
+                        operands);
+  if (!type_is_aggregate(ret_type)) {
+    return operand_rvalue_imm(ret_type, rv);
+  }
+  if (layout.num_ret_eightbytes == 2) {
+    // Has to be right after the CALL, before anything else can use it.
+    SysvClass first = layout.ret_class[0];
+    SysvClass second = layout.ret_class[1];
+    int reg;
+    if (second == SYSV_SSE) {
+      reg = first == SYSV_SSE ? IR_REG_XMM1 : IR_REG_XMM0;
+    } else {
+      reg = first == SYSV_SSE ? IR_REG_RAX : IR_REG_RDX;
+    }
+    ir_ref rest = ir_RLOAD(sysv_ir_type(second), reg);
+    ir_STORE(ir_ADD_OFFSET(ret_addr, 8), rest);
+  }
+  if (layout.num_ret_eightbytes > 0) {
+    ir_STORE(ret_addr, rv);
+  }
+  return operand_rvalue_local_addr(ret_type, ret_addr);
 #endif
 }
 
+// Whether the IDENT_* at token |index| is exactly |name|.
+static bool token_is_name(uint32_t index, Str name) {
+  const char* tok = &parser.file_contents[parser.token_offsets[index]];
+  uint32_t len = str_len(name);
+  char after = tok[len];
+  bool continues = (after >= 'a' && after <= 'z') || (after >= 'A' && after <= 'Z') ||
+                   (after >= '0' && after <= '9') || after == '_';
+  return memcmp(tok, str_raw_ptr(name), len) == 0 && !continues;
+}
+
+// Whether the function body starting at the cursor is just `return
+// <expression>`, with the expression no more than |max_tokens| long and only
+// referring to the parameters by name (other than after a '.', which is a
+// field or memfn). That's what makes it mean the same thing when it's parsed
+// again in some other function by inline_call().
+static bool inline_body_is_eligible(Type functype, Str* param_names, uint32_t max_tokens) {
+  if (!check(TOK_RETURN)) {
+    return false;
+  }
+  Type ret_type = type_func_return_type(functype);
+  if (type_eq(ret_type, type_void) || type_is_aggregate(ret_type) ||
+      (type_func_flags(functype) & TFF_NESTED)) {
+    return false;
+  }
+  uint32_t num_params = type_func_num_params(functype);
+  for (uint32_t i = 0; i < num_params; ++i) {
+    if (type_is_aggregate(type_func_param(functype, i))) {
+      return false;
+    }
+  }
+
+  TokenCursor saved = parser.cursor;
+  int body_indent = parser.indent_levels[parser.num_indents - 1];
+  bool result = false;
+  uint32_t size = 0;
+  TokenKind prev = TOK_RETURN;
+  for (uint32_t i = saved.token_index + 1; size <= max_tokens; ++i) {
+    TokenKind kind = token_at(i)->kind;
+    if (kind == TOK_NL) {
+      continue;
+    }
+    if (kind == TOK_EOF || is_newline_kind(kind)) {
+      // Anything else in the body after it means it's not the only statement.
+      while (kind == TOK_NEWLINE_BLANK) {
+        kind = token_at(++i)->kind;
+      }
+      result = size > 0 && (kind == TOK_EOF ||
+                            (kind >= TOK_NEWLINE_INDENT_0 && kind <= TOK_NEWLINE_INDENT_40 &&
+                             (int)(kind - TOK_NEWLINE_INDENT_0) * 4 < body_indent));
+      break;
+    }
+    if ((kind == TOK_IDENT_VAR || kind == TOK_IDENT_CONST) && prev != TOK_DOT) {
+      uint32_t j = 0;
+      while (j < num_params && !token_is_name(i, param_names[j])) {
+        ++j;
+      }
+      if (j == num_params) {
+        break;
+      }
+    }
+    prev = kind;
+    ++size;
+  }
+  seek_cursor(saved);
+  return result;
+}
+
+// Called at the start of a function body (before parse_block()) to decide
+// whether to inline_record() it afterwards.
+static bool inline_check_body(InlineHint hint,
+                              Type functype,
+                              Str* param_names,
+                              Str name,
+                              uint32_t function_start_offset) {
+  if (hint == INLINE_NEVER || parser.tier_recompiling) {
+    return false;
+  }
+  int max_tokens = INLINE_MAX_TOKENS;
+  uint64_t entries;
+  if (hint == INLINE_ALWAYS) {
+    max_tokens = INLINE_FORCED_MAX_TOKENS;
+  } else if (profile_lookup(function_start_offset, PROF_ENTRY, &entries)) {
+    if (entries == 0) {
+      return false;  // Not worth the code size if it never runs.
+    }
+    if (entries >= PROFILE_HOT_ENTRIES) {
+      max_tokens = INLINE_HOT_MAX_TOKENS;
+    }
+  }
+  bool eligible = inline_body_is_eligible(functype, param_names, max_tokens);
+  if (hint == INLINE_ALWAYS && !eligible) {
+    errorf_offset(function_start_offset,
+                  "Cannot @inline '%s', the body must be only `return <expression>` using only "
+                  "its parameters, which can't be aggregates.",
+                  cstr_copy(parser.arena, name));
+  }
+  return eligible;
+}
+
+static void inline_record(Sym* funcsym,
+                          TokenCursor cursor,
+                          Str* param_names,
+                          uint32_t function_start_offset) {
+#if ENABLE_INLINING
+  if (!funcsym->addr || parser.track_deps || (parser.opt_level < 1 && !parser.tiered)) {
+    return;
+  }
+  uint32_t num_params = type_func_num_params(funcsym->type);
+  InlineBody body = {
+      .addr = funcsym->addr,
+      .cursor = cursor,
+      .param_names = arena_push(parser.arena, (num_params + 1) * sizeof(Str), _Alignof(Str)),
+      .entry_offset = function_start_offset,
+  };
+  memcpy(body.param_names, param_names, num_params * sizeof(Str));
+  DictInsert res =
+      dict_insert(&parser.inline_bodies, &body, inline_body_hash_func,
+                  inline_body_eq_func, sizeof(InlineBody), _Alignof(InlineBody));
+  *(InlineBody*)dict_rawiter_get(&res.iter) = body;
+#else
+  (void)funcsym;
+  (void)cursor;
+  (void)param_names;
+  (void)function_start_offset;
+#endif
+}
+
+#if ENABLE_INLINING
+static InlineBody* inline_body_for_call(Operand* func) {
+  if (parser.opt_level < 1 || parser.track_deps || !parser.cur_scope->is_function ||
+      parser.cur_scope->is_ctfe || parser.inline_depth >= MAX_INLINE_DEPTH ||
+      (func->kind != OPK_REF_RVAL_GLOBAL_ADDR &&
+       func->kind != OPK_REF_RVAL_GLOBAL_ADDR_BOUND_FUNC) ||
+      !IR_IS_CONST_REF(func->ref)) {
+    return NULL;
+  }
+  void* addr = (void*)_ir_CTX->ir_base[func->ref].val.addr;
+  DictRawIter iter = dict_find(&parser.inline_bodies, &addr, inline_body_hash_func,
+                               inline_body_eq_func, sizeof(InlineBody));
+  return (InlineBody*)dict_rawiter_get(&iter);
+}
+
+// Parses the callee's `return` expression again, here, with its parameters
+// bound to the (already evaluated) arguments. Since the expression only refers
+// to the parameters, nothing else that's visible here can change what it
+// means. Parameters are read-only, so they can just be the argument values
+// without any VARs.
+static Operand inline_call(InlineBody* body, Type functype, ir_ref* arg_values) {
+  TokenCursor saved_cursor = parser.cursor;
+  TokenKind saved_pending_indent_kind = parser.pending_indent_kind;
+  int saved_num_pending_indents = parser.num_pending_indents;
+  int saved_indent_levels[COUNTOF(parser.indent_levels)];
+  memcpy(saved_indent_levels, parser.indent_levels, sizeof(parser.indent_levels));
+  int saved_num_indents = parser.num_indents;
+  Binding* saved_last_binding = parser.cur_scope->last_binding;
+  uint64_t saved_arena_pos = arena_pos(parser.var_scope_arena);
+
+  uint32_t num_params = type_func_num_params(functype);
+  for (uint32_t i = 0; i < num_params; ++i) {
+    make_param(body->param_names[i], type_func_param(functype, i), arg_values[i]);
+  }
+
+  profile_emit_count(body->entry_offset, PROF_ENTRY);
+  parser.num_pending_indents = 0;
+  seek_cursor(body->cursor);
+  consume(TOK_RETURN, "internal error: inlined body doesn't start with return.");
+  ++parser.inline_depth;
+  Operand op = parse_expression(NULL);
+  --parser.inline_depth;
+  Type ret_type = type_func_return_type(functype);
+  if (!convert_operand(&op, ret_type)) {
+    error("internal error: inlined return type changed.");
+  }
+  ir_ref result = operand_to_irref_imm(&op);
+
+  unwind_bindings(parser.cur_scope, saved_last_binding);
+  arena_pop_to(parser.var_scope_arena, saved_arena_pos);
+
+  // The expression ended on the NEWLINE after it, which might have queued
+  // indents that belong to the callee.
+  parser.num_pending_indents = 0;
+  seek_cursor(saved_cursor);
+  parser.pending_indent_kind = saved_pending_indent_kind;
+  parser.num_pending_indents = saved_num_pending_indents;
+  memcpy(parser.indent_levels, saved_indent_levels, sizeof(parser.indent_levels));
+  parser.num_indents = saved_num_indents;
+  return operand_rvalue_imm(ret_type, result);
+}
+#endif
+
 static Operand parse_call(Operand left, bool can_assign, Type* expected) {
   if (can_assign && match_assignment()) {
     CHECK(false && "todo; returning address i think");
@@ -2074,35 +4285,33 @@ static Operand parse_call(Operand left, bool can_assign, Type* expected) {
       ++num_args;
       if (!match(TOK_COMMA)) {
         break;
-      }
-    }
-  }
-  if (num_args < type_func_num_params(left.type)) {
-    errorf("Passing only %d argument%s to function, but it expects %d.", num_args,
-           num_args == 1 ? "" : "s", type_func_num_params(left.type));
-  }
-
-  consume(TOK_RPAREN, "Expect ')' after arguments.");
-  return lower_structs_and_call(&left, num_args, arg_values);
-}
-
-static Operand parse_compound_literal(bool can_assign, Type* expected) {
-  Type lit_type;
-  Str type_name = str_from_previous();
-
-  Sym* sym;
-  ScopeResult scope_result = scope_lookup_recursive(type_name, &sym);
-  if (scope_result == SCOPE_RESULT_UNDEFINED) {
-    errorf("Undefined type %s.", cstr_copy(parser.arena, type_name));
-  } else if (scope_result == SCOPE_RESULT_GLOBAL && sym->kind == SYM_TYPE) {
-    lit_type = sym->type;
-    if (type_kind(lit_type) != TYPE_STRUCT) {
-      errorf("Cannot construct compound literal of type %s.", type_as_str(lit_type));
+      }
     }
-  } else {
-    error("TODO: unhandled case in compound literal.");
   }
+  if (num_args < type_func_num_params(left.type)) {
+    errorf("Passing only %d argument%s to function, but it expects %d.", num_args,
+           num_args == 1 ? "" : "s", type_func_num_params(left.type));
+  }
+
+  consume(TOK_RPAREN, "Expect ')' after arguments.");
+#if ENABLE_INLINING
+  InlineBody* inline_body = inline_body_for_call(&left);
+  if (inline_body) {
+    return inline_call(inline_body, left.type, arg_values);
+  }
+#endif
+  Operand result = lower_structs_and_call(&left, num_args, arg_values);
+  if (type_contains_list(type_func_return_type(left.type))) {
+    ir_CALL_1(IR_VOID, ir_CONST_ADDR(list_adopt_impl), ir_FRAME_ADDR());
+    parser.cur_scope->made_lists = true;
+  }
+  return result;
+}
 
+static Operand compound_literal_of_type(Type lit_type) {
+  if (type_kind(lit_type) != TYPE_STRUCT) {
+    errorf("Cannot construct compound literal of type %s.", type_as_str(lit_type));
+  }
   consume(TOK_LPAREN, "Expecting '(' to start compound literal.");
   Str field_names[MAX_STRUCT_FIELDS];
   Operand field_values[MAX_STRUCT_FIELDS];
@@ -2152,6 +4361,26 @@ static Operand parse_compound_literal(bool can_assign, Type* expected) {
   return operand_rvalue_local_addr(lit_type, base_addr);
 }
 
+static Operand parse_compound_literal(bool can_assign, Type* expected) {
+  Type lit_type;
+  Str type_name = str_from_previous();
+
+  Sym* sym;
+  ScopeResult scope_result = scope_lookup_recursive(type_name, &sym);
+  if (scope_result != SCOPE_RESULT_UNDEFINED && sym->kind == SYM_CONST) {
+    // A one-letter const, see const_statement().
+    return parse_variable(can_assign, expected);
+  }
+  if (scope_result == SCOPE_RESULT_UNDEFINED) {
+    errorf("Undefined type %s.", cstr_copy(parser.arena, type_name));
+  } else if (scope_result == SCOPE_RESULT_GLOBAL && sym->kind == SYM_TYPE) {
+    lit_type = sym->type;
+  } else {
+    error("TODO: unhandled case in compound literal.");
+  }
+  return compound_literal_of_type(lit_type);
+}
+
 static Operand parse_dict_literal(bool can_assign, Type* expected) {
   ASSERT(false && "not implemented");
   return operand_null;
@@ -2166,17 +4395,45 @@ static Str memfn_name_from_type(Type type, Str func_name) {
   return memfn_name_from_type_name(type_decl_name(type), func_name);
 }
 
+// The mangled name is only "Type:func", so check that the self parameter is
+// really this type, and not another one with the same name from a different
+// module.
+static bool memfn_is_on_type(Sym* sym, Type type) {
+  return sym->kind == SYM_FUNC && type_func_num_params(sym->type) >= 1 &&
+         type_eq(type_func_param(sym->type, 0), type_ptr(type));
+}
+
 static Sym* lookup_memfn(Type type, Str func_name) {
   Str memfn_name = memfn_name_from_type(type, func_name);
   Sym* sym;
   ScopeResult scope_result = scope_lookup_recursive(memfn_name, &sym);
-  if (scope_result == SCOPE_RESULT_UNDEFINED) {
-    return NULL;
-  } else if (scope_result == SCOPE_RESULT_GLOBAL && sym->kind == SYM_FUNC) {
+  if (scope_result == SCOPE_RESULT_GLOBAL && memfn_is_on_type(sym, type)) {
     return sym;
-  } else {
+  } else if (scope_result != SCOPE_RESULT_UNDEFINED && scope_result != SCOPE_RESULT_GLOBAL) {
     error("internal error: lookup_memfn");
   }
+
+  // The type might have come from an import, in which case its memfns are
+  // only in that module's exports.
+  Sym* found = NULL;
+  Module* found_module = NULL;
+  for (int i = 0; i < parser.num_modules; ++i) {
+    sym = module_find_export(parser.modules[i], memfn_name);
+    if (!sym || !memfn_is_on_type(sym, type)) {
+      continue;
+    }
+    if (found) {
+      errorf("Member function %s of %s is defined by both %s and %s.",
+             cstr_copy(parser.arena, func_name), type_as_str(type), found_module->filename,
+             parser.modules[i]->filename);
+    }
+    found = sym;
+    found_module = parser.modules[i];
+  }
+  if (found && parser.track_deps) {
+    cache_note_sym(found);
+  }
+  return found;
 }
 
 static Operand parse_dot(Operand left, bool can_assign, Type* expected) {
@@ -2185,8 +4442,10 @@ static Operand parse_dot(Operand left, bool can_assign, Type* expected) {
   uint32_t name_offset = prev_offset();
 
   if (can_assign && match_assignment()) {
+    bool through_ptr = false;
     while (type_kind(left.type) == TYPE_PTR) {
       left = operand_lvalue_local(type_ptr_subtype(left.type), ir_LOAD(IR_ADDR, left.ref));
+      through_ptr = true;
     }
 
     if (type_kind(left.type) == TYPE_STRUCT) {
@@ -2194,6 +4453,9 @@ static Operand parse_dot(Operand left, bool can_assign, Type* expected) {
       Type field_type;
       if (type_struct_find_field_by_name(left.type, name, &field_type, &field_offset)) {
         Operand rhs_value = parse_expression(expected);
+        if (through_ptr) {
+          list_note_escape(field_type);
+        }
         ir_STORE(ir_ADD_OFFSET(operand_to_irref_imm(&left), field_offset),
                               operand_to_irref_imm(&rhs_value));
         return operand_null;
@@ -2299,10 +4561,9 @@ static Operand parse_len(bool can_assign, Type* expected) {
 }
 
 static bool scan_to_determine_if_comprehension(TokenCursor* original, TokenCursor* at_for) {
-  ASSERT(parser.num_buffered_tokens == 0);
+  ASSERT(parser.num_pending_indents == 0);
 
   *original = parser.cursor;
-  original->paren_level = token_get_continuation_paren_level();
 
   // We start the scan after the starting [.
   int square_bracket_count = 1;
@@ -2312,8 +4573,7 @@ static bool scan_to_determine_if_comprehension(TokenCursor* original, TokenCurso
     } else if (parser.cursor.cur_kind == TOK_RSQUARE) {
       --square_bracket_count;
       if (square_bracket_count == 0) {
-        parser.cursor = *original;
-        token_restore_continuation_paren_level(original->paren_level);
+        seek_cursor(*original);
         return false;
       }
     } else if (parser.cursor.cur_kind == TOK_FOR) {
@@ -2323,112 +4583,265 @@ static bool scan_to_determine_if_comprehension(TokenCursor* original, TokenCurso
       error("Expecting ']' to end list literal or comprehension.");
     }
 
-    parser.cursor.prev_kind = parser.cursor.cur_kind;
-    ++parser.cursor.token_index;
-    ASSERT(parser.cursor.token_index < parser.num_tokens);
-    parser.cursor.cur_kind = token_categorize(parser.token_offsets[parser.cursor.token_index]);
-    ASSERT(parser.cursor.cur_kind != TOK_NEWLINE_BLANK);
-    ASSERT(parser.cursor.cur_kind < TOK_NEWLINE_INDENT_0 ||
-           parser.cursor.cur_kind > TOK_NEWLINE_INDENT_40);
+    // Newlines are all TOK_NL inside the [], so this can't touch the indent
+    // stack. If there's an unbalanced ) that makes it otherwise, the NEWLINE
+    // will be an error above anyway.
+    advance();
   }
 }
 
 typedef enum IterationKind {
   ITK_UNKNOWN = 0,
   ITK_ARRAY,
+  ITK_RANGE,
 } IterationKind;
 
+// Both kinds count |index| up from 0 to |count|, so that the number of
+// iterations is known before the loop starts.
 typedef struct IterationData {
   IterationKind kind;
   Sym* itsym;
   ir_ref loop;
   ir_ref cond;
+  ir_ref index;
+  ir_ref count;  // U64.
   union {
-    ir_ref index;
-  } ARRAY;
+    struct {
+      ir_ref start;
+      ir_ref step;
+    } RANGE;
+  };
 } IterationData;
 
-static IterationData iteration_prolog(Str it, Operand* over) {
+// Everything that has to be before the loop.
+static IterationData iteration_setup(Str it, Operand* over) {
+  IterationData itd = {0};
   Type it_type;
   if (type_kind(over->type) == TYPE_ARRAY) {
+    itd.kind = ITK_ARRAY;
     it_type = type_array_subtype(over->type);
+    itd.count = ir_CONST_U64(type_array_count(over->type));
+  } else if (type_eq(over->type, type_range)) {
+    ASSERT(op_is_local_addr(*over));
+    itd.kind = ITK_RANGE;
+    it_type = type_i64;
+    itd.RANGE.start = ir_LOAD_I64(over->ref);
+    ir_ref stop = ir_LOAD_I64(ir_ADD_OFFSET(over->ref, sizeof(int64_t)));
+    itd.RANGE.step = ir_LOAD_I64(ir_ADD_OFFSET(over->ref, 2 * sizeof(int64_t)));
+    // (stop - start + step - sign(step)) / step, or 0 if that's negative. The
+    // step can't be 0, see parse_range_args().
+    ir_ref sign = ir_OR_I64(ir_SAR_I64(itd.RANGE.step, ir_CONST_I64(63)), ir_CONST_I64(1));
+    ir_ref n = ir_DIV_I64(ir_ADD_I64(ir_SUB_I64(stop, itd.RANGE.start),
+                                     ir_SUB_I64(itd.RANGE.step, sign)),
+                          itd.RANGE.step);
+    itd.count = ir_BITCAST(IR_U64, ir_COND(IR_I64, ir_LT(n, ir_CONST_I64(0)), ir_CONST_I64(0), n));
   } else {
     errorf("Can't iterate over type %s.", type_as_str(over->type));
   }
 
-  IterationData itd = {.kind = ITK_ARRAY };
   itd.itsym = make_local_and_alloc(SYM_VAR, it, it_type, NULL);
 
-  itd.ARRAY.index = ir_VAR(IR_U64, "index");
-  ir_VSTORE(itd.ARRAY.index, ir_CONST_U64(0));
+  itd.index = ir_VAR(IR_U64, "index");
+  ir_VSTORE(itd.index, ir_CONST_U64(0));
+  return itd;
+}
 
-  itd.loop = ir_LOOP_BEGIN(ir_END());
+static void iteration_prolog(IterationData* itd, Operand* over) {
+  itd->loop = ir_LOOP_BEGIN(ir_END());
 
-  ir_ref cur = ir_VLOAD_U64(itd.ARRAY.index);
-  itd.cond = ir_IF(ir_LT(cur, ir_CONST_U64(type_array_count(over->type))));
-  ir_IF_TRUE(itd.cond);
+  ir_ref cur = ir_VLOAD_U64(itd->index);
+  itd->cond = ir_IF(ir_LT(cur, itd->count));
+  ir_IF_TRUE(itd->cond);
 
-  ir_ref arr_load_addr = ir_ADD_A(
-      over->ref, ir_MUL(IR_U64, ir_CONST_U64(type_size(it_type)), ir_VLOAD_U64(itd.ARRAY.index)));
-  ir_VSTORE(itd.itsym->ref, ir_LOAD(type_to_ir_type(it_type), arr_load_addr));
+  if (itd->kind == ITK_ARRAY) {
+    Type it_type = itd->itsym->type;
+    ir_ref arr_load_addr =
+        ir_ADD_A(over->ref, ir_MUL(IR_U64, ir_CONST_U64(type_size(it_type)), cur));
+    ir_VSTORE(itd->itsym->ref, ir_LOAD(type_to_ir_type(it_type), arr_load_addr));
+  } else {
+    ir_ref offset = ir_MUL(IR_I64, ir_BITCAST(IR_I64, cur), itd->RANGE.step);
+    ir_VSTORE(itd->itsym->ref, ir_ADD_I64(itd->RANGE.start, offset));
+  }
+}
 
-  return itd;
+static void iteration_epilog(IterationData* itd) {
+  ir_VSTORE(itd->index, ir_ADD_U64(ir_VLOAD_U64(itd->index), ir_CONST_U64(1)));
+  tier_emit_count();
+  ir_MERGE_SET_OP(itd->loop, 2, ir_LOOP_END());
+  ir_IF_FALSE(itd->cond);
 }
 
-static void iteration_epilog(IterationData itd) {
-  if (itd.kind == ITK_ARRAY) {
-    ir_VSTORE(itd.ARRAY.index, ir_ADD_U64(ir_VLOAD_U64(itd.ARRAY.index), ir_CONST_U64(1)));
-    ir_MERGE_SET_OP(itd.loop, 2, ir_LOOP_END());
-    ir_IF_FALSE(itd.cond);
-  } else {
-    error("Unhandled iteration epilog.");
+// Skips over the expression of an 'if' clause, which is parsed later inside
+// the loop.
+static void skip_comprehension_clause(void) {
+  int square_bracket_count = 0;
+  for (;;) {
+    if (parser.cursor.cur_kind == TOK_LSQUARE) {
+      ++square_bracket_count;
+    } else if (parser.cursor.cur_kind == TOK_RSQUARE) {
+      if (square_bracket_count-- == 0) {
+        return;
+      }
+    } else if (parser.cursor.cur_kind == TOK_FOR && square_bracket_count == 0) {
+      error("The 'if' of a list comprehension has to come after all of its 'for's.");
+    } else if (parser.cursor.cur_kind == TOK_EOF) {
+      error("Expecting ']' to end list comprehension.");
+    }
+    advance();
   }
 }
 
+// Every `for` of a comprehension is set up before any of the loops start, so
+// that the size of the output is known, which means each one's iterable is
+// evaluated once, and can't use the iterators of the ones before it.
 static Operand parse_list_comprehension(TokenCursor original, TokenCursor at_for, Type* expected) {
-  parser.cursor = at_for;
-  consume(TOK_FOR, "Expect 'for' to start list comprehension.");
-  Str it = parse_name("Expect iterator name of list comprehension.");
-  // TODO: other forms for enumerate
-  consume(TOK_IN, "Expect 'in'.");
-  Operand over = parse_expression(NULL);
-  if (check(TOK_FOR)) {
-    error("todo; multiple for in list compr");
-  }
-  if (check(TOK_IF)) {
-    error("todo; conditional in list compr");
+  seek_cursor(at_for);
+  Str its[MAX_COMPREHENSION_FORS];
+  Operand overs[MAX_COMPREHENSION_FORS];
+  int num_fors = 0;
+  while (match(TOK_FOR)) {
+    if (num_fors == MAX_COMPREHENSION_FORS) {
+      errorf("Too many 'for's in list comprehension, the limit is %d.", MAX_COMPREHENSION_FORS);
+    }
+    its[num_fors] = parse_name("Expect iterator name of list comprehension.");
+    // TODO: other forms for enumerate
+    consume(TOK_IN, "Expect 'in'.");
+    overs[num_fors] = parse_expression(NULL);
+    ++num_fors;
+  }
+  bool has_filter = false;
+  TokenCursor at_filter;
+  if (match(TOK_IF)) {
+    has_filter = true;
+    at_filter = parser.cursor;
+    skip_comprehension_clause();
   }
   TokenCursor after_clauses = parser.cursor;
 
-  // In general, we have to assume a slice output here because even if iterating
-  // over an array, it could be filtered, so we can't know the number of
-  // outputs. So this only creates an array if |expected| is provided
-  // explicitly.
-  // TODO: implement this once there's slices!
+  // The output is allocated once, before the loop, at the exact size (or with
+  // a filter, at the size it'd be if nothing were filtered out, and then the
+  // length is however many were kept). So the element type has to be known
+  // before the element expression is parsed, which means from |expected|.
+  // TODO: slices.
+  if (!expected || (type_kind(*expected) != TYPE_LIST && type_kind(*expected) != TYPE_ARRAY)) {
+    error("Cannot deduce type of list comprehension with no explicit type on left-hand side.");
+  }
+  bool to_array = type_kind(*expected) == TYPE_ARRAY;
+  Type elem_type = to_array ? type_array_subtype(*expected) : type_list_subtype(*expected);
+  size_t elem_size = type_size(elem_type);
 
   // TODO: enter a full function scope here? or some third non-module,
   // non-function type of scope?
   // enter_scope(false, false, NULL);
 
-  IterationData itd = iteration_prolog(it, &over);
+  IterationData itds[MAX_COMPREHENSION_FORS];
+  for (int i = 0; i < num_fors; ++i) {
+    itds[i] = iteration_setup(its[i], &overs[i]);
+  }
+
+  ir_ref data;
+  ir_ref list = IR_UNUSED;
+  if (to_array) {
+    if (has_filter) {
+      error("Cannot filter a list comprehension into an array.");
+    }
+    uint64_t count = 1;
+    for (int i = 0; i < num_fors; ++i) {
+      if (itds[i].kind != ITK_ARRAY) {
+        count = 0;
+        break;
+      }
+      count *= type_array_count(overs[i].type);
+    }
+    if (count != type_array_count(*expected)) {
+      errorf("List comprehension doesn't produce exactly the elements of %s.",
+             type_as_str(*expected));
+    }
+    // Its size is known, so it goes in the frame like any other array.
+    data = ir_ALLOCA(ir_CONST_U64(ALIGN_UP(type_size(*expected), 8)));
+  } else {
+    ir_ref count = itds[0].count;
+    for (int i = 1; i < num_fors; ++i) {
+      count = ir_CALL_2(IR_U64, ir_CONST_ADDR(list_count_mul_impl), count, itds[i].count);
+    }
+    // The list header goes in the same allocation, right before the data.
+    size_t header_size = type_size(*expected);
+    list = ir_CALL_4(IR_ADDR, ir_CONST_ADDR(list_alloc_impl), ir_CONST_U64(header_size), count,
+                     ir_CONST_U64(elem_size), ir_FRAME_ADDR());
+    parser.cur_scope->made_lists = true;
+    data = ir_ADD_OFFSET(list, header_size);
+    ir_STORE(list, data);
+  }
+
+  ir_ref out_index = itds[0].index;
+  if (has_filter || num_fors > 1) {
+    out_index = ir_VAR(IR_U64, "out_index");
+    ir_VSTORE(out_index, ir_CONST_U64(0));
+  }
+
+  for (int i = 0; i < num_fors; ++i) {
+    if (i > 0) {
+      // Starting over for each iteration of the one outside it.
+      ir_VSTORE(itds[i].index, ir_CONST_U64(0));
+    }
+    iteration_prolog(&itds[i], &overs[i]);
+  }
+
+  ir_ref filter = IR_UNUSED;
+  if (has_filter) {
+    seek_cursor(at_filter);
+    Operand cond = parse_expression(NULL);
+    if (!convert_operand(&cond, type_bool)) {
+      errorf("Cannot use type %s as a list comprehension filter.", type_as_str(cond.type));
+    }
+    filter = ir_IF(operand_to_irref_imm(&cond));
+    ir_IF_TRUE(filter);
+  }
 
-  parser.cursor = original;
+  seek_cursor(original);
+
+  Operand elem = parse_expression(&elem_type);
+  if (!convert_operand(&elem, elem_type)) {
+    errorf("Cannot convert list comprehension element of type %s to %s.",
+           type_as_str(elem.type), type_as_str(elem_type));
+  }
+  ir_ref cur = ir_VLOAD_U64(out_index);
+  ir_ref addr = ir_ADD_A(data, ir_MUL_U64(cur, ir_CONST_U64(elem_size)));
+  if (type_is_aggregate(elem_type)) {
+    emit_aggregate_copy(addr, operand_to_irref_imm(&elem), elem_size);
+  } else {
+    ir_STORE(addr, operand_to_irref_imm(&elem));
+  }
 
-  Operand elem = parse_expression(NULL);
-  (void)elem;
+  if (out_index != itds[0].index) {
+    ir_VSTORE(out_index, ir_ADD_U64(cur, ir_CONST_U64(1)));
+  }
+  if (has_filter) {
+    ir_MERGE_WITH_EMPTY_FALSE(filter);
+  }
 
-  iteration_epilog(itd);
+  for (int i = num_fors - 1; i >= 0; --i) {
+    iteration_epilog(&itds[i]);
+  }
 
   // leave_scope();
 
-  parser.cursor = after_clauses;
+  seek_cursor(after_clauses);
 
-  return operand_null;
+  if (to_array) {
+    return operand_rvalue_imm(*expected, data);
+  }
+  ir_STORE(ir_ADD_OFFSET(list, sizeof(void*)), ir_VLOAD_U64(out_index));
+  return operand_rvalue_local_addr(*expected, list);
 }
 
 static Operand parse_list_literal(Type* expected) {
+  // An inlined call in an element can add bindings, so the dicts might grow
+  // while elems is live.
+  Arena* conflicts[] = {parser.name_bindings.arena, parser.inline_bodies.arena};
+  TempArena scratch = scratch_begin(conflicts, COUNTOFI(conflicts));
   OpVec elems;
-  opv_init(&elems, parser.arena);
+  opv_init(&elems, scratch.arena);
 
   for (;;) {
     if (check(TOK_RSQUARE)) {
@@ -2470,7 +4883,9 @@ static Operand parse_list_literal(Type* expected) {
       ir_STORE(ir_ADD_OFFSET(arr_base, type_size(first_item.type) * i),
                operand_to_irref_imm(&next_item));
     }
-    return operand_rvalue_imm(type_array(first_item.type, elems.size), arr_base);
+    Type type = type_array(first_item.type, elems.size);
+    scratch_end(scratch);
+    return operand_rvalue_imm(type, arr_base);
   }
 }
 
@@ -2639,7 +5054,23 @@ static Operand parse_or(Operand left, bool can_assign, Type* expected) {
   return operand_rvalue_imm(type_bool, result);
 }
 
-static Operand parse_range_literal(bool can_assign, Type* expected) {
+// The same error as a constant zero step gets, but when the range is made.
+static void emit_range_step_check(uint32_t offset, ir_ref step) {
+  uint32_t loc_line;
+  uint32_t loc_column;
+  StrView line;
+  get_location_and_line_slow(offset, &loc_line, &loc_column, &line);
+
+  ir_ref is_zero = ir_IF(ir_EQ(step, ir_CONST_I64(0)));
+  ir_IF_TRUE_cold(is_zero);
+  ir_CALL_1(IR_VOID, ir_CONST_ADDR(range_step_zero_fail_impl), ir_CONST_I32(loc_line));
+  ir_UNREACHABLE();
+  ir_IF_FALSE(is_zero);
+}
+
+// Fills out start, stop, and step, all as i64, with the defaults filled in
+// as constants, so that for_statement() can see them before they go in memory.
+static void parse_range_args(Operand* start, Operand* stop, Operand* step) {
   consume(TOK_LPAREN, "Expect '(' after range.");
   Operand first = parse_precedence(PREC_OR, &type_i64);
   if (!convert_operand(&first, type_i64)) {
@@ -2654,33 +5085,47 @@ static Operand parse_range_literal(bool can_assign, Type* expected) {
       errorf("Cannot convert type %s to i64.", type_as_str(second.type));
     }
     if (match(TOK_COMMA)) {
+      uint32_t step_offset = cur_offset();
       third = parse_precedence(PREC_OR, &type_i64);
       if (!convert_operand(&third, type_i64)) {
         errorf("Cannot convert type %s to i64.", type_as_str(third.type));
       }
+      if (op_is_const(third)) {
+        if (third.val.i64 == 0) {
+          error_offset(step_offset, "range() step cannot be zero.");
+        }
+      } else {
+        third = operand_rvalue_imm(type_i64, operand_to_irref_imm(&third));
+        emit_range_step_check(step_offset, third.ref);
+      }
     }
   }
   consume(TOK_RPAREN, "Expect ')' after range.");
 
-  ir_ref range = ir_ALLOCA(ir_CONST_U64(sizeof(RuntimeRange)));
-  ir_ref astart = range;
-  ir_ref astop = ir_ADD_A(range, ir_CONST_ADDR(sizeof(int64_t)));
-  ir_ref astep = ir_ADD_A(range, ir_CONST_ADDR(2 * sizeof(int64_t)));
   if (type_is_none(second.type)) {
     // range(0, first, 1)
-    ir_STORE(astart, ir_CONST_I64(0));
-    ir_STORE(astop, operand_to_irref_imm(&first));
-    ir_STORE(astep, ir_CONST_I64(1));
+    *start = operand_const(type_i64, (Val){.i64 = 0});
+    *stop = first;
+    *step = operand_const(type_i64, (Val){.i64 = 1});
   } else {
     // range(first, second, third || 1)
-    ir_STORE(astart, operand_to_irref_imm(&first));
-    ir_STORE(astop, operand_to_irref_imm(&second));
-    if (type_is_none(third.type)) {
-      ir_STORE(astep, ir_CONST_I64(1));
-    } else {
-      ir_STORE(astep, operand_to_irref_imm(&third));
-    }
+    *start = first;
+    *stop = second;
+    *step = type_is_none(third.type) ? operand_const(type_i64, (Val){.i64 = 1}) : third;
   }
+}
+
+static Operand parse_range_literal(bool can_assign, Type* expected) {
+  Operand start, stop, step;
+  parse_range_args(&start, &stop, &step);
+
+  ir_ref range = ir_ALLOCA(ir_CONST_U64(sizeof(RuntimeRange)));
+  ir_ref astart = range;
+  ir_ref astop = ir_ADD_A(range, ir_CONST_ADDR(sizeof(int64_t)));
+  ir_ref astep = ir_ADD_A(range, ir_CONST_ADDR(2 * sizeof(int64_t)));
+  ir_STORE(astart, operand_to_irref_imm(&start));
+  ir_STORE(astop, operand_to_irref_imm(&stop));
+  ir_STORE(astep, operand_to_irref_imm(&step));
   return operand_rvalue_local_addr(type_range, range);
 }
 
@@ -2690,15 +5135,43 @@ static Operand parse_sizeof(bool can_assign, Type* expected) {
 }
 
 static ir_ref emit_string_obj(StrView str) {
-  // TODO: I think IR doesn't do much with data? So the str bytes can go into
-  // the intern table, and then the Str object probably needs a data segment
-  // that lives with the code segment that we shove all these into.
-  RuntimeStr* p = arena_push(parser.arena, sizeof(RuntimeStr) + str.size + 1, _Alignof(RuntimeStr));
-  uint8_t* strp = (uint8_t*)(((RuntimeStr*)p) + 1);
-  p->data = strp;
-  memcpy(strp, str.data, str.size);
-  p->length = str.size;
-  return ir_CONST_ADDR(p);
+  if (parser.track_targets) {
+    return ir_CONST_ADDR(cache_string_obj(str));
+  }
+
+  if (str.size == 0) {
+    if (!parser.empty_string_obj) {
+      parser.empty_string_obj = arena_push(parser.arena, sizeof(RuntimeStr), _Alignof(RuntimeStr));
+      parser.empty_string_obj->data = (const uint8_t*)"";
+      parser.empty_string_obj->length = 0;
+    } else {
+      parser.string_bytes_saved += sizeof(RuntimeStr) + 1;
+    }
+    return ir_CONST_ADDR(parser.empty_string_obj);
+  }
+
+  StringObj key = {.contents = str_intern_len(str.data, str.size)};
+  DictInsert res = dict_insert(&parser.string_objs, &key, name_binding_hash_func,
+                               name_binding_eq_func, sizeof(StringObj), _Alignof(StringObj));
+  StringObj* so = (StringObj*)dict_rawiter_get(&res.iter);
+  if (!res.inserted) {
+    parser.string_bytes_saved += sizeof(RuntimeStr) + str.size + 1;
+    return ir_CONST_ADDR(so->obj);
+  }
+
+  if (str.size > 8) {
+    so->obj = arena_push(parser.arena, sizeof(RuntimeStr), _Alignof(RuntimeStr));
+    so->obj->data = (const uint8_t*)str_raw_ptr(so->contents);
+    parser.string_bytes_saved += str.size + 1;
+  } else {
+    // Short ones are stored in the Str itself, so there's nothing to point at.
+    so->obj = arena_push(parser.arena, sizeof(RuntimeStr) + str.size + 1, _Alignof(RuntimeStr));
+    uint8_t* strp = (uint8_t*)(so->obj + 1);
+    memcpy(strp, str.data, str.size);
+    so->obj->data = strp;
+  }
+  so->obj->length = str.size;
+  return ir_CONST_ADDR(so->obj);
 }
 
 static Operand parse_string(bool can_assign, Type* expected) {
@@ -2722,6 +5195,41 @@ static Operand parse_string_interpolate(bool can_assign, Type* expected) {
   return operand_null;
 }
 
+// For --bounds-check, whether a subscript can skip the check: a constant, or
+// the iterator of an enclosing range() loop with constant bounds.
+static bool subscript_known_in_bounds(Operand* subscript, Sym* sym, uint64_t length) {
+  if (op_is_const(*subscript)) {
+    return subscript->val.u64 < length;
+  }
+  if (!sym) {
+    return false;
+  }
+  for (int i = parser.num_bounded_iters - 1; i >= 0; --i) {
+    BoundedIter* bi = &parser.bounded_iters[i];
+    if (bi->sym == sym) {
+      return bi->min >= 0 && (uint64_t)bi->max < length;
+    }
+  }
+  return false;
+}
+
+// The failing side is cold so that it's moved out of the way, and the
+// in-bounds path just falls through the compare.
+static void emit_bounds_check(uint32_t offset, ir_ref index, ir_ref length) {
+  // TODO: This is a scan from the start of the file for every check.
+  uint32_t loc_line;
+  uint32_t loc_column;
+  StrView line;
+  get_location_and_line_slow(offset, &loc_line, &loc_column, &line);
+
+  ir_ref in_bounds = ir_IF(ir_ULT(index, length));
+  ir_IF_FALSE_cold(in_bounds);
+  ir_CALL_3(IR_VOID, ir_CONST_ADDR(bounds_check_fail_impl), index, length,
+            ir_CONST_I32(loc_line));
+  ir_UNREACHABLE();
+  ir_IF_TRUE(in_bounds);
+}
+
 static Operand parse_subscript(Operand left, bool can_assign, Type* expected) {
   ir_ref target_addr;
   Type subtype;
@@ -2735,7 +5243,18 @@ static Operand parse_subscript(Operand left, bool can_assign, Type* expected) {
         error("TODO: [:x]");
     }
   } else {
+    uint32_t subscript_offset = cur_offset();
+    TokenCursor subscript_start = parser.cursor;
     Operand subscript = parse_expression(NULL);
+    // Just a name, which might be a range() loop's iterator.
+    Sym* subscript_sym = NULL;
+    if (subscript_start.cur_kind == TOK_IDENT_VAR &&
+        parser.cursor.token_index == subscript_start.token_index + 1) {
+      NameBinding* nb = find_name_binding(str_from_previous());
+      if (nb && nb->top) {
+        subscript_sym = &nb->top->sym;
+      }
+    }
     if (match(TOK_COLON)) {
       if (check(TOK_RSQUARE)) {  // [x:]
         // slice(left, subscript, NULL)
@@ -2755,9 +5274,18 @@ static Operand parse_subscript(Operand left, bool can_assign, Type* expected) {
           if (!type_is_integer(subscript.type)) {
             errorf("Cannot subscript using type %s.", type_as_str(subscript.type));
           }
+          // A negative index is then huge, so one unsigned compare is enough
+          // for --bounds-check.
+          cast_operand(&subscript, type_u64);
           if (left_type_kind == TYPE_ARRAY) {
             ASSERT(op_is_local_addr(left));
             subtype = type_array_subtype(left.type);
+            uint64_t count = type_array_count(left.type);
+            if (parser.bounds_check &&
+                !subscript_known_in_bounds(&subscript, subscript_sym, count)) {
+              emit_bounds_check(subscript_offset, operand_to_irref_imm(&subscript),
+                                ir_CONST_U64(count));
+            }
             target_addr = ir_ADD_A(left.ref, ir_MUL_U64(ir_CONST_U64(type_size(subtype)),
                                                         operand_to_irref_imm(&subscript)));
           } else if (left_type_kind == TYPE_PTR) {
@@ -2765,6 +5293,18 @@ static Operand parse_subscript(Operand left, bool can_assign, Type* expected) {
             target_addr = ir_ADD_A(
                 op_is_local_addr(left) ? ir_VLOAD(IR_ADDR, left.ref) : left.ref,
                 ir_MUL_U64(ir_CONST_U64(type_size(subtype)), operand_to_irref_imm(&subscript)));
+          } else if (left_type_kind == TYPE_LIST) {
+            ASSERT(op_is_local_addr(left));
+            if (parser.bounds_check) {
+              emit_bounds_check(subscript_offset, operand_to_irref_imm(&subscript),
+                                ir_LOAD_U64(ir_ADD_OFFSET(left.ref, sizeof(void*))));
+            }
+            subtype = type_list_subtype(left.type);
+            // COPY so that --opt 0 doesn't fuse the LOAD into the ADD, which
+            // clobbers the other operand.
+            target_addr = ir_ADD_A(
+                ir_COPY_A(ir_LOAD(IR_ADDR, left.ref)),
+                ir_MUL_U64(ir_CONST_U64(type_size(subtype)), operand_to_irref_imm(&subscript)));
           } else {
             error("TODO: subscript impl");
           }
@@ -2784,6 +5324,9 @@ static Operand parse_subscript(Operand left, bool can_assign, Type* expected) {
     if (!convert_operand(&rhs, subtype)) {
       errorf("Cannot store type %s into %s.", type_as_str(rhs.type), type_as_str(left.type));
     }
+    if (type_kind(left.type) != TYPE_ARRAY) {
+      list_note_escape(subtype);
+    }
     ir_STORE(target_addr, operand_to_irref_imm(&rhs));
     return operand_null;
   } else {
@@ -2859,92 +5402,79 @@ static Operand parse_unary(bool can_assign, Type* expected) {
   }
 }
 
-static Sym* find_in_scope(Scope* scope, Str name) {
-  if (BRANCH_UNLIKELY(scope->is_full_dict)) {
-    DictRawIter iter =
-        dict_find(&scope->sym_dict, &name, namesym_hash_func, namesym_eq_func, sizeof(NameSymPair));
-    NameSymPair* nsp = (NameSymPair*)dict_rawiter_get(&iter);
-    if (!nsp) {
-      return NULL;
-    }
-    return &nsp->sym;
-  } else {
-    SmallFlatNameSymMap* nm = &scope->flat_map;
-    for (int i = nm->num_entries - 1; i >= 0; --i) {
-      if (str_eq(nm->names[i], name))
-        return &nm->syms[i];
+static ScopeResult classify_sym(Scope* scope, Sym* found_sym, bool crossed_function) {
+  SymScopeDecl sd = found_sym->scope_decl;
+  switch (sd) {
+    case SSD_DECLARED_GLOBAL: {
+      if (scope->is_module) {
+        return SCOPE_RESULT_GLOBAL;
+      } else {
+        ASSERT(scope->is_function && !crossed_function);
+        return SCOPE_RESULT_LOCAL;
+      }
     }
+    case SSD_DECLARED_LOCAL:
+      if (scope->is_module) {
+        return SCOPE_RESULT_GLOBAL;
+      } else if (crossed_function) {
+        return SCOPE_RESULT_UPVALUE;
+      } else {
+        return SCOPE_RESULT_LOCAL;
+      }
+      break;
+    case SSD_DECLARED_PARAMETER:
+      if (crossed_function) {
+        return SCOPE_RESULT_UPVALUE;
+      } else {
+        return SCOPE_RESULT_PARAMETER;
+      }
+    case SSD_DECLARED_NONLOCAL:
+      return SCOPE_RESULT_UPVALUE;
+    default:
+      errorf("internal error, SymScopeDecl: %d", sd);
+  }
+}
+
+// Returns the innermost binding of |name| that's visible from
+// scopes[scope_index], or NULL.
+static Binding* binding_visible_from(Str name, int scope_index) {
+  NameBinding* nb = find_name_binding(name);
+  if (!nb) {
     return NULL;
   }
+  Binding* b = nb->top;
+  while (b && b->scope_index > scope_index) {
+    b = b->shadowed;
+  }
+  return b;
 }
 
-// Returns pointer into sym_dict/flat_map (where Sym is stored by value),
-// probably a bad idea.
+// Only finds |name| if it was declared directly in |scope|.
 // if crossed_function, map parameters and locals to upvalue
 static ScopeResult scope_lookup_single(Scope* scope, Str name, bool crossed_function, Sym** sym) {
-  Sym* found_sym = find_in_scope(scope, name);
-  if (found_sym) {
-    *sym = found_sym;
-    SymScopeDecl sd = found_sym->scope_decl;
-    switch (sd) {
-      case SSD_DECLARED_GLOBAL: {
-        if (scope->is_module) {
-          return SCOPE_RESULT_GLOBAL;
-        } else {
-          ASSERT(scope->is_function && !crossed_function);
-          return SCOPE_RESULT_LOCAL;
-        }
-      }
-      case SSD_DECLARED_LOCAL:
-        if (scope->is_module) {
-          return SCOPE_RESULT_GLOBAL;
-        } else if (crossed_function) {
-          return SCOPE_RESULT_UPVALUE;
-        } else {
-          return SCOPE_RESULT_LOCAL;
-        }
-        break;
-      case SSD_DECLARED_PARAMETER:
-        if (crossed_function) {
-          return SCOPE_RESULT_UPVALUE;
-        } else {
-          return SCOPE_RESULT_PARAMETER;
-        }
-      case SSD_DECLARED_NONLOCAL:
-        return SCOPE_RESULT_UPVALUE;
-      default:
-        errorf("internal error, SymScopeDecl: %d", sd);
-    }
+  Binding* b = binding_visible_from(name, (int)(scope - parser.scopes));
+  if (b && &parser.scopes[b->scope_index] == scope) {
+    *sym = &b->sym;
+    return classify_sym(scope, &b->sym, crossed_function);
   }
   return SCOPE_RESULT_UNDEFINED;
 }
 
-// Returns pointer into sym_dict/flat_map (where Sym is stored by value),
-// probably a bad idea.
 static ScopeResult scope_lookup_recursive(Str name, Sym** sym) {
   *sym = NULL;
-  bool crossed_function = false;
-  Scope* cur_scope = parser.cur_scope;
-  for (;;) {
-    ScopeResult res = scope_lookup_single(cur_scope, name, crossed_function, sym);
-    if (res != SCOPE_RESULT_UNDEFINED) {
-      return res;
-    }
-    // otherwise keep going upwards
-
-    if (cur_scope->is_function) {
-      crossed_function = true;
-    }
-
-    if (cur_scope == &parser.scopes[0]) {
-      break;
-    }
-    ASSERT(cur_scope >= &parser.scopes[0] &&
-           cur_scope <= &parser.scopes[parser.num_scopes - 1]);
-    cur_scope--;  // parent
+  Binding* b = binding_visible_from(name, (int)(parser.cur_scope - parser.scopes));
+  if (!b) {
+    return SCOPE_RESULT_UNDEFINED;
   }
-
-  return SCOPE_RESULT_UNDEFINED;
+  Scope* scope = &parser.scopes[b->scope_index];
+  *sym = &b->sym;
+  if (b->scope_index == 0 && parser.track_deps) {
+    cache_note_sym(&b->sym);
+  }
+  // Any function scope between the one the name was found in and here means
+  // it's coming from a different frame.
+  bool crossed_function = parser.cur_scope->func_depth > scope->func_depth;
+  return classify_sym(scope, &b->sym, crossed_function);
 }
 
 static int create_upval(Scope* scope, Str name, Sym* sym) {
@@ -2952,6 +5482,9 @@ static int create_upval(Scope* scope, Str name, Sym* sym) {
   if (uvm->num_upvals >= COUNTOFI(uvm->upvals)) {
     error("Too many upvals.");
   }
+  if (uvm->direct) {
+    error("internal error, upval missed by capture_upvals()");
+  }
   int upval_index = uvm->num_upvals++;
 
   Type type = sym->type;
@@ -2997,7 +5530,9 @@ static int create_upval(Scope* scope, Str name, Sym* sym) {
         // the parent, but we don't (cannot) create a "load" because the
         // ir_ref values would be in the current function, not the parent.
         uv->scope_result = SCOPE_RESULT_UPVALUE;
-        create_upval(parent_scope, name, sym);
+        if (find_upval(&parent_scope->upval_map, name) < 0) {
+          create_upval(parent_scope, name, sym);
+        }
         break;
     }
   } else {
@@ -3016,22 +5551,111 @@ static int create_upval(Scope* scope, Str name, Sym* sym) {
 static Operand find_or_create_upval(Scope* scope, Str name, Sym* sym) {
   ASSERT(!str_is_none(name));
   UpvalMap* uvm = &scope->upval_map;
-  int upval_index;
-  for (upval_index = uvm->num_upvals - 1; upval_index >= 0; --upval_index) {
-    if (str_eq(name, uvm->upvals[upval_index].name)) {
-      break;
-    }
-  }
-
+  int upval_index = find_upval(uvm, name);
   if (upval_index < 0) {
     // Didn't find it in the existing map, add a reference and then return it.
     upval_index = create_upval(scope, name, sym);
   }
 
   Type type = sym->type;
+  Upval* uv = &uvm->upvals[upval_index];
+  if (uv->value) {
+    return operand_rvalue_imm(type, uv->value);
+  }
   return operand_rvalue_imm(
-      type, ir_LOAD(type_to_ir_type(type),
-                    ir_ADD_OFFSET(scope->upval_base, uvm->upvals[upval_index].offset)));
+      type, ir_LOAD(type_to_ir_type(type), ir_ADD_OFFSET(scope->upval_base, uv->offset)));
+}
+
+// The IDENT_VAR at token |index|.
+static Str token_name(uint32_t index) {
+  const char* tok = &parser.file_contents[parser.token_offsets[index]];
+  uint32_t len = 0;
+  for (;;) {
+    char c = tok[len];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+          c == '_')) {
+      break;
+    }
+    ++len;
+  }
+  return str_intern_len(tok, len);
+}
+
+// Called at the start of a nested function's body, just after
+// enter_function(). Upvals are otherwise only discovered (and loaded through
+// $up) as they're used, but since they can't be assigned to, and they're
+// captured by value, they can all be loaded once here instead, which also
+// makes them SSA values rather than loads at every use. So the body's tokens
+// are scanned for any name that currently refers to a local or parameter of
+// an enclosing function. That can be more than are actually used (e.g. if the
+// body declares its own local of the same name), but never fewer, which is
+// also what nested functions inside this one rely on when they forward
+// through it.
+//
+// When that's a single scalar, it's passed as $up itself, so there's no
+// block to allocate in the parent or load from here.
+static void capture_upvals(void) {
+  Scope* scope = parser.cur_scope;
+  int scope_index = (int)(scope - parser.scopes);
+  TokenCursor saved = parser.cursor;
+  int body_indent = parser.indent_levels[parser.num_indents - 1];
+  Sym* syms[MAX_UPVALS];
+  Str names[MAX_UPVALS];
+  int num_syms = 0;
+  bool all_scalar = true;
+  TokenKind prev = TOK_INDENT;
+  for (uint32_t i = saved.token_index;; ++i) {
+    TokenKind kind = token_at(i)->kind;
+    if (kind == TOK_NL) {
+      continue;
+    }
+    if (kind == TOK_EOF || (kind >= TOK_NEWLINE_INDENT_0 && kind <= TOK_NEWLINE_INDENT_40 &&
+                            (int)(kind - TOK_NEWLINE_INDENT_0) * 4 < body_indent)) {
+      break;
+    }
+    if (kind == TOK_IDENT_VAR && prev != TOK_DOT) {
+      Str name = token_name(i);
+      NameBinding* nb = find_name_binding(name);
+      Binding* b = nb ? nb->top : NULL;
+      if (b && b->scope_index > 0 && b->scope_index < scope_index && b->sym.kind != SYM_CONST) {
+        int j = 0;
+        while (j < num_syms && syms[j] != &b->sym) {
+          ++j;
+        }
+        if (j == num_syms) {
+          if (b->sym.kind != SYM_VAR || type_is_aggregate(b->sym.type) ||
+              (b->sym.scope_decl != SSD_DECLARED_LOCAL &&
+               b->sym.scope_decl != SSD_DECLARED_PARAMETER)) {
+            // Left to be found on use as before.
+            all_scalar = false;
+          } else if (num_syms < MAX_UPVALS) {
+            syms[num_syms] = &b->sym;
+            names[num_syms] = name;
+            ++num_syms;
+          }
+        }
+      }
+    }
+    prev = kind;
+  }
+  seek_cursor(saved);
+
+  for (int i = 0; i < num_syms; ++i) {
+    create_upval(scope, names[i], syms[i]);
+  }
+  UpvalMap* uvm = &scope->upval_map;
+  uvm->direct = num_syms == 1 && all_scalar;
+  for (int i = 0; i < num_syms; ++i) {
+    Upval* uv = &uvm->upvals[i];
+    if (uvm->direct) {
+      uv->value = upval_from_up(scope->upval_base, uv->type);
+    } else {
+      // COPY so that --opt 0 doesn't fuse the LOAD into its (possibly much
+      // later) use, same as for list subscripts.
+      ir_type t = type_to_ir_type(uv->type);
+      uv->value = ir_COPY(t, ir_LOAD(t, ir_ADD_OFFSET(scope->upval_base, uv->offset)));
+    }
+  }
 }
 
 static Operand load_value(ScopeResult scope_result, Sym* sym, Str var_name) {
@@ -3055,6 +5679,12 @@ static Operand load_value(ScopeResult scope_result, Sym* sym, Str var_name) {
     }
     case SCOPE_RESULT_GLOBAL: {
       if (type_kind(sym->type) == TYPE_FUNC) {
+#if ENABLE_CODE_GEN
+        if (parser.cur_scope->is_ctfe && !sym->addr && !parser.ir_only) {
+          errorf("Cannot call '%s' in a constant expression before it's compiled.",
+                 cstr_copy(parser.arena, var_name));
+        }
+#endif
         // Doesn't make sense in our use for GLOBAL to be bound I don't think.
         return operand_rvalue_global_addr(sym->type, ir_CONST_ADDR(sym->addr));
       } else {
@@ -3062,6 +5692,10 @@ static Operand load_value(ScopeResult scope_result, Sym* sym, Str var_name) {
       }
     }
     case SCOPE_RESULT_UPVALUE: {
+      if (parser.cur_scope->is_ctfe) {
+        errorf("Cannot use local '%s' in a constant expression.",
+               cstr_copy(parser.arena, var_name));
+      }
       // We already did a scope_lookup() so we know the in the current function,
       // we need to reference this value through $up.
       Operand value = find_or_create_upval(parser.cur_scope, var_name, sym);
@@ -3073,10 +5707,49 @@ static Operand load_value(ScopeResult scope_result, Sym* sym, Str var_name) {
   }
 }
 
+// `pkg.name`, where pkg was already consumed.
+static Operand parse_package_member(Sym* package_sym, bool can_assign) {
+  consume(TOK_DOT, "Expect '.' after package name.");
+  if (!match(TOK_IDENT_VAR) && !match(TOK_IDENT_TYPE) && !match(TOK_IDENT_CONST)) {
+    error("Expect name after '.' in package reference.");
+  }
+  Str name = str_from_previous();
+  Sym* sym = module_find_export(package_sym->module, name);
+  if (!sym) {
+    errorf("Package '%s' has no member '%s'.", cstr_copy(parser.arena, package_sym->name),
+           cstr_copy(parser.arena, name));
+  }
+  if (can_assign && match_assignment()) {
+    errorf("Cannot assign to '%s' in another package.", cstr_copy(parser.arena, name));
+  }
+  switch (sym->kind) {
+    case SYM_CONST:
+      return operand_const(sym->type, sym->val);
+    case SYM_TYPE:
+      return compound_literal_of_type(sym->type);
+    case SYM_FUNC:
+    case SYM_VAR:
+      return load_value(SCOPE_RESULT_GLOBAL, sym, name);
+    default:
+      error("internal error: unexpected package member kind.");
+  }
+}
+
 static Operand parse_variable(bool can_assign, Type* expected) {
   Str target = str_from_previous();
   Sym* sym = NULL;
   ScopeResult scope_result = scope_lookup_recursive(target, &sym);
+  if (sym && sym->kind == SYM_PACKAGE) {
+    return parse_package_member(sym, can_assign);
+  }
+  if (sym && sym->kind == SYM_CONST) {
+    // Doesn't matter which function it was declared in, there's nothing to
+    // capture.
+    if (can_assign && match_assignment()) {
+      errorf("Cannot assign to const '%s'.", cstr_copy(parser.arena, target));
+    }
+    return operand_const(sym->type, sym->val);
+  }
   if (can_assign && match_assignment()) {
     TokenKind eq_kind = parser.cursor.prev_kind;
     TokenKind eq_offset = prev_offset();
@@ -3089,6 +5762,9 @@ static Operand parse_variable(bool can_assign, Type* expected) {
           errorf("Cannot assign type %s to type %s.", type_as_str(op.type), type_as_str(sym->type));
         }
         if (eq_kind == TOK_EQ) {
+          if (sym->scope_decl == SSD_DECLARED_GLOBAL) {
+            list_note_escape(sym->type);
+          }
           ir_VSTORE(sym->ref, operand_to_irref_imm(&op));
           return operand_null;
         } else {
@@ -3132,13 +5808,8 @@ static Operand parse_variable(bool can_assign, Type* expected) {
           ASSERT(!parser.cur_scope->is_function);
           ASSERT(eq_kind == TOK_EQ);
           if (scope_result == SCOPE_RESULT_UNDEFINED) {
-            // Global variable declaration without a type. TODO: need to be more
-            // careful about const eval vs in-function eval as this can easily
-            // crash if it starts to emit ir_INSTRs on the RHS.
-            Operand op = const_expression();
-            if (!op_is_const(op)) {
-              error("Global initializers must be constants.");
-            }
+            // Global variable declaration without a type.
+            Operand op = const_expression(&type_u64);
             make_global(SYM_VAR, target, op.type, op.val);
             return operand_null;
           } else {
@@ -3338,14 +6009,18 @@ static Operand if_statement_cond_helper(void) {
 
 static void if_statement(void) {
   do {
+    uint32_t cond_offset = cur_offset();
     Operand opcond = if_statement_cond_helper();
     ASSERT(type_kind(opcond.type) == TYPE_BOOL && "todo, other types");
     ir_ref cond = ir_IF(operand_to_irref_imm(&opcond));
-    ir_IF_TRUE(cond);
+    int percent = profile_branch_percent(cond_offset, PROF_TAKEN, PROF_NOT_TAKEN);
+    if_arm(cond, true, percent);
+    profile_emit_count(cond_offset, PROF_TAKEN);
     LastStatementType lst = parse_block();
     ir_ref iftrue = ir_END();
     if (lst == LST_RETURN_VALUE || lst == LST_RETURN_VOID) {
-      ir_IF_FALSE(cond);
+      if_arm(cond, false, percent);
+      profile_emit_count(cond_offset, PROF_NOT_TAKEN);
       // Push that we're in the FALSE block, with END of iftrue
       // When we get to the end of the outer block, END this false
       // and the MERGE iftrue, iffalse
@@ -3354,7 +6029,8 @@ static void if_statement(void) {
           (PendingCond){iftrue};
     } else {
       bool no_more = false;
-      ir_IF_FALSE(cond);
+      if_arm(cond, false, percent);
+      profile_emit_count(cond_offset, PROF_NOT_TAKEN);
       if (match(TOK_ELSE)) {
         consume(TOK_COLON, "Expect ':' to start else.");
         consume(TOK_NEWLINE, "Expect newline after ':' to start else.");
@@ -3371,7 +6047,146 @@ static void if_statement(void) {
         break;
       }
     }
-  } while (match(TOK_ELIF));
+  } while (match(TOK_ELIF));
+}
+
+// Whether |name| might be assigned to or have its address taken in the block
+// that follows the ':' at the cursor. This only looks at tokens, so it's
+// conservative, e.g. a local of the same name in a nested def counts too.
+static bool block_might_write_name(Str name) {
+  ASSERT(check(TOK_COLON));
+  TokenCursor saved = parser.cursor;
+  int base_indent = parser.indent_levels[parser.num_indents - 1];
+  bool result = false;
+  TokenKind prev = TOK_COLON;
+  bool prev_is_name = false;
+  for (uint32_t i = saved.token_index + 1;; ++i) {
+    TokenKind kind = token_at(i)->kind;
+    if (kind == TOK_NL) {
+      continue;
+    }
+    if (kind == TOK_EOF || (kind >= TOK_NEWLINE_INDENT_0 && kind <= TOK_NEWLINE_INDENT_40 &&
+                            (int)(kind - TOK_NEWLINE_INDENT_0) * 4 <= base_indent)) {
+      break;
+    }
+    if (prev_is_name && kind == TOK_EQ) {
+      result = true;
+      break;
+    }
+    prev_is_name = false;
+    if (kind == TOK_IDENT_VAR && token_is_name(i, name)) {
+      if (prev == TOK_AMPERSAND) {
+        result = true;
+        break;
+      }
+      prev_is_name = true;
+    }
+    prev = kind;
+  }
+  seek_cursor(saved);
+  return result;
+}
+
+// The induction variable is a PHI rather than going through the iterator's
+// VAR, so assigning to the iterator in the body doesn't change the iteration
+// (as in Python), and the loop is in a simple counted form for the optimizer.
+// The iterator's VAR is just written at the top of each iteration.
+static void range_loop(Str it_name, Operand start, Operand stop, Operand step) {
+  ir_ref start_ref = operand_to_irref_imm(&start);
+  ir_ref stop_ref = operand_to_irref_imm(&stop);
+  ir_ref step_ref = operand_to_irref_imm(&step);
+
+  // When the step isn't known, everything is flipped with ~ for a negative
+  // step, so there's still just one compare in the loop: ~cur < ~stop is
+  // cur > stop. The mask is -1 for a negative step and 0 otherwise.
+  ir_ref mask = IR_UNUSED;
+  if (!op_is_const(step)) {
+    mask = ir_SAR_I64(step_ref, ir_CONST_I64(63));
+    stop_ref = ir_XOR_I64(stop_ref, mask);
+  }
+
+  Sym* it = make_local_and_alloc(SYM_VAR, it_name, type_i64, NULL);
+
+  // For --bounds-check, if the iterator only ever holds values from a constant
+  // range, subscripts with it don't need to be checked.
+  bool bounded = false;
+  if (parser.bounds_check && op_is_const(start) && op_is_const(stop) && op_is_const(step) &&
+      parser.num_bounded_iters < MAX_BOUNDED_ITERS && !block_might_write_name(it_name)) {
+    int64_t first = start.val.i64;
+    int64_t s = step.val.i64;
+    int64_t span = s > 0 ? stop.val.i64 - first : first - stop.val.i64;
+    if (span > 0) {
+      int64_t last = first + ((span - 1) / (s > 0 ? s : -s)) * s;
+      parser.bounded_iters[parser.num_bounded_iters++] =
+          (BoundedIter){it, s > 0 ? first : last, s > 0 ? last : first};
+      bounded = true;
+    }
+  }
+
+  uint32_t loop_offset = cur_offset();
+  ir_ref loop = ir_LOOP_BEGIN(ir_END());
+  ir_ref cur = ir_PHI_2(IR_I64, start_ref, IR_UNUSED);
+  ir_ref in_range;
+  if (mask == IR_UNUSED) {
+    in_range = step.val.i64 < 0 ? ir_GT(cur, stop_ref) : ir_LT(cur, stop_ref);
+  } else {
+    in_range = ir_LT(ir_XOR_I64(cur, mask), stop_ref);
+  }
+  ir_ref cond = ir_IF(in_range);
+  int percent = profile_branch_percent(loop_offset, PROF_BACKEDGE, PROF_LOOP_EXIT);
+  if_arm(cond, true, percent);
+  // Through a COPY because --opt 0 gives a value that's VSTOREd the VAR's
+  // own slot, which would make assigning to the iterator change the PHI.
+  ir_VSTORE(it->ref, ir_COPY_I64(cur));
+
+  consume(TOK_COLON, "Expect ':' to start for.");
+  consume(TOK_NEWLINE, "Expect newline after ':' to start for.");
+  consume(TOK_INDENT, "Expect indent to start for.");
+  LastStatementType lst = parse_block();
+  ASSERT(lst == LST_NON_RETURN && "todo; return from loop");
+  if (bounded) {
+    --parser.num_bounded_iters;
+  }
+
+  // Set before the LOOP_END because the baseline tier writes the PHI's slot
+  // here.
+  ir_PHI_SET_OP(cur, 2, ir_ADD_I64(cur, step_ref));
+  tier_emit_count();
+  profile_emit_count(loop_offset, PROF_BACKEDGE);
+  ir_MERGE_SET_OP(loop, 2, ir_LOOP_END());
+  if_arm(cond, false, percent);
+  profile_emit_count(loop_offset, PROF_LOOP_EXIT);
+}
+
+// `for:` and `for cond:`, with the condition evaluated again before each
+// iteration.
+static void cond_loop(void) {
+  uint32_t loop_offset = cur_offset();
+  ir_ref loop = ir_LOOP_BEGIN(ir_END());
+  ir_ref cond;
+  if (check(TOK_COLON)) {
+    cond = ir_IF(ir_CONST_BOOL(true));
+  } else {
+    Operand opcond = parse_expression(NULL);
+    if (type_kind(opcond.type) != TYPE_BOOL) {
+      errorf("Expect bool condition for 'for', but got %s.", type_as_str(opcond.type));
+    }
+    cond = ir_IF(operand_to_irref_imm(&opcond));
+  }
+  int percent = profile_branch_percent(loop_offset, PROF_BACKEDGE, PROF_LOOP_EXIT);
+  if_arm(cond, true, percent);
+
+  consume(TOK_COLON, "Expect ':' to start for.");
+  consume(TOK_NEWLINE, "Expect newline after ':' to start for.");
+  consume(TOK_INDENT, "Expect indent to start for.");
+  LastStatementType lst = parse_block();
+  ASSERT(lst == LST_NON_RETURN && "todo; return from loop");
+
+  tier_emit_count();
+  profile_emit_count(loop_offset, PROF_BACKEDGE);
+  ir_MERGE_SET_OP(loop, 2, ir_LOOP_END());
+  if_arm(cond, false, percent);
+  profile_emit_count(loop_offset, PROF_LOOP_EXIT);
 }
 
 static void for_statement(void) {
@@ -3383,12 +6198,21 @@ static void for_statement(void) {
   // 5. index, iter enumerate expr
   // 6. index, *ptr enumerate expr
 
-  if (check(TOK_COLON)) {
-    // Nothing, case 1:
-  } else {  // if (check(TOK_IDENT_VAR) && peek(2, TOK_IN)) {
+  if (check(TOK_COLON) || !(check(TOK_IDENT_VAR) && peek(TOK_IN))) {
+    // Cases 1 and 2.
+    cond_loop();
+  } else {
     // Case 3.
     Str it_name = parse_name("Expect iterator name.");
     consume(TOK_IN, "Expect 'in'.");
+    if (match(TOK_RANGE)) {
+      // Directly over a range(), so the bounds never need to go through
+      // memory, and the step is usually a constant.
+      Operand start, stop, step;
+      parse_range_args(&start, &stop, &step);
+      range_loop(it_name, start, stop, step);
+      return;
+    }
     Operand expr = parse_expression(NULL);
     if (type_eq(expr.type, type_range)) {
       ASSERT(op_is_local_addr(expr));
@@ -3396,36 +6220,9 @@ static void for_statement(void) {
       ir_ref astop = ir_ADD_A(expr.ref, ir_CONST_ADDR(sizeof(int64_t)));
       ir_ref astep = ir_ADD_A(expr.ref, ir_CONST_ADDR(2 * sizeof(int64_t)));
 
-      ir_ref start = ir_LOAD_I64(astart);
-      ir_ref stop = ir_LOAD_I64(astop);
-      ir_ref step = ir_LOAD_I64(astep);
-
-      ir_ref is_neg = ir_LT(step, ir_CONST_I64(0));
-
-      // TODO: This probably needs work if the Range isn't trivial, start
-      // should be using the Operand expr or something maybe
-      Sym* it = make_local_and_alloc(SYM_VAR, it_name, type_i64, NULL);
-      ir_VSTORE(it->ref, start);
-
-      ir_ref loop = ir_LOOP_BEGIN(ir_END());
-
-      ir_ref cur = ir_VLOAD(IR_I64, it->ref);
-      // (is_neg ? cur > stop : cur < stop)
-      ir_ref cond = ir_IF(ir_COND(IR_BOOL, is_neg, ir_GT(cur, stop), ir_LT(cur, stop)));
-      ir_IF_TRUE(cond);
-
-      consume(TOK_COLON, "Expect ':' to start for.");
-      consume(TOK_NEWLINE, "Expect newline after ':' to start for.");
-      consume(TOK_INDENT, "Expect indent to start for.");
-      LastStatementType lst = parse_block();
-      ASSERT(lst == LST_NON_RETURN && "todo; return from loop");
-
-      ir_ref itval = ir_VLOAD(IR_I64, it->ref);
-      ir_ref inc = ir_ADD_I64(itval, step);
-      ir_VSTORE(it->ref, inc);
-
-      ir_MERGE_SET_OP(loop, 2, ir_LOOP_END());
-      ir_IF_FALSE(cond);
+      range_loop(it_name, operand_rvalue_imm(type_i64, ir_LOAD_I64(astart)),
+                 operand_rvalue_imm(type_i64, ir_LOAD_I64(astop)),
+                 operand_rvalue_imm(type_i64, ir_LOAD_I64(astep)));
     } else {
       errorf("Unhandled for/in over type %s.", type_as_str(expr.type));
     }
@@ -3478,8 +6275,23 @@ static LastStatementType parse_block(void) {
   return lst;
 }
 
-// TODO: decorators
-static void def_statement(void) {
+static void def_statement(InlineHint hint) {
+  bool is_nested = parser.num_scopes > 1;
+  TierRecord* tier_rec = NULL;
+  if (!is_nested && parser.tier_recompiling) {
+    tier_rec = parser.tier_recompiling;
+  } else if (!is_nested && parser.tiered) {
+    tier_rec = arena_push(parser.arena, sizeof(TierRecord), _Alignof(TierRecord));
+    tier_rec->count = 0;
+    tier_rec->cursor = parser.cursor;
+    tier_rec->pending_indent_kind = parser.pending_indent_kind;
+    tier_rec->num_pending_indents = parser.num_pending_indents;
+    memcpy(tier_rec->indent_levels, parser.indent_levels, sizeof(parser.indent_levels));
+    tier_rec->num_indents = parser.num_indents;
+    tier_rec->stub = NULL;
+    tier_rec->tier2_entry = NULL;
+  }
+
   Type return_type = parse_type();
   if (type_is_none(return_type)) {
     return_type = type_void;
@@ -3490,7 +6302,6 @@ static void def_statement(void) {
 
   Type param_types[MAX_FUNC_PARAMS];
   Str param_names[MAX_FUNC_PARAMS];
-  bool is_nested = parser.num_scopes > 1;
   if (is_nested) {
     ASSERT(parser.scopes[parser.num_scopes - 1].is_function);
     ASSERT(parser.scopes[0].is_module);
@@ -3505,10 +6316,28 @@ static void def_statement(void) {
 
   Type functype =
       type_function(param_types, num_params, return_type, is_nested ? TFF_NESTED : TFF_NONE);
-
-  Sym* funcsym = sym_new(SYM_FUNC, name, functype);
-  funcsym->scope_decl = is_nested ? SSD_DECLARED_LOCAL : SSD_DECLARED_GLOBAL;  // ?
+  TokenCursor body_cursor = parser.cursor;
+  bool inlinable = inline_check_body(hint, functype, param_names, name, function_start_offset);
+
+  Sym* funcsym;
+  if (parser.tier_recompiling && !is_nested) {
+    // The module scope already has this name pointing at the stub, so don't
+    // redefine it, just compile into a detached Sym.
+    funcsym = &tier_rec->sym;
+  } else {
+    funcsym = sym_new(SYM_FUNC, name, functype);
+    funcsym->scope_decl = is_nested ? SSD_DECLARED_LOCAL : SSD_DECLARED_GLOBAL;  // ?
+    if (tier_rec) {
+      tier_rec->sym = *funcsym;
+    }
+  }
   enter_function(funcsym, param_names, param_types);
+  parser.cur_scope->tier_rec = tier_rec;
+  tier_emit_count();
+  profile_enter_function(function_start_offset);
+  if (is_nested) {
+    capture_upvals();
+  }
   LastStatementType lst = parse_block();
   if (lst == LST_NON_RETURN) {
     if (!type_eq(type_void, type_func_return_type(functype))) {
@@ -3519,6 +6348,9 @@ static void def_statement(void) {
   }
 
   leave_function();
+  if (inlinable) {
+    inline_record(funcsym, body_cursor, param_names, function_start_offset);
+  }
 }
 
 static void foreign_statement(void) {
@@ -3539,9 +6371,10 @@ static void foreign_statement(void) {
   funcsym->scope_decl = SSD_DECLARED_GLOBAL;
 
   funcsym->addr = parser.get_extern((StrView){str_raw_ptr(name), str_len(name)});
+  cache_register_extern(funcsym->addr, str_raw_ptr(name), str_len(name));
 }
 
-static void on_statement(void) {
+static void on_statement(InlineHint hint) {
   Type on_type;
   Str on_type_name;
   if (parser.cursor.cur_kind >= TOK_BOOL && parser.cursor.cur_kind <= TOK_UINT) {
@@ -3603,9 +6436,13 @@ static void on_statement(void) {
 
   ASSERT(str_eq(on_type_name, type_decl_name(on_type)));
   Str full_name = memfn_name_from_type_name(on_type_name, func_name);
+  TokenCursor body_cursor = parser.cursor;
+  bool inlinable =
+      inline_check_body(hint, functype, param_names, full_name, function_start_offset);
   Sym* funcsym = sym_new(SYM_FUNC, full_name, functype);
   funcsym->scope_decl = SSD_DECLARED_GLOBAL;
   enter_function(funcsym, param_names, param_types);
+  profile_enter_function(function_start_offset);
   LastStatementType lst = parse_block();
   if (lst == LST_NON_RETURN) {
     if (!type_eq(type_void, type_func_return_type(functype))) {
@@ -3615,79 +6452,866 @@ static void on_statement(void) {
     }
   }
 
-  leave_function();
+  leave_function();
+  if (inlinable) {
+    inline_record(funcsym, body_cursor, param_names, function_start_offset);
+  }
+}
+
+// `@inline` or `@noinline` on the line before a def. These only change
+// whether calls are inlined at opt >= 1, see inline_check_body().
+static void decorated_statement(void) {
+  Str name = str_from_previous();
+  InlineHint hint;
+  if (str_eq(name, parser.static_str_inline)) {
+    hint = INLINE_ALWAYS;
+  } else if (str_eq(name, parser.static_str_noinline)) {
+    hint = INLINE_NEVER;
+  } else {
+    errorf("Unknown decorator '%s'.", cstr_copy(parser.arena, name));
+  }
+  consume(TOK_NEWLINE, "Expect newline after decorator.");
+  skip_newlines();
+  if (match(TOK_DEF)) {
+    def_statement(hint);
+  } else if (match(TOK_ON)) {
+    on_statement(hint);
+  } else {
+    error("Expect def or on after decorator.");
+  }
+}
+
+static void struct_statement() {
+  Str name = parse_type_name("Expect struct type name.");
+  consume(TOK_COLON, "Expect ':' after struct name.");
+  consume(TOK_NEWLINE, "Expect newline to start struct.");
+  consume(TOK_INDENT, "Expect indented struct body.");
+
+  Str field_names[MAX_STRUCT_FIELDS];
+  Type field_types[MAX_STRUCT_FIELDS];
+  Operand field_initializers[MAX_STRUCT_FIELDS];
+  bool have_initializers = false;
+  uint32_t num_fields = 0;
+  for (;;) {
+    if (check(TOK_DEDENT)) {
+      break;
+    }
+
+    Type field_type = parse_type();
+    if (type_is_none(field_type)) {
+      error("Expect struct field type.");
+    }
+    field_types[num_fields] = field_type;
+
+    Str field_name = parse_name("Expect struct field name.");
+    for (uint32_t i = 0; i < num_fields; ++i) {
+      if (str_eq(field_names[i], field_name)) {
+        errorf("Duplicate struct field name '%s'.", cstr_copy(parser.arena, field_name));
+      }
+    }
+    field_names[num_fields] = field_name;
+
+    if (match(TOK_EQ)) {
+      // TODO: need to support compound_literal is_const evaluation here
+      field_initializers[num_fields] = const_expression(&type_u64);
+      have_initializers = true;
+    } else {
+      field_initializers[num_fields] = operand_null;
+    }
+
+    ++num_fields;
+
+    do {
+      consume(TOK_NEWLINE, "Expect newline after struct field.");
+    } while (check(TOK_NEWLINE));
+  }
+  consume(TOK_DEDENT, "Expecting dedent after struct definition.");
+
+  Type strukt = type_new_struct(name, num_fields, field_names, field_types, have_initializers);
+  if (have_initializers) {
+    uint8_t* blob = arena_push(parser.arena, type_size(strukt), type_align(strukt));
+    memset(blob, 0, type_size(strukt));
+    for (uint32_t i = 0; i < num_fields; ++i) {
+      if (!op_is_null(field_initializers[i])) {
+        if (!op_is_const(field_initializers[i])) {
+          errorf("Expecting constant initializer for field %s.",
+                 cstr_copy(parser.arena, field_names[i]));
+        }
+        Type field_type = type_struct_field_type(strukt, i);
+        if (!convert_operand(&field_initializers[i], field_type)) {
+          errorf("Cannot convert initializer to type %s.", type_as_str(field_type));
+        }
+        // TODO: not 100% certain this is not copying garbage from the val field
+        // out of the range of the size of type if it gets convert_operand'd.
+        memcpy(blob + type_struct_field_offset(strukt, i), &field_initializers[i].val,
+               type_size(field_type));
+      }
+    }
+    type_struct_set_initializer_blob(strukt, blob);
+    cache_register_data(blob, name, type_size(strukt));
+  }
+  Sym* new = sym_new(SYM_TYPE, name, strukt);
+  new->scope_decl = SSD_DECLARED_GLOBAL;
+}
+
+static Module* find_module(uint64_t content_hash) {
+  for (int i = 0; i < parser.num_modules; ++i) {
+    if (parser.modules[i]->content_hash == content_hash) {
+      return parser.modules[i];
+    }
+  }
+  return NULL;
+}
+
+// Of the directory part, including the last separator.
+static size_t filename_dir_len(const char* filename) {
+  size_t dir_len = 0;
+  for (const char* p = filename; *p; ++p) {
+    if (*p == '/' || *p == '\\') {
+      dir_len = p - filename + 1;
+    }
+  }
+  return dir_len;
+}
+
+// "a.b.c" is a/b/c.luv, relative to the directory of the importing file.
+static const char* module_filename(Str* parts, int num_parts) {
+  size_t dir_len = filename_dir_len(parser.cur_filename);
+  size_t len = dir_len + sizeof(".luv");
+  for (int i = 0; i < num_parts; ++i) {
+    len += str_len(parts[i]) + 1;
+  }
+  char* filename = arena_push(parser.arena, len, 1);
+  char* out = filename;
+  memcpy(out, parser.cur_filename, dir_len);
+  out += dir_len;
+  for (int i = 0; i < num_parts; ++i) {
+    if (i > 0) {
+      *out++ = '/';
+    }
+    memcpy(out, str_raw_ptr(parts[i]), str_len(parts[i]));
+    out += str_len(parts[i]);
+  }
+  memcpy(out, ".luv", sizeof(".luv"));
+  return filename;
+}
+
+static uint32_t index_tokens(const char* filename, ReadFileResult file) {
+  TRACE_BEGIN("lex index", str_intern(filename));
+  uint64_t start_us = parser.stats ? base_timer_now() : 0;
+  uint32_t num_tokens = lex_indexer(file.buffer, file.allocated_size, parser.token_offsets);
+  if (parser.stats) {
+    parser.stats->index_us += base_timer_now() - start_us;
+    parser.stats->num_tokens += num_tokens;
+  }
+  TRACE_END();
+  return num_tokens;
+}
+
+// Imported modules go into the same code buffer and type table as the
+// importer, but they get their own token stream and name bindings so they
+// can't see the importer's globals. import is only allowed at the top level,
+// so the module scope is the only one that's live while we're swapped out.
+//
+// With --serve, full_path is set and the module is also kept for later
+// requests. Everything it leaves behind goes in module_arena and module_code,
+// and it gets its own string objects, so that none of it points into what the
+// request pops.
+static Module* compile_module(const char* filename,
+                              ReadFileResult file,
+                              uint64_t content_hash,
+                              const char* full_path,
+                              uint64_t mtime) {
+  if (parser.num_modules >= COUNTOFI(parser.modules)) {
+    error("Too many imported modules.");
+  }
+  bool keep = full_path != NULL;
+  Arena* arena = keep ? parser.module_arena : parser.arena;
+  Module* module = arena_push(arena, sizeof(Module), _Alignof(Module));
+  *module = (Module){
+      .filename = filename,
+      .content_hash = content_hash,
+      .in_progress = true,
+      .exports = dict_new(arena, 64, sizeof(ModuleExport), _Alignof(ModuleExport)),
+  };
+  if (keep) {
+    size_t len = strlen(full_path) + 1;
+    module->filename = memcpy(arena_push(arena, len, 1), full_path, len);
+    module->mtime = mtime;
+    module->opt_level = parser.opt_level;
+    module->bounds_check = parser.bounds_check;
+    module->get_extern = parser.get_extern;
+  }
+  parser.modules[parser.num_modules++] = module;
+
+  ASSERT(parser.num_scopes == 1);
+  uint64_t saved_arena_pos = arena_pos(parser.var_scope_arena);
+  Parser* saved = arena_push(parser.var_scope_arena, sizeof(Parser), _Alignof(Parser));
+  *saved = parser;
+  int saved_paren_level = token_get_continuation_paren_level();
+
+  parser.cur_module = module;
+  if (keep) {
+    parser.arena = parser.module_arena;
+    if (!saved->cur_module) {
+      parser.code_buffer = parser.module_code;
+    }
+    parser.string_objs = dict_new(parser.arena, 64, sizeof(StringObj), _Alignof(StringObj));
+    parser.empty_string_obj = NULL;
+  }
+
+  parser.token_offsets = (uint32_t*)base_mem_large_alloc(file.allocated_size * sizeof(uint32_t));
+  parser.file_contents = (const char*)file.buffer;
+  parser.cur_filename = filename;
+  parser.file_hash = content_hash;
+  parser.num_scopes = 0;
+  parser.cur_scope = NULL;
+  // These are dropped along with the rest of the module's state at the end.
+  // Not in var_scope_arena as they'd get popped by leaving a scope if they
+  // grew while it was open.
+  TempArena scratch = scratch_begin(NULL, 0);
+  parser.name_bindings =
+      dict_new(scratch.arena, 1 << 10, sizeof(NameBinding), _Alignof(NameBinding));
+  parser.inline_bodies = dict_new(scratch.arena, 64, sizeof(InlineBody), _Alignof(InlineBody));
+  parser.cursor = (TokenCursor){-1, 0, 0, 0};
+  parser.indent_levels[0] = 0;
+  parser.num_indents = 1;
+  parser.token_ring_start = 0;
+  parser.token_ring_end = 0;
+  parser.num_pending_indents = 0;
+  // TierRecords only know a cursor, not which file it's in, so imported code
+  // stays at whatever it was first compiled at for now.
+  parser.tiered = false;
+  // Similarly, only the root file is watched.
+  parser.hot_active = false;
+
+  enter_scope(/*is_module=*/true, /*is_function=*/false, NULL);
+
+  TRACE_BEGIN("import", str_intern(filename));
+  parser.num_tokens = index_tokens(filename, file);
+  token_init(file.buffer);
+  advance();
+
+  while (parser.cursor.cur_kind != TOK_EOF) {
+    parse_statement(/*toplevel=*/true);
+  }
+  TRACE_END();
+
+  // Bindings are newest first, so if something was redeclared, the one that
+  // was visible at the end wins.
+  for (Binding* b = parser.cur_scope->last_binding; b; b = b->prev_in_scope) {
+    if (b->sym.kind == SYM_PACKAGE) {
+      continue;  // Not re-exported.
+    }
+    ModuleExport exp = {.name = b->sym.name, .sym = b->sym};
+    dict_insert(&module->exports, &exp, name_binding_hash_func, name_binding_eq_func,
+                sizeof(ModuleExport), _Alignof(ModuleExport));
+  }
+
+  leave_scope();
+  base_mem_release(parser.token_offsets, file.allocated_size * sizeof(uint32_t));
+
+  uint8_t* module_code_end = parser.code_buffer.pos;
+  // Everything else is per-file, but these accumulate across all of them.
+  if (!keep || saved->cur_module) {
+    saved->code_buffer = parser.code_buffer;
+  }
+  saved->cold_code = parser.cold_code;
+  saved->num_profile_counts = parser.num_profile_counts;
+  saved->num_funcs_compiled = parser.num_funcs_compiled;
+  saved->num_cold_funcs = parser.num_cold_funcs;
+  memcpy(saved->phase_us, parser.phase_us, sizeof(parser.phase_us));
+  memcpy(saved->modules, parser.modules, sizeof(parser.modules));
+  saved->num_modules = parser.num_modules;
+  saved->obj_funcs = parser.obj_funcs;
+  if (!keep) {
+    saved->string_objs = parser.string_objs;
+    saved->empty_string_obj = parser.empty_string_obj;
+  }
+  saved->module_arena_kept_pos = parser.module_arena_kept_pos;
+  saved->module_code = parser.module_code;
+  saved->kept_modules = parser.kept_modules;
+  saved->string_bytes_saved = parser.string_bytes_saved;
+  saved->num_cache_hits = parser.num_cache_hits;
+  saved->num_cache_misses = parser.num_cache_misses;
+  saved->num_module_interfaces = parser.num_module_interfaces;
+  parser = *saved;
+  arena_pop_to(parser.var_scope_arena, saved_arena_pos);
+  scratch_end(scratch);
+  token_init((const unsigned char*)parser.file_contents);
+  token_restore_continuation_paren_level(saved_paren_level);
+
+  module->in_progress = false;
+  if (keep) {
+    KeptModule km = {.full_path = str_intern(full_path), .module = module};
+    DictInsert res = dict_insert(&parser.kept_modules, &km, name_binding_hash_func,
+                                 name_binding_eq_func, sizeof(KeptModule), _Alignof(KeptModule));
+    KeptModule* slot = (KeptModule*)dict_rawiter_get(&res.iter);
+    if (!res.inserted) {
+      slot->module->replaced = true;
+      slot->module = module;
+    }
+    // Only now is it all safe from the next request's clean up, in case this
+    // one fails partway through something that imports it.
+    parser.module_arena_kept_pos = arena_pos(parser.module_arena);
+    parser.module_code.pos = module_code_end;
+    type_keep();
+  }
+  return module;
+}
+
+static bool kept_module_is_current(Module* module) {
+  if (module->replaced || base_file_mtime(module->filename) != module->mtime) {
+    return false;
+  }
+  for (ModuleDep* dep = module->deps; dep; dep = dep->next) {
+    if (!kept_module_is_current(dep->module)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A module that an earlier --serve request compiled can be used again as long
+// as it was compiled the same way, and neither it nor anything it imported has
+// been written to since.
+static Module* find_kept_module(const char* full_path) {
+  KeptModule key = {.full_path = str_intern(full_path)};
+  DictRawIter iter = dict_find(&parser.kept_modules, &key, name_binding_hash_func,
+                               name_binding_eq_func, sizeof(KeptModule));
+  KeptModule* km = (KeptModule*)dict_rawiter_get(&iter);
+  if (!km) {
+    return NULL;
+  }
+  Module* module = km->module;
+  if (module->opt_level != parser.opt_level || module->bounds_check != parser.bounds_check ||
+      module->get_extern != parser.get_extern || !kept_module_is_current(module)) {
+    return NULL;
+  }
+  return module;
+}
+
+// Adds a kept module and what it imported to this request's modules (for
+// finding memfns), and puts its globals back to how they started.
+static void use_kept_module(Module* module) {
+  for (int i = 0; i < parser.num_modules; ++i) {
+    if (parser.modules[i] == module) {
+      return;
+    }
+  }
+  if (parser.num_modules >= COUNTOFI(parser.modules)) {
+    error("Too many imported modules.");
+  }
+  parser.modules[parser.num_modules++] = module;
+  for (ModuleGlobal* mg = module->globals; mg; mg = mg->next) {
+    memcpy(mg->addr, &mg->initial, mg->size);
+  }
+  for (ModuleDep* dep = module->deps; dep; dep = dep->next) {
+    use_kept_module(dep->module);
+  }
+}
+
+static Module* import_module(const char* filename);
+
+#if ENABLE_CODE_CACHE
+// With --code-cache, an imported module that was compiled is also written to
+// an interface file, named by a hash of its contents and how it was compiled.
+// That has the types its exports need, and the code and initial values of its
+// top level functions and globals with the same sort of relocations that the
+// importer's cache file has. Another import of the same contents (in this run
+// or a later one) copies all of that back in rather than parsing the module at
+// all, as long as what it imported still has the same contents too.
+//
+// Modules aren't compiled concurrently, even with interface files to say what
+// they export: there's only the one parser, and the type table, string intern
+// pool, and code buffer it puts everything in aren't safe to use from more
+// than one thread. Each is compiled on this thread when its import is reached.
+static const char* module_interface_filename(uint64_t content_hash) {
+  size_t hash = 0;
+  dict_hash_write(&hash, &content_hash, sizeof(content_hash));
+  dict_hash_write(&hash, (void*)cache_version, sizeof(cache_version));
+  dict_hash_write(&hash, &parser.opt_level, sizeof(parser.opt_level));
+  dict_hash_write(&hash, &parser.bounds_check, sizeof(parser.bounds_check));
+  size_t len = strlen(parser.code_cache_dir) + 1 + 16 + sizeof(".luvmod");
+  char* filename = arena_push(parser.arena, len, 1);
+  snprintf(filename, len, "%s/%016llx.luvmod", parser.code_cache_dir, (unsigned long long)hash);
+  return filename;
+}
+
+static ModuleExport* module_find_type_export(Module* module, Type type) {
+  for (DictRawIter iter = dict_iter_at(&module->exports, 0, sizeof(ModuleExport));
+       dict_rawiter_get(&iter); dict_rawiter_next(&iter, sizeof(ModuleExport))) {
+    ModuleExport* exp = (ModuleExport*)dict_rawiter_get(&iter);
+    if (exp->sym.kind == SYM_TYPE && type_eq(exp->sym.type, type)) {
+      return exp;
+    }
+  }
+  return NULL;
+}
+
+// Which of what |module| imported (directly or not) declared |type|.
+static Module* module_find_dep_struct(Module* module, Type type, ModuleExport** out_exp,
+                                      int depth) {
+  if (depth > MAX_PACKAGE_DEPTH) {
+    return NULL;
+  }
+  for (ModuleDep* dep = module->deps; dep; dep = dep->next) {
+    *out_exp = module_find_type_export(dep->module, type);
+    if (*out_exp) {
+      return dep->module;
+    }
+    Module* found = module_find_dep_struct(dep->module, type, out_exp, depth + 1);
+    if (found) {
+      return found;
+    }
+  }
+  return NULL;
+}
+
+// Short Strs hold their own bytes, so |str| has to stay put for as long as
+// the view is used.
+static StrView interface_name(const Str* str) {
+  return (StrView){str_raw_ptr(*str), str_len(*str)};
+}
+
+static uint32_t interface_type_index(ModuleInterface* iface, Type type) {
+  for (uint32_t i = 0; i < iface->num_types; ++i) {
+    if (type_eq(iface->types[i].type, type)) {
+      return i;
+    }
+  }
+  return iface->num_types;
+}
+
+static bool interface_add_type(ModuleInterface* iface, Module* module, Type type, int depth) {
+  if (interface_type_index(iface, type) < iface->num_types) {
+    return true;
+  }
+  if (depth > MAX_PACKAGE_DEPTH) {
+    return false;
+  }
+  InterfaceType it = {.type = type};
+  bool ok = true;
+  switch (type_kind(type)) {
+    case TYPE_PTR:
+      ok = interface_add_type(iface, module, type_ptr_subtype(type), depth + 1);
+      break;
+    case TYPE_ARRAY:
+      ok = interface_add_type(iface, module, type_array_subtype(type), depth + 1);
+      break;
+    case TYPE_LIST:
+      ok = interface_add_type(iface, module, type_list_subtype(type), depth + 1);
+      break;
+    case TYPE_FUNC:
+      for (uint32_t i = 0; ok && i < type_func_num_params(type); ++i) {
+        ok = interface_add_type(iface, module, type_func_param(type, i), depth + 1);
+      }
+      ok = ok && interface_add_type(iface, module, type_func_return_type(type), depth + 1);
+      break;
+    case TYPE_STRUCT: {
+      if (module_find_type_export(module, type)) {
+        for (uint32_t i = 0; ok && i < type_struct_num_fields(type); ++i) {
+          ok = interface_add_type(iface, module, type_struct_field_type(type, i), depth + 1);
+        }
+        if (ok && type_struct_has_initializer(type)) {
+          CacheTarget* target = cache_targets_find_addr(parser.cache_targets,
+                                                        type_struct_initializer_blob(type));
+          ok = target && !target->ambiguous;
+        }
+      } else {
+        ModuleExport* exp;
+        Module* dep = module_find_dep_struct(module, type, &exp, 0);
+        ok = dep != NULL;
+        if (ok) {
+          it.dep_hash = dep->content_hash;
+          it.dep_name = interface_name(&exp->name);
+        }
+      }
+      break;
+    }
+    default:
+      // Dicts and so on aren't written out, but the basic types are all made
+      // by type_init().
+      ok = (type.u >> 8) < NUM_TYPE_KINDS;
+      break;
+  }
+  if (!ok || iface->num_types == MAX_INTERFACE_TYPES) {
+    return false;
+  }
+  iface->types[iface->num_types++] = it;
+  return true;
+}
+
+static uint32_t module_func_index(Module* module, void* addr) {
+  for (uint32_t i = 0; i < module->num_funcs; ++i) {
+    if (module->funcs[i].addr == addr) {
+      return i;
+    }
+  }
+  return module->num_funcs;
+}
+
+static bool target_is_usable(void* addr) {
+  CacheTarget* target = cache_targets_find_addr(parser.cache_targets, addr);
+  return target && !target->ambiguous;
+}
+
+// Whether everything |module| has can be found by name again, filling out
+// |iface| with it if so. Arrays are in |arena|.
+static bool interface_collect(Arena* arena, Module* module, ModuleInterface* iface) {
+  *iface = (ModuleInterface){.filename = module->filename,
+                             .content_hash = module->content_hash};
+  size_t dir_len = filename_dir_len(module->filename);
+  for (ModuleDep* dep = module->deps; dep; dep = dep->next) {
+    if (strncmp(dep->filename, module->filename, dir_len) != 0) {
+      return false;
+    }
+    ++iface->num_deps;
+  }
+  iface->deps =
+      arena_push(arena, iface->num_deps * sizeof(InterfaceDep) + 1, _Alignof(InterfaceDep));
+  uint32_t num_deps = 0;
+  for (ModuleDep* dep = module->deps; dep; dep = dep->next) {
+    iface->deps[num_deps++] = (InterfaceDep){
+        .filename = {dep->filename + dir_len, (uint32_t)(strlen(dep->filename) - dir_len)},
+        .content_hash = dep->module->content_hash};
+  }
+
+  for (ModuleGlobal* mg = module->globals; mg; mg = mg->next) {
+    if (!target_is_usable(mg->addr)) {
+      return false;
+    }
+    ++iface->num_globals;
+  }
+  iface->globals = arena_push(arena, iface->num_globals * sizeof(InterfaceGlobal) + 1,
+                              _Alignof(InterfaceGlobal));
+  uint32_t num_globals = 0;
+  for (ModuleGlobal* mg = module->globals; mg; mg = mg->next) {
+    iface->globals[num_globals++] = (InterfaceGlobal){
+        .name = interface_name(&mg->name), .size = mg->size};
+    memcpy(&iface->globals[num_globals - 1].initial, &mg->initial, mg->size);
+  }
+
+  iface->num_funcs = module->num_funcs;
+  iface->funcs =
+      arena_push(arena, iface->num_funcs * sizeof(InterfaceFunc) + 1, _Alignof(InterfaceFunc));
+  for (uint32_t i = 0; i < module->num_funcs; ++i) {
+    if (!target_is_usable(module->funcs[i].addr)) {
+      return false;
+    }
+    iface->funcs[i] = (InterfaceFunc){.name = interface_name(&module->funcs[i].name),
+                                      .code = *module->funcs[i].cached};
+  }
+
+  iface->types = arena_push(arena, MAX_INTERFACE_TYPES * sizeof(InterfaceType),
+                            _Alignof(InterfaceType));
+  iface->exports = arena_push(arena, module->exports.size * sizeof(InterfaceExport) + 1,
+                              _Alignof(InterfaceExport));
+  for (DictRawIter iter = dict_iter_at(&module->exports, 0, sizeof(ModuleExport));
+       dict_rawiter_get(&iter); dict_rawiter_next(&iter, sizeof(ModuleExport))) {
+    Sym* sym = &((ModuleExport*)dict_rawiter_get(&iter))->sym;
+    InterfaceExport* exp = &iface->exports[iface->num_exports++];
+    *exp = (InterfaceExport){.name = interface_name(&sym->name), .kind = (uint8_t)sym->kind};
+    switch (sym->kind) {
+      case SYM_CONST:
+        if (!type_is_arithmetic(sym->type) && type_kind(sym->type) != TYPE_BOOL) {
+          return false;
+        }
+        memcpy(&exp->payload, &sym->val, sizeof(sym->val));
+        break;
+      case SYM_TYPE:
+        break;
+      case SYM_FUNC:
+        if (type_func_flags(sym->type) & TFF_FOREIGN) {
+          exp->payload = ~0ull;
+        } else {
+          exp->payload = module_func_index(module, sym->addr);
+          if (exp->payload == module->num_funcs) {
+            return false;
+          }
+        }
+        break;
+      case SYM_VAR: {
+        uint32_t index = 0;
+        ModuleGlobal* mg = module->globals;
+        while (mg && mg->addr != sym->addr) {
+          mg = mg->next;
+          ++index;
+        }
+        if (!mg) {
+          return false;
+        }
+        exp->payload = index;
+        break;
+      }
+      default:
+        return false;
+    }
+    if (!interface_add_type(iface, module, sym->type, 0)) {
+      return false;
+    }
+    exp->type = interface_type_index(iface, sym->type);
+  }
+  return true;
+}
+
+// Writes the interface file of a module that was just compiled, unless
+// something in it can't be.
+static void module_interface_save(Module* module) {
+  if (module->no_interface) {
+    return;
+  }
+  TempArena scratch = scratch_begin(NULL, 0);
+  ModuleInterface iface;
+  if (interface_collect(scratch.arena, module, &iface)) {
+    module_interface_write(scratch.arena, module_interface_filename(module->content_hash),
+                           cache_version_hash(), &iface);
+  }
+  scratch_end(scratch);
+}
+
+// What the module imported is imported here as well, and has to be the same as
+// it was then.
+typedef struct InterfaceLoad {
+  const char* filename;
+  ModuleDep* deps;
+} InterfaceLoad;
+
+static bool interface_import_dep(void* ctx, StrView rel, uint64_t content_hash) {
+  InterfaceLoad* load = ctx;
+  size_t dir_len = filename_dir_len(load->filename);
+  char* dep_filename = arena_push(parser.arena, dir_len + rel.size + 1, 1);
+  memcpy(dep_filename, load->filename, dir_len);
+  memcpy(dep_filename + dir_len, rel.data, rel.size);
+  dep_filename[dir_len + rel.size] = 0;
+  Module* dep_module = import_module(dep_filename);
+  if (dep_module->content_hash != content_hash) {
+    return false;
+  }
+  ModuleDep* dep = arena_push(parser.arena, sizeof(ModuleDep), _Alignof(ModuleDep));
+  *dep = (ModuleDep){.module = dep_module, .filename = dep_filename, .next = load->deps};
+  load->deps = dep;
+  return true;
 }
 
-static void struct_statement() {
-  Str name = parse_type_name("Expect struct type name.");
-  consume(TOK_COLON, "Expect ':' after struct name.");
-  consume(TOK_NEWLINE, "Expect newline to start struct.");
-  consume(TOK_INDENT, "Expect indented struct body.");
+static bool interface_find_dep_struct(void* ctx, uint64_t content_hash, StrView name, Type* out) {
+  (void)ctx;
+  Module* dep = find_module(content_hash);
+  Sym* sym = dep ? module_find_export(dep, str_intern_len(name.data, name.size)) : NULL;
+  if (!sym || sym->kind != SYM_TYPE || type_kind(sym->type) != TYPE_STRUCT) {
+    return false;
+  }
+  *out = sym->type;
+  return true;
+}
 
-  Str field_names[MAX_STRUCT_FIELDS];
-  Type field_types[MAX_STRUCT_FIELDS];
-  Operand field_initializers[MAX_STRUCT_FIELDS];
-  bool have_initializers = false;
-  uint32_t num_fields = 0;
-  for (;;) {
-    if (check(TOK_DEDENT)) {
-      break;
-    }
+static bool interface_is_own_blob(InterfaceType* it) {
+  return type_kind(it->type) == TYPE_STRUCT && !it->dep_name.size &&
+         type_struct_has_initializer(it->type);
+}
 
-    Type field_type = parse_type();
-    if (type_is_none(field_type)) {
-      error("Expect struct field type.");
+static Module* module_interface_install(const char* filename,
+                                        uint64_t content_hash,
+                                        const uint8_t* p,
+                                        const uint8_t* end,
+                                        Arena* arena) {
+  InterfaceLoad load = {.filename = filename};
+  InterfaceImporter importer = {&load, interface_import_dep, interface_find_dep_struct};
+  ModuleInterface iface;
+  if (!module_interface_read(arena, parser.arena, p, end, cache_version_hash(), content_hash,
+                             &importer, &iface)) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < iface.num_exports; ++i) {
+    InterfaceExport* exp = &iface.exports[i];
+    switch (exp->kind) {
+      case SYM_CONST:
+      case SYM_TYPE:
+        break;
+      case SYM_FUNC:
+        if (exp->payload == ~0ull) {
+          // Foreign, so whatever the importer's get_extern() says now. Code
+          // that calls it refers to it by that name.
+          cache_register_extern(parser.get_extern(exp->name), exp->name.data, exp->name.size);
+        } else if (exp->payload >= iface.num_funcs) {
+          return NULL;
+        }
+        break;
+      case SYM_VAR:
+        if (exp->payload >= iface.num_globals) {
+          return NULL;
+        }
+        break;
+      default:
+        return NULL;
     }
-    field_types[num_fields] = field_type;
+  }
 
-    Str field_name = parse_name("Expect struct field name.");
-    for (uint32_t i = 0; i < num_fields; ++i) {
-      if (str_eq(field_names[i], field_name)) {
-        errorf("Duplicate struct field name '%s'.", cstr_copy(parser.arena, field_name));
+  // Everything the code refers to has to be there before any of it is
+  // installed. Globals get their storage now so that the code can be linked
+  // to it, which is all that's lost if it can't be.
+  size_t code_size = 0;
+  for (uint32_t i = 0; i < iface.num_funcs; ++i) {
+    CacheEntry* code = &iface.funcs[i].code;
+    for (uint32_t j = 0; j < code->num_relocs; ++j) {
+      CacheReloc* reloc = &code->relocs[j];
+      if (reloc->name_len > 5 &&
+          (memcmp(reloc->name, "$str:", 5) == 0 || memcmp(reloc->name, "$len:", 5) == 0)) {
+        cache_string_obj((StrView){reloc->name + 5, reloc->name_len - 5});
       }
     }
-    field_names[num_fields] = field_name;
+    code_size += 16 + code->size;
+  }
+  if ((size_t)((uint8_t*)parser.code_buffer.end - (uint8_t*)parser.code_buffer.pos) < code_size) {
+    return NULL;
+  }
+  uint8_t* code_pos = parser.code_buffer.pos;
+  for (uint32_t i = 0; i < iface.num_funcs; ++i) {
+    InterfaceFunc* func = &iface.funcs[i];
+    func->addr = ALIGN_UP_PTR(code_pos, 16);
+    memcpy(func->addr, func->code.code, func->code.size);
+    code_pos = (uint8_t*)func->addr + func->code.size;
+  }
+  for (uint32_t i = 0; i < iface.num_globals; ++i) {
+    InterfaceGlobal* g = &iface.globals[i];
+    g->addr = arena_push(parser.arena, g->size, g->size);
+    memcpy(g->addr, &g->initial, g->size);
+  }
+  if (!module_interface_link(arena, parser.cache_targets, &iface)) {
+    return NULL;
+  }
+  parser.code_buffer.pos = code_pos;
 
-    if (match(TOK_EQ)) {
-      // TODO: need to support compound_literal is_const evaluation here
-      field_initializers[num_fields] = const_expression();
-      have_initializers = true;
-    } else {
-      field_initializers[num_fields] = operand_null;
+  // Now it's all the same as if it had been compiled, including the names that
+  // code compiled later refers to it by.
+  const char* saved_filename = parser.cur_filename;
+  parser.cur_filename = filename;
+  Module* module = arena_push(parser.arena, sizeof(Module), _Alignof(Module));
+  *module = (Module){
+      .filename = filename,
+      .content_hash = content_hash,
+      .exports = dict_new(parser.arena, 64, sizeof(ModuleExport), _Alignof(ModuleExport)),
+      .deps = load.deps,
+  };
+  for (uint32_t i = 0; i < iface.num_types; ++i) {
+    if (interface_is_own_blob(&iface.types[i])) {
+      Type type = iface.types[i].type;
+      cache_register_data(type_struct_initializer_blob(type), type_struct_decl_name(type),
+                          type_size(type));
+    }
+  }
+  for (uint32_t i = 0; i < iface.num_globals; ++i) {
+    InterfaceGlobal* g = &iface.globals[i];
+    Str name = str_intern_len(g->name.data, g->name.size);
+    cache_register_data(g->addr, name, g->size);
+    ModuleGlobal* mg = arena_push(parser.arena, sizeof(ModuleGlobal), _Alignof(ModuleGlobal));
+    *mg = (ModuleGlobal){.name = name,
+                         .addr = g->addr,
+                         .size = g->size,
+                         .next = module->globals};
+    memcpy(&mg->initial, &g->initial, sizeof(mg->initial));
+    module->globals = mg;
+  }
+  for (uint32_t i = 0; i < iface.num_funcs; ++i) {
+    InterfaceFunc* func = &iface.funcs[i];
+    Str name = str_intern_len(func->name.data, func->name.size);
+    cache_register_global(func->addr, name);
+    perf_register(name, func->addr, func->code.size);
+  }
+  parser.cur_filename = saved_filename;
+
+  for (uint32_t i = 0; i < iface.num_exports; ++i) {
+    InterfaceExport* exp = &iface.exports[i];
+    Sym sym = {.kind = (SymKind)exp->kind,
+               .name = str_intern_len(exp->name.data, exp->name.size),
+               .type = iface.types[exp->type].type,
+               .scope_decl = SSD_DECLARED_GLOBAL};
+    if (exp->kind == SYM_CONST) {
+      memcpy(&sym.val, &exp->payload, sizeof(sym.val));
+    } else if (exp->kind == SYM_FUNC && exp->payload == ~0ull) {
+      sym.addr = parser.get_extern(exp->name);
+    } else if (exp->kind == SYM_FUNC) {
+      sym.addr = iface.funcs[exp->payload].addr;
+      if (str_eq(sym.name, parser.static_str_main)) {
+        parser.main_func_entry = sym.addr;  // As compiling it would have.
+      }
+    } else if (exp->kind == SYM_VAR) {
+      sym.addr = iface.globals[exp->payload].addr;
     }
+    ModuleExport me = {.name = sym.name, .sym = sym};
+    dict_insert(&module->exports, &me, name_binding_hash_func, name_binding_eq_func,
+                sizeof(ModuleExport), _Alignof(ModuleExport));
+  }
+  parser.modules[parser.num_modules++] = module;
+  ++parser.num_module_interfaces;
+  return module;
+}
 
-    ++num_fields;
+// Anything wrong with the file just means compiling the module as usual.
+static Module* module_interface_load(const char* filename, uint64_t content_hash) {
+  if (parser.num_modules >= COUNTOFI(parser.modules)) {
+    return NULL;
+  }
+  ReadFileResult file = base_read_file(module_interface_filename(content_hash));
+  if (!file.buffer) {
+    return NULL;
+  }
+  TempArena scratch = scratch_begin(NULL, 0);
+  Module* module = module_interface_install(filename, content_hash, file.buffer,
+                                            file.buffer + file.file_size, scratch.arena);
+  scratch_end(scratch);
+  base_mem_release(file.buffer, file.allocated_size);
+  return module;
+}
+#endif
 
-    do {
-      consume(TOK_NEWLINE, "Expect newline after struct field.");
-    } while (check(TOK_NEWLINE));
+// Reads and compiles |filename|, unless the same contents have already been
+// imported, or there's a kept module or interface file for it.
+static Module* import_module(const char* filename) {
+  const char* full_path = NULL;
+  uint64_t mtime = 0;
+  if (parser.keep_modules) {
+    // Before reading, so that a write in between makes it look stale later
+    // rather than current.
+    mtime = base_file_mtime(filename);
+    full_path = base_full_path(parser.arena, filename);
+    if (!full_path) {
+      errorf("Couldn't read '%s' for import.", filename);
+    }
+    Module* module = find_kept_module(full_path);
+    if (module) {
+      use_kept_module(module);
+      return module;
+    }
   }
-  consume(TOK_DEDENT, "Expecting dedent after struct definition.");
 
-  Type strukt = type_new_struct(name, num_fields, field_names, field_types, have_initializers);
-  if (have_initializers) {
-    uint8_t* blob = arena_push(parser.arena, type_size(strukt), type_align(strukt));
-    memset(blob, 0, type_size(strukt));
-    for (uint32_t i = 0; i < num_fields; ++i) {
-      if (!op_is_null(field_initializers[i])) {
-        if (!op_is_const(field_initializers[i])) {
-          errorf("Expecting constant initializer for field %s.",
-                 cstr_copy(parser.arena, field_names[i]));
-        }
-        Type field_type = type_struct_field_type(strukt, i);
-        if (!convert_operand(&field_initializers[i], field_type)) {
-          errorf("Cannot convert initializer to type %s.", type_as_str(field_type));
-        }
-        // TODO: not 100% certain this is not copying garbage from the val field
-        // out of the range of the size of type if it gets convert_operand'd.
-        memcpy(blob + type_struct_field_offset(strukt, i), &field_initializers[i].val,
-               type_size(field_type));
-      }
+  ReadFileResult file = base_read_file(filename);
+  if (!file.buffer) {
+    errorf("Couldn't read '%s' for import.", filename);
+  }
+
+  size_t content_hash = 0;
+  dict_hash_write(&content_hash, file.buffer, file.file_size);
+  Module* module = find_module(content_hash);
+  if (module && module->in_progress) {
+    errorf("Circular import of '%s'.", filename);
+  }
+#if ENABLE_CODE_CACHE
+  if (!module && parser.code_cache) {
+    module = module_interface_load(filename, content_hash);
+  }
+#endif
+  if (!module) {
+    module = compile_module(filename, file, content_hash, full_path, mtime);
+#if ENABLE_CODE_CACHE
+    if (parser.code_cache) {
+      module_interface_save(module);
     }
-    type_struct_set_initializer_blob(strukt, blob);
+#endif
   }
-  Sym* new = sym_new(SYM_TYPE, name, strukt);
-  new->scope_decl = SSD_DECLARED_GLOBAL;
+  // Anything that's kept has been copied out of it.
+  base_mem_release(file.buffer, file.allocated_size);
+  return module;
 }
 
 static void import_statement(void) {
@@ -3696,29 +7320,82 @@ static void import_statement(void) {
   parts[num_parts++] = parse_name("Expect package name.");
   for (;;) {
     if (match(TOK_DOT)) {
+      if (num_parts >= COUNTOFI(parts)) {
+        error("Package name nested too deeply.");
+      }
       parts[num_parts++] = parse_name("Expecting nested package name after '.'.");
     } else {
       break;
     }
   }
 
-  // TODO: many things
-  // The end result from the imported package is a DictImpl containing
-  // name->syms for def, struct, const, var.
-  // need address/value for def/var/const.
-  // need Type to check and call propertly
-  // need struct layout, so it's pretty much the full sym_dict
+  const char* filename = module_filename(parts, num_parts);
+  Module* module = import_module(filename);
+  if (parser.cur_module) {
+    ModuleDep* dep = arena_push(parser.arena, sizeof(ModuleDep), _Alignof(ModuleDep));
+    dep->module = module;
+    dep->filename = filename;
+    dep->next = parser.cur_module->deps;
+    parser.cur_module->deps = dep;
+  }
+
+  // TODO: `import a.b` only binds `b` for now, rather than `a` as a package
+  // that contains `b`.
+  Sym* sym = sym_new(SYM_PACKAGE, parts[num_parts - 1], type_none);
+  sym->module = module;
+  sym->scope_decl = SSD_DECLARED_GLOBAL;
+
+  expect_end_of_statement("import");
+}
+
+// A one-letter name like `N` lexes as a type name, since it could just as well
+// be a type (`T`). Right before the '=' though, it's the constant's name.
+static bool check_one_letter_const_name(void) {
+  return check(TOK_IDENT_TYPE) && peek(TOK_EQ);
+}
+
+static void const_statement(void) {
+  Type type = check_one_letter_const_name() ? type_none : parse_type();
+  if (check_one_letter_const_name()) {
+    advance();
+  } else {
+    consume(TOK_IDENT_CONST, "Expect constant name (all capitals) after const.");
+  }
+  Str name = str_from_previous();
+  uint32_t name_offset = prev_offset();
+  consume(TOK_EQ, "Expect '=' after constant name.");
+  Operand op = const_expression(type_is_none(type) ? NULL : &type);
+  if (!type_is_none(type) && !convert_operand(&op, type)) {
+    errorf_offset(name_offset, "Cannot convert constant from type %s to declared type %s.",
+                  type_as_str(op.type), type_as_str(type));
+  }
+  Sym* sym = sym_new(SYM_CONST, name, op.type);
+  sym->val = op.val;
+  sym->scope_decl = parser.cur_scope->is_module ? SSD_DECLARED_GLOBAL : SSD_DECLARED_LOCAL;
+  expect_end_of_statement("const");
 }
 
 static void parse_variable_statement(Type type) {
   Str name = parse_name("Expect variable or typed variable name.");
   ASSERT(name.i);
+  uint32_t name_offset = prev_offset();
 
   bool have_init;
   ASSERT(!type_is_none(type));
   have_init = match(TOK_EQ);
   uint32_t eq_offset = prev_offset();
-  if (have_init) {
+  if (parser.cur_scope->is_module) {
+    // See make_global(), the initial value has to fit in a Val.
+    if (!type_is_arithmetic(type) && type_kind(type) != TYPE_BOOL) {
+      error_offset(name_offset, "Global variables can only be bool or arithmetic types for now.");
+    }
+    Operand op = have_init ? const_expression(&type) : operand_const(type, (Val){0});
+    if (!convert_operand(&op, type)) {
+      errorf_offset(eq_offset, "Initializer cannot be converted from type %s to declared type %s.",
+                    type_as_str(op.type), type_as_str(type));
+    }
+    make_global(SYM_VAR, name, type, op.val);
+  } else if (have_init) {
     Operand op = parse_expression(&type);
     if (!convert_operand(&op, type)) {
       errorf_offset(eq_offset, "Initializer cannot be converted from type %s to declared type %s.",
@@ -3742,7 +7419,12 @@ static LastStatementType return_statement(void) {
       errorf("Cannot convert type %s to expected return type %s.", type_as_str(op.type),
              type_as_str(func_ret));
     }
-    ir_VSTORE(parser.cur_scope->return_slot->ref, operand_to_irref_imm(&op));
+    if (type_is_aggregate(func_ret)) {
+      emit_aggregate_copy(parser.cur_scope->return_slot->ref, operand_to_irref_imm(&op),
+                          type_size(func_ret));
+    } else {
+      ir_VSTORE(parser.cur_scope->return_slot->ref, operand_to_irref_imm(&op));
+    }
     return LST_RETURN_VALUE;
   } else {
     consume(TOK_NEWLINE, "Expected newline after return in function with no return type.");
@@ -3768,10 +7450,14 @@ static LastStatementType parse_statement(bool toplevel) {
 
   skip_newlines();
 
+  if (toplevel) {
+    TRACE_BEGIN(token_enum_name(parser.cursor.cur_kind), (Str){0});
+  }
+
   switch (parser.cursor.cur_kind) {
     case TOK_DEF:
       advance();
-      def_statement();
+      def_statement(INLINE_DEFAULT);
       break;
     case TOK_FOREIGN:
       advance();
@@ -3781,7 +7467,12 @@ static LastStatementType parse_statement(bool toplevel) {
     case TOK_ON:
       advance();
       if (!toplevel) error("on statement only allowed at top level.");
-      on_statement();
+      on_statement(INLINE_DEFAULT);
+      break;
+    case TOK_IDENT_DECORATOR:
+      advance();
+      if (!toplevel) error("decorators only allowed at top level.");
+      decorated_statement();
       break;
     case TOK_IMPORT:
       advance();
@@ -3823,6 +7514,10 @@ static LastStatementType parse_statement(bool toplevel) {
       if (toplevel) error("global statement not allowed at top level.");
       global_statement();
       break;
+    case TOK_CONST:
+      advance();
+      const_statement();
+      break;
     default: {
       Type var_type = parse_type();
       if (!type_is_none(var_type)) {
@@ -3836,59 +7531,444 @@ static LastStatementType parse_statement(bool toplevel) {
     }
   }
 
+  if (toplevel) {
+    TRACE_END();
+  }
+
   skip_newlines();
   return lst;
 }
 
+// The root file's are kept rather than freed, both for --watch and so that
+// the next call under --serve probably doesn't need to allocate.
+static void ensure_token_offsets(size_t file_allocated_size) {
+  if (file_allocated_size <= parser.token_offsets_capacity) {
+    return;
+  }
+  if (parser.token_offsets) {
+    base_mem_release(parser.token_offsets, parser.token_offsets_capacity * sizeof(uint32_t));
+  }
+  // In the case of "a.a." the worst case for offsets is the same as the number
+  // of characters in the buffer.
+  parser.token_offsets = (uint32_t*)base_mem_large_alloc(file_allocated_size * sizeof(uint32_t));
+  parser.token_offsets_capacity = file_allocated_size;
+}
+
+#if ENABLE_CODE_GEN
+static void tier_recompile(TierRecord* rec) {
+  // The ring has long since moved on, so start categorizing again from here.
+  parser.num_pending_indents = 0;
+  parser.token_ring_start = parser.token_ring_end = UINT32_MAX;
+  seek_cursor(rec->cursor);
+  parser.pending_indent_kind = rec->pending_indent_kind;
+  parser.num_pending_indents = rec->num_pending_indents;
+  memcpy(parser.indent_levels, rec->indent_levels, sizeof(parser.indent_levels));
+  parser.num_indents = rec->num_indents;
+
+  // The module scope was left alive at the end of parse_impl() so this lookup
+  // is the same as it was the first time, other than names that were defined
+  // later in the file also being visible.
+  parser.opt_level = 2;
+  parser.tier_recompiling = rec;
+  uint8_t* code_start = parser.code_buffer.pos;
+  def_statement(INLINE_DEFAULT);
+  parser.tier_recompiling = NULL;
+
+  // Each batch of tier 2 code gets its own pages so that they can be made
+  // executable and never touched again while the program is running.
+  uint64_t page_size = base_page_size();
+  uint8_t* code_end = ALIGN_UP_PTR(parser.code_buffer.pos, page_size);
+  ir_mem_protect(code_start, code_end - code_start);
+  ir_mem_flush(code_start, code_end - code_start);
+  parser.code_buffer.pos = parser.code_writable_start = code_end;
+
+  if (!rec->tier2_entry) {
+    return;
+  }
+
+  if (parser.verbose) {
+    base_writef_stderr("=> tier up '%s' to %p\n", cstr_copy(parser.arena, rec->sym.name),
+                       rec->tier2_entry);
+  }
+  jump_stub_patch(rec->stub, rec->tier2_entry);
+  __atomic_fetch_add(&parser.tier_num_installed, 1, __ATOMIC_RELAXED);
+}
+
+static void tier_worker(void* arg) {
+  trace_thread_name("tier worker");
+  arena_ir = arena_create(MiB(256), KiB(128));
+  for (;;) {
+    base_semaphore_wait(parser.tier_sem);
+    if (parser.tier_quit) {
+      break;
+    }
+    uint32_t head = parser.tier_queue_head;
+    ASSERT(head != __atomic_load_n(&parser.tier_queue_tail, __ATOMIC_ACQUIRE));
+    TierRecord* rec = parser.tier_queue[head % COUNTOF(parser.tier_queue)];
+    __atomic_store_n(&parser.tier_queue_head, head + 1, __ATOMIC_RELEASE);
+    tier_recompile(rec);
+    __atomic_store_n(&parser.tier_num_done, parser.tier_num_done + 1, __ATOMIC_RELEASE);
+  }
+  arena_destroy(arena_ir);
+}
+
+static uint32_t tier_wait(void) {
+  if (!parser.tier_thread) {
+    return 0;
+  }
+  while (__atomic_load_n(&parser.tier_num_done, __ATOMIC_ACQUIRE) != parser.tier_queue_tail) {
+    base_sleep_ms(1);
+  }
+  return __atomic_load_n(&parser.tier_num_installed, __ATOMIC_RELAXED);
+}
+
+static void tier_shutdown(void) {
+  if (!parser.tier_thread) {
+    return;
+  }
+  parser.tier_quit = true;
+  base_semaphore_signal(parser.tier_sem);
+  base_thread_join(parser.tier_thread);
+  parser.tier_thread = NULL;
+}
+#endif
+
+#if ENABLE_CODE_CACHE
+static void hot_init(const char* filename, ReadFileResult file) {
+  parser.hot_filename = filename;
+  parser.hot_active = true;
+  parser.track_deps = true;
+  parser.hot = hot_new(parser.arena, filename, file);
+  parser.hot_file = (ReadFileResult){0};
+  parser.hot_saved = arena_push(parser.arena, sizeof(Parser), _Alignof(Parser));
+}
+
+// Parses and compiles all of the new contents of the file on the watcher
+// thread while the program keeps running. If there's an error, the program
+// just keeps running what it had.
+//
+// TODO: The front end still has to go through the whole file every time, it's
+// only the backend that's skipped for functions that didn't change. Nested
+// functions are always recompiled (even if the parent isn't), and imports
+// aren't watched.
+static void hot_reload(ReadFileResult file) {
+  ensure_token_offsets(file.allocated_size);
+
+  Parser* saved = parser.hot_saved;
+  *saved = parser;
+  uint64_t saved_ir_pos = arena_pos(arena_ir);
+  uint64_t saved_var_scope_pos = arena_pos(parser.var_scope_arena);
+  if (setjmp(parser.hot_error_jmp)) {
+    // Possibly in the middle of an import, so go all the way back to how
+    // things were, including no bindings being visible. The string objects
+    // are kept, the dict might have grown since it was saved.
+    DictImpl string_objs = parser.string_objs;
+    parser = *saved;
+    parser.string_objs = string_objs;
+    for (DictRawIter iter = dict_iter_at(&parser.name_bindings, 0, sizeof(NameBinding));
+         dict_rawiter_get(&iter); dict_rawiter_next(&iter, sizeof(NameBinding))) {
+      ((NameBinding*)dict_rawiter_get(&iter))->top = NULL;
+    }
+    arena_pop_to(arena_ir, saved_ir_pos);
+    arena_pop_to(parser.var_scope_arena, saved_var_scope_pos);
+    // e.g. compile_module()'s, if it was in an import. The watcher doesn't keep
+    // anything in them between reloads.
+    scratch_reset();
+    base_mem_release(file.buffer, file.allocated_size);
+    hot_discard(parser.hot);
+    base_writef_stderr("%s: not reloaded.\n", parser.hot_filename);
+    return;
+  }
+  parser.hot_reloading = true;
+
+  parser.file_contents = (const char*)file.buffer;
+  parser.cursor = (TokenCursor){-1, 0, 0, 0};
+  parser.indent_levels[0] = 0;
+  parser.num_indents = 1;
+  parser.token_ring_start = 0;
+  parser.token_ring_end = 0;
+  parser.num_pending_indents = 0;
+  uint8_t* code_start = parser.code_buffer.pos;
+
+  enter_scope(/*is_module=*/true, /*is_function=*/false, NULL);
+
+  parser.num_tokens = index_tokens(parser.hot_filename, file);
+  token_init(file.buffer);
+  advance();
+
+  while (parser.cursor.cur_kind != TOK_EOF) {
+    parse_statement(/*toplevel=*/true);
+  }
+
+  leave_scope();
+  parser.hot_reloading = false;
+
+  uint8_t* code_end = ALIGN_UP_PTR(parser.code_buffer.pos, base_page_size());
+  ir_mem_protect(code_start, code_end - code_start);
+  ir_mem_flush(code_start, code_end - code_start);
+  parser.code_buffer.pos = parser.code_writable_start = code_end;
+  uint32_t num_changed = hot_commit(parser.hot);
+
+  // Everything that's kept was copied out of it by now.
+  if (parser.hot_file.buffer) {
+    base_mem_release(parser.hot_file.buffer, parser.hot_file.allocated_size);
+  }
+  parser.hot_file = file;
+  base_writef_stderr("%s: reloaded, %u function%s changed.\n", parser.hot_filename, num_changed,
+                     num_changed == 1 ? "" : "s");
+}
+
+static void hot_shutdown(void) {
+  if (parser.hot) {
+    hot_stop(parser.hot);
+  }
+}
+#endif
+
+static void report_phase_times(void) {
+  uint64_t total_us = base_timer_now() - parser.start_us;
+  uint64_t backend_us = 0;
+  for (int i = 0; i < NUM_JIT_PHASES; ++i) {
+    backend_us += parser.phase_us[i];
+  }
+  double pct = total_us ? 100.0 / total_us : 0.0;
+  uint64_t front_end_us = total_us - backend_us;
+  base_writef_stderr("%-16s %10.3f ms %5.1f%%, %u tokens, %.2f Mtok/s\n", "front end",
+                     front_end_us / 1000.0, front_end_us * pct, parser.num_tokens,
+                     front_end_us ? (double)parser.num_tokens / front_end_us : 0.0);
+  for (int i = 0; i < NUM_JIT_PHASES; ++i) {
+    if (parser.phase_us[i]) {
+      base_writef_stderr("%-16s %10.3f ms %5.1f%%\n", jit_phase_names[i],
+                         parser.phase_us[i] / 1000.0, parser.phase_us[i] * pct);
+    }
+  }
+  base_writef_stderr("%-16s %10.3f ms, %u functions, %.2f us/function in backend\n", "total",
+                     total_us / 1000.0, parser.num_funcs_compiled,
+                     parser.num_funcs_compiled ? (double)backend_us / parser.num_funcs_compiled
+                                               : 0.0);
+  if (parser.code_cache) {
+    base_writef_stderr("%-16s %u hits, %u misses, %u modules from interface files\n",
+                       "code cache", parser.num_cache_hits, parser.num_cache_misses,
+                       parser.num_module_interfaces);
+  }
+  if (!parser.track_targets) {
+    base_writef_stderr("%-16s %u unique, %zu bytes saved\n", "string literals",
+                       (uint32_t)parser.string_objs.size, parser.string_bytes_saved);
+  }
+}
+
+// The rest of --stats is counted as it goes.
+static void finish_stats(void) {
+  CompileStats* stats = parser.stats;
+  for (int i = 0; i < NUM_JIT_PHASES; ++i) {
+    stats->jit_us += parser.phase_us[i];
+  }
+  stats->num_string_literals = (uint32_t)parser.string_objs.size;
+  stats->num_types = type_num_created();
+#if ENABLE_CODE_GEN
+  stats->code_buffer_used = (uint8_t*)parser.code_buffer.pos - (uint8_t*)parser.code_buffer.start;
+  stats->code_buffer_size = (uint8_t*)parser.code_buffer.end - (uint8_t*)parser.code_buffer.start;
+  if (parser.profile) {
+    stats->code_buffer_used += (uint8_t*)parser.cold_code.pos - (uint8_t*)parser.code_buffer.end;
+    stats->code_buffer_size += PROFILE_COLD_CODE_SIZE;
+  }
+#endif
+}
+
 static void* always_fail_get_extern(StrView name) {
   errorf("Unresolved external '%.*s'.", name.size, name.data);
 }
 
 static void* parse_impl(Arena* main_arena,
-                   Arena* temp_arena,
-                   const char* filename,
-                   ReadFileResult file,
-                   void* (*get_extern)(StrView),
-                   int verbose,
-                   bool ir_only,
-                   int opt_level) {
-  type_init(main_arena);
+                        Arena* temp_arena,
+                        ReadFileResult file,
+                        void* (*get_extern)(StrView),
+                        const Options* options,
+                        CompileStats* stats) {
+  const char* filename = options->input;
+  parser.time_phases = options->time_phases;
+  parser.stats = stats;
+  parser.start_us = options->time_phases ? base_timer_now() : 0;
+  memset(parser.phase_us, 0, sizeof(parser.phase_us));
+  parser.num_funcs_compiled = 0;
+
+  // Otherwise serve() owns the type table, see type_keep().
+  if (!options->keep_modules) {
+    type_init(main_arena);
+  }
 
   parser.arena = main_arena;
   parser.var_scope_arena = temp_arena;
-  // In the case of "a.a." the worst case for offsets is the same as the number
-  // of characters in the buffer.
-  parser.token_offsets = (uint32_t*)base_mem_large_alloc(file.allocated_size * sizeof(uint32_t));
+  ensure_token_offsets(file.allocated_size);
   parser.file_contents = (const char*)file.buffer;
   parser.cur_filename = filename;
   parser.num_scopes = 0;
   parser.cur_scope = NULL;
+  parser.name_bindings =
+      dict_new(parser.arena, 1 << 16, sizeof(NameBinding), _Alignof(NameBinding));
+  parser.num_modules = 0;
+  parser.keep_modules = false;
+  parser.cur_module = NULL;
+#if ENABLE_CODE_GEN
+  // Those that aren't only compiled in the code buffer need all of their code
+  // in this request's part of it.
+  if (options->keep_modules && !options->ir_only && !options->code_cache_dir &&
+      !options->obj_filename && !options->profile_gen_filename &&
+      !options->profile_use_filename) {
+    parser.keep_modules = true;
+    if (!parser.module_arena) {
+      parser.module_arena = arena_create(MiB(256), KiB(128));
+      parser.kept_modules =
+          dict_new(parser.module_arena, 64, sizeof(KeptModule), _Alignof(KeptModule));
+      parser.module_arena_kept_pos = arena_pos(parser.module_arena);
+    }
+    // Whatever a failed import left behind.
+    arena_pop_to(parser.module_arena, parser.module_arena_kept_pos);
+  }
+#endif
   parser.cursor = (TokenCursor){-1, 0, 0, 0};
   parser.indent_levels[0] = 0;
   parser.num_indents = 1;
-  parser.num_buffered_tokens = 0;
+  parser.token_ring_start = 0;
+  parser.token_ring_end = 0;
+  parser.num_pending_indents = 0;
   parser.main_func_entry = NULL;
   parser.get_extern = get_extern ? get_extern : always_fail_get_extern;
-  parser.verbose = verbose;
-  parser.ir_only = ir_only;
-  parser.opt_level = opt_level;
+  parser.verbose = options->verbose;
+  parser.ir_only = options->ir_only;
+  parser.opt_level = options->opt_level;
+  parser.bounds_check = options->bounds_check;
+  parser.num_bounded_iters = 0;
+  parser.perf_map = options->perf_map;
+  parser.jitdump = options->jitdump;
+  if (parser.list_arena) {
+    // The previous --serve request's program is done with its lists.
+    arena_pop_to(parser.list_arena, 0);
+  }
+  parser.list_top = NULL;
+  parser.tiered = false;
+  parser.tier_recompiling = NULL;
+  parser.tier_queue_head = parser.tier_queue_tail = 0;
+  parser.tier_num_done = parser.tier_num_installed = 0;
+  parser.tier_quit = false;
+  parser.tier_thread = NULL;
+#if ENABLE_CODE_GEN
+  if (options->tiered && !options->ir_only) {
+#  if !ARCH_X64
+    error("--tiered is only implemented for x64.");
+#  endif
+    parser.tiered = true;
+    parser.opt_level = 0;
+    parser.tier_sem = base_semaphore_create();
+  }
+#endif
   parser.static_str_main = str_intern_len("main", 4);
   parser.static_str_repr = str_intern_len("__repr__", 8);
   parser.static_str_ret = str_intern_len("$ret", 4);
   parser.static_str_up = str_intern_len("$up", 3);
+  parser.static_str_ctfe = str_intern_len("$ctfe", 5);
+  parser.static_str_pad = str_intern_len("$pad", 4);
+  parser.static_str_inline = str_intern_len("@inline", 7);
+  parser.static_str_noinline = str_intern_len("@noinline", 9);
+  Type range = type_range;
+  parser.print_range_func_type = type_function(&range, 1, type_void, TFF_FOREIGN);
+
+  parser.string_objs = dict_new(parser.arena, 256, sizeof(StringObj), _Alignof(StringObj));
+  parser.empty_string_obj = NULL;
+  parser.string_bytes_saved = 0;
+
+  parser.inline_bodies = dict_new(parser.arena, 64, sizeof(InlineBody), _Alignof(InlineBody));
+  parser.inline_depth = 0;
+
+  parser.track_deps = false;
+  parser.track_targets = false;
+  parser.cache_targets = NULL;
+  parser.code_cache_dir = NULL;
+  parser.code_cache = NULL;
+  parser.num_cache_hits = parser.num_cache_misses = 0;
+  parser.num_module_interfaces = 0;
+  if (options->code_cache_dir && !options->ir_only) {
+    ASSERT(!parser.tiered && options->opt_level >= 0);
+    cache_init(options->code_cache_dir, filename);
+  }
+  parser.obj_filename = NULL;
+  parser.obj_funcs = NULL;
+  if (options->obj_filename && !options->ir_only) {
+#if !(ARCH_X64 && OS_LINUX)
+    error("--emit-obj is only implemented for x64 Linux.");
+#endif
+    ASSERT(!parser.tiered && !parser.code_cache);
+    parser.obj_filename = options->obj_filename;
+    targets_init();
+  }
+  parser.file_hash = 0;
+  parser.profile_gen_filename = NULL;
+  parser.profile_counts = NULL;
+  parser.num_profile_counts = 0;
+  parser.profile = NULL;
+  parser.num_cold_funcs = 0;
+  if (options->profile_gen_filename || options->profile_use_filename) {
+    ASSERT(!parser.tiered && !parser.code_cache && !parser.obj_filename &&
+           !options->watch);
+    dict_hash_write(&parser.file_hash, (void*)file.buffer, file.file_size);
+    if (options->profile_gen_filename && !options->ir_only) {
+      parser.profile_gen_filename = options->profile_gen_filename;
+      parser.profile_counts = arena_push(parser.arena, MAX_PROFILE_COUNTS * sizeof(ProfileCount),
+                                         _Alignof(ProfileCount));
+    }
+    if (options->profile_use_filename) {
+      parser.profile = profile_load(parser.arena, options->profile_use_filename);
+    }
+  }
+  parser.hot_filename = NULL;
+  parser.hot_active = false;
+  parser.hot_reloading = false;
+  parser.hot = NULL;
+#if ENABLE_CODE_CACHE
+  if (options->watch && !options->ir_only) {
+#  if !ARCH_X64
+    error("--watch is only implemented for x64.");
+#  endif
+    ASSERT(!parser.tiered && !parser.code_cache && !parser.obj_filename);
+    hot_init(filename, file);
+  }
+#endif
 
 #if ENABLE_CODE_GEN
   size_t code_buffer_size = MiB(512);
-  parser.code_buffer.start = ir_mem_mmap(code_buffer_size);
-  ASSERT(parser.code_buffer.start);
+  // With --serve, this is reused for every request.
+  if (!parser.code_buffer.start) {
+    parser.code_buffer.start = ir_mem_mmap(code_buffer_size);
+    ASSERT(parser.code_buffer.start);
+  }
   ir_mem_unprotect(parser.code_buffer.start, code_buffer_size);
   parser.code_buffer.end = (uint8_t*)parser.code_buffer.start + code_buffer_size;
   parser.code_buffer.pos = parser.code_buffer.start;
+  parser.code_writable_start = parser.code_buffer.start;
+  if (options->keep_modules) {
+    // Kept modules' code is at the end, where it stays put across requests
+    // (whether or not this one can keep modules).
+    parser.code_buffer.end = (uint8_t*)parser.code_buffer.end - MODULE_CODE_SIZE;
+    if (!parser.module_code.start) {
+      parser.module_code = (ir_code_buffer){.start = parser.code_buffer.end,
+                                            .end = (uint8_t*)parser.code_buffer.end +
+                                                   MODULE_CODE_SIZE,
+                                            .pos = parser.code_buffer.end};
+    }
+  }
+  if (parser.profile) {
+    // Still within rel32 of everything else.
+    parser.code_buffer.end = (uint8_t*)parser.code_buffer.end - PROFILE_COLD_CODE_SIZE;
+    parser.cold_code = (ir_code_buffer){.start = parser.code_buffer.start,
+                                        .end = (uint8_t*)parser.code_buffer.end +
+                                               PROFILE_COLD_CODE_SIZE,
+                                        .pos = parser.code_buffer.end};
+  }
 #endif
 
   enter_scope(/*is_module=*/true, /*is_function=*/false, NULL);
 
-  parser.num_tokens = lex_indexer(file.buffer, file.allocated_size, parser.token_offsets);
+  parser.num_tokens = index_tokens(filename, file);
   token_init(file.buffer);
   if (parser.verbose > 1) {
     token_dump_offsets(parser.num_tokens, parser.token_offsets, file.file_size);
@@ -3899,11 +7979,63 @@ static void* parse_impl(Arena* main_arena,
     parse_statement(/*toplevel=*/true);
   }
 
+#if ENABLE_CODE_GEN
+  if (parser.tiered) {
+    // Keep the module scope around for the recompiles, and hand the rest of
+    // the code buffer to the worker, starting on a fresh page.
+    uint8_t* tier2_start = ALIGN_UP_PTR(parser.code_buffer.pos, base_page_size());
+    ir_mem_protect(parser.code_buffer.start, tier2_start - (uint8_t*)parser.code_buffer.start);
+    parser.code_buffer.pos = parser.code_writable_start = tier2_start;
+    parser.tier_thread = base_thread_create(tier_worker, NULL);
+    if (parser.time_phases) {
+      report_phase_times();
+    }
+    if (parser.stats) {
+      finish_stats();
+    }
+    return parser.main_func_entry;
+  }
+#endif
+
   leave_scope();
 
+#if ENABLE_CODE_CACHE
+  if (parser.hot_active) {
+    // Like --tiered, the rest of the code buffer is for reloads, starting on a
+    // fresh page.
+    uint8_t* reload_start = ALIGN_UP_PTR(parser.code_buffer.pos, base_page_size());
+    ir_mem_protect(parser.code_buffer.start, reload_start - (uint8_t*)parser.code_buffer.start);
+    parser.code_buffer.pos = parser.code_writable_start = reload_start;
+    hot_commit(parser.hot);
+    hot_watch(parser.hot, hot_reload);
+    if (parser.time_phases) {
+      report_phase_times();
+    }
+    if (parser.stats) {
+      finish_stats();
+    }
+    return parser.main_func_entry;
+  }
+#endif
+
+  if (parser.code_cache) {
+    code_cache_save(parser.code_cache);
+  }
+#if ENABLE_CODE_CACHE
+  if (parser.obj_filename) {
+    obj_write();
+  }
+#endif
 #if ENABLE_CODE_GEN
   ir_mem_protect(parser.code_buffer.start, code_buffer_size);
 #endif
 
+  if (parser.time_phases) {
+    report_phase_times();
+  }
+  if (parser.stats) {
+    finish_stats();
+  }
+
   return parser.main_func_entry;
 }
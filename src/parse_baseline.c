@@ -0,0 +1,1346 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// --opt -1: a baseline tier that doesn't build an IR graph at all. Instead,
+// every ir_* that parse.c calls immediately copies a small fixed x64 template
+// into the code buffer and patches its holes (frame offsets, immediates,
+// branch targets). There's no register allocation; every value lives in its
+// own 8 byte slot in the frame, so the templates only need to know rbp-relative
+// offsets. This is the same idea as the old gen.c, but driven by the same
+// front end as the other two instantiations of parse.c.
+//
+// Value slots are always written as 8 bytes, but readers extend from the
+// width/signedness of the value's type, so nothing needs normalizing after an
+// operation. Floats are kept as raw bits in the slots and only go through xmm
+// registers for arithmetic, compares, and the ABI.
+
+#define ENABLE_CODE_GEN 1
+#define ENABLE_CODE_CACHE 0
+#define ENABLE_INLINING 0
+#define ENABLE_PROFILE 0
+
+typedef int32_t ir_ref;
+typedef uint32_t ir_op;
+typedef uint8_t ir_type;
+typedef struct _ir_baseline_code_buffer {
+  void* start;
+  void* end;
+  void* pos;
+} ir_code_buffer;
+typedef union _ir_val {
+  double d;
+  float f;
+  uint64_t u64;
+  int64_t i64;
+} ir_val;
+
+typedef struct BlValue {
+  uint8_t kind;
+  ir_type type;
+  uint8_t arm;  // For BLK_IF: which arm has been started first.
+  int32_t disp;
+  uint64_t imm;
+} BlValue;
+
+typedef struct _ir_baseline_ctx {
+  ir_type ret_type;
+  int mflags;
+  ir_code_buffer* code_buffer;
+
+  BlValue* values;
+  int32_t num_values;
+  int32_t cap_values;
+  int32_t frame_size;
+  int32_t func_start;
+  int32_t frame_patch;
+  int32_t probe_patch;
+  int32_t skip_patch;  // jmp in the parent's code over this function, or -1.
+  int32_t label_pos;   // Most recent offset that something jumps to.
+  ir_ref pending[2];   // ENDs of a MERGE_2 that haven't been bound yet.
+  int num_pending;
+  int num_gp_params;
+  int num_fp_params;
+  int num_stack_params;
+  ir_ref rax_holds;  // Value that's in rax as a reader would load it, if any.
+} ir_ctx;
+
+#define IR_UNUSED 0
+
+#define IR_VOID 0
+#define IR_BOOL 1
+#define IR_U8 2
+#define IR_U16 3
+#define IR_U32 4
+#define IR_U64 5
+#define IR_ADDR 6
+#define IR_I8 7
+#define IR_I16 8
+#define IR_I32 9
+#define IR_I64 10
+#define IR_DOUBLE 11
+#define IR_FLOAT 12
+
+#define IR_EQ 10
+#define IR_NE 11
+#define IR_LE 12
+#define IR_LT 13
+#define IR_GE 14
+#define IR_GT 15
+#define IR_ULE 16
+#define IR_ULT 17
+#define IR_UGE 18
+#define IR_UGT 19
+#define IR_ADD 20
+#define IR_SUB 21
+#define IR_MUL 22
+#define IR_DIV 23
+#define IR_MOD 24
+#define IR_OR 25
+#define IR_AND 26
+#define IR_XOR 27
+#define IR_SHL 28
+#define IR_SHR 29
+#define IR_SAR 30
+#define IR_NOT 31
+#define IR_NEG 32
+#define IR_SEXT 33
+#define IR_ZEXT 34
+#define IR_TRUNC 35
+#define IR_BITCAST 36
+
+#define IR_FUNCTION 0
+#define IR_OPT_FOLDING 0
+#define IR_OPT_MEM2SSA 0
+
+#define IR_X86_SSE2 0
+#define IR_X86_SSE3 0
+#define IR_X86_SSSE3 0
+#define IR_X86_SSE41 0
+#define IR_X86_SSE42 0
+#define IR_X86_AVX 0
+#define IR_X86_AVX2 0
+#define IR_X86_BMI1 0
+#define IR_X86_CLDEMOTE 0
+
+// These are the real ones from ir.c, for the code buffer.
+void* ir_mem_mmap(size_t size);
+int ir_mem_unmap(void* ptr, size_t size);
+int ir_mem_protect(void* ptr, size_t size);
+int ir_mem_unprotect(void* ptr, size_t size);
+int ir_mem_flush(void* ptr, size_t size);
+
+static void bl_init(ir_ctx* ctx);
+static void bl_free(ir_ctx* ctx);
+static void* bl_finish(ir_ctx* ctx, size_t* size);
+static ir_ref bl_const(ir_ctx* ctx, ir_type type, uint64_t bits);
+static ir_ref bl_const_float(ir_ctx* ctx, float f);
+static ir_ref bl_const_double(ir_ctx* ctx, double d);
+static ir_ref bl_binary(ir_ctx* ctx, ir_op op, ir_type type, ir_ref a, ir_ref b);
+static ir_ref bl_add_offset(ir_ctx* ctx, ir_ref addr, uintptr_t offset);
+static ir_ref bl_cmp(ir_ctx* ctx, ir_op op, ir_ref a, ir_ref b);
+static ir_ref bl_unary(ir_ctx* ctx, ir_op op, ir_type type, ir_ref a);
+static ir_ref bl_cond(ir_ctx* ctx, ir_type type, ir_ref c, ir_ref a, ir_ref b);
+static ir_ref bl_load(ir_ctx* ctx, ir_type type, ir_ref addr);
+static void bl_store(ir_ctx* ctx, ir_ref addr, ir_ref val);
+static ir_ref bl_var(ir_ctx* ctx, ir_type type);
+static ir_ref bl_vaddr(ir_ctx* ctx, ir_ref var);
+static ir_ref bl_vload(ir_ctx* ctx, ir_type type, ir_ref var);
+static void bl_vstore(ir_ctx* ctx, ir_ref var, ir_ref val);
+static ir_ref bl_alloca(ir_ctx* ctx, ir_ref size);
+static ir_ref bl_frame_addr(ir_ctx* ctx);
+static void bl_start(ir_ctx* ctx);
+static ir_ref bl_param(ir_ctx* ctx, ir_type type, int num);
+static void bl_return(ir_ctx* ctx, ir_ref val);
+static void bl_unreachable(ir_ctx* ctx);
+static ir_ref bl_call(ir_ctx* ctx, ir_type type, ir_ref func, int count, ir_ref* args);
+static ir_ref bl_rload(ir_ctx* ctx, ir_type type, int reg);
+static ir_ref bl_end(ir_ctx* ctx);
+static ir_ref bl_if(ir_ctx* ctx, ir_ref cond);
+static void bl_if_arm(ir_ctx* ctx, ir_ref iff, bool is_true);
+static void bl_merge_with_empty_false(ir_ctx* ctx, ir_ref iff);
+static void bl_merge_2(ir_ctx* ctx, ir_ref a, ir_ref b);
+static ir_ref bl_phi_2(ir_ctx* ctx, ir_type type, ir_ref a, ir_ref b);
+static void bl_phi_set_op(ir_ctx* ctx, ir_ref phi, int pos, ir_ref val);
+static ir_ref bl_loop_begin(ir_ctx* ctx, ir_ref end);
+static void bl_merge_set_op(ir_ctx* ctx, ir_ref loop, int pos, ir_ref end);
+
+#define ir_init(_ctx, _flags, _consts, _insns) bl_init(_ctx)
+#define ir_free(_ctx) bl_free(_ctx)
+#define ir_check(_ctx) 1
+#define ir_save(_ctx, _flags, _f) ((void)0)
+#define ir_dump_dot(_ctx, _name, _f) ((void)(_f))
+#define ir_consistency_check() ((void)0)
+
+#define ir_const(_ctx, _val, _type) bl_const((_ctx), (_type), (_val).u64)
+#define ir_CONST_BOOL(_val) bl_const(_ir_CTX, IR_BOOL, (uint64_t)(bool)(_val))
+#define ir_CONST_U8(_val) bl_const(_ir_CTX, IR_U8, (uint64_t)(uint8_t)(_val))
+#define ir_CONST_U16(_val) bl_const(_ir_CTX, IR_U16, (uint64_t)(uint16_t)(_val))
+#define ir_CONST_U32(_val) bl_const(_ir_CTX, IR_U32, (uint64_t)(uint32_t)(_val))
+#define ir_CONST_U64(_val) bl_const(_ir_CTX, IR_U64, (uint64_t)(_val))
+#define ir_CONST_ADDR(_val) bl_const(_ir_CTX, IR_ADDR, (uint64_t)(uintptr_t)(_val))
+#define ir_CONST_I8(_val) bl_const(_ir_CTX, IR_I8, (uint64_t)(int64_t)(int8_t)(_val))
+#define ir_CONST_I16(_val) bl_const(_ir_CTX, IR_I16, (uint64_t)(int64_t)(int16_t)(_val))
+#define ir_CONST_I32(_val) bl_const(_ir_CTX, IR_I32, (uint64_t)(int64_t)(int32_t)(_val))
+#define ir_CONST_I64(_val) bl_const(_ir_CTX, IR_I64, (uint64_t)(int64_t)(_val))
+#define ir_CONST_FLOAT(_val) bl_const_float(_ir_CTX, (_val))
+#define ir_CONST_DOUBLE(_val) bl_const_double(_ir_CTX, (_val))
+
+#define ir_BINARY_OP(_op, _t, _op1, _op2) bl_binary(_ir_CTX, (_op), (_t), (_op1), (_op2))
+#define ir_ADD_A(_op1, _op2) bl_binary(_ir_CTX, IR_ADD, IR_ADDR, (_op1), (_op2))
+#define ir_ADD_U32(_op1, _op2) bl_binary(_ir_CTX, IR_ADD, IR_U32, (_op1), (_op2))
+#define ir_ADD_U64(_op1, _op2) bl_binary(_ir_CTX, IR_ADD, IR_U64, (_op1), (_op2))
+#define ir_ADD_I64(_op1, _op2) bl_binary(_ir_CTX, IR_ADD, IR_I64, (_op1), (_op2))
+// Values are only ever copied when they're read, so there's nothing to do.
+#define ir_COPY(_type, _op1) (_op1)
+#define ir_COPY_A(_op1) (_op1)
+#define ir_COPY_I64(_op1) (_op1)
+#define ir_SUB_I64(_op1, _op2) bl_binary(_ir_CTX, IR_SUB, IR_I64, (_op1), (_op2))
+#define ir_DIV_I64(_op1, _op2) bl_binary(_ir_CTX, IR_DIV, IR_I64, (_op1), (_op2))
+#define ir_OR_I64(_op1, _op2) bl_binary(_ir_CTX, IR_OR, IR_I64, (_op1), (_op2))
+#define ir_XOR_I64(_op1, _op2) bl_binary(_ir_CTX, IR_XOR, IR_I64, (_op1), (_op2))
+#define ir_SAR_I64(_op1, _op2) bl_binary(_ir_CTX, IR_SAR, IR_I64, (_op1), (_op2))
+#define ir_MUL(_t, _op1, _op2) bl_binary(_ir_CTX, IR_MUL, (_t), (_op1), (_op2))
+#define ir_MUL_U64(_op1, _op2) bl_binary(_ir_CTX, IR_MUL, IR_U64, (_op1), (_op2))
+#define ir_ADD_OFFSET(_addr, _offset) bl_add_offset(_ir_CTX, (_addr), (_offset))
+
+#define ir_CMP_OP(_op, _op1, _op2) bl_cmp(_ir_CTX, (_op), (_op1), (_op2))
+#define ir_EQ(_op1, _op2) bl_cmp(_ir_CTX, IR_EQ, (_op1), (_op2))
+#define ir_LT(_op1, _op2) bl_cmp(_ir_CTX, IR_LT, (_op1), (_op2))
+#define ir_GT(_op1, _op2) bl_cmp(_ir_CTX, IR_GT, (_op1), (_op2))
+#define ir_ULT(_op1, _op2) bl_cmp(_ir_CTX, IR_ULT, (_op1), (_op2))
+
+#define ir_NEG(_t, _op1) bl_unary(_ir_CTX, IR_NEG, (_t), (_op1))
+#define ir_NOT(_t, _op1) bl_unary(_ir_CTX, IR_NOT, (_t), (_op1))
+#define ir_SEXT(_t, _op1) bl_unary(_ir_CTX, IR_SEXT, (_t), (_op1))
+#define ir_ZEXT(_t, _op1) bl_unary(_ir_CTX, IR_ZEXT, (_t), (_op1))
+#define ir_ZEXT_U32(_op1) bl_unary(_ir_CTX, IR_ZEXT, IR_U32, (_op1))
+#define ir_TRUNC(_t, _op1) bl_unary(_ir_CTX, IR_TRUNC, (_t), (_op1))
+#define ir_BITCAST(_t, _op1) bl_unary(_ir_CTX, IR_BITCAST, (_t), (_op1))
+#define ir_COND(_t, _op1, _op2, _op3) bl_cond(_ir_CTX, (_t), (_op1), (_op2), (_op3))
+
+#define ir_LOAD(_type, _addr) bl_load(_ir_CTX, (_type), (_addr))
+#define ir_LOAD_U32(_addr) bl_load(_ir_CTX, IR_U32, (_addr))
+#define ir_LOAD_U64(_addr) bl_load(_ir_CTX, IR_U64, (_addr))
+#define ir_LOAD_I64(_addr) bl_load(_ir_CTX, IR_I64, (_addr))
+#define ir_STORE(_addr, _val) bl_store(_ir_CTX, (_addr), (_val))
+#define ir_VAR(_type, _name) bl_var(_ir_CTX, (_type))
+#define ir_VADDR(_var) bl_vaddr(_ir_CTX, (_var))
+#define ir_VLOAD(_type, _var) bl_vload(_ir_CTX, (_type), (_var))
+#define ir_VLOAD_U64(_var) bl_vload(_ir_CTX, IR_U64, (_var))
+#define ir_VSTORE(_var, _val) bl_vstore(_ir_CTX, (_var), (_val))
+#define ir_ALLOCA(_size) bl_alloca(_ir_CTX, (_size))
+#define ir_FRAME_ADDR() bl_frame_addr(_ir_CTX)
+
+#define ir_START() bl_start(_ir_CTX)
+#define ir_PARAM(_type, _name, _num) bl_param(_ir_CTX, (_type), (_num))
+#define ir_RETURN(_val) bl_return(_ir_CTX, (_val))
+#define ir_UNREACHABLE() bl_unreachable(_ir_CTX)
+#define ir_CALL_1(_type, _func, _a1) bl_call(_ir_CTX, (_type), (_func), 1, (ir_ref[]){(_a1)})
+#define ir_CALL_2(_type, _func, _a1, _a2) \
+  bl_call(_ir_CTX, (_type), (_func), 2, (ir_ref[]){(_a1), (_a2)})
+#define ir_CALL_3(_type, _func, _a1, _a2, _a3) \
+  bl_call(_ir_CTX, (_type), (_func), 3, (ir_ref[]){(_a1), (_a2), (_a3)})
+#define ir_CALL_4(_type, _func, _a1, _a2, _a3, _a4) \
+  bl_call(_ir_CTX, (_type), (_func), 4, (ir_ref[]){(_a1), (_a2), (_a3), (_a4)})
+#define ir_CALL_N(_type, _func, _count, _args) \
+  bl_call(_ir_CTX, (_type), (_func), (_count), (_args))
+// Only for the second return register, right after a CALL.
+#define ir_RLOAD(_type, _reg) bl_rload(_ir_CTX, (_type), (_reg))
+#define IR_REG_RAX 0
+#define IR_REG_RDX 2
+#define IR_REG_XMM0 16
+#define IR_REG_XMM1 17
+
+#define ir_END() bl_end(_ir_CTX)
+#define ir_IF(_cond) bl_if(_ir_CTX, (_cond))
+#define ir_IF_TRUE(_if) bl_if_arm(_ir_CTX, (_if), true)
+#define ir_IF_TRUE_cold(_if) bl_if_arm(_ir_CTX, (_if), true)
+#define ir_IF_FALSE(_if) bl_if_arm(_ir_CTX, (_if), false)
+#define ir_IF_FALSE_cold(_if) bl_if_arm(_ir_CTX, (_if), false)
+#define ir_MERGE_WITH_EMPTY_FALSE(_if) bl_merge_with_empty_false(_ir_CTX, (_if))
+#define ir_MERGE_2(_src1, _src2) bl_merge_2(_ir_CTX, (_src1), (_src2))
+#define ir_PHI_2(_type, _src1, _src2) bl_phi_2(_ir_CTX, (_type), (_src1), (_src2))
+#define ir_PHI_SET_OP(_ref, _pos, _src) bl_phi_set_op(_ir_CTX, (_ref), (_pos), (_src))
+#define ir_LOOP_BEGIN(_src1) bl_loop_begin(_ir_CTX, (_src1))
+#define ir_LOOP_END() bl_end(_ir_CTX)
+#define ir_MERGE_SET_OP(_ref, _pos, _src) bl_merge_set_op(_ir_CTX, (_ref), (_pos), (_src))
+
+#define _ir_CTX (&parser.cur_scope->ctx)
+
+// Closest thing to IR instructions here is the values, for --stats.
+#define ir_insns_count(ctx) ((ctx)->num_values)
+
+#include "parse.c"
+
+// There's no backend pipeline here, all the code has already been emitted, so
+// --time-phases reports everything but the final patching as front end.
+static void* jit_compile(ir_ctx* ctx, int opt_level, size_t* size) {
+  (void)opt_level;
+  return bl_finish(ctx, size);
+}
+
+typedef enum BlKind {
+  BLK_NONE,
+  BLK_CONST,  // imm holds the bits.
+  BLK_SLOT,   // Value lives at [rbp+disp].
+  BLK_VAR,    // Variable storage at [rbp+disp].
+  BLK_FRAME,  // The address rbp+disp, materialized with lea when used.
+  BLK_IF,     // disp is the rel32 of the jcc.
+  BLK_END,    // disp is the rel32 of the jmp.
+  BLK_LOOP,   // disp is the code offset of the loop header.
+} BlKind;
+
+enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R8 = 8,
+  R9 = 9,
+  R11 = 11,
+};
+
+#define BL_MAX_NESTED_FUNCS 64
+static ir_ctx* bl_ctx_stack[BL_MAX_NESTED_FUNCS];
+static int bl_num_ctxs;
+
+//
+// Emission.
+//
+
+static inline int32_t bl_pos(void) {
+  return (int32_t)((uint8_t*)parser.code_buffer.pos - (uint8_t*)parser.code_buffer.start);
+}
+
+static inline uint8_t* bl_at(int32_t pos) {
+  return (uint8_t*)parser.code_buffer.start + pos;
+}
+
+static inline void bl_set_pos(int32_t pos) {
+  parser.code_buffer.pos = bl_at(pos);
+}
+
+static inline uint8_t* bl_reserve(size_t n) {
+  uint8_t* p = parser.code_buffer.pos;
+  if (BRANCH_UNLIKELY(p + n > (uint8_t*)parser.code_buffer.end)) {
+    error("Out of code buffer space.");
+  }
+  parser.code_buffer.pos = p + n;
+  return p;
+}
+
+static inline void bl_emit(const uint8_t* stencil, size_t n) {
+  memcpy(bl_reserve(n), stencil, n);
+}
+
+static inline void bl_emit1(uint8_t b) {
+  *bl_reserve(1) = b;
+}
+
+static inline void bl_emit4(uint32_t v) {
+  memcpy(bl_reserve(4), &v, 4);
+}
+
+static inline void bl_emit8(uint64_t v) {
+  memcpy(bl_reserve(8), &v, 8);
+}
+
+#define BL_EMIT(...)                             \
+  do {                                           \
+    static const uint8_t _st[] = {__VA_ARGS__};  \
+    bl_emit(_st, sizeof(_st));                   \
+  } while (0)
+
+static inline void bl_patch4(int32_t at, uint32_t v) {
+  memcpy(bl_at(at), &v, 4);
+}
+
+static inline void bl_patch_rel32(int32_t site, int32_t target) {
+  bl_patch4(site, (uint32_t)(target - (site + 4)));
+}
+
+static inline uint8_t bl_rex(bool w, int reg, int rm) {
+  return 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | ((rm >> 3) & 1);
+}
+
+// [prefix] [REX] opcode... modrm(reg, base) [sib] disp8/disp32
+static void bl_mem(uint8_t prefix, bool w, const uint8_t* op, int oplen, int reg, int base,
+                   int32_t disp) {
+  if (prefix) {
+    bl_emit1(prefix);
+  }
+  uint8_t rex = bl_rex(w, reg, base);
+  if (rex != 0x40) {
+    bl_emit1(rex);
+  }
+  bl_emit(op, oplen);
+  bool short_disp = disp == (int8_t)disp;
+  bl_emit1((short_disp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    bl_emit1(0x24);
+  }
+  if (short_disp) {
+    bl_emit1((uint8_t)disp);
+  } else {
+    bl_emit4((uint32_t)disp);
+  }
+}
+
+#define BL_MEM(prefix, w, reg, base, disp, ...)                    \
+  do {                                                            \
+    static const uint8_t _op[] = {__VA_ARGS__};                   \
+    bl_mem((prefix), (w), _op, sizeof(_op), (reg), (base), (disp)); \
+  } while (0)
+
+//
+// Types and values.
+//
+
+static const uint8_t bl_type_size[] = {
+    [IR_VOID] = 0, [IR_BOOL] = 1, [IR_U8] = 1,  [IR_U16] = 2,    [IR_U32] = 4,
+    [IR_U64] = 8,  [IR_ADDR] = 8, [IR_I8] = 1,  [IR_I16] = 2,    [IR_I32] = 4,
+    [IR_I64] = 8,  [IR_DOUBLE] = 8, [IR_FLOAT] = 4,
+};
+
+static inline bool bl_type_is_signed(ir_type t) {
+  return t >= IR_I8 && t <= IR_I64;
+}
+
+static inline bool bl_type_is_fp(ir_type t) {
+  return t == IR_DOUBLE || t == IR_FLOAT;
+}
+
+static uint64_t bl_extend(uint64_t bits, ir_type t) {
+  switch (bl_type_size[t]) {
+    case 1:
+      return bl_type_is_signed(t) ? (uint64_t)(int64_t)(int8_t)bits : (uint8_t)bits;
+    case 2:
+      return bl_type_is_signed(t) ? (uint64_t)(int64_t)(int16_t)bits : (uint16_t)bits;
+    case 4:
+      return bl_type_is_signed(t) ? (uint64_t)(int64_t)(int32_t)bits : (uint32_t)bits;
+    default:
+      return bits;
+  }
+}
+
+static ir_ref bl_new(ir_ctx* ctx, BlKind kind, ir_type type) {
+  if (BRANCH_UNLIKELY(ctx->num_values == ctx->cap_values)) {
+    ctx->cap_values *= 2;
+    ctx->values = arena_ir_realloc(ctx->values, ctx->cap_values * sizeof(BlValue));
+  }
+  ir_ref ref = ctx->num_values++;
+  ctx->values[ref] = (BlValue){.kind = kind, .type = type};
+  return ref;
+}
+
+static inline BlValue* bl_val(ir_ctx* ctx, ir_ref ref) {
+  ASSERT(ref > 0 && ref < ctx->num_values);
+  return &ctx->values[ref];
+}
+
+static int32_t bl_alloc_frame(ir_ctx* ctx, int32_t size, int32_t align) {
+  ctx->frame_size = ALIGN_UP(ctx->frame_size + size, align);
+  return -ctx->frame_size;
+}
+
+static ir_ref bl_new_slot(ir_ctx* ctx, ir_type type) {
+  ir_ref ref = bl_new(ctx, BLK_SLOT, type);
+  ctx->values[ref].disp = bl_alloc_frame(ctx, 8, 8);
+  return ref;
+}
+
+//
+// Templates for moving values around.
+//
+
+static void bl_mov_imm(int reg, uint64_t imm) {
+  if (imm == 0) {
+    // xor r32, r32
+    if (reg >= 8) {
+      bl_emit1(bl_rex(false, reg, reg));
+    }
+    bl_emit1(0x31);
+    bl_emit1(0xc0 | ((reg & 7) << 3) | (reg & 7));
+  } else if (imm == (uint32_t)imm) {
+    // mov r32, imm32
+    if (reg >= 8) {
+      bl_emit1(bl_rex(false, 0, reg));
+    }
+    bl_emit1(0xb8 | (reg & 7));
+    bl_emit4((uint32_t)imm);
+  } else if ((int64_t)imm == (int32_t)imm) {
+    // mov r64, simm32
+    bl_emit1(bl_rex(true, 0, reg));
+    bl_emit1(0xc7);
+    bl_emit1(0xc0 | (reg & 7));
+    bl_emit4((uint32_t)imm);
+  } else {
+    // mov r64, imm64
+    bl_emit1(bl_rex(true, 0, reg));
+    bl_emit1(0xb8 | (reg & 7));
+    bl_emit8(imm);
+  }
+}
+
+// Load with extension from the width and signedness of |type|.
+static void bl_load_mem(ir_type type, int reg, int base, int32_t disp) {
+  switch (type) {
+    case IR_BOOL:
+    case IR_U8:
+      BL_MEM(0, true, reg, base, disp, 0x0f, 0xb6);  // movzx
+      break;
+    case IR_I8:
+      BL_MEM(0, true, reg, base, disp, 0x0f, 0xbe);  // movsx
+      break;
+    case IR_U16:
+      BL_MEM(0, true, reg, base, disp, 0x0f, 0xb7);  // movzx
+      break;
+    case IR_I16:
+      BL_MEM(0, true, reg, base, disp, 0x0f, 0xbf);  // movsx
+      break;
+    case IR_U32:
+    case IR_FLOAT:
+      BL_MEM(0, false, reg, base, disp, 0x8b);  // mov r32
+      break;
+    case IR_I32:
+      BL_MEM(0, true, reg, base, disp, 0x63);  // movsxd
+      break;
+    default:
+      BL_MEM(0, true, reg, base, disp, 0x8b);  // mov r64
+      break;
+  }
+}
+
+static void bl_store_mem(ir_type type, int reg, int base, int32_t disp) {
+  switch (bl_type_size[type]) {
+    case 1:
+      ASSERT(reg < 4 || reg >= 8);
+      BL_MEM(0, false, reg, base, disp, 0x88);
+      break;
+    case 2:
+      BL_MEM(0x66, false, reg, base, disp, 0x89);
+      break;
+    case 4:
+      BL_MEM(0, false, reg, base, disp, 0x89);
+      break;
+    default:
+      BL_MEM(0, true, reg, base, disp, 0x89);
+      break;
+  }
+}
+
+static inline void bl_store_slot(int reg, int32_t disp) {
+  BL_MEM(0, true, reg, RBP, disp, 0x89);
+}
+
+static void bl_load_gpr(ir_ctx* ctx, int reg, ir_ref ref) {
+  if (reg == RAX) {
+    if (ctx->rax_holds == ref) {
+      return;
+    }
+    ctx->rax_holds = ref;
+  }
+  BlValue* v = bl_val(ctx, ref);
+  switch (v->kind) {
+    case BLK_CONST:
+      bl_mov_imm(reg, bl_extend(v->imm, v->type));
+      break;
+    case BLK_SLOT:
+    case BLK_VAR:
+      bl_load_mem(v->type, reg, RBP, v->disp);
+      break;
+    case BLK_FRAME:
+      BL_MEM(0, true, reg, RBP, v->disp, 0x8d);  // lea
+      break;
+    default:
+      error("internal error: not a value in baseline codegen.");
+  }
+}
+
+static void bl_load_xmm(ir_ctx* ctx, int xreg, ir_ref ref) {
+  BlValue* v = bl_val(ctx, ref);
+  if (v->kind == BLK_SLOT || v->kind == BLK_VAR) {
+    // movss/movsd xmm, m
+    BL_MEM(v->type == IR_FLOAT ? 0xf3 : 0xf2, false, xreg, RBP, v->disp, 0x0f, 0x10);
+  } else {
+    // Via rax; movq xmm, rax
+    bl_load_gpr(ctx, RAX, ref);
+    bl_emit1(0x66);
+    bl_emit1(bl_rex(true, xreg, RAX));
+    bl_emit1(0x0f);
+    bl_emit1(0x6e);
+    bl_emit1(0xc0 | ((xreg & 7) << 3));
+  }
+}
+
+static inline void bl_store_xmm_slot(int xreg, int32_t disp) {
+  BL_MEM(0xf2, false, xreg, RBP, disp, 0x0f, 0x11);  // movsd m, xmm
+}
+
+// Returns the offset of the rel32 to be patched.
+static int32_t bl_jmp(void) {
+  bl_emit1(0xe9);
+  int32_t site = bl_pos();
+  bl_emit4(0);
+  return site;
+}
+
+//
+// Control flow.
+//
+// Blocks are laid out in the order that parse.c starts them, so most of the
+// time the target of a jump is the very next thing. For ENDs, the trailing jmp
+// is removed again if nothing else has been bound to the position after it.
+// For IFs, the jcc is flipped so that whichever arm is started first falls
+// through.
+//
+
+static void bl_bind_ends(ir_ctx* ctx, ir_ref* ends, int num_ends) {
+  bool bound[2] = {false, false};
+  ctx->rax_holds = IR_UNUSED;
+  ASSERT(num_ends <= 2);
+  for (bool again = true; again;) {
+    again = false;
+    for (int i = 0; i < num_ends; ++i) {
+      int32_t site = bl_val(ctx, ends[i])->disp;
+      if (!bound[i] && bl_pos() == site + 4 && ctx->label_pos != bl_pos()) {
+        bl_set_pos(site - 1);
+        bound[i] = true;
+        again = true;
+      }
+    }
+  }
+  for (int i = 0; i < num_ends; ++i) {
+    if (!bound[i]) {
+      bl_patch_rel32(bl_val(ctx, ends[i])->disp, bl_pos());
+      ctx->label_pos = bl_pos();
+    }
+  }
+}
+
+// Anything that emits code has to call this first so that a preceding
+// MERGE_2 lands in the right spot.
+static inline void bl_flush(ir_ctx* ctx) {
+  if (ctx->num_pending) {
+    bl_bind_ends(ctx, ctx->pending, ctx->num_pending);
+    ctx->num_pending = 0;
+  }
+}
+
+static ir_ref bl_end(ir_ctx* ctx) {
+  bl_flush(ctx);
+  ir_ref ref = bl_new(ctx, BLK_END, IR_VOID);
+  ctx->values[ref].disp = bl_jmp();
+  ctx->rax_holds = IR_UNUSED;
+  return ref;
+}
+
+static ir_ref bl_if(ir_ctx* ctx, ir_ref cond) {
+  bl_flush(ctx);
+  bl_load_gpr(ctx, RAX, cond);
+  BL_EMIT(0x48, 0x85, 0xc0);  // test rax, rax
+  BL_EMIT(0x0f, 0x84);        // jz/jnz, decided by whichever arm starts first.
+  ir_ref ref = bl_new(ctx, BLK_IF, IR_VOID);
+  ctx->values[ref].disp = bl_pos();
+  bl_emit4(0);
+  return ref;
+}
+
+static void bl_if_arm(ir_ctx* ctx, ir_ref iff, bool is_true) {
+  bl_flush(ctx);
+  BlValue* v = bl_val(ctx, iff);
+  if (!v->arm) {
+    ASSERT(bl_pos() == v->disp + 4);
+    bl_at(v->disp)[-1] = is_true ? 0x84 : 0x85;
+    v->arm = is_true ? 1 : 2;
+  } else {
+    ASSERT(v->arm == (is_true ? 2 : 1));
+    bl_patch_rel32(v->disp, bl_pos());
+    ctx->label_pos = bl_pos();
+    ctx->rax_holds = IR_UNUSED;
+  }
+}
+
+static void bl_merge_with_empty_false(ir_ctx* ctx, ir_ref iff) {
+  bl_if_arm(ctx, iff, false);
+}
+
+static void bl_merge_2(ir_ctx* ctx, ir_ref a, ir_ref b) {
+  bl_flush(ctx);
+  ctx->pending[0] = a;
+  ctx->pending[1] = b;
+  ctx->num_pending = 2;
+}
+
+// Only ever directly after a MERGE_2, so each predecessor gets a little landing
+// pad that copies its value into the result before joining. Or, directly after
+// a LOOP_BEGIN with the back edge value still to come: then the entry value is
+// written first and the loop header moves past it, and bl_phi_set_op() writes
+// the back edge value before the LOOP_END.
+static ir_ref bl_phi_2(ir_ctx* ctx, ir_type type, ir_ref a, ir_ref b) {
+  if (b == IR_UNUSED) {
+    ir_ref loop = ctx->num_values - 1;
+    CHECK(bl_val(ctx, loop)->kind == BLK_LOOP && bl_val(ctx, loop)->disp == bl_pos());
+    ir_ref result = bl_new_slot(ctx, type);
+    bl_load_gpr(ctx, RAX, a);
+    bl_store_slot(RAX, ctx->values[result].disp);
+    bl_val(ctx, loop)->disp = bl_pos();
+    ctx->label_pos = bl_pos();
+    ctx->rax_holds = IR_UNUSED;
+    return result;
+  }
+
+  CHECK(ctx->num_pending == 2);
+  ctx->num_pending = 0;
+  ir_ref ends[2] = {ctx->pending[0], ctx->pending[1]};
+  ir_ref vals[2] = {a, b};
+  ir_ref result = bl_new_slot(ctx, type);
+  int32_t disp = ctx->values[result].disp;
+
+  int first = bl_pos() == bl_val(ctx, ends[1])->disp + 4 ? 1 : 0;
+  bl_bind_ends(ctx, &ends[first], 1);
+  bl_load_gpr(ctx, RAX, vals[first]);
+  bl_store_slot(RAX, disp);
+  int32_t join = bl_jmp();
+  bl_bind_ends(ctx, &ends[1 - first], 1);
+  bl_load_gpr(ctx, RAX, vals[1 - first]);
+  bl_store_slot(RAX, disp);
+  bl_patch_rel32(join, bl_pos());
+  ctx->label_pos = bl_pos();
+  ctx->rax_holds = IR_UNUSED;
+  return result;
+}
+
+static void bl_phi_set_op(ir_ctx* ctx, ir_ref phi, int pos, ir_ref val) {
+  ASSERT(pos == 2);
+  bl_flush(ctx);
+  bl_load_gpr(ctx, RAX, val);
+  bl_store_slot(RAX, bl_val(ctx, phi)->disp);
+  ctx->rax_holds = IR_UNUSED;
+}
+
+static ir_ref bl_loop_begin(ir_ctx* ctx, ir_ref end) {
+  bl_flush(ctx);
+  bl_bind_ends(ctx, &end, 1);
+  ctx->label_pos = bl_pos();
+  ir_ref ref = bl_new(ctx, BLK_LOOP, IR_VOID);
+  ctx->values[ref].disp = bl_pos();
+  return ref;
+}
+
+static void bl_merge_set_op(ir_ctx* ctx, ir_ref loop, int pos, ir_ref end) {
+  ASSERT(pos == 2);
+  bl_patch_rel32(bl_val(ctx, end)->disp, bl_val(ctx, loop)->disp);
+}
+
+//
+// Functions.
+//
+
+static void bl_init(ir_ctx* ctx) {
+  CHECK(bl_num_ctxs < BL_MAX_NESTED_FUNCS);
+  ctx->skip_patch = -1;
+  if (bl_num_ctxs > 0) {
+    // Nested functions are emitted in the middle of their parent, so jump
+    // over them.
+    ir_ctx* parent = bl_ctx_stack[bl_num_ctxs - 1];
+    bl_flush(parent);
+    ctx->skip_patch = bl_jmp();
+  }
+  bl_ctx_stack[bl_num_ctxs++] = ctx;
+
+  ctx->cap_values = 1024;
+  ctx->values = arena_ir_malloc(ctx->cap_values * sizeof(BlValue));
+  ctx->num_values = 1;  // IR_UNUSED
+  ctx->frame_size = 0;
+  ctx->func_start = -1;
+  ctx->frame_patch = -1;
+  ctx->probe_patch = -1;
+  ctx->label_pos = -1;
+  ctx->num_pending = 0;
+  ctx->num_gp_params = 0;
+  ctx->num_fp_params = 0;
+  ctx->num_stack_params = 0;
+  ctx->rax_holds = IR_UNUSED;
+}
+
+static void bl_free(ir_ctx* ctx) {
+  ASSERT(bl_num_ctxs > 0 && bl_ctx_stack[bl_num_ctxs - 1] == ctx);
+  --bl_num_ctxs;
+  if (ctx->skip_patch >= 0) {
+    ir_ctx* parent = bl_ctx_stack[bl_num_ctxs - 1];
+    bl_patch_rel32(ctx->skip_patch, bl_pos());
+    parent->label_pos = bl_pos();
+    parent->rax_holds = IR_UNUSED;
+  }
+}
+
+static void bl_start(ir_ctx* ctx) {
+  int32_t aligned = ALIGN_UP(bl_pos(), 16);
+  memset(bl_reserve(aligned - bl_pos()), 0xcc, aligned - bl_pos());
+  ctx->func_start = bl_pos();
+  BL_EMIT(0x55,              // push rbp
+          0x48, 0x89, 0xe5);  // mov rbp, rsp
+#if OS_WINDOWS
+  // Touch each page of the frame in order so that the guard page moves along.
+  bl_emit1(0xb8);  // mov eax, frame_size
+  ctx->probe_patch = bl_pos();
+  bl_emit4(0);
+  BL_EMIT(0x49, 0x89, 0xe3,                          // mov r11, rsp
+          0x48, 0x3d, 0x00, 0x10, 0x00, 0x00,        // 1: cmp rax, 4096
+          0x72, 0x12,                                // jb 2f
+          0x49, 0x81, 0xeb, 0x00, 0x10, 0x00, 0x00,  // sub r11, 4096
+          0x41, 0x85, 0x03,                          // test [r11], eax
+          0x48, 0x2d, 0x00, 0x10, 0x00, 0x00,        // sub rax, 4096
+          0xeb, 0xe6);                               // jmp 1b
+                                                     // 2:
+#endif
+  BL_EMIT(0x48, 0x81, 0xec);  // sub rsp, frame_size
+  ctx->frame_patch = bl_pos();
+  bl_emit4(0);
+}
+
+static void* bl_finish(ir_ctx* ctx, size_t* size) {
+  uint32_t frame = ALIGN_UP(ctx->frame_size, 16);
+#if OS_WINDOWS
+  bl_patch4(ctx->probe_patch, frame);
+#endif
+  bl_patch4(ctx->frame_patch, frame);
+  *size = bl_pos() - ctx->func_start;
+  return bl_at(ctx->func_start);
+}
+
+static ir_ref bl_param(ir_ctx* ctx, ir_type type, int num) {
+  ir_ref ref = bl_new(ctx, BLK_SLOT, type);
+  BlValue* v = &ctx->values[ref];
+  bool fp = bl_type_is_fp(type);
+#if OS_WINDOWS
+  static const int gp_regs[] = {RCX, RDX, R8, R9};
+  int index = num - 1;
+  if (index < 4) {
+    v->disp = bl_alloc_frame(ctx, 8, 8);
+    if (fp) {
+      bl_store_xmm_slot(index, v->disp);
+    } else {
+      bl_store_slot(gp_regs[index], v->disp);
+    }
+  } else {
+    v->disp = 16 + 8 * index;
+  }
+#else
+  static const int gp_regs[] = {RDI, RSI, RDX, RCX, R8, R9};
+  if (fp && ctx->num_fp_params < 8) {
+    v->disp = bl_alloc_frame(ctx, 8, 8);
+    bl_store_xmm_slot(ctx->num_fp_params++, v->disp);
+  } else if (!fp && ctx->num_gp_params < 6) {
+    v->disp = bl_alloc_frame(ctx, 8, 8);
+    bl_store_slot(gp_regs[ctx->num_gp_params++], v->disp);
+  } else {
+    v->disp = 16 + 8 * ctx->num_stack_params++;
+  }
+#endif
+  return ref;
+}
+
+static void bl_return(ir_ctx* ctx, ir_ref val) {
+  bl_flush(ctx);
+  if (val != IR_UNUSED) {
+    if (bl_type_is_fp(ctx->ret_type)) {
+      bl_load_xmm(ctx, 0, val);
+    } else {
+      bl_load_gpr(ctx, RAX, val);
+    }
+  }
+  BL_EMIT(0x48, 0x89, 0xec,  // mov rsp, rbp
+          0x5d,              // pop rbp
+          0xc3);             // ret
+  ctx->rax_holds = IR_UNUSED;
+}
+
+static void bl_unreachable(ir_ctx* ctx) {
+  bl_flush(ctx);
+  BL_EMIT(0x0f, 0x0b);  // ud2
+  ctx->rax_holds = IR_UNUSED;
+}
+
+static ir_ref bl_call(ir_ctx* ctx, ir_type type, ir_ref func, int count, ir_ref* args) {
+  bl_flush(ctx);
+
+  // Where each argument goes: >= 0 is a register, < 0 is ~(stack offset).
+  int where[MAX_CALL_OPERANDS];
+  CHECK(count <= (int)COUNTOF(where));
+  int num_fp = 0;
+  int32_t stack_size;
+#if OS_WINDOWS
+  static const int gp_regs[] = {RCX, RDX, R8, R9};
+  for (int i = 0; i < count; ++i) {
+    bool fp = bl_type_is_fp(bl_val(ctx, args[i])->type);
+    if (i < 4) {
+      where[i] = fp ? i : gp_regs[i];
+      num_fp += fp;
+    } else {
+      where[i] = ~(32 + 8 * (i - 4));
+    }
+  }
+  stack_size = 32 + 8 * (count > 4 ? count - 4 : 0);
+#else
+  static const int gp_regs[] = {RDI, RSI, RDX, RCX, R8, R9};
+  int num_gp = 0;
+  int num_stack = 0;
+  for (int i = 0; i < count; ++i) {
+    bool fp = bl_type_is_fp(bl_val(ctx, args[i])->type);
+    if (fp && num_fp < 8) {
+      where[i] = num_fp++;
+    } else if (!fp && num_gp < 6) {
+      where[i] = gp_regs[num_gp++];
+    } else {
+      where[i] = ~(8 * num_stack++);
+    }
+  }
+  stack_size = 8 * num_stack;
+#endif
+  stack_size = ALIGN_UP(stack_size, 16);
+
+  if (stack_size) {
+    BL_EMIT(0x48, 0x81, 0xec);  // sub rsp, imm32
+    bl_emit4(stack_size);
+  }
+  for (int i = 0; i < count; ++i) {
+    if (where[i] < 0) {
+      bl_load_gpr(ctx, RAX, args[i]);
+      BL_MEM(0, true, RAX, RSP, ~where[i], 0x89);
+    }
+  }
+  for (int i = 0; i < count; ++i) {
+    if (where[i] >= 0) {
+      if (bl_type_is_fp(bl_val(ctx, args[i])->type)) {
+        bl_load_xmm(ctx, where[i], args[i]);
+      } else {
+        bl_load_gpr(ctx, where[i], args[i]);
+      }
+    }
+  }
+  bl_load_gpr(ctx, R11, func);
+#if !OS_WINDOWS
+  bl_emit1(0xb8);  // mov eax, num_fp (for varargs)
+  bl_emit4(num_fp);
+#endif
+  BL_EMIT(0x41, 0xff, 0xd3);  // call r11
+  ctx->rax_holds = IR_UNUSED;
+  if (stack_size) {
+    BL_EMIT(0x48, 0x81, 0xc4);  // add rsp, imm32
+    bl_emit4(stack_size);
+  }
+
+  if (type == IR_VOID) {
+    return IR_UNUSED;
+  }
+  ir_ref result = bl_new_slot(ctx, type);
+  if (bl_type_is_fp(type)) {
+    bl_store_xmm_slot(0, ctx->values[result].disp);
+  } else {
+    bl_store_slot(RAX, ctx->values[result].disp);
+    if (bl_type_size[type] == 8) {
+      ctx->rax_holds = result;
+    }
+  }
+  return result;
+}
+
+static ir_ref bl_rload(ir_ctx* ctx, ir_type type, int reg) {
+  ir_ref result = bl_new_slot(ctx, type);
+  if (reg >= IR_REG_XMM0) {
+    bl_store_xmm_slot(reg - IR_REG_XMM0, ctx->values[result].disp);
+  } else {
+    bl_store_slot(reg, ctx->values[result].disp);
+  }
+  return result;
+}
+
+//
+// Data.
+//
+
+static ir_ref bl_const(ir_ctx* ctx, ir_type type, uint64_t bits) {
+  ir_ref ref = bl_new(ctx, BLK_CONST, type);
+  ctx->values[ref].imm = bits;
+  return ref;
+}
+
+static ir_ref bl_const_float(ir_ctx* ctx, float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bl_const(ctx, IR_FLOAT, bits);
+}
+
+static ir_ref bl_const_double(ir_ctx* ctx, double d) {
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  return bl_const(ctx, IR_DOUBLE, bits);
+}
+
+static ir_ref bl_var(ir_ctx* ctx, ir_type type) {
+  ir_ref ref = bl_new(ctx, BLK_VAR, type);
+  ctx->values[ref].disp = bl_alloc_frame(ctx, 8, 8);
+  return ref;
+}
+
+static ir_ref bl_vaddr(ir_ctx* ctx, ir_ref var) {
+  ASSERT(bl_val(ctx, var)->kind == BLK_VAR);
+  ir_ref ref = bl_new(ctx, BLK_FRAME, IR_ADDR);
+  ctx->values[ref].disp = ctx->values[var].disp;
+  return ref;
+}
+
+static ir_ref bl_vload(ir_ctx* ctx, ir_type type, ir_ref var) {
+  bl_flush(ctx);
+  ASSERT(bl_val(ctx, var)->kind == BLK_VAR);
+  int32_t var_disp = ctx->values[var].disp;
+  ir_ref result = bl_new_slot(ctx, type);
+  bl_load_mem(type, RAX, RBP, var_disp);
+  bl_store_slot(RAX, ctx->values[result].disp);
+  ctx->rax_holds = result;
+  return result;
+}
+
+static void bl_vstore(ir_ctx* ctx, ir_ref var, ir_ref val) {
+  bl_flush(ctx);
+  ASSERT(bl_val(ctx, var)->kind == BLK_VAR);
+  bl_load_gpr(ctx, RAX, val);
+  bl_store_slot(RAX, ctx->values[var].disp);
+}
+
+// Everything is allocated in the frame rather than moving rsp, so locals
+// declared in a loop don't grow the stack.
+static ir_ref bl_alloca(ir_ctx* ctx, ir_ref size) {
+  BlValue* v = bl_val(ctx, size);
+  if (v->kind != BLK_CONST) {
+    // Below everything else; the frame is found through rbp so rsp can move.
+    // TODO: probing on Windows.
+    bl_flush(ctx);
+    bl_load_gpr(ctx, RAX, size);
+    BL_EMIT(0x48, 0x83, 0xc0, 0x0f);  // add rax, 15
+    BL_EMIT(0x48, 0x83, 0xe0, 0xf0);  // and rax, -16
+    BL_EMIT(0x48, 0x29, 0xc4);        // sub rsp, rax
+    BL_EMIT(0x48, 0x89, 0xe0);        // mov rax, rsp
+    ir_ref ref = bl_new_slot(ctx, IR_ADDR);
+    bl_store_slot(RAX, ctx->values[ref].disp);
+    ctx->rax_holds = ref;
+    return ref;
+  }
+  int32_t disp = bl_alloc_frame(ctx, ALIGN_UP((int32_t)v->imm, 16), 16);
+  ir_ref ref = bl_new(ctx, BLK_FRAME, IR_ADDR);
+  ctx->values[ref].disp = disp;
+  return ref;
+}
+
+// rbp, which is where IR's FRAME_ADDR is too when it has a frame pointer.
+static ir_ref bl_frame_addr(ir_ctx* ctx) {
+  ir_ref ref = bl_new(ctx, BLK_FRAME, IR_ADDR);
+  ctx->values[ref].disp = 0;
+  return ref;
+}
+
+// Loads through |addr| don't need to materialize it when it's in the frame.
+static void bl_address(ir_ctx* ctx, ir_ref addr, int scratch, int* base, int32_t* disp) {
+  BlValue* v = bl_val(ctx, addr);
+  if (v->kind == BLK_FRAME) {
+    *base = RBP;
+    *disp = v->disp;
+  } else {
+    bl_load_gpr(ctx, scratch, addr);
+    *base = scratch;
+    *disp = 0;
+  }
+}
+
+static ir_ref bl_load(ir_ctx* ctx, ir_type type, ir_ref addr) {
+  bl_flush(ctx);
+  int base;
+  int32_t disp;
+  bl_address(ctx, addr, RCX, &base, &disp);
+  ir_ref result = bl_new_slot(ctx, type);
+  bl_load_mem(type, RAX, base, disp);
+  bl_store_slot(RAX, ctx->values[result].disp);
+  ctx->rax_holds = result;
+  return result;
+}
+
+static void bl_store(ir_ctx* ctx, ir_ref addr, ir_ref val) {
+  bl_flush(ctx);
+  int base;
+  int32_t disp;
+  bl_address(ctx, addr, RCX, &base, &disp);
+  bl_load_gpr(ctx, RAX, val);
+  bl_store_mem(bl_val(ctx, val)->type, RAX, base, disp);
+}
+
+//
+// Arithmetic.
+//
+
+static bool bl_fold_binary(ir_op op, ir_type type, uint64_t a, uint64_t b, uint64_t* out) {
+  bool is_signed = bl_type_is_signed(type);
+  switch (op) {
+    case IR_ADD: *out = a + b; return true;
+    case IR_SUB: *out = a - b; return true;
+    case IR_MUL: *out = a * b; return true;
+    case IR_AND: *out = a & b; return true;
+    case IR_OR: *out = a | b; return true;
+    case IR_XOR: *out = a ^ b; return true;
+    case IR_SHL: *out = a << (b & 63); return true;
+    case IR_SHR: *out = a >> (b & 63); return true;
+    case IR_SAR: *out = (uint64_t)((int64_t)a >> (b & 63)); return true;
+    case IR_DIV:
+    case IR_MOD:
+      if (b == 0 || (is_signed && (int64_t)b == -1)) {
+        return false;
+      }
+      if (is_signed) {
+        *out = op == IR_DIV ? (uint64_t)((int64_t)a / (int64_t)b)
+                            : (uint64_t)((int64_t)a % (int64_t)b);
+      } else {
+        *out = op == IR_DIV ? a / b : a % b;
+      }
+      return true;
+    default:
+      return false;
+  }
+}
+
+static ir_ref bl_binary(ir_ctx* ctx, ir_op op, ir_type type, ir_ref a, ir_ref b) {
+  BlValue* va = bl_val(ctx, a);
+  BlValue* vb = bl_val(ctx, b);
+  if (!bl_type_is_fp(type)) {
+    uint64_t folded;
+    if (va->kind == BLK_CONST && vb->kind == BLK_CONST &&
+        bl_fold_binary(op, type, bl_extend(va->imm, va->type), bl_extend(vb->imm, vb->type),
+                       &folded)) {
+      return bl_const(ctx, type, bl_extend(folded, type));
+    }
+    // Address arithmetic on the frame folds into the displacement.
+    if (op == IR_ADD && va->kind == BLK_FRAME && vb->kind == BLK_CONST &&
+        (int64_t)vb->imm == (int32_t)vb->imm) {
+      int32_t disp = va->disp + (int32_t)vb->imm;
+      ir_ref ref = bl_new(ctx, BLK_FRAME, IR_ADDR);
+      ctx->values[ref].disp = disp;
+      return ref;
+    }
+  }
+
+  bl_flush(ctx);
+  ir_ref result = bl_new_slot(ctx, type);
+  int32_t disp = ctx->values[result].disp;
+
+  if (bl_type_is_fp(type)) {
+    bl_load_xmm(ctx, 0, a);
+    bl_load_xmm(ctx, 1, b);
+    uint8_t opcode;
+    switch (op) {
+      case IR_ADD: opcode = 0x58; break;
+      case IR_SUB: opcode = 0x5c; break;
+      case IR_MUL: opcode = 0x59; break;
+      case IR_DIV: opcode = 0x5e; break;
+      default:
+        error("internal error: unhandled floating point op at --opt -1.");
+    }
+    // addss/subss/mulss/divss xmm0, xmm1 (sd for double)
+    uint8_t st[] = {type == IR_FLOAT ? 0xf3 : 0xf2, 0x0f, opcode, 0xc1};
+    bl_emit(st, sizeof(st));
+    bl_store_xmm_slot(0, disp);
+    return result;
+  }
+
+  bl_load_gpr(ctx, RAX, a);
+  bl_load_gpr(ctx, RCX, b);
+  bool is_signed = bl_type_is_signed(type);
+  switch (op) {
+    case IR_ADD: BL_EMIT(0x48, 0x01, 0xc8); break;        // add rax, rcx
+    case IR_SUB: BL_EMIT(0x48, 0x29, 0xc8); break;        // sub rax, rcx
+    case IR_MUL: BL_EMIT(0x48, 0x0f, 0xaf, 0xc1); break;  // imul rax, rcx
+    case IR_AND: BL_EMIT(0x48, 0x21, 0xc8); break;        // and rax, rcx
+    case IR_OR: BL_EMIT(0x48, 0x09, 0xc8); break;         // or rax, rcx
+    case IR_XOR: BL_EMIT(0x48, 0x31, 0xc8); break;        // xor rax, rcx
+    case IR_SHL: BL_EMIT(0x48, 0xd3, 0xe0); break;        // shl rax, cl
+    case IR_SHR: BL_EMIT(0x48, 0xd3, 0xe8); break;        // shr rax, cl
+    case IR_SAR: BL_EMIT(0x48, 0xd3, 0xf8); break;        // sar rax, cl
+    case IR_DIV:
+    case IR_MOD:
+      if (is_signed) {
+        BL_EMIT(0x48, 0x99,         // cqo
+                0x48, 0xf7, 0xf9);  // idiv rcx
+      } else {
+        BL_EMIT(0x31, 0xd2,         // xor edx, edx
+                0x48, 0xf7, 0xf1);  // div rcx
+      }
+      if (op == IR_MOD) {
+        BL_EMIT(0x48, 0x89, 0xd0);  // mov rax, rdx
+      }
+      break;
+    default:
+      error("internal error: unhandled binary op at --opt -1.");
+  }
+  bl_store_slot(RAX, disp);
+  ctx->rax_holds = bl_type_size[type] == 8 ? result : IR_UNUSED;
+  return result;
+}
+
+static ir_ref bl_add_offset(ir_ctx* ctx, ir_ref addr, uintptr_t offset) {
+  if (offset == 0) {
+    return addr;
+  }
+  return bl_binary(ctx, IR_ADD, IR_ADDR, addr, bl_const(ctx, IR_ADDR, offset));
+}
+
+static ir_ref bl_cmp(ir_ctx* ctx, ir_op op, ir_ref a, ir_ref b) {
+  bl_flush(ctx);
+  ir_type type = bl_val(ctx, a)->type;
+  ir_ref result = bl_new_slot(ctx, IR_BOOL);
+
+  if (bl_type_is_fp(type)) {
+    bl_load_xmm(ctx, 0, a);
+    bl_load_xmm(ctx, 1, b);
+    // LT/LE compare the other way around so that unordered is false.
+    bool swap = op == IR_LT || op == IR_LE || op == IR_ULT || op == IR_ULE;
+    if (type == IR_DOUBLE) {
+      bl_emit1(0x66);
+    }
+    uint8_t ucomis[] = {0x0f, 0x2e, swap ? 0xc8 : 0xc1};  // ucomiss/ucomisd
+    bl_emit(ucomis, sizeof(ucomis));
+    switch (op) {
+      case IR_EQ:
+        BL_EMIT(0x0f, 0x94, 0xc0,  // sete al
+                0x0f, 0x9b, 0xc1,  // setnp cl
+                0x20, 0xc8);       // and al, cl
+        break;
+      case IR_NE:
+        BL_EMIT(0x0f, 0x95, 0xc0,  // setne al
+                0x0f, 0x9a, 0xc1,  // setp cl
+                0x08, 0xc8);       // or al, cl
+        break;
+      case IR_LT:
+      case IR_GT:
+      case IR_ULT:
+      case IR_UGT:
+        BL_EMIT(0x0f, 0x97, 0xc0);  // seta al
+        break;
+      default:
+        BL_EMIT(0x0f, 0x93, 0xc0);  // setae al
+        break;
+    }
+  } else {
+    static const uint8_t setcc[] = {
+        [IR_EQ] = 0x94,  [IR_NE] = 0x95,  [IR_LT] = 0x9c,  [IR_GE] = 0x9d,  [IR_LE] = 0x9e,
+        [IR_GT] = 0x9f,  [IR_ULT] = 0x92, [IR_UGE] = 0x93, [IR_ULE] = 0x96, [IR_UGT] = 0x97,
+    };
+    ASSERT(op < COUNTOF(setcc) && setcc[op]);
+    bl_load_gpr(ctx, RAX, a);
+    bl_load_gpr(ctx, RCX, b);
+    BL_EMIT(0x48, 0x39, 0xc8);  // cmp rax, rcx
+    uint8_t st[] = {0x0f, setcc[op], 0xc0};
+    bl_emit(st, sizeof(st));
+  }
+  BL_EMIT(0x0f, 0xb6, 0xc0);  // movzx eax, al
+  bl_store_mem(IR_BOOL, RAX, RBP, ctx->values[result].disp);
+  ctx->rax_holds = result;
+  return result;
+}
+
+static ir_ref bl_unary(ir_ctx* ctx, ir_op op, ir_type type, ir_ref a) {
+  bl_flush(ctx);
+  ir_type from = bl_val(ctx, a)->type;
+  ir_ref result = bl_new_slot(ctx, type);
+  bl_load_gpr(ctx, RAX, a);
+  switch (op) {
+    case IR_NEG:
+      if (type == IR_FLOAT) {
+        BL_EMIT(0x0f, 0xba, 0xf8, 31);  // btc eax, 31
+      } else if (type == IR_DOUBLE) {
+        BL_EMIT(0x48, 0x0f, 0xba, 0xf8, 63);  // btc rax, 63
+      } else {
+        BL_EMIT(0x48, 0xf7, 0xd8);  // neg rax
+      }
+      break;
+    case IR_NOT:
+      if (type == IR_BOOL) {
+        BL_EMIT(0x83, 0xf0, 0x01);  // xor eax, 1
+      } else {
+        BL_EMIT(0x48, 0xf7, 0xd0);  // not rax
+      }
+      break;
+    case IR_SEXT:
+      if (!bl_type_is_signed(from)) {
+        switch (bl_type_size[from]) {
+          case 1: BL_EMIT(0x48, 0x0f, 0xbe, 0xc0); break;  // movsx rax, al
+          case 2: BL_EMIT(0x48, 0x0f, 0xbf, 0xc0); break;  // movsx rax, ax
+          case 4: BL_EMIT(0x48, 0x63, 0xc0); break;        // movsxd rax, eax
+        }
+      }
+      break;
+    case IR_ZEXT:
+      if (bl_type_is_signed(from)) {
+        switch (bl_type_size[from]) {
+          case 1: BL_EMIT(0x48, 0x0f, 0xb6, 0xc0); break;  // movzx rax, al
+          case 2: BL_EMIT(0x48, 0x0f, 0xb7, 0xc0); break;  // movzx rax, ax
+          case 4: BL_EMIT(0x89, 0xc0); break;              // mov eax, eax
+        }
+      }
+      break;
+    case IR_TRUNC:
+    case IR_BITCAST:
+      // Readers only look at the width of |type|.
+      break;
+    default:
+      error("internal error: unhandled unary op at --opt -1.");
+  }
+  bl_store_slot(RAX, ctx->values[result].disp);
+  ctx->rax_holds = bl_type_size[type] == 8 ? result : IR_UNUSED;
+  return result;
+}
+
+static ir_ref bl_cond(ir_ctx* ctx, ir_type type, ir_ref c, ir_ref a, ir_ref b) {
+  bl_flush(ctx);
+  ir_ref result = bl_new_slot(ctx, type);
+  bl_load_gpr(ctx, RAX, a);
+  bl_load_gpr(ctx, RCX, b);
+  bl_load_gpr(ctx, RDX, c);
+  BL_EMIT(0x48, 0x85, 0xd2,         // test rdx, rdx
+          0x48, 0x0f, 0x44, 0xc1);  // cmovz rax, rcx
+  bl_store_slot(RAX, ctx->values[result].disp);
+  ctx->rax_holds = result;
+  return result;
+}
+
+void* parse_baseline(Arena* main_arena,
+                     Arena* temp_arena,
+                     ReadFileResult file,
+                     void* (*get_extern)(StrView),
+                     const Options* options,
+                     CompileStats* stats) {
+#if !ARCH_X64
+  base_writef_stderr("--opt -1 is only implemented for x64.\n");
+  base_exit(1);
+#endif
+  Options baseline_options = *options;
+  baseline_options.opt_level = -1;
+  baseline_options.tiered = false;
+  baseline_options.code_cache_dir = NULL;
+  baseline_options.obj_filename = NULL;
+  baseline_options.watch = false;
+  baseline_options.profile_gen_filename = NULL;
+  baseline_options.profile_use_filename = NULL;
+  return parse_impl(main_arena, temp_arena, file, get_extern, &baseline_options, stats);
+}
+
+uint64_t parse_baseline_list_bytes(void) {
+  return parser.list_top ? arena_pos(parser.list_arena) : 0;
+}
@@ -1,21 +1,139 @@
 #define ENABLE_CODE_GEN 1
+#define ENABLE_CODE_CACHE 1
+#define ENABLE_INLINING 1
+#define ENABLE_PROFILE 1
+
+#include "luv60.h"
 
 #include "../third_party/ir/ir.h"
 #include "../third_party/ir/ir_builder.h"
+#if defined(IR_TARGET_X64)
+#include "../third_party/ir/ir_x86.h"  // For IR_REG_*, see lower_structs_and_call().
+#endif
 
 #undef _ir_CTX
 #define _ir_CTX (&parser.cur_scope->ctx)
 
+#define ir_insns_count(ctx) ((ctx)->insns_count)
+
 #include "parse.c"
 
+// Only the main thread's compiles are counted; the --tiered worker would race.
+// --trace records per thread though, so it sees the worker's too. Phases don't
+// nest, so one start time is enough.
+static uint64_t jit_phase_start_us;
+
+static bool jit_phase_timed(void) {
+  return (parser.time_phases || parser.stats) && !parser.tier_recompiling;
+}
+
+static void jit_phase_begin(JitPhase phase) {
+  if (jit_phase_timed()) {
+    jit_phase_start_us = base_timer_now();
+  }
+  TRACE_BEGIN(jit_phase_names[phase], (Str){0});
+}
+
+static bool jit_phase_end(JitPhase phase, bool ok) {
+  TRACE_END();
+  if (jit_phase_timed()) {
+    parser.phase_us[phase] += base_timer_now() - jit_phase_start_us;
+  }
+  return ok;
+}
+
+#define JIT_PHASE(phase, call)                                 \
+  do {                                                         \
+    jit_phase_begin(JP_##phase);                               \
+    if (!jit_phase_end(JP_##phase, (call))) {                  \
+      return NULL;                                             \
+    }                                                          \
+  } while (0)
+
+// This is ir_jit_compile() split up so that --time-phases and --trace can see
+// where the time goes. It's here rather than in ir.h so that it survives
+// update_ir.py. At opt 0 there's no SCCP, GCM, or linear scan, instructions
+// stay in emission order, and ir_emit_code() hands out registers itself.
+static void* jit_compile(ir_ctx* ctx, int opt_level, size_t* size) {
+  void* entry = NULL;
+  if (opt_level == 0) {
+    if (ctx->flags & IR_OPT_FOLDING) {
+      return NULL;
+    }
+    ctx->flags &= ~(IR_OPT_CFG | IR_OPT_CODEGEN);
+    JIT_PHASE(DEF_USE, (ir_build_def_use_lists(ctx), true));
+    JIT_PHASE(CFG, ir_build_cfg(ctx));
+    JIT_PHASE(MATCH, ir_match(ctx));
+    JIT_PHASE(VREGS, ir_assign_virtual_registers(ctx));
+    JIT_PHASE(DESSA, ir_compute_dessa_moves(ctx));
+    JIT_PHASE(EMIT, (entry = ir_emit_code(ctx, size)) != NULL);
+    return entry;
+  }
+
+  if (!(ctx->flags & IR_OPT_FOLDING)) {
+    return NULL;
+  }
+  ctx->flags |= IR_OPT_CFG | IR_OPT_CODEGEN;
+  JIT_PHASE(DEF_USE, (ir_build_def_use_lists(ctx), true));
+  if (ctx->flags & IR_OPT_MEM2SSA) {
+    JIT_PHASE(CFG, ir_build_cfg(ctx));
+    JIT_PHASE(DOMINATORS, ir_build_dominators_tree(ctx));
+    JIT_PHASE(MEM2SSA, ir_mem2ssa(ctx));
+    if (opt_level > 1) {
+      ir_reset_cfg(ctx);
+    }
+  }
+  if (opt_level > 1) {
+    JIT_PHASE(SCCP, ir_sccp(ctx));
+  }
+  if (!ctx->cfg_blocks) {
+    JIT_PHASE(CFG, ir_build_cfg(ctx));
+    JIT_PHASE(DOMINATORS, ir_build_dominators_tree(ctx));
+  }
+  JIT_PHASE(LOOPS, ir_find_loops(ctx));
+  JIT_PHASE(GCM, ir_gcm(ctx));
+  JIT_PHASE(SCHEDULE, ir_schedule(ctx));
+  JIT_PHASE(MATCH, ir_match(ctx));
+  JIT_PHASE(VREGS, ir_assign_virtual_registers(ctx));
+  JIT_PHASE(LIVE_RANGES, ir_compute_live_ranges(ctx));
+  JIT_PHASE(COALESCE, ir_coalesce(ctx));
+  JIT_PHASE(REG_ALLOC, ir_reg_alloc(ctx));
+  JIT_PHASE(SCHEDULE_BLOCKS, ir_schedule_blocks(ctx));
+  JIT_PHASE(EMIT, (entry = ir_emit_code(ctx, size)) != NULL);
+  return entry;
+}
+
 void* parse_code_gen(Arena* main_arena,
                      Arena* temp_arena,
-                     const char* filename,
                      ReadFileResult file,
                      void* (*get_extern)(StrView),
-                     int verbose,
-                     bool ir_only,
-                     int opt_level) {
-  return parse_impl(main_arena, temp_arena, filename, file, get_extern, verbose, ir_only,
-                    opt_level);
+                     const Options* options,
+                     CompileStats* stats) {
+  return parse_impl(main_arena, temp_arena, file, get_extern, options, stats);
+}
+
+uint32_t parse_code_gen_tier_wait(void) {
+  return tier_wait();
+}
+
+uint32_t parse_code_gen_hot_wait(void) {
+  return parser.hot ? hot_wait(parser.hot) : 0;
+}
+
+uint32_t parse_code_gen_num_cold_funcs(void) {
+  return parser.num_cold_funcs;
+}
+
+uint32_t parse_code_gen_num_module_interfaces(void) {
+  return parser.num_module_interfaces;
+}
+
+uint64_t parse_code_gen_list_bytes(void) {
+  return parser.list_top ? arena_pos(parser.list_arena) : 0;
+}
+
+void parse_code_gen_shutdown(void) {
+  tier_shutdown();
+  hot_shutdown();
+  profile_write();
 }
@@ -6,6 +6,9 @@
 #pragma GCC diagnostic ignored "-Wunused-function"
 
 #define ENABLE_CODE_GEN 0
+#define ENABLE_CODE_CACHE 0
+#define ENABLE_INLINING 0
+#define ENABLE_PROFILE 0
 
 typedef uint32_t ir_ref;
 typedef uint32_t ir_op;
@@ -593,6 +596,11 @@ typedef struct _ir_val {
 #define ir_VLOAD_F(_var) 0
 #define ir_VSTORE(_var, _val) 0
 #define ir_RLOAD(_type, _reg) 0
+#define IR_UNUSED 0
+#define IR_REG_RAX 0
+#define IR_REG_RDX 0
+#define IR_REG_XMM0 0
+#define IR_REG_XMM1 0
 #define ir_RLOAD_B(_reg) 0
 #define ir_RLOAD_U8(_reg) 0
 #define ir_RLOAD_U16(_reg) 0
@@ -691,7 +699,6 @@ typedef struct _ir_val {
 #define ir_save(ctx, flags, file)
 #define ir_dump_dot(ctx, name, file)
 #define ir_check(ctx) 1
-#define ir_jit_compile(ctx, opt, size) 0
 #define ir_free(ctx)
 #define ir_mem_mmap(size) 0
 
@@ -701,12 +708,17 @@ typedef struct _ir_val {
 
 void* parse_syntax_check(Arena* main_arena,
                          Arena* temp_arena,
-                         const char* filename,
                          ReadFileResult file,
                          void* (*get_extern)(StrView),
-                         int verbose,
-                         bool ir_only,
-                         int opt_level) {
-  return parse_impl(main_arena, temp_arena, filename, file, get_extern, verbose, ir_only,
-                    opt_level);
+                         const Options* options,
+                         CompileStats* stats) {
+  Options check_options = *options;
+  check_options.code_cache_dir = NULL;
+  check_options.obj_filename = NULL;
+  check_options.watch = false;
+  check_options.profile_gen_filename = NULL;
+  check_options.profile_use_filename = NULL;
+  check_options.perf_map = false;
+  check_options.jitdump = false;
+  return parse_impl(main_arena, temp_arena, file, get_extern, &check_options, stats);
 }
@@ -0,0 +1,79 @@
+#include "luv60.h"
+
+#include "dict.h"
+
+// The files behind --profile-gen and --profile-use. Unlike the code cache, a
+// profile was asked for by name, so anything wrong with one is an error rather
+// than just being ignored.
+
+struct Profile {
+  DictImpl counts;  // Of ProfileCount.
+};
+
+static size_t profile_key_hash_func(void* vkey) {
+  size_t hash = 0;
+  dict_hash_write(&hash, vkey, sizeof(ProfileKey));
+  return hash;
+}
+
+static bool profile_key_eq_func(void* a, void* b) {
+  return memcmp(a, b, sizeof(ProfileKey)) == 0;
+}
+
+Profile* profile_load(Arena* arena, const char* filename) {
+  ReadFileResult file = base_read_file(filename);
+  if (!file.buffer) {
+    base_writef_stderr("Couldn't read profile '%s'.\n", filename);
+    base_exit(1);
+  }
+  const uint8_t* p = file.buffer;
+  uint32_t num_counts = 0;
+  size_t header_size = 8 + sizeof(num_counts);
+  if (file.file_size >= header_size) {
+    memcpy(&num_counts, p + 8, sizeof(num_counts));
+  }
+  if (file.file_size < header_size || memcmp(p, "LUVPROF1", 8) != 0 ||
+      file.file_size - header_size != (size_t)num_counts * sizeof(ProfileCount)) {
+    base_writef_stderr("'%s' isn't a profile written by --profile-gen.\n", filename);
+    base_exit(1);
+  }
+  p += header_size;
+  Profile* profile = arena_push(arena, sizeof(Profile), _Alignof(Profile));
+  profile->counts = dict_new(arena, 1 << 10, sizeof(ProfileCount), _Alignof(ProfileCount));
+  for (uint32_t i = 0; i < num_counts; ++i) {
+    ProfileCount pc;
+    memcpy(&pc, p + i * sizeof(pc), sizeof(pc));
+    DictInsert res = dict_insert(&profile->counts, &pc, profile_key_hash_func,
+                                 profile_key_eq_func, sizeof(ProfileCount), _Alignof(ProfileCount));
+    if (!res.inserted) {
+      ((ProfileCount*)dict_rawiter_get(&res.iter))->count += pc.count;
+    }
+  }
+  base_mem_release(file.buffer, file.allocated_size);
+  return profile;
+}
+
+bool profile_find(Profile* profile, ProfileKey key, uint64_t* count) {
+  DictRawIter iter = dict_find(&profile->counts, &key, profile_key_hash_func,
+                               profile_key_eq_func, sizeof(ProfileCount));
+  ProfileCount* pc = (ProfileCount*)dict_rawiter_get(&iter);
+  if (!pc) {
+    return false;
+  }
+  *count = pc->count;
+  return true;
+}
+
+void profile_save(const char* filename, const ProfileCount* counts, uint32_t num_counts) {
+  FILE* f = fopen(filename, "wb");
+  if (!f) {
+    base_writef_stderr("warning: couldn't write '%s'\n", filename);
+    return;
+  }
+  bool ok = fwrite("LUVPROF1", 1, 8, f) == 8 &&
+            fwrite(&num_counts, sizeof(num_counts), 1, f) == 1 &&
+            fwrite(counts, sizeof(ProfileCount), num_counts, f) == num_counts;
+  if (fclose(f) != 0 || !ok) {
+    base_writef_stderr("warning: couldn't write '%s'\n", filename);
+  }
+}
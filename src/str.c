@@ -42,13 +42,35 @@ static char* new_buffer_;
 static size_t new_buffer_size_;
 static size_t new_buffer_insert_location_;
 
+// Of Str, so that each "new" string is only stored once. Otherwise something
+// that keeps re-interning the same names (imports, --watch reparsing the file)
+// would fill up the new buffer.
+static DictImpl new_strs_;
+
 static Arena* arena_;
 
+static size_t new_str_hash_func(void* vstr) {
+  Str* str = (Str*)vstr;
+  size_t hash = 0;
+  dict_hash_write(&hash, (void*)str_raw_ptr(*str), str_len(*str));
+  return hash;
+}
+
+static bool new_str_eq_func(void* va, void* vb) {
+  return str_eq(*(Str*)va, *(Str*)vb);
+}
+
 void str_intern_pool_init(Arena* arena, char* parse_buffer, size_t buffer_size) {
   arena_ = arena;
   new_buffer_ = arena_push(arena, STR_NEW_BUFFER_SIZE, 8);
   new_buffer_size_ = STR_NEW_BUFFER_SIZE;
   new_buffer_insert_location_ = 1;
+  new_strs_ = dict_new(arena, 1 << 10, sizeof(Str), _Alignof(Str));
+  parse_buffer_ = parse_buffer;
+  parse_buffer_size_ = buffer_size;
+}
+
+void str_intern_pool_set_parse_buffer(char* parse_buffer, size_t buffer_size) {
   parse_buffer_ = parse_buffer;
   parse_buffer_size_ = buffer_size;
 }
@@ -105,12 +127,20 @@ Str str_intern_len(const char* p, uint32_t len) {
         return (Str){MAKE_PARSE_BUFFER_STR_VAL(p - parse_buffer_, len)};
       }
 
+      // Copied to the end of the buffer first so that it can be looked up as
+      // a Str, but only kept if it wasn't already there.
       uint32_t new_loc = new_buffer_insert_location_;
-      new_buffer_insert_location_ += len;
-      ASSERT(new_buffer_insert_location_ < new_buffer_size_);
+      ASSERT(new_loc + len < new_buffer_size_);
       char* strp = &new_buffer_[new_loc];
       memcpy(strp, p, len);
-      return (Str){MAKE_NEW_BUFFER_STR_VAL(new_loc, len)};
+      Str str = {MAKE_NEW_BUFFER_STR_VAL(new_loc, len)};
+      DictInsert res = dict_insert(&new_strs_, &str, new_str_hash_func, new_str_eq_func,
+                                   sizeof(Str), _Alignof(Str));
+      if (res.inserted) {
+        new_buffer_insert_location_ += len;
+        return str;
+      }
+      return *(Str*)dict_rawiter_get(&res.iter);
   }
 }
 
@@ -172,14 +202,15 @@ Str str_internf(const char* fmt, ...) {
   uint32_t len = vsnprintf(NULL, 0, fmt, args);
   va_end(args);
 
-  uint64_t saved_pos = arena_pos(arena_);
-  char* strp = arena_push(arena_, len + 1, 1);
+  // Not in arena_, where new_strs_ growing would strand it.
+  TempArena scratch = scratch_begin(&arena_, 1);
+  char* strp = arena_push(scratch.arena, len + 1, 1);
   va_start(args, fmt);
   vsnprintf(strp, len + 1, fmt, args);
   va_end(args);
 
   Str ret = str_intern_len(strp, len);
-  arena_pop_to(arena_, saved_pos);
+  scratch_end(scratch);
 
   return ret;
 }
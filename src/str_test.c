@@ -50,3 +50,49 @@ TEST(Str, Internf) {
   str_intern_pool_destroy_for_tests();
   arena_destroy(arena);
 }
+
+TEST(Str, InternLongNew) {
+  Arena* arena = arena_create(MiB(128), KiB(128));
+  str_intern_pool_init(arena, NULL, 0);
+
+  char a[] = "a_longer_identifier";
+  char b[] = "a_longer_identifier";
+  Str x = str_intern(a);
+  Str y = str_intern(b);
+  EXPECT_EQ(x.i, y.i);
+  EXPECT_STREQ(cstr_copy(arena, y), "a_longer_identifier");
+
+  Str z = str_internf("a_longer_%s", "identifier");
+  EXPECT_EQ(x.i, z.i);
+
+  Str w = str_intern("a_longer_identifier2");
+  EXPECT_TRUE(x.i != w.i);
+
+  str_intern_pool_destroy_for_tests();
+  arena_destroy(arena);
+}
+
+TEST(Str, InternfLeavesNothingBehind) {
+  // Enough long strings that new_strs_ has to grow while interning them.
+  Arena* arena = arena_create(MiB(128), KiB(128));
+  str_intern_pool_init(arena, NULL, 0);
+  uint64_t start = arena_pos(arena);
+  for (int i = 0; i < 5000; ++i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "a_longer_identifier_%d", i);
+    str_intern(buf);
+  }
+  uint64_t used_by_intern = arena_pos(arena) - start;
+  str_intern_pool_destroy_for_tests();
+  arena_destroy(arena);
+
+  arena = arena_create(MiB(128), KiB(128));
+  str_intern_pool_init(arena, NULL, 0);
+  start = arena_pos(arena);
+  for (int i = 0; i < 5000; ++i) {
+    str_internf("a_longer_identifier_%d", i);
+  }
+  EXPECT_EQ(arena_pos(arena) - start, used_by_intern);
+  str_intern_pool_destroy_for_tests();
+  arena_destroy(arena);
+}
@@ -1,8 +1,11 @@
 import base64
 import json
 import os
+import shutil
 import subprocess
 import sys
+import tempfile
+import time
 
 
 # https://gist.github.com/NeatMonster/c06c61ba4114a2b31418a364341c26c0
@@ -35,6 +38,137 @@ class hexdump:
         return "\n".join(self)
 
 
+def check_result(cmds, res):
+    if res.stdout is not None:
+        out = res.stdout
+        err = res.stderr
+        if out != cmds["out"]:
+            print("got stdout:\n")
+            print(out)
+            print(hexdump(out.encode("utf-8")))
+            print("but expected:\n")
+            print(cmds["out"])
+            print(hexdump(cmds["out"].encode("utf-8")))
+            return 1
+        if err != cmds["err"]:
+            print("got stderr:\n")
+            print(err)
+            print(hexdump(err.encode("utf-8")))
+            print("but expected:\n")
+            print(cmds["err"])
+            print(hexdump(cmds["err"].encode("utf-8")))
+            return 1
+
+    if cmds["ret"] == "NOCRASH":
+        if res.returncode >= 0 and res.returncode <= 255 and res.returncode != 117:
+            return 0
+        # Something out of range indicates crash, e.g Windows returns -1073741819 on GPF.
+        # Linux is always in the range 0..255, so pick 117 arbitrarily for an ASAN signal.
+        return 2
+    else:
+        if res.returncode != cmds["ret"]:
+            print("got return code %d, but expected %d" % (res.returncode, cmds["ret"]))
+            return 2
+    return 0
+
+
+# For --watch tests: runs on a copy of the test, and once the program has
+# printed its first line (testhelper_hot_wait() flushes it), makes the "# EDIT:"
+# changes to the copy so that it gets reloaded. The copy's path in the output is
+# put back to the test's.
+def run_with_edits(ccbin, root, cmds, env):
+    args = cmds["run"].split(" ")
+    test = [a for a in args if a.endswith(".luv")][0]
+    tmpdir = tempfile.mkdtemp()
+    try:
+        copy = os.path.join(tmpdir, os.path.basename(test))
+        shutil.copyfile(test, copy)
+        proc = subprocess.Popen(
+            [ccbin] + [copy if a == test else a for a in args],
+            cwd=root,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+            universal_newlines=True,
+            env=env,
+        )
+        first = proc.stdout.readline()
+        with open(copy, "r", encoding="utf-8") as f:
+            contents = f.read()
+        for old, new in cmds["edits"]:
+            contents = contents.replace(old, new)
+        # Replaced in one go so that the watcher never sees half of it.
+        with open(copy + ".tmp", "w", encoding="utf-8") as f:
+            f.write(contents)
+        os.replace(copy + ".tmp", copy)
+        rest, err = proc.communicate()
+        return subprocess.CompletedProcess(
+            proc.args, proc.returncode, first + rest, err.replace(copy, test)
+        )
+    finally:
+        shutil.rmtree(tmpdir)
+
+
+# For "# SERVE: n" tests: starts a --serve server, and sends it the test n
+# times with --client, so that later requests see whatever the earlier ones
+# left behind. Each one has to pass on its own.
+def run_served(ccbin, root, cmds, env):
+    tmpdir = tempfile.mkdtemp()
+    socket_path = os.path.join(tmpdir, "luvc.sock")
+    server = subprocess.Popen([ccbin, "--serve", socket_path], cwd=root, env=env)
+    try:
+        for _ in range(1000):
+            if os.path.exists(socket_path) or server.poll() is not None:
+                break
+            time.sleep(0.01)
+        for _ in range(cmds["serve"]):
+            res = subprocess.run(
+                [ccbin, "--client", socket_path] + cmds["run"].split(" "),
+                cwd=root,
+                capture_output=True,
+                universal_newlines=True,
+                env=env,
+            )
+            rc = check_result(cmds, res)
+            if rc:
+                return rc
+        return 0
+    finally:
+        server.kill()
+        server.wait()
+        shutil.rmtree(tmpdir)
+
+
+# For tests that have "# BEFORE:" commands, e.g. a --profile-gen to write a
+# profile for the RUN to use. They only have to succeed, and "{tmp}" in any of
+# the commands is a directory that's just for this test.
+def run_with_before(ccbin, root, cmds, env):
+    tmpdir = tempfile.mkdtemp()
+    try:
+        for before in cmds["before"]:
+            args = before.replace("{tmp}", tmpdir).split(" ")
+            res = subprocess.run(
+                [ccbin] + args,
+                cwd=root,
+                capture_output=True,
+                universal_newlines=True,
+                env=env,
+            )
+            if res.returncode != 0:
+                print("'%s' returned %d:\n" % (before, res.returncode))
+                print(res.stdout + res.stderr)
+                return 2
+        res = subprocess.run(
+            [ccbin] + cmds["run"].replace("{tmp}", tmpdir).split(" "),
+            cwd=root,
+            capture_output=True,
+            universal_newlines=True,
+            env=env,
+        )
+        return check_result(cmds, res)
+    finally:
+        shutil.rmtree(tmpdir)
+
+
 def main():
     out_dir = os.getcwd()
 
@@ -65,7 +199,13 @@ def main():
     ):
         return 0
 
-    if cmds["out"] or cmds["err"]:
+    if cmds.get("serve"):
+        return run_served(ccbin, root, cmds, env)
+    elif cmds.get("before"):
+        return run_with_before(ccbin, root, cmds, env)
+    elif cmds.get("edits"):
+        res = run_with_edits(ccbin, root, cmds, env)
+    elif cmds["out"] or cmds["err"]:
         res = subprocess.run(
             [ccbin] + cmds["run"].split(" "),
             cwd=root,
@@ -73,37 +213,9 @@ def main():
             universal_newlines=True,
             env=env,
         )
-        out = res.stdout
-        err = res.stderr
-        if out != cmds["out"]:
-            print("got stdout:\n")
-            print(out)
-            print(hexdump(out.encode("utf-8")))
-            print("but expected:\n")
-            print(cmds["out"])
-            print(hexdump(cmds["out"].encode("utf-8")))
-            return 1
-        if err != cmds["err"]:
-            print("got stderr:\n")
-            print(err)
-            print(hexdump(err.encode("utf-8")))
-            print("but expected:\n")
-            print(cmds["err"])
-            print(hexdump(cmds["err"].encode("utf-8")))
-            return 1
     else:
         res = subprocess.run([ccbin] + cmds["run"].split(" "), cwd=root, env=env)
-
-    if cmds["ret"] == "NOCRASH":
-        if res.returncode >= 0 and res.returncode <= 255 and res.returncode != 117:
-            return 0
-        # Something out of range indicates crash, e.g Windows returns -1073741819 on GPF.
-        # Linux is always in the range 0..255, so pick 117 arbitrarily for an ASAN signal.
-        return 2
-    else:
-        if res.returncode != cmds["ret"]:
-            print("got return code %d, but expected %d" % (res.returncode, cmds["ret"]))
-            return 2
+    return check_result(cmds, res)
 
 
 if __name__ == "__main__":
@@ -0,0 +1,209 @@
+#include "luv60.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+// For --trace. Each thread records into its own buffer so there's no locking
+// on the way in, and a zone becomes a single complete ("X") event when it
+// ends. If a thread records more than TRACE_MAX_EVENTS, the oldest ones are
+// overwritten, so a long run keeps its tail.
+//
+// The process's RSS is also sampled as a counter, whenever a thread's
+// outermost zone ends but at most every TRACE_RSS_INTERVAL_US.
+
+#define TRACE_MAX_THREADS 8
+#define TRACE_MAX_DEPTH 64
+#define TRACE_MAX_EVENTS (1 << 18)
+#define TRACE_RSS_INTERVAL_US 1000
+
+typedef struct TraceEvent {
+  const char* name;
+  Str detail;
+  uint64_t start_us;
+  uint64_t dur_us;  // Or for a counter, its value.
+  bool counter;
+} TraceEvent;
+
+typedef struct TraceThread {
+  const char* thread_name;
+  uint32_t depth;
+  uint64_t last_rss_us;
+  uint64_t num_events;
+  TraceEvent open[TRACE_MAX_DEPTH];
+  TraceEvent events[TRACE_MAX_EVENTS];
+} TraceThread;
+
+bool trace_enabled;
+
+static uint64_t trace_start_us;
+static TraceThread* trace_threads[TRACE_MAX_THREADS];
+static uint32_t trace_num_threads;
+// Bumped by each trace_start(), so that a thread that was recording for the
+// previous --serve request knows its buffer is gone.
+static uint32_t trace_generation;
+
+static _Thread_local TraceThread* tls_trace_thread;
+static _Thread_local uint32_t tls_trace_generation;
+
+static TraceThread* trace_this_thread(void) {
+  if (BRANCH_LIKELY(tls_trace_thread && tls_trace_generation == trace_generation)) {
+    return tls_trace_thread;
+  }
+  tls_trace_thread = NULL;
+  tls_trace_generation = trace_generation;
+  uint32_t slot = __atomic_fetch_add(&trace_num_threads, 1, __ATOMIC_RELAXED);
+  if (slot >= TRACE_MAX_THREADS) {
+    return NULL;
+  }
+  TraceThread* thread = base_mem_large_alloc(sizeof(TraceThread));
+  if (!thread) {
+    return NULL;
+  }
+  trace_threads[slot] = thread;
+  tls_trace_thread = thread;
+  return thread;
+}
+
+static void trace_release_threads(void) {
+  uint32_t num_threads = MIN(trace_num_threads, TRACE_MAX_THREADS);
+  for (uint32_t i = 0; i < num_threads; ++i) {
+    if (trace_threads[i]) {
+      base_mem_release(trace_threads[i], sizeof(TraceThread));
+      trace_threads[i] = NULL;
+    }
+  }
+  trace_num_threads = 0;
+  ++trace_generation;
+}
+
+static void trace_sample_rss(TraceThread* thread, uint64_t now_us) {
+  uint64_t rss, peak_rss;
+  base_mem_rss(&rss, &peak_rss);
+  thread->events[thread->num_events++ % TRACE_MAX_EVENTS] =
+      (TraceEvent){.name = "rss", .start_us = now_us, .dur_us = rss, .counter = true};
+  thread->last_rss_us = now_us;
+}
+
+void trace_start(void) {
+  trace_release_threads();
+  trace_start_us = base_timer_now();
+  trace_enabled = true;
+  trace_thread_name("main");
+  if (trace_threads[0]) {
+    trace_sample_rss(trace_threads[0], trace_start_us);
+  }
+}
+
+void trace_thread_name(const char* name) {
+  if (!trace_enabled) {
+    return;
+  }
+  TraceThread* thread = trace_this_thread();
+  if (thread) {
+    thread->thread_name = name;
+  }
+}
+
+void trace_begin_impl(const char* name, Str detail) {
+  TraceThread* thread = trace_this_thread();
+  if (!thread) {
+    return;
+  }
+  // Still counted when too deep, so that the matching end lines up.
+  if (thread->depth < TRACE_MAX_DEPTH) {
+    thread->open[thread->depth] =
+        (TraceEvent){.name = name, .detail = detail, .start_us = base_timer_now()};
+  }
+  ++thread->depth;
+}
+
+void trace_end_impl(void) {
+  TraceThread* thread = trace_this_thread();
+  // depth could be 0 if a compile error unwound out of an open zone.
+  if (!thread || thread->depth == 0) {
+    return;
+  }
+  --thread->depth;
+  if (thread->depth < TRACE_MAX_DEPTH) {
+    uint64_t now_us = base_timer_now();
+    TraceEvent* ev = &thread->events[thread->num_events++ % TRACE_MAX_EVENTS];
+    *ev = thread->open[thread->depth];
+    ev->dur_us = now_us - ev->start_us;
+    if (thread->depth == 0 && now_us - thread->last_rss_us >= TRACE_RSS_INTERVAL_US) {
+      trace_sample_rss(thread, now_us);
+    }
+  }
+}
+
+static void trace_write_json_string(FILE* f, const char* s, uint32_t len) {
+  fputc('"', f);
+  for (uint32_t i = 0; i < len; ++i) {
+    unsigned char c = (unsigned char)s[i];
+    if (c == '"' || c == '\\') {
+      fprintf(f, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(f, "\\u%04x", c);
+    } else {
+      fputc(c, f);
+    }
+  }
+  fputc('"', f);
+}
+
+static void trace_write_event(FILE* f, TraceEvent* ev, uint32_t tid) {
+  if (ev->counter) {
+    fprintf(f,
+            ",\n{\"ph\":\"C\",\"pid\":1,\"tid\":%u,\"ts\":%" PRIu64
+            ",\"name\":\"%s\",\"args\":{\"MiB\":%.3f}}",
+            tid, ev->start_us - trace_start_us, ev->name, ev->dur_us / (1024.0 * 1024.0));
+    return;
+  }
+  fprintf(f, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%" PRIu64 ",\"dur\":%" PRIu64
+             ",\"name\":",
+          tid, ev->start_us - trace_start_us, ev->dur_us);
+  trace_write_json_string(f, ev->name, (uint32_t)strlen(ev->name));
+  if (!str_is_none(ev->detail)) {
+    fprintf(f, ",\"args\":{\"detail\":");
+    trace_write_json_string(f, str_raw_ptr(ev->detail), str_len(ev->detail));
+    fputc('}', f);
+  }
+  fputc('}', f);
+}
+
+// Must be called once any other threads that recorded have stopped.
+bool trace_finish(const char* filename) {
+  trace_enabled = false;
+  bool ok = true;
+  FILE* f = filename ? fopen(filename, "wb") : NULL;
+  if (f) {
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"luvc\"}}");
+    uint32_t num_threads = MIN(trace_num_threads, TRACE_MAX_THREADS);
+    for (uint32_t tid = 0; tid < num_threads; ++tid) {
+      TraceThread* thread = trace_threads[tid];
+      if (!thread) {
+        continue;
+      }
+      if (thread->thread_name) {
+        fprintf(f,
+                ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\","
+                "\"args\":{\"name\":",
+                tid);
+        trace_write_json_string(f, thread->thread_name, (uint32_t)strlen(thread->thread_name));
+        fprintf(f, "}}");
+      }
+      uint64_t first = thread->num_events > TRACE_MAX_EVENTS
+                           ? thread->num_events - TRACE_MAX_EVENTS
+                           : 0;
+      for (uint64_t i = first; i < thread->num_events; ++i) {
+        trace_write_event(f, &thread->events[i % TRACE_MAX_EVENTS], tid);
+      }
+    }
+    fprintf(f, "\n]}\n");
+    ok = fclose(f) == 0;
+  } else if (filename) {
+    ok = false;
+  }
+  trace_release_threads();
+  return ok;
+}
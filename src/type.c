@@ -86,7 +86,11 @@ static DictImpl cached_func_types;
 static DictImpl cached_ptr_types;
 static DictImpl cached_array_types;
 static DictImpl cached_list_types;
+static uint32_t num_struct_types;
 static Arena* arena_;
+// See type_keep().
+static int kept_num_typedata;
+static uint32_t kept_num_struct_types;
 
 static void set_builtin_typedata(uint32_t index, const char* name, uint32_t size, uint32_t align) {
   ASSERT(index < COUNTOF(typedata));
@@ -130,6 +134,8 @@ size_t type_size(Type type) {
       abort();
     case TYPE_STRUCT:
       return type_td(type)->STRUCT.size;
+    case TYPE_LIST:
+      return type_td(type)->LIST.size;
     case TYPE_FUNC:
       return 8;
     default:
@@ -144,6 +150,8 @@ size_t type_align(Type type) {
     case TYPE_ARRAY:
       return type_td(type)->ARRAY.align;
       abort();
+    case TYPE_LIST:
+      return type_td(type)->LIST.align;
     case TYPE_DICT:
       ASSERT(false && "todo");
       abort();
@@ -248,6 +256,7 @@ Type type_new_struct(Str name,
                      bool has_initializer) {
   uint32_t unused;
   Type strukt = type_alloc(TYPE_STRUCT, /*extra=*/num_fields + (has_initializer ? 1 : 0), &unused);
+  ++num_struct_types;
 
   TypeData* td = type_td(strukt);
 
@@ -361,8 +370,9 @@ Type type_list(Type subtype) {
   uint32_t rewind_location;
   Type list = type_alloc(TYPE_LIST, 0, &rewind_location);
   TypeData* td = type_td(list);
+  // {data, length}
   td->LIST.size = 16;
-  td->LIST.align = type_align(subtype);
+  td->LIST.align = 8;
   td->LIST.subtype = subtype;
 
   // The dict is only a set of intern'd Type, but we know they're all TYPE_LIST.
@@ -419,6 +429,9 @@ void type_init(Arena* arena) {
   cached_ptr_types = dict_new(arena, 128, sizeof(Type), _Alignof(Type));
   cached_array_types = dict_new(arena, 128, sizeof(Type), _Alignof(Type));
   cached_list_types = dict_new(arena, 128, sizeof(Type), _Alignof(Type));
+  num_struct_types = 0;
+  kept_num_typedata = NUM_TYPE_KINDS;
+  kept_num_struct_types = 0;
 
   set_builtin_typedata(TYPE_VOID, "void", 0, 1);
   set_builtin_typedata(TYPE_BOOL, "bool", 1, 1);
@@ -570,6 +583,12 @@ Type type_array_subtype(Type type) {
   return td->ARRAY.subtype;
 }
 
+Type type_list_subtype(Type type) {
+  ASSERT(type_kind(type) == TYPE_LIST);
+  TypeData* td = type_td(type);
+  return td->LIST.subtype;
+}
+
 uint32_t type_array_count(Type type) {
   ASSERT(type_kind(type) == TYPE_ARRAY);
   TypeData* td = type_td(type);
@@ -655,8 +674,45 @@ bool type_struct_find_field_by_name(Type type, Str name, Type* out_type, uint32_
   return false;
 }
 
-void type_destroy_for_tests(void) {
+uint32_t type_num_created(void) {
+  // Everything else is interned, so they're all in one of the caches.
+  return (uint32_t)(cached_func_types.size + cached_ptr_types.size + cached_array_types.size +
+                    cached_list_types.size) +
+         num_struct_types;
+}
+
+void type_destroy(void) {
   dict_destroy(&cached_func_types);
   memset(typedata, 0, sizeof(TypeData) * num_typedata);
   num_typedata = 0;
 }
+
+void type_keep(void) {
+  kept_num_typedata = num_typedata;
+  kept_num_struct_types = num_struct_types;
+}
+
+// Interned types only point at ones made before them, so everything left is
+// still whole.
+static void drop_unkept_from(DictImpl* dict) {
+  DictRawIter iter = dict_iter(dict, sizeof(Type));
+  while (dict_rawiter_get(&iter)) {
+    DictRawIter cur = iter;
+    Type t = *(Type*)dict_rawiter_get(&cur);
+    dict_rawiter_next(&iter, sizeof(Type));
+    if ((int)(t.u >> 8) >= kept_num_typedata) {
+      dict_erase_at(cur, sizeof(Type));
+    }
+  }
+}
+
+void type_drop_unkept(void) {
+  drop_unkept_from(&cached_func_types);
+  drop_unkept_from(&cached_ptr_types);
+  drop_unkept_from(&cached_array_types);
+  drop_unkept_from(&cached_list_types);
+  memset(&typedata[kept_num_typedata], 0,
+         sizeof(TypeData) * (num_typedata - kept_num_typedata));
+  num_typedata = kept_num_typedata;
+  num_struct_types = kept_num_struct_types;
+}
@@ -4,7 +4,7 @@
 TEST(Type, Basic) {
   Arena* arena = arena_create(KiB(128), KiB(128));
   type_init(arena);
-  type_destroy_for_tests();
+  type_destroy();
   arena_destroy(arena);
 }
 
@@ -24,7 +24,7 @@ TEST(Type, FuncNoParam) {
   EXPECT_TRUE(!type_eq(a, d));
   EXPECT_TRUE(!type_eq(c, d));
 
-  type_destroy_for_tests();
+  type_destroy();
   arena_destroy(arena);
 }
 
@@ -49,7 +49,7 @@ TEST(Type, FuncWithBasicParams) {
   Type c = type_function(params_c, 3, type_void, TFF_NONE);
   EXPECT_TRUE(!type_eq(a0, c));  // same return, same args up to 3
 
-  type_destroy_for_tests();
+  type_destroy();
   arena_destroy(arena);
 }
 
@@ -74,7 +74,7 @@ TEST(Type, FuncNested) {
   EXPECT_EQ(type_func_num_params(a0), 1);
   EXPECT_EQ(type_func_num_params(a1), 1);
 
-  type_destroy_for_tests();
+  type_destroy();
   arena_destroy(arena);
 }
 
@@ -104,7 +104,7 @@ TEST(Type, FuncMemfn) {
 
   EXPECT_TRUE(type_func_flags(a0) & TFF_MEMFN);
 
-  type_destroy_for_tests();
+  type_destroy();
   arena_destroy(arena);
 }
 
@@ -123,7 +123,7 @@ TEST(Type, CrackFuncs) {
   EXPECT_TRUE(type_eq(type_func_param(f, 2), type_bool));
   EXPECT_TRUE(type_eq(type_func_param(f, 3), type_double));
 
-  type_destroy_for_tests();
+  type_destroy();
   arena_destroy(arena);
 }
 
@@ -137,7 +137,7 @@ TEST(Type, Ptr) {
   Type c = type_ptr(type_bool);
   EXPECT_TRUE(!type_eq(a, c));
 
-  type_destroy_for_tests();
+  type_destroy();
   arena_destroy(arena);
 }
 
@@ -170,7 +170,7 @@ TEST(Type, StructBasic) {
   EXPECT_EQ(type_size(strukt), 12);
   EXPECT_EQ(type_align(strukt), 4);
 
-  type_destroy_for_tests();
+  type_destroy();
   arena_destroy(arena);
 }
 
@@ -214,7 +214,7 @@ TEST(Type, StructInitializer) {
   EXPECT_EQ(type_size(strukt), 12);
   EXPECT_EQ(type_align(strukt), 4);
 
-  type_destroy_for_tests();
+  type_destroy();
   arena_destroy(arena);
 }
 
@@ -245,7 +245,7 @@ TEST(Type, ArrayBasic) {
   EXPECT_EQ(type_array_count(a2), 17);
   EXPECT_EQ(type_array_count(a3), 16);
 
-  type_destroy_for_tests();
+  type_destroy();
   arena_destroy(arena);
 }
 
@@ -261,6 +261,32 @@ TEST(Type, ListBasic) {
   EXPECT_TRUE(!type_eq(a0, a2));
   EXPECT_TRUE(!type_eq(a1, a2));
 
-  type_destroy_for_tests();
+  type_destroy();
+  arena_destroy(arena);
+}
+
+TEST(Type, DropUnkept) {
+  Arena* arena = arena_create(KiB(128), KiB(128));
+  type_init(arena);
+
+  Type kept_ptr = type_ptr(type_i32);
+  Type kept_list = type_list(kept_ptr);
+  type_keep();
+
+  Type dropped_ptr = type_ptr(type_u8);
+  Type dropped_func = type_function(&kept_list, 1, type_void, TFF_NONE);
+  EXPECT_EQ(type_num_created(), 4);
+  type_drop_unkept();
+  EXPECT_EQ(type_num_created(), 2);
+
+  // The kept ones are still interned, and the dropped ones are made again in
+  // the same spots.
+  EXPECT_TRUE(type_eq(type_ptr(type_i32), kept_ptr));
+  EXPECT_TRUE(type_eq(type_list(kept_ptr), kept_list));
+  EXPECT_TRUE(type_eq(type_ptr(type_u8), dropped_ptr));
+  EXPECT_TRUE(type_eq(type_function(&kept_list, 1, type_void, TFF_NONE), dropped_func));
+  EXPECT_EQ(type_num_created(), 4);
+
+  type_destroy();
   arena_destroy(arena);
 }
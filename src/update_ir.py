@@ -4,6 +4,7 @@ ROOT_DIR = os.path.normpath(
     os.path.join(os.path.abspath(os.path.dirname(__file__)), "..")
 )
 
+import glob
 import shutil
 import subprocess
 import sys
@@ -85,8 +86,18 @@ def main():
             f.write('Minor portability patches carried in the sgraham tree. Last pulled at:\n')
             rev_proc = subprocess.run(['git', 'rev-parse', 'HEAD'], capture_output=True)
             f.write(rev_proc.stdout.decode('utf-8') + '\n')
+            f.write('Then the patches in src/ir_patches/ are applied on top by src/update_ir.py.\n')
         os.chdir(ROOT_DIR)
 
+    # Our own changes that haven't gone upstream (or to the fork) yet.
+    for patch in sorted(glob.glob(os.path.join(ROOT_DIR, "src", "ir_patches", "*.patch"))):
+        proc = subprocess.run(
+            ["git", "apply", "--directory=third_party/ir", patch], cwd=ROOT_DIR
+        )
+        if proc.returncode != 0:
+            print("%s no longer applies, update it against the new tree." % patch)
+            sys.exit(1)
+
     subprocess.run(['git', 'add', '-u'])
     subprocess.run(['git', 'add', ir_dir])
     subprocess.run(['git', 'status'])